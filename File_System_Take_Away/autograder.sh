@@ -18,7 +18,7 @@ for filename in $TESTDIR/*.c; do
     outfile=$OUTDIR/$name.out
     echo "Running testcase $filename: Output stored in $outfile"
     cp $filename testcase.c
-    gcc testcase.c simplefs-ops.c simplefs-disk.c
+    gcc testcase.c simplefs-ops.c simplefs-disk.c simplefs-cache.c simplefs-index.c simplefs-dir.c simplefs-journal.c simplefs-uring.c simplefs-lz.c simplefs-crc.c
     ./a.out > $outfile
     rm -f testcase.c
     rm -f a.out
@@ -0,0 +1,127 @@
+/*
+	Namespace benchmark: creating and deleting many files with a loop of
+	single calls against simplefs_createMany() and simplefs_deleteMany().
+	Build from File_System_Take_Away:
+	    gcc -O2 -I. benchmarks/bench_batch.c simplefs-ops.c simplefs-disk.c simplefs-cache.c simplefs-index.c simplefs-dir.c simplefs-journal.c simplefs-uring.c simplefs-lz.c simplefs-crc.c -o bench_batch
+	Usage: ./bench_batch [files] [flat|journal|dirs] [rounds]
+	Each phase ends with simplefs_sync(), timed on its own: the calls
+	themselves only change cached blocks, the sync writes the same table
+	blocks back either way. The best of `rounds` runs of each phase is kept
+*/
+#include <time.h>
+#include "simplefs-ops.h"
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void format(int files, uint32_t features)
+{
+	struct simplefs_geometry geometry = { .block_size = 4096, .num_inodes = files + 8, .num_data_blocks = files + 64,
+	                                      .features = features, .journal_blocks = features & SIMPLEFS_FEATURE_JOURNAL ? 1024 : 0 };
+	if (simplefs_formatDiskWithGeometry(&geometry) < 0) {
+		fprintf(stderr, "cannot format\n");
+		exit(1);
+	}
+	if (features & SIMPLEFS_FEATURE_DIRS)
+		simplefs_mkdir("/d");
+}
+
+struct result
+{
+	double calls, sync;
+	long disk_calls;
+};
+
+static void phase(struct result *best, int files, void (*work)(char **, int), char **names)
+{
+	simplefs_resetStats();
+	double start = now();
+	work(names, files);
+	double elapsed = now() - start;
+	simplefs_sync();
+	double sync = now() - start - elapsed;
+	struct simplefs_stats stats;
+	simplefs_getStats(&stats);
+	if (best->calls == 0 || elapsed < best->calls)
+		*best = (struct result){ elapsed, sync, stats.disk_calls };
+}
+
+static void report(const char *label, const struct result *r)
+{
+	printf("%-14s%10.3f ms%10.3f ms%12ld\n", label, r->calls * 1e3, r->sync * 1e3, r->disk_calls);
+}
+
+static void createLoop(char **names, int n)
+{
+	for (int i = 0; i < n; i++)
+		simplefs_create(names[i]);
+}
+
+static void deleteLoop(char **names, int n)
+{
+	for (int i = 0; i < n; i++)
+		simplefs_delete(names[i]);
+}
+
+static void createBatch(char **names, int n)
+{
+	int *inodes = malloc(n * sizeof(int));
+	assert(inodes);
+	if (simplefs_createMany(names, n, inodes) != n) {
+		fprintf(stderr, "batch create fell short\n");
+		exit(1);
+	}
+	free(inodes);
+}
+
+static void deleteBatch(char **names, int n)
+{
+	if (simplefs_deleteMany(names, n) != n) {
+		fprintf(stderr, "batch delete fell short\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int files = argc > 1 ? atoi(argv[1]) : 10000;
+	const char *mode = argc > 2 ? argv[2] : "flat";
+	int rounds = argc > 3 ? atoi(argv[3]) : 5;
+	uint32_t features = 0;
+	if (strcmp(mode, "journal") == 0)
+		features = SIMPLEFS_FEATURE_JOURNAL;
+	else if (strcmp(mode, "dirs") == 0)
+		features = SIMPLEFS_FEATURE_DIRS | SIMPLEFS_FEATURE_JOURNAL;
+	char **names = malloc(files * sizeof(char *));
+	assert(names);
+	for (int i = 0; i < files; i++) {
+		names[i] = malloc(24);
+		assert(names[i]);
+		snprintf(names[i], 24, features & SIMPLEFS_FEATURE_DIRS ? "/d/s%d" : "s%d", i);
+	}
+
+	struct result create_loop = {0}, delete_loop = {0}, create_batch = {0}, delete_batch = {0};
+	for (int r = 0; r < rounds; r++) {
+		format(files, features);
+		phase(&create_loop, files, createLoop, names);
+		phase(&delete_loop, files, deleteLoop, names);
+		format(files, features);
+		phase(&create_batch, files, createBatch, names);
+		phase(&delete_batch, files, deleteBatch, names);
+	}
+	printf("%d files, %s, best of %d\n%-14s%13s%13s%12s\n", files, mode, rounds, "", "calls", "sync", "disk calls");
+	report("create loop", &create_loop);
+	report("delete loop", &delete_loop);
+	report("create batch", &create_batch);
+	report("delete batch", &delete_batch);
+	printf("speedup: create %.1fx, delete %.1fx\n", create_loop.calls / create_batch.calls, delete_loop.calls / delete_batch.calls);
+	simplefs_unmount();
+	for (int i = 0; i < files; i++)
+		free(names[i]);
+	free(names);
+	return 0;
+}
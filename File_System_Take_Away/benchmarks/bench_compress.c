@@ -0,0 +1,90 @@
+/*
+	Compression benchmark: small overwrites of a compressed file, scattered
+	or in order, counting how often clusters are compressed and expanded.
+	Build from File_System_Take_Away:
+	    gcc -O2 -I. benchmarks/bench_compress.c simplefs-ops.c simplefs-disk.c simplefs-cache.c simplefs-index.c simplefs-dir.c simplefs-journal.c simplefs-uring.c simplefs-lz.c simplefs-crc.c -o bench_compress
+	Usage: ./bench_compress [file_kb] [writes] [write_bytes] [random|sequential]
+	The overwrites are log lines much like the ones already in the file, so
+	a cluster still compresses about as well once changed. The file is
+	closed and synced at the end, which is when clusters left expanded are
+	compressed again
+*/
+#include <time.h>
+#include "simplefs-ops.h"
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fillLog(char *buf, int64_t len, int seed)
+{
+	int64_t n = 0;
+	for (int line = seed; n < len; line++) {
+		char text[64];
+		int k = sprintf(text, "%06d INFO request served in %d ms\n", line, line % 97);
+		for (int i = 0; i < k && n < len; i++)
+			buf[n++] = text[i];
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int64_t size = (argc > 1 ? atoi(argv[1]) : 4096) * 1024LL;
+	int writes = argc > 2 ? atoi(argv[2]) : 20000;
+	int write_bytes = argc > 3 ? atoi(argv[3]) : 100;
+	int sequential = argc > 4 && strcmp(argv[4], "sequential") == 0;
+	int bs = 4096;
+	struct simplefs_geometry geometry = { .block_size = bs, .num_inodes = 16, .num_data_blocks = size / bs * 2 + 64,
+	                                      .features = SIMPLEFS_FEATURE_EXTENTS | SIMPLEFS_FEATURE_COMPRESSION
+	                                                | SIMPLEFS_FEATURE_JOURNAL, .journal_blocks = 1024 };
+	if (simplefs_formatDiskWithGeometry(&geometry) < 0) {
+		fprintf(stderr, "cannot format\n");
+		return 1;
+	}
+	char *data = malloc(size);
+	char *line = malloc(write_bytes);
+	assert(data && line);
+	fillLog(data, size, 0);
+	simplefs_create("log");
+	int fd = simplefs_open("log");
+	simplefs_write(fd, data, size);
+	simplefs_sync();
+
+	simplefs_resetStats();
+	double start = now();
+	int64_t position = 0;
+	unsigned seed = 1;
+	for (int i = 0; i < writes; i++) {
+		seed = seed * 1103515245 + 12345;
+		int64_t offset = sequential ? (int64_t)i * write_bytes % (size - write_bytes) : (int64_t)(seed >> 8) % (size - write_bytes);
+		fillLog(line, write_bytes, seed % 100000);
+		simplefs_seek(fd, offset - position);
+		position = offset;
+		simplefs_write(fd, line, write_bytes);
+		memcpy(data + offset, line, write_bytes);
+	}
+	double writing = now() - start;
+	simplefs_close(fd);
+	simplefs_sync();
+	double elapsed = now() - start;
+	struct simplefs_stats stats;
+	simplefs_getStats(&stats);
+
+	fd = simplefs_open("log");
+	char *back = malloc(size);
+	assert(back);
+	simplefs_read(fd, back, size);
+	simplefs_close(fd);
+	printf("%d %s writes of %d bytes over %lld KB\n", writes, sequential ? "sequential" : "random", write_bytes, (long long)(size / 1024));
+	printf("writes %.3f ms, with close and sync %.3f ms\n", writing * 1e3, elapsed * 1e3);
+	printf("clusters packed %ld, expanded %ld, disk calls %ld, same %d\n", stats.packs, stats.unpacks, stats.disk_calls,
+	       memcmp(back, data, size) == 0);
+	simplefs_unmount();
+	free(back);
+	free(line);
+	free(data);
+	return 0;
+}
@@ -0,0 +1,125 @@
+/*
+	Checksum benchmark: CRC32C throughput with the CPU's instructions and
+	with the slicing-by-8 tables, then what checking it costs the read path.
+	Build from File_System_Take_Away:
+	    gcc -O2 -I. benchmarks/bench_crc.c simplefs-ops.c simplefs-disk.c simplefs-cache.c simplefs-index.c simplefs-dir.c simplefs-journal.c simplefs-uring.c simplefs-lz.c simplefs-crc.c -o bench_crc
+	Usage: ./bench_crc [block_size] [file_blocks] [rounds] [fd|direct|mmap]
+	A block is checked every time it is read from disk. The file is read
+	twice, and once more with simplefs_setVerifyOnce(), which checks a block
+	read around the cache only the first time after the mount: there the
+	second pass shows what is left of the checks
+*/
+#include <time.h>
+#include "simplefs-ops.h"
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double crcRate(uint32_t (*crc)(const void *, size_t), const char *buf, size_t len, size_t total)
+{
+	// GB/s over `total` bytes taken `len` at a time
+	volatile uint32_t sink = 0;
+	double start = now();
+	for (size_t done = 0; done < total; done += len)
+		sink ^= crc(buf, len);
+	(void)sink;
+	return total / (now() - start) / 1e9;
+}
+
+static double readPass(int fd, char *buf, size_t len, size_t chunk)
+{
+	// Seconds reading the file from its start, `chunk` bytes at a time
+	simplefs_seek(fd, -(int64_t)len);
+	double start = now();
+	for (size_t done = 0; done < len; done += chunk) {
+		if (simplefs_read(fd, buf + done, chunk) != 0) {
+			fprintf(stderr, "read failed\n");
+			exit(1);
+		}
+		simplefs_seek(fd, chunk);
+	}
+	return now() - start;
+}
+
+static double readRate(uint32_t block_size, int file_blocks, uint32_t features, int once, int chunk_blocks, double *again)
+{
+	// MB/s reading a whole file, `chunk_blocks` at a time, from a freshly
+	// mounted image, and in `again` reading it a second time. With `once`
+	// blocks are only checked until they first match
+	struct simplefs_geometry geometry = { .block_size = block_size, .num_inodes = 4,
+			.num_data_blocks = file_blocks + 16, .features = SIMPLEFS_FEATURE_EXTENTS | features };
+	if (simplefs_formatDiskWithGeometry(&geometry) < 0) {
+		fprintf(stderr, "cannot format with block size %u\n", block_size);
+		exit(1);
+	}
+	size_t len = (size_t)block_size * file_blocks;
+	size_t chunk = (size_t)block_size * chunk_blocks;
+	char *buf = malloc(len);
+	assert(buf);
+	for (size_t i = 0; i < len; i++)
+		buf[i] = i * 31 + i / 4093;
+	simplefs_create("f");
+	int fd = simplefs_open("f");
+	simplefs_write(fd, buf, len);
+	simplefs_close(fd);
+	simplefs_unmount();
+	simplefs_setVerifyOnce(once);
+	simplefs_mount();
+	fd = simplefs_open("f");
+	simplefs_seek(fd, len);
+	double rate = len / readPass(fd, buf, len, chunk) / 1e6;
+	*again = len / readPass(fd, buf, len, chunk) / 1e6;
+	simplefs_close(fd);
+	simplefs_unmount();
+	simplefs_setVerifyOnce(0);
+	free(buf);
+	return rate;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t block_size = argc > 1 ? atoi(argv[1]) : 4096;
+	int file_blocks = argc > 2 ? atoi(argv[2]) : 4096;
+	int rounds = argc > 3 ? atoi(argv[3]) : 20;
+	const char *name = argc > 4 ? argv[4] : "fd";
+	int mode = strcmp(name, "direct") == 0 ? SIMPLEFS_IO_DIRECT : strcmp(name, "mmap") == 0 ? SIMPLEFS_IO_MMAP : SIMPLEFS_IO_FD;
+	simplefs_setIOMode(mode);
+
+	static char data[65536];
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = i * 7 + 3;
+	printf("CRC32C instructions: %s\n", simplefs_crc32cHardware() ? "yes" : "no");
+	printf("bytes\thardware GB/s\tslicing-by-8 GB/s\n");
+	for (size_t len = BLOCKSIZE; len <= sizeof(data); len *= 8)
+		printf("%zu\t%.2f\t\t%.2f\n", len, crcRate(simplefs_crc32c, data, len, 1 << 30),
+		       crcRate(simplefs_crc32cSoftware, data, len, 1 << 28));
+
+	// Whole-file reads go around the cache in one vectored call, single blocks through it
+	printf("\nread path, block size %u, %d blocks, best of %d, %s\n", block_size, file_blocks, rounds,
+	       mode == SIMPLEFS_IO_DIRECT ? "O_DIRECT" : mode == SIMPLEFS_IO_MMAP ? "mapped image" : "host page cache");
+	printf("reads of\tpass\tplain MB/s\tchecksummed MB/s\tcost\tchecked once MB/s\tcost\n");
+	int chunks[] = { file_blocks, 1 };
+	for (int c = 0; c < 2; c++) {
+		// Best of each, the kinds of image taking turns so drift on the host hits all alike
+		double plain[2] = { 0, 0 }, checked[2] = { 0, 0 }, once[2] = { 0, 0 };
+		for (int r = 0; r < rounds; r++) {
+			double rate[2];
+			rate[0] = readRate(block_size, file_blocks, 0, 0, chunks[c], &rate[1]);
+			for (int p = 0; p < 2; p++)
+				plain[p] = rate[p] > plain[p] ? rate[p] : plain[p];
+			rate[0] = readRate(block_size, file_blocks, SIMPLEFS_FEATURE_CHECKSUMS, 0, chunks[c], &rate[1]);
+			for (int p = 0; p < 2; p++)
+				checked[p] = rate[p] > checked[p] ? rate[p] : checked[p];
+			rate[0] = readRate(block_size, file_blocks, SIMPLEFS_FEATURE_CHECKSUMS, 1, chunks[c], &rate[1]);
+			for (int p = 0; p < 2; p++)
+				once[p] = rate[p] > once[p] ? rate[p] : once[p];
+		}
+		for (int p = 0; p < 2; p++)
+			printf("%d blocks\t%s\t%.0f\t\t%.0f\t\t\t%.1f%%\t%.0f\t\t\t%.1f%%\n", chunks[c], p ? "second" : "first",
+			       plain[p], checked[p], 100.0 * (plain[p] - checked[p]) / plain[p], once[p], 100.0 * (plain[p] - once[p]) / plain[p]);
+	}
+}
@@ -0,0 +1,117 @@
+/*
+	Scaling benchmark: each thread reads and rewrites its own file.
+	Build from File_System_Take_Away:
+	    gcc -O2 -I. benchmarks/bench_threads.c simplefs-ops.c simplefs-disk.c simplefs-cache.c simplefs-index.c simplefs-dir.c simplefs-journal.c simplefs-uring.c simplefs-lz.c simplefs-crc.c -o bench_threads
+	Usage: ./bench_threads [max_threads] [iterations] [fd|mmap|uring|direct] [file_blocks] [block_size]
+	With the default 3 block files every block stays cached. Files larger
+	than the cache make each thread miss to disk: each iteration then reads
+	at a different offset of its file
+*/
+#include <time.h>
+#include "simplefs-ops.h"
+
+#define FILE_BLOCKS 3
+
+struct worker_t
+{
+	int fd;
+	long iterations;
+	int file_blocks;
+	int block_size;
+};
+
+static void *worker(void *arg)
+{
+	struct worker_t *w = (struct worker_t *)arg;
+	char *buf = malloc((size_t)w->block_size * FILE_BLOCKS);
+	int64_t pos = 0;
+	for (long i = 0; i < w->iterations; i++) {
+		int64_t next = (int64_t)(i * 37 % (w->file_blocks - FILE_BLOCKS + 1)) * w->block_size;
+		simplefs_seek(w->fd, next - pos);
+		pos = next;
+		if (simplefs_read(w->fd, buf, (int64_t)w->block_size * FILE_BLOCKS) != 0
+		    || simplefs_write(w->fd, buf, w->block_size) != 0) {
+			fprintf(stderr, "I/O failed on handle %d\n", w->fd);
+			exit(1);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = argc > 1 ? atoi(argv[1]) : NUM_INODES;
+	long iterations = argc > 2 ? atol(argv[2]) : 200000;
+	int mode = SIMPLEFS_IO_FD;
+	if (argc > 3 && strcmp(argv[3], "mmap") == 0)
+		mode = SIMPLEFS_IO_MMAP;
+	else if (argc > 3 && strcmp(argv[3], "uring") == 0)
+		mode = SIMPLEFS_IO_URING;
+	else if (argc > 3 && strcmp(argv[3], "direct") == 0)
+		mode = SIMPLEFS_IO_DIRECT;
+	int file_blocks = argc > 4 ? atoi(argv[4]) : FILE_BLOCKS;
+	int block_size = argc > 5 ? atoi(argv[5]) : BLOCKSIZE;
+	if (file_blocks < FILE_BLOCKS) {
+		fprintf(stderr, "file_blocks must be at least %d\n", FILE_BLOCKS);
+		return 1;
+	}
+	// The default geometry holds the default files, larger ones get a disk sized for them
+	struct simplefs_geometry geometry = { .block_size = block_size, .num_inodes = NUM_INODES,
+	                                      .num_data_blocks = NUM_INODES * file_blocks, .features = SIMPLEFS_FEATURE_EXTENTS };
+	if (file_blocks == FILE_BLOCKS && block_size == BLOCKSIZE
+	    && (max_threads < 1 || max_threads > NUM_INODES || max_threads * FILE_BLOCKS > NUM_DATA_BLOCKS)) {
+		fprintf(stderr, "max_threads must be between 1 and %d\n", NUM_DATA_BLOCKS / FILE_BLOCKS < NUM_INODES ? NUM_DATA_BLOCKS / FILE_BLOCKS : NUM_INODES);
+		return 1;
+	}
+	if (max_threads < 1 || max_threads > NUM_INODES) {
+		fprintf(stderr, "max_threads must be between 1 and %d\n", NUM_INODES);
+		return 1;
+	}
+
+	char *data = malloc((size_t)block_size * file_blocks);
+	memset(data, 'a', (size_t)block_size * file_blocks);
+	double base = 0;
+	printf("threads\tops/s\t\tspeedup\n");
+	for (int t = 1; t <= max_threads; t++) {
+		pthread_t tids[NUM_INODES];
+		struct worker_t workers[NUM_INODES];
+		simplefs_setIOMode(mode);
+		if (file_blocks == FILE_BLOCKS && block_size == BLOCKSIZE)
+			simplefs_formatDisk();
+		else if (simplefs_formatDiskWithGeometry(&geometry) < 0) {
+			fprintf(stderr, "cannot format %d byte blocks\n", block_size);
+			return 1;
+		}
+		for (int i = 0; i < t; i++) {
+			char name[MAX_NAME_STRLEN];
+			snprintf(name, sizeof(name), "t%d", i);
+			simplefs_create(name);
+			workers[i].fd = simplefs_open(name);
+			workers[i].iterations = iterations;
+			workers[i].file_blocks = file_blocks;
+			workers[i].block_size = block_size;
+			simplefs_write(workers[i].fd, data, (int64_t)block_size * file_blocks);
+		}
+
+		double start = now();
+		for (int i = 0; i < t; i++)
+			pthread_create(&tids[i], NULL, worker, &workers[i]);
+		for (int i = 0; i < t; i++)
+			pthread_join(tids[i], NULL);
+		double ops = 2.0 * iterations * t / (now() - start);
+		if (t == 1)
+			base = ops;
+		printf("%d\t%.0f\t%.2fx\n", t, ops, ops / base);
+		simplefs_unmount();
+	}
+	free(data);
+	return 0;
+}
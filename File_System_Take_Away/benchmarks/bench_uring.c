@@ -0,0 +1,85 @@
+/*
+	System call benchmark: the same journaled workload on the fd backend and
+	on the io_uring one, counting the calls each makes on the disk image.
+	Build from File_System_Take_Away:
+	    gcc -O2 -I. benchmarks/bench_uring.c simplefs-ops.c simplefs-disk.c simplefs-cache.c simplefs-index.c simplefs-dir.c simplefs-journal.c simplefs-uring.c simplefs-lz.c simplefs-crc.c -o bench_uring
+	Usage: ./bench_uring [files] [file_blocks] [block_size]
+	Reads and writes are counted by the disk_calls statistic, io_uring_enter
+	included. fsync is counted here, by wrapping it
+*/
+#include <time.h>
+#include <sys/syscall.h>
+#include "simplefs-ops.h"
+
+static long fsync_calls = 0;
+
+int fsync(int fd)
+{
+	fsync_calls++;
+	return syscall(SYS_fsync, fd);
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *label, int mode, int files, int file_blocks, int block_size)
+{
+	struct simplefs_geometry geometry = { .block_size = block_size, .num_inodes = files + 1,
+	                                      .num_data_blocks = files * file_blocks + 16,
+	                                      .features = SIMPLEFS_FEATURE_EXTENTS | SIMPLEFS_FEATURE_JOURNAL, .journal_blocks = 512 };
+	char *data = malloc((size_t)block_size * file_blocks);
+	memset(data, 'u', (size_t)block_size * file_blocks);
+	simplefs_setIOMode(mode);
+	if (simplefs_formatDiskWithGeometry(&geometry) < 0) {
+		fprintf(stderr, "cannot format\n");
+		exit(1);
+	}
+	simplefs_resetStats();
+	fsync_calls = 0;
+	double start = now();
+
+	// Write every file, syncing after each as a mail spool or log would
+	char name[16];
+	for (int i = 0; i < files; i++) {
+		snprintf(name, sizeof(name), "f%d", i);
+		simplefs_create(name);
+		int fd = simplefs_open(name);
+		simplefs_write(fd, data, (int64_t)block_size * file_blocks);
+		simplefs_close(fd);
+		simplefs_sync();
+	}
+	// Remount and read it all back a block at a time from a cold cache
+	simplefs_unmount();
+	simplefs_mount();
+	for (int i = 0; i < files; i++) {
+		snprintf(name, sizeof(name), "f%d", i);
+		int fd = simplefs_open(name);
+		for (int b = 0; b < file_blocks; b++) {
+			simplefs_read(fd, data, block_size);
+			simplefs_seek(fd, block_size);
+		}
+		simplefs_close(fd);
+	}
+	simplefs_unmount();
+
+	double elapsed = now() - start;
+	struct simplefs_stats stats;
+	simplefs_getStats(&stats);
+	printf("%s\t%ld\t\t%ld\t%ld\t%.3f s\n", label, stats.disk_calls, fsync_calls, stats.disk_calls + fsync_calls, elapsed);
+	free(data);
+}
+
+int main(int argc, char **argv)
+{
+	int files = argc > 1 ? atoi(argv[1]) : 200;
+	int file_blocks = argc > 2 ? atoi(argv[2]) : 4;
+	int block_size = argc > 3 ? atoi(argv[3]) : 4096;
+	printf("backend\tread/write\tfsync\ttotal\ttime\n");
+	run("fd", SIMPLEFS_IO_FD, files, file_blocks, block_size);
+	run("uring", SIMPLEFS_IO_URING, files, file_blocks, block_size);
+	return 0;
+}
@@ -0,0 +1,506 @@
+#include "simplefs-disk.h"
+
+static struct simplefs_buffer *buffers = NULL;
+static int num_buffers = 0;
+static struct simplefs_buffer **hash_table = NULL;
+static int hash_mask = 0;                  // number of hash buckets - 1
+static char *buffer_data = NULL;           // one slab backing every buffer's data
+static uint32_t cache_block_size = 0;
+static struct simplefs_buffer *lru_head;   // most recently used
+static struct simplefs_buffer *lru_tail;   // least recently used, next victim
+static int dirty_count = 0;                // buffers with dirty set
+static int pin_dirty = 0;                  // dirty buffers wait for a journal commit instead of being evicted
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER; // guards buffers, hash and LRU list, not held across disk I/O
+
+static inline int simplefs_cacheHash(int blocknum){
+    return blocknum & hash_mask;
+}
+
+static void simplefs_lruUnlink(struct simplefs_buffer *b){
+    if(b->lru_prev)
+        b->lru_prev->lru_next = b->lru_next;
+    else
+        lru_head = b->lru_next;
+    if(b->lru_next)
+        b->lru_next->lru_prev = b->lru_prev;
+    else
+        lru_tail = b->lru_prev;
+    b->lru_prev = b->lru_next = NULL;
+}
+
+static void simplefs_lruPushFront(struct simplefs_buffer *b){
+    b->lru_prev = NULL;
+    b->lru_next = lru_head;
+    if(lru_head)
+        lru_head->lru_prev = b;
+    lru_head = b;
+    if(!lru_tail)
+        lru_tail = b;
+}
+
+static void simplefs_hashRemove(struct simplefs_buffer *b){
+    struct simplefs_buffer **pp = &hash_table[simplefs_cacheHash(b->blocknum)];
+    while(*pp && *pp != b)
+        pp = &(*pp)->hash_next;
+    if(*pp)
+        *pp = b->hash_next;
+    b->hash_next = NULL;
+}
+
+static struct simplefs_buffer *simplefs_cacheLookup(int blocknum){
+    struct simplefs_buffer *b = hash_table[simplefs_cacheHash(blocknum)];
+    while(b && b->blocknum != blocknum)
+        b = b->hash_next;
+    return b;
+}
+
+static struct simplefs_buffer *simplefs_cacheLookupReady(int blocknum){
+    /*
+	    Look `blocknum` up, first waiting out a transfer of its buffer. The
+	    buffer may be reused meanwhile, so the lookup is repeated after each wait
+	*/
+    struct simplefs_buffer *b;
+    while((b = simplefs_cacheLookup(blocknum)) && b->busy)
+        pthread_cond_wait(&b->io_done, &cache_lock);
+    return b;
+}
+
+void simplefs_cacheInit(uint32_t block_size){
+    /*
+	    Empty the cache and size it for `block_size` byte blocks. Called when
+	    a disk is formatted or mounted, once the previous one has been synced
+	    or discarded: only buffers pinned for an uncommitted journal
+	    transaction, which a crash would lose as well, may still be dirty
+	*/
+    pthread_mutex_lock(&cache_lock);
+    assert(dirty_count == 0 || pin_dirty);
+    for(int i=0; i<num_buffers; i++){
+        assert(!buffers[i].busy);
+        pthread_cond_destroy(&buffers[i].io_done);
+    }
+    free(buffers);
+    free(hash_table);
+    free(buffer_data);
+    cache_block_size = block_size;
+    num_buffers = BCACHE_BUDGET / block_size;
+    if(num_buffers < BCACHE_MIN_BUFFERS)
+        num_buffers = BCACHE_MIN_BUFFERS;
+    int buckets = 1;
+    while(buckets < num_buffers)
+        buckets <<= 1;
+    hash_mask = buckets - 1;
+    buffers = calloc(num_buffers, sizeof(struct simplefs_buffer));
+    hash_table = calloc(buckets, sizeof(struct simplefs_buffer *));
+    // Page aligned, so an O_DIRECT image can transfer buffers without bouncing them
+    int ret = posix_memalign((void **)&buffer_data, sysconf(_SC_PAGESIZE), (size_t)num_buffers * block_size);
+    assert(buffers && hash_table && ret == 0);
+    lru_head = lru_tail = NULL;
+    dirty_count = 0;
+    for(int i=0; i<num_buffers; i++){
+        buffers[i].data = buffer_data + (size_t)i * block_size;
+        buffers[i].blocknum = -1;
+        buffers[i].dirty = 0;
+        buffers[i].busy = 0;
+        pthread_cond_init(&buffers[i].io_done, NULL);
+        buffers[i].hash_next = NULL;
+        simplefs_lruPushFront(&buffers[i]);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static inline void simplefs_bufferSetDirty(struct simplefs_buffer *b){
+    if(!b->dirty)
+        dirty_count++;
+    b->dirty = 1;
+}
+
+static inline void simplefs_bufferClearDirty(struct simplefs_buffer *b){
+    if(b->dirty)
+        dirty_count--;
+    b->dirty = 0;
+}
+
+static void simplefs_bufferDone(struct simplefs_buffer *b){
+    b->busy = 0;
+    pthread_cond_broadcast(&b->io_done);
+}
+
+static void simplefs_bufferWrite(struct simplefs_buffer *b){
+    /*
+	    Write a dirty buffer back with the cache lock dropped. Marked busy
+	    meanwhile, it is neither changed nor reused
+	*/
+    b->busy = 1;
+    pthread_mutex_unlock(&cache_lock);
+    simplefs_diskWriteBlock(b->blocknum, b->data);
+    pthread_mutex_lock(&cache_lock);
+    SIMPLEFS_STAT_INC(cache_writebacks);
+    simplefs_bufferClearDirty(b);
+    simplefs_bufferDone(b);
+}
+
+static struct simplefs_buffer *simplefs_cacheClaim(int blocknum){
+    /*
+	    Take the least recently used buffer for `blocknum`. Pinned dirty
+	    buffers are passed over, the journal keeps enough clean ones, and so
+	    are busy ones. When the victim is dirty it is written back and NULL
+	    returned: the lock was dropped, so the caller looks `blocknum` up
+	    again before claiming. So it does after waiting for a transfer when
+	    every buffer it could take is busy
+	*/
+    struct simplefs_buffer *b = lru_tail;
+    while(b && (b->busy || (pin_dirty && b->dirty)))
+        b = b->lru_prev;
+    if(!b){
+        for(b = lru_tail; b && !b->busy; b = b->lru_prev)
+            ;
+        assert(b);
+        pthread_cond_wait(&b->io_done, &cache_lock);
+        return NULL;
+    }
+    if(b->blocknum >= 0){
+        if(b->dirty){
+            simplefs_bufferWrite(b);
+            return NULL;
+        }
+        simplefs_hashRemove(b);
+    }
+    b->blocknum = blocknum;
+    b->dirty = 0;
+    int h = simplefs_cacheHash(blocknum);
+    b->hash_next = hash_table[h];
+    hash_table[h] = b;
+    return b;
+}
+
+static struct simplefs_buffer *simplefs_cacheGet(int blocknum, int fill, int *status){
+    /*
+	    Return the buffer holding `blocknum` and make it most recently used.
+	    On a miss a buffer is claimed, its contents are read from disk only
+	    when `fill` is set. The read runs without the cache lock, other
+	    lookups of the block wait for it on the buffer. `status` is set to
+	    -1 when the block read does not match its checksum, 0 otherwise
+	*/
+    struct simplefs_buffer *b;
+    int hit;
+    *status = 0;
+    while(!(hit = (b = simplefs_cacheLookupReady(blocknum)) != NULL) && !(b = simplefs_cacheClaim(blocknum)))
+        ;
+    if(hit){
+        SIMPLEFS_STAT_INC(cache_hits);
+    }
+    else{
+        SIMPLEFS_STAT_INC(cache_misses);
+        if(fill){
+            b->busy = 1;
+            pthread_mutex_unlock(&cache_lock);
+            *status = simplefs_diskReadBlock(blocknum, b->data);
+            pthread_mutex_lock(&cache_lock);
+            simplefs_bufferDone(b);
+        }
+    }
+    simplefs_lruUnlink(b);
+    simplefs_lruPushFront(b);
+    return b;
+}
+
+static void simplefs_bufferDiscard(struct simplefs_buffer *b){
+    simplefs_hashRemove(b);
+    b->blocknum = -1;
+    simplefs_bufferClearDirty(b);
+    simplefs_lruUnlink(b);
+    b->lru_prev = lru_tail;
+    if(lru_tail)
+        lru_tail->lru_next = b;
+    else
+        lru_head = b;
+    lru_tail = b;
+}
+
+int simplefs_cacheReadBlock(int blocknum, char *buf){
+    /*
+	    Copy `blocknum` to `buf`, reading it on a miss. A block that does
+	    not match its checksum is still copied but not kept, and -1 returned
+	*/
+    int status;
+    pthread_mutex_lock(&cache_lock);
+    struct simplefs_buffer *b = simplefs_cacheGet(blocknum, 1, &status);
+    memcpy(buf, b->data, cache_block_size);
+    if(status < 0)
+        simplefs_bufferDiscard(b);
+    pthread_mutex_unlock(&cache_lock);
+    return status;
+}
+
+int simplefs_cacheReadCached(int blocknum, char *buf){
+    /*
+	    Copy `blocknum` to `buf` if it is cached and return 1, or return 0
+	    without claiming a buffer for it
+	*/
+    pthread_mutex_lock(&cache_lock);
+    struct simplefs_buffer *b = simplefs_cacheLookupReady(blocknum);
+    if(b){
+        SIMPLEFS_STAT_INC(cache_hits);
+        memcpy(buf, b->data, cache_block_size);
+        simplefs_lruUnlink(b);
+        simplefs_lruPushFront(b);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return b != NULL;
+}
+
+void simplefs_cacheWriteBlock(int blocknum, const char *buf){
+    /*
+	    A whole-block write never needs the old contents, so a miss does not
+	    read the block from disk
+	*/
+    int status;
+    pthread_mutex_lock(&cache_lock);
+    struct simplefs_buffer *b = simplefs_cacheGet(blocknum, 0, &status);
+    memcpy(b->data, buf, cache_block_size);
+    simplefs_bufferSetDirty(b);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int simplefs_cacheReadPartial(int blocknum, int offset, char *buf, int len){
+    assert(offset >= 0 && (uint32_t)(offset + len) <= cache_block_size);
+    int status;
+    pthread_mutex_lock(&cache_lock);
+    struct simplefs_buffer *b = simplefs_cacheGet(blocknum, 1, &status);
+    memcpy(buf, b->data + offset, len);
+    if(status < 0)
+        simplefs_bufferDiscard(b);
+    pthread_mutex_unlock(&cache_lock);
+    return status;
+}
+
+int simplefs_cacheWritePartial(int blocknum, int offset, const char *buf, int len){
+    /*
+	    Patch `len` bytes at `offset` of block `blocknum`. A block that fails
+	    its checksum is left alone rather than stored under a new one, -1
+    */
+    assert(offset >= 0 && (uint32_t)(offset + len) <= cache_block_size);
+    int status;
+    pthread_mutex_lock(&cache_lock);
+    struct simplefs_buffer *b = simplefs_cacheGet(blocknum, 1, &status);
+    if(status < 0){
+        simplefs_bufferDiscard(b);
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    memcpy(b->data + offset, buf, len);
+    simplefs_bufferSetDirty(b);
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+static void simplefs_cacheForRange(int blocknum, int count, void (*fn)(struct simplefs_buffer *)){
+    /*
+	    Apply `fn` to every cached buffer of blocks [blocknum, blocknum + count),
+	    walking the buffers instead of the hash when the range is the larger.
+	    Buffers in transfer are waited for first
+	*/
+    if(count > num_buffers){
+        for(int i=0; i<num_buffers; i++){
+            while(buffers[i].busy)
+                pthread_cond_wait(&buffers[i].io_done, &cache_lock);
+            if(buffers[i].blocknum >= blocknum && buffers[i].blocknum < blocknum + count)
+                fn(&buffers[i]);
+        }
+        return;
+    }
+    for(int i=0; i<count; i++){
+        struct simplefs_buffer *b = simplefs_cacheLookupReady(blocknum + i);
+        if(b)
+            fn(b);
+    }
+}
+
+static void simplefs_bufferWriteback(struct simplefs_buffer *b){
+    if(b->dirty)
+        simplefs_bufferWrite(b);
+}
+
+void simplefs_cacheWritebackRange(int blocknum, int count){
+    /*
+	    Write back the dirty cached blocks of a range about to be read from
+	    disk directly, keeping them cached
+	*/
+    pthread_mutex_lock(&cache_lock);
+    simplefs_cacheForRange(blocknum, count, simplefs_bufferWriteback);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void simplefs_cacheDiscardRange(int blocknum, int count){
+    /*
+	    Drop the cached copies of a range about to be overwritten on disk
+	    directly, without writing them back. The freed buffers are reused first
+	*/
+    pthread_mutex_lock(&cache_lock);
+    simplefs_cacheForRange(blocknum, count, simplefs_bufferDiscard);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void simplefs_cacheDiscardAll(){
+    /*
+	    Drop every dirty buffer without writing it back, for a disk that is
+	    being formatted over
+	*/
+    pthread_mutex_lock(&cache_lock);
+    for(int i=0; i<num_buffers; i++){
+        while(buffers[i].busy)
+            pthread_cond_wait(&buffers[i].io_done, &cache_lock);
+        if(buffers[i].blocknum >= 0 && buffers[i].dirty)
+            simplefs_bufferDiscard(&buffers[i]);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void simplefs_cacheFlush(){
+    /*
+	    Write every dirty buffer back to disk, keeping the clean copies cached.
+	    The buffers go to the disk layer in batches it can submit together,
+	    each marked busy while the cache lock is dropped for the transfer.
+	    One already being written back is waited for
+	*/
+    struct simplefs_buffer *batch[BCACHE_FLUSH_BATCH];
+    int blocknums[BCACHE_FLUSH_BATCH];
+    const char *data[BCACHE_FLUSH_BATCH];
+    int n = 0;
+    pthread_mutex_lock(&cache_lock);
+    for(int i=0; i<num_buffers; i++){
+        while(buffers[i].busy && buffers[i].dirty)
+            pthread_cond_wait(&buffers[i].io_done, &cache_lock);
+        if(buffers[i].blocknum >= 0 && buffers[i].dirty && !buffers[i].busy){
+            batch[n] = &buffers[i];
+            blocknums[n] = buffers[i].blocknum;
+            data[n++] = buffers[i].data;
+            buffers[i].busy = 1;
+        }
+        if(n == BCACHE_FLUSH_BATCH || (n > 0 && i == num_buffers - 1)){
+            pthread_mutex_unlock(&cache_lock);
+            simplefs_diskWriteBlocks(n, blocknums, data);
+            pthread_mutex_lock(&cache_lock);
+            for(int k=0; k<n; k++){
+                SIMPLEFS_STAT_INC(cache_writebacks);
+                simplefs_bufferClearDirty(batch[k]);
+                simplefs_bufferDone(batch[k]);
+            }
+            n = 0;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int simplefs_cacheBuffers(){
+    return num_buffers;
+}
+
+char *simplefs_cacheData(size_t *len){
+    /*
+	    The slab holding every buffer's data, for registration with the disk backend
+	*/
+    *len = (size_t)num_buffers * cache_block_size;
+    return buffer_data;
+}
+
+void simplefs_cachePinDirty(int pin){
+    /*
+	    While set, dirty buffers stay cached until simplefs_cacheClean(): they
+	    belong to an uncommitted journal transaction and must not reach their
+	    home location early
+	*/
+    pthread_mutex_lock(&cache_lock);
+    pin_dirty = pin;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int simplefs_cacheDirtyCount(){
+    pthread_mutex_lock(&cache_lock);
+    int n = dirty_count;
+    pthread_mutex_unlock(&cache_lock);
+    return n;
+}
+
+int simplefs_cacheRangeDirty(int blocknum, int count){
+    /*
+	    1 if any block of [blocknum, blocknum + count) has a dirty cached copy
+	*/
+    int found = 0;
+    pthread_mutex_lock(&cache_lock);
+    if(dirty_count > 0){
+        if(count > num_buffers){
+            for(int i=0; i<num_buffers && !found; i++)
+                found = buffers[i].dirty && buffers[i].blocknum >= blocknum && buffers[i].blocknum < blocknum + count;
+        }
+        else{
+            for(int i=0; i<count && !found; i++){
+                struct simplefs_buffer *b = simplefs_cacheLookup(blocknum + i);
+                found = b && b->dirty;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return found;
+}
+
+int simplefs_cacheSnapshot(int *blocknums, char *images, int max){
+    /*
+	    Copy up to `max` dirty buffers and their block numbers out, leaving
+	    them dirty. Returns how many were copied
+	*/
+    int n = 0;
+    pthread_mutex_lock(&cache_lock);
+    for(int i=0; i<num_buffers && n<max; i++){
+        if(buffers[i].blocknum < 0 || !buffers[i].dirty)
+            continue;
+        blocknums[n] = buffers[i].blocknum;
+        memcpy(images + (size_t)n * cache_block_size, buffers[i].data, cache_block_size);
+        n++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return n;
+}
+
+int simplefs_cacheRangeCached(int blocknum, int count){
+    /*
+	    1 if every block of [blocknum, blocknum + count) is cached
+	*/
+    int found = count <= num_buffers;
+    pthread_mutex_lock(&cache_lock);
+    for(int i=0; i<count && found; i++)
+        found = simplefs_cacheLookup(blocknum + i) != NULL;
+    pthread_mutex_unlock(&cache_lock);
+    return found;
+}
+
+void simplefs_cacheFill(int blocknum, int count, const char *data){
+    /*
+	    Cache blocks [blocknum, blocknum + count) read ahead of use from
+	    `data`. Blocks already cached keep their buffer, a dirty copy is
+	    newer than the one read
+	*/
+    pthread_mutex_lock(&cache_lock);
+    for(int i=0; i<count; i++){
+        struct simplefs_buffer *b = NULL;
+        while(!simplefs_cacheLookup(blocknum + i) && !(b = simplefs_cacheClaim(blocknum + i)))
+            ;
+        if(!b)
+            continue;
+        memcpy(b->data, data + (size_t)i * cache_block_size, cache_block_size);
+        simplefs_lruUnlink(b);
+        simplefs_lruPushFront(b);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void simplefs_cacheClean(int blocknum){
+    /*
+	    Mark the cached copy of `blocknum` clean once it has been written home
+	*/
+    pthread_mutex_lock(&cache_lock);
+    struct simplefs_buffer *b = simplefs_cacheLookup(blocknum);
+    if(b)
+        simplefs_bufferClearDirty(b);
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,43 @@
+/*
+	BLOCK BUFFER CACHE
+*/
+#ifndef SIMPLEFS_CACHE_H
+#define SIMPLEFS_CACHE_H
+
+#define BCACHE_BUDGET (256 * 1024)	// bytes of block data the cache may hold
+#define BCACHE_MIN_BUFFERS 96
+#define BCACHE_FLUSH_BATCH 64	// dirty buffers handed to the disk layer at a time by a flush
+
+struct simplefs_buffer
+{
+	int blocknum;							// absolute block number on disk, -1 if unused
+	int dirty;								// 1 if data differs from the disk copy
+	int busy;								// 1 while data moves to or from disk without the cache lock
+	pthread_cond_t io_done;					// signalled when busy clears
+	struct simplefs_buffer *hash_next;		// chain in the block number hash
+	struct simplefs_buffer *lru_prev;		// towards most recently used
+	struct simplefs_buffer *lru_next;		// towards least recently used
+	char *data;								// block_size bytes
+};
+
+void simplefs_cacheInit(uint32_t block_size);
+int simplefs_cacheReadBlock(int blocknum, char *buf);
+int simplefs_cacheReadCached(int blocknum, char *buf);
+void simplefs_cacheWriteBlock(int blocknum, const char *buf);
+int simplefs_cacheReadPartial(int blocknum, int offset, char *buf, int len);
+int simplefs_cacheWritePartial(int blocknum, int offset, const char *buf, int len);
+void simplefs_cacheWritebackRange(int blocknum, int count);
+void simplefs_cacheDiscardRange(int blocknum, int count);
+void simplefs_cacheDiscardAll();
+void simplefs_cacheFlush();
+int simplefs_cacheBuffers();
+char *simplefs_cacheData(size_t *len);
+void simplefs_cachePinDirty(int pin);
+int simplefs_cacheDirtyCount();
+int simplefs_cacheRangeDirty(int blocknum, int count);
+int simplefs_cacheSnapshot(int *blocknums, char *images, int max);
+int simplefs_cacheRangeCached(int blocknum, int count);
+void simplefs_cacheFill(int blocknum, int count, const char *data);
+void simplefs_cacheClean(int blocknum);
+
+#endif
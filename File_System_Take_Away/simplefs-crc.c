@@ -0,0 +1,168 @@
+#include "simplefs-disk.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+static uint32_t crc_table[8][256];             // crc_table[k][b]: byte b followed by k zero bytes
+static uint32_t crc_long[4][256];              // appends CRC_LONG zero bytes to a CRC, a byte of it per table
+static uint32_t crc_short[4][256];             // the same for CRC_SHORT zero bytes
+static int crc_hardware = 0;                   // 1 when the CPU's CRC32 instructions are used
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t simplefs_gf2Times(const uint32_t *mat, uint32_t vec){
+    uint32_t sum = 0;
+    for(; vec; vec >>= 1, mat++){
+        if(vec & 1)
+            sum ^= *mat;
+    }
+    return sum;
+}
+
+static void simplefs_crcZeros(uint32_t zeros[4][256], size_t len){
+    /*
+	    Tables that append `len` zero bytes to a CRC. Appending zeros is
+	    linear over GF(2): the 32x32 matrix for one zero bit is squared up
+	    to one for `len` bytes, then applied to every value of each byte
+	*/
+    uint32_t op[32], sq[32], acc[32];
+    op[0] = CRC32C_POLY;
+    for(int n=1; n<32; n++)
+        op[n] = 1u << (n - 1);
+    for(int k=0; k<3; k++){             // one zero bit to one zero byte
+        for(int n=0; n<32; n++)
+            sq[n] = simplefs_gf2Times(op, op[n]);
+        memcpy(op, sq, sizeof(op));
+    }
+    for(int n=0; n<32; n++)
+        acc[n] = 1u << n;
+    for(; len; len >>= 1){
+        if(len & 1){
+            for(int n=0; n<32; n++)
+                sq[n] = simplefs_gf2Times(op, acc[n]);
+            memcpy(acc, sq, sizeof(acc));
+        }
+        for(int n=0; n<32; n++)
+            sq[n] = simplefs_gf2Times(op, op[n]);
+        memcpy(op, sq, sizeof(op));
+    }
+    for(uint32_t b=0; b<256; b++){
+        for(int k=0; k<4; k++)
+            zeros[k][b] = simplefs_gf2Times(acc, b << (8 * k));
+    }
+}
+
+static inline uint32_t simplefs_crcShift(const uint32_t zeros[4][256], uint32_t crc){
+    return zeros[0][crc & 0xff] ^ zeros[1][crc >> 8 & 0xff] ^ zeros[2][crc >> 16 & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static void simplefs_crcInit(){
+    /*
+	    Build the slicing and zeros tables and see whether the CPU has the
+	    instructions
+	*/
+    for(uint32_t b=0; b<256; b++){
+        uint32_t crc = b;
+        for(int i=0; i<8; i++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc_table[0][b] = crc;
+    }
+    for(uint32_t b=0; b<256; b++){
+        for(int k=1; k<8; k++)
+            crc_table[k][b] = (crc_table[k - 1][b] >> 8) ^ crc_table[0][crc_table[k - 1][b] & 0xff];
+    }
+    simplefs_crcZeros(crc_long, CRC_LONG);
+    simplefs_crcZeros(crc_short, CRC_SHORT);
+#if defined(__x86_64__)
+    crc_hardware = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+}
+
+static uint32_t simplefs_crcSlicing(uint32_t crc, const uint8_t *p, size_t len){
+    for(; len >= 8; p += 8, len -= 8){
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][lo >> 8 & 0xff] ^ crc_table[5][lo >> 16 & 0xff] ^ crc_table[4][lo >> 24]
+            ^ crc_table[3][hi & 0xff] ^ crc_table[2][hi >> 8 & 0xff] ^ crc_table[1][hi >> 16 & 0xff] ^ crc_table[0][hi >> 24];
+    }
+    for(; len > 0; p++, len--)
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__)
+#define CRC_TARGET __attribute__((target("sse4.2")))
+#define CRC_STEP8(crc, v) ((uint32_t)_mm_crc32_u64((crc), (v)))
+#define CRC_STEP1(crc, b) _mm_crc32_u8((crc), (b))
+#endif
+
+#ifdef CRC_TARGET
+CRC_TARGET
+static inline uint32_t simplefs_crcStream(uint32_t crc, const uint8_t *p, size_t len){
+    for(; len >= 8; p += 8, len -= 8){
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = CRC_STEP8(crc, v);
+    }
+    for(; len > 0; p++, len--)
+        crc = CRC_STEP1(crc, *p);
+    return crc;
+}
+
+CRC_TARGET
+static uint32_t simplefs_crcHardware(uint32_t crc, const uint8_t *p, size_t len){
+    /*
+	    The instruction takes a few cycles to deliver its result but a new
+	    one can start every cycle, so three stretches of the buffer are
+	    summed side by side and their CRCs joined with the zeros tables
+	*/
+    for(size_t stretch = CRC_LONG; stretch >= CRC_SHORT; stretch = stretch == CRC_LONG ? CRC_SHORT : 0){
+        const uint32_t (*zeros)[256] = stretch == CRC_LONG ? crc_long : crc_short;
+        for(; len >= 3 * stretch; p += 3 * stretch, len -= 3 * stretch){
+            uint32_t crc1 = 0, crc2 = 0;
+            for(size_t i = 0; i < stretch; i += 8){
+                uint64_t v0, v1, v2;
+                memcpy(&v0, p + i, 8);
+                memcpy(&v1, p + stretch + i, 8);
+                memcpy(&v2, p + 2 * stretch + i, 8);
+                crc = CRC_STEP8(crc, v0);
+                crc1 = CRC_STEP8(crc1, v1);
+                crc2 = CRC_STEP8(crc2, v2);
+            }
+            crc = simplefs_crcShift(zeros, crc) ^ crc1;
+            crc = simplefs_crcShift(zeros, crc) ^ crc2;
+        }
+    }
+    return simplefs_crcStream(crc, p, len);
+}
+#else
+static uint32_t simplefs_crcHardware(uint32_t crc, const uint8_t *p, size_t len){
+    return simplefs_crcSlicing(crc, p, len);
+}
+#endif
+
+uint32_t simplefs_crc32c(const void *buf, size_t len){
+    /*
+	    CRC32C of the `len` bytes at `buf`
+	*/
+    pthread_once(&crc_once, simplefs_crcInit);
+    if(crc_hardware)
+        return ~simplefs_crcHardware(~0u, buf, len);
+    return ~simplefs_crcSlicing(~0u, buf, len);
+}
+
+uint32_t simplefs_crc32cSoftware(const void *buf, size_t len){
+    /*
+	    simplefs_crc32c() with the table walk even where the CPU has the
+	    instructions, for comparing the two
+	*/
+    pthread_once(&crc_once, simplefs_crcInit);
+    return ~simplefs_crcSlicing(~0u, buf, len);
+}
+
+int simplefs_crc32cHardware(){
+    pthread_once(&crc_once, simplefs_crcInit);
+    return crc_hardware;
+}
@@ -0,0 +1,22 @@
+/*
+	CRC32C BLOCK CHECKSUMS
+*/
+#ifndef SIMPLEFS_CRC_H
+#define SIMPLEFS_CRC_H
+
+/*
+	CRC32C, the Castagnoli polynomial, reflected, starting from and finished
+	with all ones, as iSCSI and ext4 use it. The CRC32 instruction of SSE4.2
+	computes it where the CPU has it, which is checked once at first use,
+	on three stretches of the buffer at a time; elsewhere, ARMv8 included,
+	a slicing-by-8 table walk takes 8 bytes per step
+*/
+#define CRC32C_POLY 0x82f63b78		// reflected Castagnoli polynomial
+#define CRC_LONG 8192				// bytes per stretch while three of them fit, a multiple of 8
+#define CRC_SHORT 256				// then the stretch for what is left
+
+uint32_t simplefs_crc32c(const void *buf, size_t len);
+uint32_t simplefs_crc32cSoftware(const void *buf, size_t len);
+int simplefs_crc32cHardware();
+
+#endif
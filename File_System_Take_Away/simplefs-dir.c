@@ -0,0 +1,685 @@
+#include "simplefs-disk.h"
+
+#define LEAF_KEYS ((int)((simplefs_layout.block_size - sizeof(struct btree_node_t)) / sizeof(uint64_t)))
+#define INTERNAL_KEYS ((int)((simplefs_layout.block_size - sizeof(struct btree_node_t) - sizeof(int)) / (sizeof(uint64_t) + sizeof(int))))
+#define NODE_WORDS (simplefs_layout.block_size / sizeof(uint64_t))
+#define BTREE_MAX_HEIGHT 16
+
+/*
+    A node is one data block: the header, then the keys. Internal nodes
+    follow their keys with count + 1 child block numbers, child i holding
+    the keys below keys[i]. Deleting never merges nodes; a tree whose last
+    entry is removed is freed as a whole
+*/
+static inline struct btree_node_t *simplefs_nodeHeader(uint64_t *node){
+    return (struct btree_node_t *)node;
+}
+
+static inline uint64_t *simplefs_nodeKeys(uint64_t *node){
+    return node + sizeof(struct btree_node_t) / sizeof(uint64_t);
+}
+
+static inline int *simplefs_nodeChildren(uint64_t *node){
+    return (int *)(simplefs_nodeKeys(node) + INTERNAL_KEYS);
+}
+
+static uint64_t *simplefs_nodeAlloc(int blocks){
+    /*
+	    Room for `blocks` nodes. They grow with the block size, so they are
+	    never kept on the stack
+	*/
+    uint64_t *node = malloc((size_t)blocks * simplefs_layout.block_size);
+    assert(node);
+    return node;
+}
+
+static int simplefs_nodeRead(int block, uint64_t *node){
+    /*
+	    Read node `block` into `node`, -1 with errno EIO when it fails its
+	    checksum
+	*/
+    if(simplefs_readDataBlock(block, (char *)node) < 0){
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static inline uint64_t simplefs_dirKey(uint32_t hash, int inodenum){
+    return (uint64_t)hash << 32 | (uint32_t)inodenum;
+}
+
+static int simplefs_upperBound(const uint64_t *keys, int n, uint64_t key){
+    /*
+	    Number of keys in the sorted `keys` that are <= `key`
+	*/
+    int lo = 0, hi = n;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(keys[mid] <= key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int simplefs_lowerBound(const uint64_t *keys, int n, uint64_t key){
+    /*
+	    Number of keys in the sorted `keys` that are < `key`
+	*/
+    int lo = 0, hi = n;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int simplefs_dirMaxName(){
+    return simplefs_layout.block_size - 1 < SIMPLEFS_MAX_NAMELEN ? (int)simplefs_layout.block_size - 1 : SIMPLEFS_MAX_NAMELEN;
+}
+
+int simplefs_dirSetName(struct inode_t *inodeptr, const char *name){
+    /*
+	    Store `name` in `inodeptr`. Names that do not fit in the inode get a
+	    name block; the inode keeps their first characters for the dump
+	*/
+    strncpy(inodeptr->name, name, MAX_NAME_STRLEN);
+    inodeptr->name[MAX_NAME_STRLEN - 1] = '\0';
+    inodeptr->name_block = -1;
+    if(strlen(name) < MAX_NAME_STRLEN)
+        return 0;
+    int pblock = simplefs_allocDataBlock();
+    if(pblock == -1)
+        return -1;
+    char *buf = calloc(1, simplefs_layout.block_size);
+    assert(buf);
+    strcpy(buf, name);
+    simplefs_writeDataBlock(pblock, buf);
+    free(buf);
+    inodeptr->name_block = pblock;
+    return 0;
+}
+
+void simplefs_dirReleaseName(struct inode_t *inodeptr){
+    if(inodeptr->name_block == -1)
+        return;
+    simplefs_freeDataBlock(inodeptr->name_block);
+    inodeptr->name_block = -1;
+}
+
+static int simplefs_nameMatches(int inodenum, const char *name){
+    // -1 with errno EIO when the inode or the name block fails its checksum
+    struct inode_t inode;
+    if(simplefs_readInode(inodenum, &inode) < 0)
+        return -1;
+    if(inode.name_block == -1)
+        return strcmp(inode.name, name) == 0;
+    if(strncmp(inode.name, name, MAX_NAME_STRLEN - 1) != 0)
+        return 0;
+    // Only the name's bytes and its terminator can decide the match
+    size_t len = strlen(name) + 1;
+    if(len > simplefs_layout.block_size)
+        return 0;
+    char *buf = malloc(len);
+    assert(buf);
+    int match = simplefs_readDataBlockPartial(inode.name_block, 0, buf, len) < 0 ? -1 : memcmp(buf, name, len) == 0;
+    free(buf);
+    if(match < 0)
+        errno = EIO;
+    return match;
+}
+
+static int simplefs_btreeFind(struct inode_t *dir, const char *name, uint64_t *node, int *block, int *index){
+    /*
+	    Find the entry for `name`: returns its inode and leaves the leaf
+	    holding it in `node`, its block in `*block` and the key's position in
+	    `*index`. Returns -1 if there is no such entry, or with errno EIO
+	    when a node or name on the way fails its checksum
+	*/
+    if(dir->dir_root == -1)
+        return -1;
+    uint32_t hash = simplefs_nameHash(name);
+    uint64_t key = simplefs_dirKey(hash, 0);
+    int b = dir->dir_root;
+    for(int level = dir->dir_height; level > 0; level--){
+        if(simplefs_nodeRead(b, node) < 0)
+            return -1;
+        b = simplefs_nodeChildren(node)[simplefs_upperBound(simplefs_nodeKeys(node), simplefs_nodeHeader(node)->count, key)];
+    }
+    if(simplefs_nodeRead(b, node) < 0)
+        return -1;
+    int i = simplefs_lowerBound(simplefs_nodeKeys(node), simplefs_nodeHeader(node)->count, key);
+    while(1){
+        if(i == simplefs_nodeHeader(node)->count){
+            b = simplefs_nodeHeader(node)->next;
+            if(b == -1 || simplefs_nodeRead(b, node) < 0)
+                return -1;
+            i = 0;
+            continue;
+        }
+        uint64_t k = simplefs_nodeKeys(node)[i];
+        if((uint32_t)(k >> 32) != hash)
+            return -1;
+        int match = simplefs_nameMatches((int)(uint32_t)k, name);
+        if(match < 0)
+            return -1;
+        if(match){
+            *block = b;
+            *index = i;
+            return (int)(uint32_t)k;
+        }
+        i++;
+    }
+}
+
+int simplefs_dirLookup(int dir, const char *name){
+    /*
+	    Return the inode of entry `name` in directory `dir`, or -1, with
+	    errno EIO when the directory fails its checksum
+	*/
+    struct inode_t inode;
+    if(simplefs_readInode(dir, &inode) < 0 || inode.status != INODE_DIRECTORY)
+        return -1;
+    uint64_t *node = simplefs_nodeAlloc(1);
+    int block, index;
+    int inodenum = simplefs_btreeFind(&inode, name, node, &block, &index);
+    free(node);
+    return inodenum;
+}
+
+static void simplefs_leafInsert(uint64_t *node, uint64_t key){
+    struct btree_node_t *h = simplefs_nodeHeader(node);
+    uint64_t *keys = simplefs_nodeKeys(node);
+    int pos = simplefs_upperBound(keys, h->count, key);
+    memmove(keys + pos + 1, keys + pos, (h->count - pos) * sizeof(uint64_t));
+    keys[pos] = key;
+    h->count++;
+}
+
+static int simplefs_btreeInsert(int dir, const char *name, int inodenum, uint64_t *node){
+    /*
+	    simplefs_dirInsert() working in the four blocks at `node`
+	*/
+    struct inode_t inode;
+    if(simplefs_readInode(dir, &inode) < 0)
+        return -1;
+    uint64_t key = simplefs_dirKey(simplefs_nameHash(name), inodenum);
+    struct btree_node_t *h = simplefs_nodeHeader(node);
+    uint64_t *keys = simplefs_nodeKeys(node);
+    int *children = simplefs_nodeChildren(node);
+
+    if(inode.dir_root == -1){
+        int pblock = simplefs_allocDataBlock();
+        if(pblock == -1)
+            return -1;
+        memset(node, 0, simplefs_layout.block_size);
+        h->count = 1;
+        h->next = -1;
+        keys[0] = key;
+        simplefs_writeDataBlock(pblock, (char *)node);
+        inode.dir_root = pblock;
+        inode.dir_height = 0;
+        inode.file_size++;
+        if(simplefs_writeInode(dir, &inode) < 0){
+            simplefs_freeDataBlock(pblock);
+            return -1;
+        }
+        return 0;
+    }
+
+    // Walk down to the leaf, remembering the path and how many full nodes end it
+    int path[BTREE_MAX_HEIGHT + 1];
+    int slot[BTREE_MAX_HEIGHT + 1];
+    int full[BTREE_MAX_HEIGHT + 1];
+    int b = inode.dir_root;
+    for(int d = 0; d < inode.dir_height; d++){
+        if(simplefs_nodeRead(b, node) < 0)
+            return -1;
+        path[d] = b;
+        full[d] = h->count == INTERNAL_KEYS;
+        slot[d] = simplefs_upperBound(keys, h->count, key);
+        b = children[slot[d]];
+    }
+    path[inode.dir_height] = b;
+    if(simplefs_nodeRead(b, node) < 0)
+        return -1;
+    full[inode.dir_height] = h->count == LEAF_KEYS;
+
+    int need = 0;
+    for(int d = inode.dir_height; d >= 0 && full[d]; d--)
+        need++;
+    if(need == inode.dir_height + 1){
+        if(inode.dir_height == BTREE_MAX_HEIGHT)
+            return -1;
+        need++;
+    }
+    int spare[BTREE_MAX_HEIGHT + 2];
+    for(int i = 0; i < need; i++){
+        spare[i] = simplefs_allocDataBlock();
+        if(spare[i] == -1){
+            while(i-- > 0)
+                simplefs_freeDataBlock(spare[i]);
+            return -1;
+        }
+    }
+
+    if(!full[inode.dir_height]){
+        simplefs_leafInsert(node, key);
+        simplefs_writeDataBlock(b, (char *)node);
+        inode.file_size++;
+        return simplefs_writeInode(dir, &inode);
+    }
+
+    // Split the leaf, then carry a separator up while the parents are full.
+    // Either kind of node plus the key being added fits a block
+    uint64_t *right = node + NODE_WORDS;
+    memset(right, 0, simplefs_layout.block_size);
+    uint64_t *all = right + NODE_WORDS;
+    int *all_children = (int *)(all + NODE_WORDS);
+    int used = 0;
+    memcpy(all, keys, h->count * sizeof(uint64_t));
+    int n = h->count + 1;
+    int pos = simplefs_upperBound(all, h->count, key);
+    memmove(all + pos + 1, all + pos, (h->count - pos) * sizeof(uint64_t));
+    all[pos] = key;
+    int left_count = n / 2;
+    int right_block = spare[used++];
+    simplefs_nodeHeader(right)->count = n - left_count;
+    simplefs_nodeHeader(right)->next = h->next;
+    memcpy(simplefs_nodeKeys(right), all + left_count, (n - left_count) * sizeof(uint64_t));
+    h->count = left_count;
+    h->next = right_block;
+    memcpy(keys, all, left_count * sizeof(uint64_t));
+    simplefs_writeDataBlock(b, (char *)node);
+    simplefs_writeDataBlock(right_block, (char *)right);
+    uint64_t carry_key = all[left_count];
+    int carry_block = right_block;
+
+    for(int d = inode.dir_height - 1; d >= 0 && carry_block != -1; d--){
+        if(simplefs_nodeRead(path[d], node) < 0){
+            // Read on the way down, gone bad since: the new nodes stay unlinked
+            while(used < need)
+                simplefs_freeDataBlock(spare[used++]);
+            return -1;
+        }
+        int s = slot[d];
+        memcpy(all, keys, h->count * sizeof(uint64_t));
+        memcpy(all_children, children, (h->count + 1) * sizeof(int));
+        memmove(all + s + 1, all + s, (h->count - s) * sizeof(uint64_t));
+        memmove(all_children + s + 2, all_children + s + 1, (h->count - s) * sizeof(int));
+        all[s] = carry_key;
+        all_children[s + 1] = carry_block;
+        n = h->count + 1;
+        if(n <= INTERNAL_KEYS){
+            h->count = n;
+            memcpy(keys, all, n * sizeof(uint64_t));
+            memcpy(children, all_children, (n + 1) * sizeof(int));
+            simplefs_writeDataBlock(path[d], (char *)node);
+            carry_block = -1;
+            break;
+        }
+        int mid = n / 2;
+        right_block = spare[used++];
+        memset(right, 0, simplefs_layout.block_size);
+        simplefs_nodeHeader(right)->count = n - mid - 1;
+        simplefs_nodeHeader(right)->next = -1;
+        memcpy(simplefs_nodeKeys(right), all + mid + 1, (n - mid - 1) * sizeof(uint64_t));
+        memcpy(simplefs_nodeChildren(right), all_children + mid + 1, (n - mid) * sizeof(int));
+        h->count = mid;
+        memcpy(keys, all, mid * sizeof(uint64_t));
+        memcpy(children, all_children, (mid + 1) * sizeof(int));
+        simplefs_writeDataBlock(path[d], (char *)node);
+        simplefs_writeDataBlock(right_block, (char *)right);
+        carry_key = all[mid];
+        carry_block = right_block;
+    }
+
+    if(carry_block != -1){
+        int root = spare[used++];
+        memset(node, 0, simplefs_layout.block_size);
+        h->count = 1;
+        h->next = -1;
+        keys[0] = carry_key;
+        children[0] = inode.dir_root;
+        children[1] = carry_block;
+        simplefs_writeDataBlock(root, (char *)node);
+        inode.dir_root = root;
+        inode.dir_height++;
+    }
+    assert(used == need);
+    inode.file_size++;
+    return simplefs_writeInode(dir, &inode);
+}
+
+int simplefs_dirInsert(int dir, const char *name, int inodenum){
+    /*
+	    Add entry `name` -> `inodenum` to directory `dir`. Every block the
+	    splits need is allocated before the tree is touched, so a full disk
+	    leaves the directory unchanged and -1 is returned. So does the
+	    directory or a node on the way failing its checksum, with errno EIO
+	*/
+    uint64_t *scratch = simplefs_nodeAlloc(4);
+    int ret = simplefs_btreeInsert(dir, name, inodenum, scratch);
+    free(scratch);
+    return ret;
+}
+
+struct dir_key_t
+{
+    uint64_t key;
+    int index;      // entry of the caller's arrays the key was made from
+};
+
+static int simplefs_compareKeys(const void *a, const void *b){
+    uint64_t x = ((const struct dir_key_t *)a)->key, y = ((const struct dir_key_t *)b)->key;
+    return (x > y) - (x < y);
+}
+
+static struct dir_key_t *simplefs_sortKeys(int count, const char **names, const int *inodenums){
+    struct dir_key_t *order = malloc(count * sizeof(struct dir_key_t));
+    assert(order || count == 0);
+    for(int i=0; i<count; i++){
+        order[i].key = simplefs_dirKey(simplefs_nameHash(names[i]), inodenums[i]);
+        order[i].index = i;
+    }
+    qsort(order, count, sizeof(struct dir_key_t), simplefs_compareKeys);
+    return order;
+}
+
+static int simplefs_btreeLeaf(struct inode_t *dir, uint64_t key, uint64_t *node, uint64_t *high){
+    /*
+	    Read into `node` the leaf `key` belongs in and return its block. Keys
+	    from `*high` on belong to leaves further right, UINT64_MAX if none do.
+	    -1 with errno EIO when a node on the way fails its checksum
+	*/
+    *high = UINT64_MAX;
+    int b = dir->dir_root;
+    for(int level = dir->dir_height; level > 0; level--){
+        if(simplefs_nodeRead(b, node) < 0)
+            return -1;
+        int n = simplefs_nodeHeader(node)->count;
+        int s = simplefs_upperBound(simplefs_nodeKeys(node), n, key);
+        if(s < n)
+            *high = simplefs_nodeKeys(node)[s];
+        b = simplefs_nodeChildren(node)[s];
+    }
+    return simplefs_nodeRead(b, node) < 0 ? -1 : b;
+}
+
+int simplefs_dirCredits(int dir){
+    /*
+	    Cached blocks adding one entry to directory `dir` may dirty besides
+	    the directory's inode and a new root: the old and the new node of
+	    every level a split climbs, one more level if the tree grows
+	    meanwhile
+	*/
+    // A directory failing its checksum takes no entries, the insert finds out
+    struct inode_t inode;
+    if(simplefs_readInode(dir, &inode) < 0)
+        inode.dir_height = 0;
+    return 2 * (inode.dir_height + 2);
+}
+
+int simplefs_dirInsertMany(int dir, int count, const char **names, const int *inodenums, char *inserted){
+    /*
+	    simplefs_dirInsert() for `count` entries, setting `inserted[i]` for
+	    each one added. The keys go in in order: every run of them that falls
+	    in one leaf and fits in it is merged into it with one write, and a key
+	    meeting a full leaf is inserted on its own, splitting it. Returns how
+	    many entries were added
+	*/
+    struct dir_key_t *order = simplefs_sortKeys(count, names, inodenums);
+    uint64_t *scratch = simplefs_nodeAlloc(4);
+    struct btree_node_t *h = simplefs_nodeHeader(scratch);
+    uint64_t *keys = simplefs_nodeKeys(scratch);
+    int added = 0;
+    memset(inserted, 0, count);
+    for(int k=0; k<count; ){
+        struct inode_t inode;
+        if(simplefs_readInode(dir, &inode) < 0)
+            break;
+        int run = 0, b = -1;
+        if(inode.dir_root != -1){
+            uint64_t high;
+            b = simplefs_btreeLeaf(&inode, order[k].key, scratch, &high);
+            if(b == -1)
+                break;
+            while(run < LEAF_KEYS - h->count && k + run < count && order[k + run].key < high)
+                run++;
+        }
+        if(run == 0){
+            int i = order[k++].index;
+            inserted[i] = simplefs_btreeInsert(dir, names[i], inodenums[i], scratch) == 0;
+            added += inserted[i];
+            continue;
+        }
+        // Merge from the back, both lists being sorted
+        int n = h->count, out = h->count + run, j = run;
+        while(j > 0){
+            if(n > 0 && keys[n - 1] > order[k + j - 1].key)
+                keys[--out] = keys[--n];
+            else
+                keys[--out] = order[k + --j].key;
+        }
+        h->count += run;
+        simplefs_writeDataBlock(b, (char *)scratch);
+        inode.file_size += run;
+        if(simplefs_writeInode(dir, &inode) < 0)
+            break;
+        for(j=0; j<run; j++)
+            inserted[order[k + j].index] = 1;
+        added += run;
+        k += run;
+    }
+    free(scratch);
+    free(order);
+    return added;
+}
+
+static void simplefs_btreeFreeNode(int block, int height){
+    if(height > 0){
+        // The children of a node failing its checksum are unknown, they stay allocated
+        uint64_t *node = simplefs_nodeAlloc(1);
+        for(int i = 0; simplefs_nodeRead(block, node) == 0 && i <= simplefs_nodeHeader(node)->count; i++)
+            simplefs_btreeFreeNode(simplefs_nodeChildren(node)[i], height - 1);
+        free(node);
+    }
+    simplefs_freeDataBlock(block);
+}
+
+int simplefs_dirFree(int dir){
+    /*
+	    Free every node of directory `dir`'s entry tree. -1 with errno EIO,
+	    nothing freed, when the directory fails its checksum
+	*/
+    struct inode_t inode;
+    if(simplefs_readInode(dir, &inode) < 0)
+        return -1;
+    int root = inode.dir_root, height = inode.dir_height;
+    inode.dir_root = -1;
+    inode.dir_height = 0;
+    inode.file_size = 0;
+    if(simplefs_writeInode(dir, &inode) < 0)
+        return -1;
+    if(root != -1)
+        simplefs_btreeFreeNode(root, height);
+    return 0;
+}
+
+struct dir_walk_t
+{
+    int (*visit)(void *arg, int block, char *node);
+    void *arg;
+    int leaf;       // last leaf visited, the left neighbour's `next`, -1 before the first
+    int leaf_to;    // what `visit` returned for it
+};
+
+static int simplefs_btreeWalkNode(struct dir_walk_t *walk, int block, int height){
+    uint64_t *node = simplefs_nodeAlloc(1);
+    if(simplefs_nodeRead(block, node) < 0){
+        free(node);
+        return -1;
+    }
+    int ret;
+    if(height == 0){
+        if(simplefs_nodeHeader(node)->next == walk->leaf)
+            simplefs_nodeHeader(node)->next = walk->leaf_to;
+        walk->leaf = block;
+        walk->leaf_to = walk->visit(walk->arg, block, (char *)node);
+        ret = walk->leaf_to;
+        free(node);
+        return ret;
+    }
+    for(int i = simplefs_nodeHeader(node)->count; i >= 0; i--){
+        int child = simplefs_btreeWalkNode(walk, simplefs_nodeChildren(node)[i], height - 1);
+        if(child == -1){
+            free(node);
+            return -1;
+        }
+        simplefs_nodeChildren(node)[i] = child;
+    }
+    ret = walk->visit(walk->arg, block, (char *)node);
+    free(node);
+    return ret;
+}
+
+int simplefs_dirWalk(int root, int height, int (*visit)(void *arg, int block, char *node), void *arg){
+    /*
+	    Call `visit` on every node of the entry tree under `root`, leaves
+	    right to left and children before their parent, with the node's
+	    contents. The block numbers `visit` returns replace the ones the
+	    parent and the left neighbour hold before they are visited in turn,
+	    so a visit that copies nodes builds a copy of the tree. Returns what
+	    `visit` returned for `root`, -1 as soon as a call does or, with errno
+	    EIO, a node fails its checksum
+	*/
+    struct dir_walk_t walk = {visit, arg, -1, -1};
+    return simplefs_btreeWalkNode(&walk, root, height);
+}
+
+int simplefs_dirRemove(int dir, const char *name){
+    /*
+	    Remove entry `name` from directory `dir` and return its inode, or -1
+	    if there is no such entry, with errno EIO when the directory fails
+	    its checksum
+	*/
+    struct inode_t inode;
+    if(simplefs_readInode(dir, &inode) < 0 || inode.status != INODE_DIRECTORY)
+        return -1;
+    uint64_t *node = simplefs_nodeAlloc(1);
+    int block, index;
+    int inodenum = simplefs_btreeFind(&inode, name, node, &block, &index);
+    if(inodenum != -1 && inode.file_size == 1){
+        if(simplefs_dirFree(dir) < 0)
+            inodenum = -1;
+    } else if(inodenum != -1){
+        struct btree_node_t *h = simplefs_nodeHeader(node);
+        uint64_t *keys = simplefs_nodeKeys(node);
+        memmove(keys + index, keys + index + 1, (h->count - index - 1) * sizeof(uint64_t));
+        h->count--;
+        simplefs_writeDataBlock(block, (char *)node);
+        inode.file_size--;
+        if(simplefs_writeInode(dir, &inode) < 0)
+            inodenum = -1;
+    }
+    free(node);
+    return inodenum;
+}
+
+int simplefs_dirRemoveMany(int dir, int count, const char **names, const int *inodenums){
+    /*
+	    Remove the entries `names[i]` -> `inodenums[i]` from directory `dir`,
+	    each leaf holding some of them written once. Returns how many were
+	    found and removed
+	*/
+    struct dir_key_t *order = simplefs_sortKeys(count, names, inodenums);
+    uint64_t *node = simplefs_nodeAlloc(1);
+    struct btree_node_t *h = simplefs_nodeHeader(node);
+    uint64_t *keys = simplefs_nodeKeys(node);
+    int removed = 0;
+    for(int k=0; k<count; ){
+        struct inode_t inode;
+        if(simplefs_readInode(dir, &inode) < 0 || inode.dir_root == -1)
+            break;
+        uint64_t high;
+        int b = simplefs_btreeLeaf(&inode, order[k].key, node, &high);
+        if(b == -1)
+            break;
+        int n = h->count, out = 0;
+        for(int i=0; i<n; i++){
+            while(k < count && order[k].key < keys[i])
+                k++;
+            if(k < count && order[k].key == keys[i])
+                k++;
+            else
+                keys[out++] = keys[i];
+        }
+        while(k < count && order[k].key < high)
+            k++;
+        if(out == n)
+            continue;
+        if((int64_t)inode.file_size == n - out){
+            if(simplefs_dirFree(dir) < 0)
+                break;
+            removed += n - out;
+            continue;
+        }
+        h->count = out;
+        simplefs_writeDataBlock(b, (char *)node);
+        inode.file_size -= n - out;
+        if(simplefs_writeInode(dir, &inode) < 0)
+            break;
+        removed += n - out;
+    }
+    free(node);
+    free(order);
+    return removed;
+}
+
+int simplefs_dirResolve(const char *path, int *parent, const char **leaf){
+    /*
+	    Walk every component of `path` but the last down from the root.
+	    Returns 0 with the directory holding the last component in `*parent`
+	    and the component itself in `*leaf`, or -1 if a directory on the way
+	    does not exist or a component is empty or too long
+	*/
+    int dir = SIMPLEFS_ROOT_INODE;
+    const char *p = path;
+    while(*p == '/')
+        p++;
+    const char *slash;
+    char *component = NULL;         // names can take most of a block, so off the stack
+    while((slash = strchr(p, '/')) != NULL){
+        size_t len = slash - p;
+        if(len == 0 || len > (size_t)simplefs_dirMaxName()){
+            free(component);
+            return -1;
+        }
+        if(!component){
+            component = malloc(simplefs_dirMaxName() + 1);
+            assert(component);
+        }
+        memcpy(component, p, len);
+        component[len] = '\0';
+        dir = simplefs_dirLookup(dir, component);
+        if(dir == -1){
+            free(component);
+            return -1;
+        }
+        p = slash + 1;
+    }
+    free(component);
+    if(*p == '\0' || strlen(p) > (size_t)simplefs_dirMaxName())
+        return -1;
+    struct inode_t inode;
+    if(simplefs_readInode(dir, &inode) < 0 || inode.status != INODE_DIRECTORY)
+        return -1;
+    *parent = dir;
+    *leaf = p;
+    return 0;
+}
@@ -0,0 +1,31 @@
+/*
+	DIRECTORIES
+*/
+#ifndef SIMPLEFS_DIR_H
+#define SIMPLEFS_DIR_H
+
+/*
+	A directory's entries are kept in a B+tree of data blocks keyed by
+	(name hash << 32 | inode number). Leaves are chained left to right so
+	entries sharing a hash can be scanned across a leaf boundary
+*/
+struct btree_node_t
+{
+	int count;		// keys in use
+	int next;		// leaves: right sibling, -1 for the last leaf
+};
+
+int simplefs_dirMaxName();
+int simplefs_dirLookup(int dir, const char *name);
+int simplefs_dirInsert(int dir, const char *name, int inodenum);
+int simplefs_dirRemove(int dir, const char *name);
+int simplefs_dirCredits(int dir);
+int simplefs_dirInsertMany(int dir, int count, const char **names, const int *inodenums, char *inserted);
+int simplefs_dirRemoveMany(int dir, int count, const char **names, const int *inodenums);
+int simplefs_dirFree(int dir);
+int simplefs_dirWalk(int root, int height, int (*visit)(void *arg, int block, char *node), void *arg);
+int simplefs_dirResolve(const char *path, int *parent, const char **leaf);
+int simplefs_dirSetName(struct inode_t *inodeptr, const char *name);
+void simplefs_dirReleaseName(struct inode_t *inodeptr);
+
+#endif
@@ -1,183 +1,2396 @@
+#define _GNU_SOURCE						// O_DIRECT, statx()
 #include "simplefs-disk.h"
 
-int DISK_FD;   // pointer to simplefs.txt
-struct filehandle_t file_handle_array[MAX_OPEN_FILES]; // Array for storing opened files
+int DISK_FD = -1;   // pointer to simplefs.txt, -1 while nothing is mounted
+static int io_mode = SIMPLEFS_IO_FD;           // backend used by the next format or mount
+static char *disk_map = NULL;                  // whole image when mounted in SIMPLEFS_IO_MMAP mode
+static int direct_align = 0;                   // O_DIRECT alignment of offsets, lengths and buffers, 0 when not in use
 
-void simplefs_readSuperBlock(struct superblock_t *superblock){
+static struct superblock_t mounted_superblock; // in-memory copy of the superblock while mounted
+static uint64_t *inode_bitmap = NULL;          // mounted copy of the inode bitmap blocks
+static uint64_t *datablock_bitmap = NULL;      // mounted copy of the data block bitmap blocks
+static unsigned char *bitmap_dirty = NULL;     // one flag per bitmap block, inode bitmap blocks first, then per checksum table block
+static uint32_t *block_csums = NULL;           // mounted checksum table, NULL without SIMPLEFS_FEATURE_CHECKSUMS
+static uint64_t *csum_verified = NULL;         // one bit per checksum table entry, set once its block is known to match
+static uint64_t *csum_stale = NULL;            // one bit per checksum table entry, set when a mapped write left it behind
+static int verify_once = 0;                    // blocks read around the cache or mapped are checked only until they first match
+static int csum_refreshing = 0;                // simplefs_csumRefresh() calls under way
+static unsigned csum_refreshed = 0;            // simplefs_csumRefresh() calls done
+static uint64_t *pending_free = NULL;          // journaled disks: data blocks freed by uncommitted transactions, still set in datablock_bitmap
+static uint64_t *commit_free = NULL;           // the pending ones the commit under way carries, released once it is durable
+static int pending_free_blocks = 0;            // bits set in pending_free
+static uint64_t *fresh_blocks = NULL;          // journaled disks with checksums: data blocks allocated since the last commit
+static int superblock_mounted = 0;
+struct simplefs_stats simplefs_io_stats;
+struct simplefs_layout simplefs_layout;
+static struct inode_state_t *inode_states = NULL; // in-memory lock and map generation per inode
+static uint32_t num_inode_states = 0;             // entries of inode_states, a reformat changes the layout first
+static int inode_hint = 0;                     // no free inode below this index
+static int datablock_hint = 0;                 // no free data block below this index
+static int free_data_blocks = 0;               // clear bits in datablock_bitmap
+static int reserved_data_blocks = 0;           // free blocks promised to delayed allocations
+static void (*flush_hook)(void) = NULL;        // hands delayed writes their blocks before a sync
+static uint8_t *snapshot_refs = NULL;          // per data block, the snapshots referencing it; NULL while there are none
+static int read_only = 0;                      // a snapshot is mounted, nothing may change
+static pthread_mutex_t freemap_lock = PTHREAD_MUTEX_INITIALIZER; // guards the bitmaps, dirty flags and hints
+static pthread_mutex_t inode_table_lock = PTHREAD_MUTEX_INITIALIZER; // guards pinning and the in-core inode copies
+
+// Open-file table, grown a chunk at a time. Chunks never move, so a handle
+// in use stays put while another thread grows the table
+static struct filehandle_t *handle_chunks[MAX_OPEN_FILES / HANDLE_CHUNK];
+static int handle_slots = 0;                   // slots in the allocated chunks
+static int handle_free = -1;                   // first slot of the free list, -1 when the table has to grow
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER; // guards the free list and the table's growth
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+static inline int simplefs_bitTest(const uint64_t *map, int bit){
+    return (map[bit / BITMAP_WORD_BITS] >> (bit % BITMAP_WORD_BITS)) & 1;
+}
+
+static inline void simplefs_bitSet(uint64_t *map, int bit){
+    map[bit / BITMAP_WORD_BITS] |= (uint64_t)1 << (bit % BITMAP_WORD_BITS);
+}
+
+static inline void simplefs_bitClear(uint64_t *map, int bit){
+    map[bit / BITMAP_WORD_BITS] &= ~((uint64_t)1 << (bit % BITMAP_WORD_BITS));
+}
+
+static int simplefs_bitmapFindFree(const uint64_t *map, int nbits, int hint){
+    /*
+	    Return the first clear bit at or after `hint`, or -1 if all of
+	    [hint, nbits) is set. Whole words are skipped while they are full and
+	    the free bit inside a word is located with count-trailing-zeros
+	*/
+    if(hint >= nbits)
+        return -1;
+    int nwords = BITMAP_WORDS(nbits);
+    int w = hint / BITMAP_WORD_BITS;
+    uint64_t avail = ~map[w] & (~(uint64_t)0 << (hint % BITMAP_WORD_BITS));
+    while(!avail){
+        w++;
+#if defined(__AVX2__)
+        const __m256i full = _mm256_set1_epi64x(-1);
+        while(w + 4 <= nwords){
+            __m256i v = _mm256_loadu_si256((const __m256i *)(map + w));
+            if(_mm256_movemask_epi8(_mm256_cmpeq_epi64(v, full)) != -1)
+                break;
+            w += 4;
+        }
+#endif
+        if(w >= nwords)
+            return -1;
+        avail = ~map[w];
+    }
+    int bit = w * BITMAP_WORD_BITS + __builtin_ctzll(avail);
+    return bit < nbits ? bit : -1;
+}
+
+static int simplefs_bitmapRunLength(const uint64_t *map, int nbits, int start, int max){
+    /*
+	    Count the clear bits from `start` up to the next set bit, stopping at
+	    `nbits` or after `max` bits
+	*/
+    int limit = (max < nbits - start) ? start + max : nbits;
+    int bit = start;
+    while(bit < limit){
+        uint64_t used = map[bit / BITMAP_WORD_BITS] >> (bit % BITMAP_WORD_BITS);
+        if(used){
+            bit += __builtin_ctzll(used);
+            break;
+        }
+        bit += BITMAP_WORD_BITS - bit % BITMAP_WORD_BITS;
+    }
+    return (bit < limit ? bit : limit) - start;
+}
+
+void simplefs_bitmapSetRange(uint64_t *map, int start, int len, int value){
+    /*
+	    Set or clear bits [start, start + len), a whole word at a time where possible
+	*/
+    while(len > 0){
+        int shift = start % BITMAP_WORD_BITS;
+        int n = BITMAP_WORD_BITS - shift < len ? BITMAP_WORD_BITS - shift : len;
+        uint64_t mask = (n == BITMAP_WORD_BITS ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1)) << shift;
+        if(value)
+            map[start / BITMAP_WORD_BITS] |= mask;
+        else
+            map[start / BITMAP_WORD_BITS] &= ~mask;
+        start += n;
+        len -= n;
+    }
+}
+
+static void simplefs_iovCopy(const struct iovec *iov, size_t offset, char *buf, size_t len, int to_iov){
+    /*
+	    Copy `len` bytes between `buf` and the byte stream `iov` describes,
+	    starting `offset` bytes into it
+	*/
+    while(offset >= iov->iov_len){
+        offset -= iov->iov_len;
+        iov++;
+    }
+    while(len > 0){
+        size_t n = iov->iov_len - offset < len ? iov->iov_len - offset : len;
+        if(to_iov)
+            memcpy((char *)iov->iov_base + offset, buf, n);
+        else
+            memcpy(buf, (char *)iov->iov_base + offset, n);
+        buf += n;
+        len -= n;
+        offset = 0;
+        iov++;
+    }
+}
+
+static int simplefs_iovSlice(const struct iovec *iov, size_t offset, size_t len, struct iovec *out, int max){
+    /*
+	    Describe the `len` bytes at `offset` into the buffers of `iov` with
+	    up to `max` entries of `out`. Returns how many, -1 if they do not fit
+	*/
+    for(; offset >= iov->iov_len; iov++)
+        offset -= iov->iov_len;
+    int n = 0;
+    for(; len > 0; iov++, offset = 0){
+        if(n == max)
+            return -1;
+        size_t part = iov->iov_len - offset < len ? iov->iov_len - offset : len;
+        out[n].iov_base = (char *)iov->iov_base + offset;
+        out[n].iov_len = part;
+        n++;
+        len -= part;
+    }
+    return n;
+}
+
+static void simplefs_directIO(char *buf, size_t len, off_t offset, int write){
+    while(len > 0){
+        ssize_t ret = write ? pwrite(DISK_FD, buf, len, offset) : pread(DISK_FD, buf, len, offset);
+        assert(ret > 0);
+        SIMPLEFS_STAT_INC(disk_calls);
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+}
+
+static int simplefs_directAligned(off_t offset, const struct iovec *iov, int iovcnt){
+    if(offset % direct_align)
+        return 0;
+    for(int i=0; i<iovcnt; i++){
+        if((uintptr_t)iov[i].iov_base % direct_align || iov[i].iov_len % direct_align)
+            return 0;
+    }
+    return 1;
+}
+
+static void simplefs_directBounce(off_t offset, const struct iovec *iov, int iovcnt, int write){
+    /*
+	    Move `iov` through an aligned bounce buffer covering whole alignment
+	    units, for a transfer O_DIRECT cannot take as it is. A write first
+	    reads the units it only partly covers
+	*/
+    size_t len = 0;
+    for(int i=0; i<iovcnt; i++)
+        len += iov[i].iov_len;
+    off_t lo = offset / direct_align * direct_align;
+    off_t hi = (offset + (off_t)len + direct_align - 1) / direct_align * direct_align;
+    char *bounce;
+    int ret = posix_memalign((void **)&bounce, direct_align, hi - lo);
+    assert(ret == 0);
+    if(!write || lo != offset || hi != offset + (off_t)len)
+        simplefs_directIO(bounce, hi - lo, lo, 0);
+    simplefs_iovCopy(iov, 0, bounce + (offset - lo), len, !write);
+    if(write)
+        simplefs_directIO(bounce, hi - lo, lo, 1);
+    free(bounce);
+}
+
+static void simplefs_rawRead(off_t offset, char *buf, size_t len){
+    if(disk_map){
+        memcpy(buf, disk_map + offset, len);
+        return;
+    }
+    struct iovec iov = {buf, len};
+    if(direct_align && !simplefs_directAligned(offset, &iov, 1)){
+        simplefs_directBounce(offset, &iov, 1, 0);
+        return;
+    }
+    if(simplefs_uringActive() && simplefs_uringTransfer(offset, &iov, 1, 0) == 0)
+        return;
+    ssize_t ret = pread(DISK_FD, buf, len, offset);
+    assert(ret == (ssize_t)len);
+    SIMPLEFS_STAT_INC(disk_calls);
+}
+
+static void simplefs_rawWrite(off_t offset, const char *buf, size_t len){
+    if(disk_map){
+        memcpy(disk_map + offset, buf, len);
+        return;
+    }
+    struct iovec iov = {(char *)buf, len};
+    if(direct_align && !simplefs_directAligned(offset, &iov, 1)){
+        simplefs_directBounce(offset, &iov, 1, 1);
+        return;
+    }
+    if(simplefs_uringActive() && simplefs_uringTransfer(offset, &iov, 1, 1) == 0)
+        return;
+    ssize_t ret = pwrite(DISK_FD, buf, len, offset);
+    assert(ret == (ssize_t)len);
+    SIMPLEFS_STAT_INC(disk_calls);
+}
+
+static void simplefs_rawTransfer(off_t offset, const struct iovec *iov, int iovcnt, int write){
+    /*
+	    Move the bytes described by `iov` to or from the image at `offset`
+	    with as few preadv/pwritev calls as the kernel allows, resuming after
+	    short transfers, or through the ring in one submission. On an
+	    O_DIRECT image a transfer that is not aligned takes a bounce buffer
+	*/
+    struct iovec v[iovcnt];
+    memcpy(v, iov, sizeof(v));
+    struct iovec *cur = v;
+    if(disk_map){
+        for(int i=0; i<iovcnt; i++){
+            if(write)
+                memcpy(disk_map + offset, v[i].iov_base, v[i].iov_len);
+            else
+                memcpy(v[i].iov_base, disk_map + offset, v[i].iov_len);
+            offset += v[i].iov_len;
+        }
+        return;
+    }
+    if(direct_align && !simplefs_directAligned(offset, iov, iovcnt)){
+        simplefs_directBounce(offset, iov, iovcnt, write);
+        return;
+    }
+    if(simplefs_uringActive() && simplefs_uringTransfer(offset, iov, iovcnt, write) == 0)
+        return;
+    while(iovcnt > 0){
+        int n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        ssize_t ret = write ? pwritev(DISK_FD, cur, n, offset) : preadv(DISK_FD, cur, n, offset);
+        assert(ret > 0);
+        SIMPLEFS_STAT_INC(disk_calls);
+        offset += ret;
+        while(iovcnt > 0 && (size_t)ret >= cur->iov_len){
+            ret -= cur->iov_len;
+            cur++;
+            iovcnt--;
+        }
+        if(iovcnt > 0){
+            cur->iov_base = (char *)cur->iov_base + ret;
+            cur->iov_len -= ret;
+        }
+    }
+}
+
+static void simplefs_rawWriteRuns(int count, const off_t *offsets, const struct iovec *iov, const int *iovcnt, int sync){
+    /*
+	    Write `count` runs to scattered `offsets`, run i from the next
+	    iovcnt[i] buffers of `iov`, then with `sync` set make the image
+	    durable. The ring takes all of it in one submission
+	*/
+    if(simplefs_uringActive() && simplefs_uringWriteRuns(count, offsets, iov, iovcnt, sync) == 0)
+        return;
+    for(int i=0; i<count; i++){
+        simplefs_rawTransfer(offsets[i], iov, iovcnt[i], 1);
+        iov += iovcnt[i];
+    }
+    if(sync){
+        int ret = fsync(DISK_FD);
+        assert(ret == 0);
+    }
+}
+
+static inline off_t simplefs_blockOffset(uint32_t blocknum){
+    return (off_t)blocknum * simplefs_layout.block_size;
+}
+
+static inline int64_t simplefs_csumIndex(uint32_t blocknum){
+    /*
+	    Entry of absolute block `blocknum` in the checksum table, -1 for a
+	    block that has none
+	*/
+    if(blocknum >= simplefs_layout.data_start)
+        return (int64_t)simplefs_layout.inode_table_blocks + blocknum - simplefs_layout.data_start;
+    if(blocknum - simplefs_layout.inode_table_start < simplefs_layout.inode_table_blocks)
+        return blocknum - simplefs_layout.inode_table_start;
+    return -1;
+}
+
+static inline void simplefs_csumMark(uint64_t *map, int64_t i){
+    __atomic_fetch_or(&map[i / BITMAP_WORD_BITS], (uint64_t)1 << (i % BITMAP_WORD_BITS), __ATOMIC_RELAXED);
+}
+
+static void simplefs_csumStore(uint32_t blocknum, const char *data){
+    /*
+	    Record the checksum of `data`, about to be written to `blocknum`.
+	    The entry is set before its table block is marked dirty and a
+	    commit clears the mark before copying the block, so no change is
+	    lost to a commit running alongside. The block needs no checking
+	    when next read, its contents are known
+	*/
+    int64_t i = block_csums ? simplefs_csumIndex(blocknum) : -1;
+    if(i < 0)
+        return;
+    uint32_t crc = simplefs_crc32c(data, simplefs_layout.block_size);
+    simplefs_csumMark(csum_verified, i);
+    if(__atomic_load_n(&block_csums[i], __ATOMIC_RELAXED) == crc)
+        return;
+    __atomic_store_n(&block_csums[i], crc, __ATOMIC_RELAXED);
+    uint32_t table_block = simplefs_layout.inode_bitmap_blocks + simplefs_layout.datablock_bitmap_blocks
+                           + i * sizeof(uint32_t) / simplefs_layout.block_size;
+    __atomic_store_n(&bitmap_dirty[table_block], 1, __ATOMIC_RELEASE);
+}
+
+static int simplefs_csumVerify(uint32_t blocknum, const char *data, int once){
+    /*
+	    Check `data`, just read from `blocknum`, against its checksum.
+	    Returns -1 on a mismatch, which is counted, 0 otherwise. With `once`
+	    a block that already matched since the mount, or was written since,
+	    is taken as it is
+	*/
+    int64_t i = block_csums ? simplefs_csumIndex(blocknum) : -1;
+    if(i < 0)
+        return 0;
+    if(once && (__atomic_load_n(&csum_verified[i / BITMAP_WORD_BITS], __ATOMIC_RELAXED) >> (i % BITMAP_WORD_BITS) & 1))
+        return 0;
+    SIMPLEFS_STAT_INC(csum_checks);
+    if(simplefs_crc32c(data, simplefs_layout.block_size) != __atomic_load_n(&block_csums[i], __ATOMIC_RELAXED)){
+        SIMPLEFS_STAT_INC(csum_errors);
+        return -1;
+    }
+    simplefs_csumMark(csum_verified, i);
+    return 0;
+}
+
+static int simplefs_csumRun(uint32_t blocknum, int count, const struct iovec *iov, int mode){
+    /*
+	    simplefs_csumStore() with `mode` CSUM_STORE, else simplefs_csumVerify()
+	    for each block of a run held by the buffers of `iov`. A block split
+	    across buffers is gathered first. Returns -1 when a block did not
+	    match its checksum
+	*/
+    if(!block_csums)
+        return 0;
+    uint32_t bs = simplefs_layout.block_size;
+    char *block = NULL;             // gathers a split block, allocated when one turns up
+    size_t offset = 0;              // into iov->iov_base
+    int ret = 0;
+    for(int i=0; i<count; i++){
+        const char *data = (const char *)iov->iov_base + offset;
+        if(iov->iov_len - offset < bs){
+            if(!block){
+                block = malloc(bs);
+                assert(block);
+            }
+            simplefs_iovCopy(iov, offset, block, bs, 0);
+            data = block;
+        }
+        if(mode == CSUM_STORE)
+            simplefs_csumStore(blocknum + i, data);
+        else if(simplefs_csumVerify(blocknum + i, data, mode == CSUM_VERIFY_ONCE && verify_once) < 0)
+            ret = -1;
+        for(size_t left = bs; left > 0; ){
+            size_t step = iov->iov_len - offset < left ? iov->iov_len - offset : left;
+            offset += step;
+            left -= step;
+            if(offset == iov->iov_len){
+                iov++;
+                offset = 0;
+            }
+        }
+    }
+    free(block);
+    return ret;
+}
+
+static int simplefs_csumMapped(uint32_t blocknum){
+    /*
+	    simplefs_csumVerify() for block `blocknum` of a mapped image, read in
+	    place. A block written through the mapping since the last sync has
+	    no checksum yet and is taken as it is. A check that ran alongside
+	    simplefs_csumRefresh() may have seen the block's mark cleared before
+	    its checksum was taken, a mismatch then is checked again
+	*/
+    int64_t i = block_csums ? simplefs_csumIndex(blocknum) : -1;
+    if(i < 0 || (verify_once && (__atomic_load_n(&csum_verified[i / BITMAP_WORD_BITS], __ATOMIC_RELAXED) >> (i % BITMAP_WORD_BITS) & 1)))
+        return 0;
+    const char *data = disk_map + simplefs_blockOffset(blocknum);
+    for(;;){
+        unsigned refreshed = __atomic_load_n(&csum_refreshed, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&csum_refreshing, __ATOMIC_SEQ_CST) == 0){
+            if(__atomic_load_n(&csum_stale[i / BITMAP_WORD_BITS], __ATOMIC_SEQ_CST) >> (i % BITMAP_WORD_BITS) & 1)
+                return 0;
+            int match = simplefs_crc32c(data, simplefs_layout.block_size) == __atomic_load_n(&block_csums[i], __ATOMIC_SEQ_CST);
+            if(match || (__atomic_load_n(&csum_refreshing, __ATOMIC_SEQ_CST) == 0
+                         && __atomic_load_n(&csum_refreshed, __ATOMIC_SEQ_CST) == refreshed)){
+                SIMPLEFS_STAT_INC(csum_checks);
+                if(!match){
+                    SIMPLEFS_STAT_INC(csum_errors);
+                    return -1;
+                }
+                simplefs_csumMark(csum_verified, i);
+                return 0;
+            }
+        }
+        sched_yield();
+    }
+}
+
+static int simplefs_csumReadRun(uint32_t blocknum, int count, const struct iovec *iov){
+    /*
+	    Check a run just read around the cache into the buffers of `iov`,
+	    on a mapped image where it was read from
+	*/
+    if(!disk_map)
+        return simplefs_csumRun(blocknum, count, iov, CSUM_VERIFY_ONCE);
+    int ret = 0;
+    for(int i=0; i<count; i++){
+        if(simplefs_csumMapped(blocknum + i) < 0)
+            ret = -1;
+    }
+    return ret;
+}
+
+static void simplefs_csumMappedWrite(uint32_t blocknum){
+    /*
+	    Note that a write through the mapping changed `blocknum`, after it
+	    did. Its checksum is taken once at the next sync, however often the
+	    block changes until then
+	*/
+    int64_t i = block_csums ? simplefs_csumIndex(blocknum) : -1;
+    if(i < 0)
+        return;
+    simplefs_csumMark(csum_verified, i);
+    simplefs_csumMark(csum_stale, i);
+}
+
+static void simplefs_csumRefresh(){
     /*
-	    Helper function to read superblock from disk into superblock_t structure
+	    Take the checksums of the mapped blocks written since the last sync.
+	    A block written again meanwhile is marked again, after its write, so
+	    the next sync catches it
+	*/
+    if(!block_csums || !disk_map)
+        return;
+    __atomic_fetch_add(&csum_refreshing, 1, __ATOMIC_SEQ_CST);
+    uint64_t entries = (uint64_t)simplefs_layout.inode_table_blocks + simplefs_layout.num_data_blocks;
+    for(uint64_t w=0; w<BITMAP_WORDS(entries); w++){
+        if(!__atomic_load_n(&csum_stale[w], __ATOMIC_RELAXED))
+            continue;
+        for(uint64_t bits = __atomic_exchange_n(&csum_stale[w], 0, __ATOMIC_ACQUIRE); bits; bits &= bits - 1){
+            uint64_t i = w * BITMAP_WORD_BITS + __builtin_ctzll(bits);
+            uint32_t blocknum = i < simplefs_layout.inode_table_blocks ? simplefs_layout.inode_table_start + i
+                                : simplefs_layout.data_start + i - simplefs_layout.inode_table_blocks;
+            simplefs_csumStore(blocknum, disk_map + simplefs_blockOffset(blocknum));
+        }
+    }
+    __atomic_fetch_add(&csum_refreshed, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_sub(&csum_refreshing, 1, __ATOMIC_SEQ_CST);
+}
+
+int simplefs_diskReadBlock(int blocknum, char *buf){
+    /*
+	    Read absolute block `blocknum` of the image into `buf`, bypassing the
+	    cache. Returns -1 when it does not match its checksum
+	*/
+    assert(blocknum >= 0 && (uint32_t)blocknum < simplefs_layout.num_blocks);
+    simplefs_rawRead(simplefs_blockOffset(blocknum), buf, simplefs_layout.block_size);
+    SIMPLEFS_STAT_INC(disk_reads);
+    return simplefs_csumVerify(blocknum, buf, 0);
+}
+
+void simplefs_diskWriteBlock(int blocknum, const char *buf){
+    /*
+	    Write `buf` to absolute block `blocknum` of the image, bypassing the cache
+	*/
+    assert(blocknum >= 0 && (uint32_t)blocknum < simplefs_layout.num_blocks);
+    simplefs_csumStore(blocknum, buf);
+    simplefs_rawWrite(simplefs_blockOffset(blocknum), buf, simplefs_layout.block_size);
+    SIMPLEFS_STAT_INC(disk_writes);
+}
+
+void simplefs_diskWriteBlocks(int count, const int *blocknums, const char *const *bufs){
+    /*
+	    Write `count` blocks to scattered absolute block numbers, bypassing the
+	    cache. A ring submits them together
+	*/
+    if(count <= 0)
+        return;
+    if(simplefs_uringActive()){
+        off_t offsets[count];
+        for(int i=0; i<count; i++){
+            assert(blocknums[i] >= 0 && (uint32_t)blocknums[i] < simplefs_layout.num_blocks);
+            offsets[i] = simplefs_blockOffset(blocknums[i]);
+            simplefs_csumStore(blocknums[i], bufs[i]);
+        }
+        if(simplefs_uringWriteBlocks(count, offsets, bufs, simplefs_layout.block_size) == 0){
+            SIMPLEFS_STAT_ADD(disk_writes, count);
+            return;
+        }
+    }
+    for(int i=0; i<count; i++)
+        simplefs_diskWriteBlock(blocknums[i], bufs[i]);
+}
+
+int simplefs_diskReadRun(int blocknum, int count, char *buf){
+    /*
+	    Read absolute blocks [blocknum, blocknum + count) into `buf`, bypassing
+	    the cache. Returns -1 when one does not match its checksum
+	*/
+    assert(blocknum >= 0 && count > 0 && (uint32_t)blocknum + count <= simplefs_layout.num_blocks);
+    struct iovec iov = {buf, (size_t)count * simplefs_layout.block_size};
+    simplefs_rawTransfer(simplefs_blockOffset(blocknum), &iov, 1, 0);
+    SIMPLEFS_STAT_ADD(disk_reads, count);
+    return simplefs_csumRun(blocknum, count, &iov, CSUM_VERIFY);
+}
+
+void simplefs_diskWriteRun(int blocknum, int count, const struct iovec *iov, int iovcnt){
+    /*
+	    Write the buffers of `iov` to absolute blocks [blocknum, blocknum + count),
+	    bypassing the cache
+	*/
+    assert(blocknum >= 0 && count > 0 && (uint32_t)blocknum + count <= simplefs_layout.num_blocks);
+    simplefs_csumRun(blocknum, count, iov, CSUM_STORE);
+    simplefs_rawTransfer(simplefs_blockOffset(blocknum), iov, iovcnt, 1);
+    SIMPLEFS_STAT_ADD(disk_writes, count);
+}
+
+void simplefs_diskWriteRuns(int nruns, const int *blocknums, const int *counts, const struct iovec *iov, const int *iovcnt, int sync){
+    /*
+	    simplefs_diskWriteRun() for `nruns` runs at once, run i taking the
+	    next iovcnt[i] buffers of `iov`, then with `sync` set make the image
+	    durable. The ring submits them, and the fsync, together
+	*/
+    off_t *offsets = malloc((nruns > 0 ? nruns : 1) * sizeof(off_t));
+    assert(offsets);
+    const struct iovec *v = iov;
+    for(int i=0; i<nruns; i++){
+        assert(blocknums[i] >= 0 && counts[i] > 0 && (uint32_t)blocknums[i] + counts[i] <= simplefs_layout.num_blocks);
+        simplefs_csumRun(blocknums[i], counts[i], v, CSUM_STORE);
+        offsets[i] = simplefs_blockOffset(blocknums[i]);
+        SIMPLEFS_STAT_ADD(disk_writes, counts[i]);
+        v += iovcnt[i];
+    }
+    simplefs_rawWriteRuns(nruns, offsets, iov, iovcnt, sync);
+    free(offsets);
+}
+
+void simplefs_diskSync(){
+    /*
+	    Make every write so far durable: fsync(), or its ring equivalent
+	*/
+    simplefs_rawWriteRuns(0, NULL, NULL, NULL, 1);
+}
+
+int simplefs_readSuperBlock(int fd, struct superblock_t *superblock){
+    /*
+	    Helper function to read superblock from the image open on `fd` into
+	    superblock_t structure. Only the first BLOCKSIZE bytes are read: the
+	    block size is not known yet
 	*/
     char tempBuf[BLOCKSIZE];
-    lseek(DISK_FD, 0, SEEK_SET);
-    int ret = read(DISK_FD ,tempBuf, BLOCKSIZE);
-    assert(ret == BLOCKSIZE);
+    if(pread(fd, tempBuf, BLOCKSIZE, 0) != BLOCKSIZE)
+        return -1;
     memcpy(superblock, tempBuf, sizeof(struct superblock_t));
+    SIMPLEFS_STAT_INC(superblock_reads);
+    return 0;
+}
+
+void simplefs_writeSuperBlock(struct superblock_t *superblock){
+    /*
+	    Helper function to write superblock from superblock_t structure to disk
+	*/
+    char *tempBuf = calloc(1, simplefs_layout.block_size);
+    assert(tempBuf);
+    memcpy(tempBuf, superblock, sizeof(struct superblock_t));
+    simplefs_rawWrite(0, tempBuf, simplefs_layout.block_size);
+    free(tempBuf);
+    SIMPLEFS_STAT_INC(superblock_writes);
+}
+
+static int simplefs_computeLayout(const struct simplefs_geometry *geometry, struct simplefs_layout *layout){
+    /*
+	    Derive every on-disk region from the geometry into `layout`:
+	    superblock | inode bitmap | data block bitmap | inode table | journal | snapshots | checksums | data blocks
+	*/
+    uint32_t bs = geometry->block_size;
+    if(bs < BLOCKSIZE || bs > MAX_BLOCKSIZE || (bs & (bs - 1)) != 0)
+        return -1;
+    if(geometry->num_inodes == 0 || geometry->num_data_blocks == 0)
+        return -1;
+    if(geometry->features & ~SIMPLEFS_FEATURES_KNOWN)
+        return -1;
+    uint64_t bits_per_block = (uint64_t)bs * 8;
+    struct simplefs_layout l;
+    l.block_size = bs;
+    l.num_inodes = geometry->num_inodes;
+    l.num_data_blocks = geometry->num_data_blocks;
+    l.inodes_per_block = bs / sizeof(struct inode_t);
+    l.inode_bitmap_start = 1;
+    l.inode_bitmap_blocks = (l.num_inodes + bits_per_block - 1) / bits_per_block;
+    l.datablock_bitmap_start = l.inode_bitmap_start + l.inode_bitmap_blocks;
+    l.datablock_bitmap_blocks = (l.num_data_blocks + bits_per_block - 1) / bits_per_block;
+    l.inode_table_start = l.datablock_bitmap_start + l.datablock_bitmap_blocks;
+    l.inode_table_blocks = (l.num_inodes + l.inodes_per_block - 1) / l.inodes_per_block;
+    l.journal_start = l.inode_table_start + l.inode_table_blocks;
+    l.journal_blocks = 0;
+    l.features = geometry->features;
+    l.csum_blocks = 0;
+    if(l.features & SIMPLEFS_FEATURE_CHECKSUMS)
+        l.csum_blocks = (((uint64_t)l.inode_table_blocks + l.num_data_blocks) * sizeof(uint32_t) + bs - 1) / bs;
+    if(l.features & SIMPLEFS_FEATURE_JOURNAL){
+        l.journal_blocks = geometry->journal_blocks & ~1u;
+        if(simplefs_journalCapacity(&l) < JOURNAL_MIN_CREDITS)
+            return -1;
+    }
+    l.snapshot_start = l.journal_start + l.journal_blocks;
+    l.snapshot_slots = 0;
+    l.snapshot_slot_blocks = l.inode_bitmap_blocks + l.datablock_bitmap_blocks + l.inode_table_blocks;
+    if(l.features & SIMPLEFS_FEATURE_SNAPSHOTS){
+        l.snapshot_slots = geometry->snapshots;
+        if(l.snapshot_slots == 0 || l.snapshot_slots > SIMPLEFS_MAX_SNAPSHOTS)
+            return -1;
+    }
+    // Compressed clusters are cached under block numbers past the data blocks, a cluster's worth for each
+    l.cluster_blocks = 0;
+    if(l.features & SIMPLEFS_FEATURE_COMPRESSION){
+        if(!(l.features & SIMPLEFS_FEATURE_EXTENTS))
+            return -1;
+        l.cluster_blocks = COMPRESS_CLUSTER_BYTES / bs > COMPRESS_MIN_CLUSTER ? COMPRESS_CLUSTER_BYTES / bs : COMPRESS_MIN_CLUSTER;
+    }
+    uint64_t csum_start = (uint64_t)l.snapshot_start + (uint64_t)l.snapshot_slots * l.snapshot_slot_blocks;
+    uint64_t data_start = csum_start + l.csum_blocks;
+    if(data_start + (uint64_t)l.num_data_blocks * (l.cluster_blocks + 1) > INT32_MAX)
+        return -1;
+    l.csum_start = csum_start;
+    l.data_start = data_start;
+    l.num_blocks = data_start + l.num_data_blocks;
+    *layout = l;
+    return 0;
+}
+
+static int simplefs_directAlignment(){
+    /*
+	    The alignment O_DIRECT needs on the image, for file offsets and
+	    buffers alike: what statx() reports, or the page size where it
+	    reports nothing. 0 if the filesystem has no direct I/O
+	*/
+    struct statx stx;
+    if(statx(DISK_FD, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN)){
+        if(stx.stx_dio_offset_align == 0)
+            return 0;
+        return stx.stx_dio_offset_align > stx.stx_dio_mem_align ? stx.stx_dio_offset_align : stx.stx_dio_mem_align;
+    }
+    return sysconf(_SC_PAGESIZE);
+}
+
+static void simplefs_startBackend(){
+    /*
+	    In SIMPLEFS_IO_MMAP mode map the whole image so block accesses become
+	    plain memory copies. Durability then comes from msync() in simplefs_sync().
+	    Journaled disks stay on the fd backend: a store through the mapping
+	    could reach the image before its transaction commits. On a disk
+	    with checksums a mapped block is checked each time it is read and
+	    the checksums of blocks written are taken at the next sync.
+	    In SIMPLEFS_IO_URING mode set up the ring instead, with the cache's
+	    buffers registered. It only takes requests that batch: a single
+	    buffered transfer is cheaper as a plain pread/pwrite, which the ring
+	    would hand to a kernel worker. Without io_uring the fd backend is used.
+	    In SIMPLEFS_IO_DIRECT mode the image is switched to O_DIRECT when its
+	    block size is a multiple of the host's alignment, else the fd
+	    backend is used as well. So it is when the image cannot be mapped:
+	    starting a backend never fails
+	*/
+    if(io_mode == SIMPLEFS_IO_DIRECT){
+        int align = simplefs_directAlignment();
+        int flags = fcntl(DISK_FD, F_GETFL);
+        if(align > 0 && simplefs_layout.block_size % align == 0 && flags >= 0
+           && fcntl(DISK_FD, F_SETFL, flags | O_DIRECT) == 0)
+            direct_align = align;
+        return;
+    }
+    if(io_mode == SIMPLEFS_IO_URING){
+        size_t len;
+        char *buffers = simplefs_cacheData(&len);
+        simplefs_uringInit(DISK_FD, buffers, len);
+        return;
+    }
+    if(io_mode != SIMPLEFS_IO_MMAP || (simplefs_layout.features & SIMPLEFS_FEATURE_JOURNAL))
+        return;
+    void *map = mmap(NULL, simplefs_blockOffset(simplefs_layout.num_blocks), PROT_READ | PROT_WRITE, MAP_SHARED, DISK_FD, 0);
+    if(map != MAP_FAILED)
+        disk_map = map;
+}
+
+static void simplefs_stopBackend(){
+    simplefs_uringExit();
+    direct_align = 0;
+    if(!disk_map)
+        return;
+    munmap(disk_map, simplefs_blockOffset(simplefs_layout.num_blocks));
+    disk_map = NULL;
+}
+
+void simplefs_setIOMode(int mode){
+    /*
+	    Select the disk backend used by the next simplefs_formatDisk() or
+	    simplefs_mount()
+	*/
+    assert(mode == SIMPLEFS_IO_FD || mode == SIMPLEFS_IO_MMAP || mode == SIMPLEFS_IO_URING || mode == SIMPLEFS_IO_DIRECT);
+    io_mode = mode;
+}
+
+void simplefs_setVerifyOnce(int once){
+    /*
+	    With `once` set, a block read around the cache or from a mapped image
+	    is checked against its checksum only until it first matches after
+	    the mount, or is written. By default every read from disk is checked
+	*/
+    verify_once = once;
+}
+
+static void simplefs_releaseMount(){
+    free(inode_bitmap);
+    free(datablock_bitmap);
+    free(bitmap_dirty);
+    free(snapshot_refs);
+    free(block_csums);
+    free(csum_verified);
+    free(csum_stale);
+    free(pending_free);
+    free(commit_free);
+    free(fresh_blocks);
+    inode_bitmap = datablock_bitmap = NULL;
+    pending_free = commit_free = fresh_blocks = NULL;
+    pending_free_blocks = 0;
+    bitmap_dirty = NULL;
+    snapshot_refs = NULL;
+    block_csums = NULL;
+    csum_verified = csum_stale = NULL;
+    read_only = 0;
+    if(inode_states){
+        for(uint32_t i=0; i<num_inode_states; i++){
+            pthread_rwlock_destroy(&inode_states[i].lock);
+            free(inode_states[i].tail.data);
+            free(inode_states[i].repack);
+        }
+        free(inode_states);
+        inode_states = NULL;
+        num_inode_states = 0;
+    }
+    simplefs_indexRelease();
+    superblock_mounted = 0;
+}
+
+static void simplefs_setupMount(){
+    /*
+	    Allocate the in-memory bitmaps, checksum table and per-inode locks for
+	    the current layout
+	*/
+    size_t words_per_block = simplefs_layout.block_size / sizeof(uint64_t);
+    inode_bitmap = calloc(simplefs_layout.inode_bitmap_blocks * words_per_block, sizeof(uint64_t));
+    datablock_bitmap = calloc(simplefs_layout.datablock_bitmap_blocks * words_per_block, sizeof(uint64_t));
+    bitmap_dirty = calloc(simplefs_layout.inode_bitmap_blocks + simplefs_layout.datablock_bitmap_blocks + simplefs_layout.csum_blocks, 1);
+    if(simplefs_layout.features & SIMPLEFS_FEATURE_CHECKSUMS){
+        uint64_t entries = (uint64_t)simplefs_layout.inode_table_blocks + simplefs_layout.num_data_blocks;
+        block_csums = calloc(simplefs_layout.csum_blocks, simplefs_layout.block_size);
+        csum_verified = calloc(BITMAP_WORDS(entries), sizeof(uint64_t));
+        csum_stale = calloc(BITMAP_WORDS(entries), sizeof(uint64_t));
+        assert(block_csums && csum_verified && csum_stale);
+    }
+    if(simplefs_layout.features & SIMPLEFS_FEATURE_JOURNAL){
+        pending_free = calloc(simplefs_layout.datablock_bitmap_blocks * words_per_block, sizeof(uint64_t));
+        commit_free = calloc(simplefs_layout.datablock_bitmap_blocks * words_per_block, sizeof(uint64_t));
+        assert(pending_free && commit_free);
+        if(block_csums){
+            fresh_blocks = calloc(simplefs_layout.datablock_bitmap_blocks * words_per_block, sizeof(uint64_t));
+            assert(fresh_blocks);
+        }
+    }
+    inode_states = calloc(simplefs_layout.num_inodes, sizeof(struct inode_state_t));
+    num_inode_states = simplefs_layout.num_inodes;
+    assert(inode_bitmap && datablock_bitmap && bitmap_dirty && inode_states);
+    for(uint32_t i=0; i<simplefs_layout.num_inodes; i++)
+        pthread_rwlock_init(&inode_states[i].lock, NULL);
+    inode_hint = 0;
+    datablock_hint = 0;
+    free_data_blocks = simplefs_layout.num_data_blocks;
+    reserved_data_blocks = 0;
+    superblock_mounted = 1;
+}
+
+static void simplefs_detachImage(){
+    /*
+	    Let go of the mounted image, if any: its backend, which still needs
+	    the layout it was started with, its in-memory state and its descriptor
+	*/
+    if(DISK_FD < 0)
+        return;
+    simplefs_stopBackend();
+    simplefs_releaseMount();
+    close(DISK_FD);
+    DISK_FD = -1;
+}
+
+static void simplefs_markBitmapDirty(int is_datablock, int bit){
+    uint32_t block = bit / (simplefs_layout.block_size * 8);
+    if(is_datablock)
+        block += simplefs_layout.inode_bitmap_blocks;
+    bitmap_dirty[block] = 1;
+}
+
+static void simplefs_markRunDirty(int start, int count){
+    uint32_t bits_per_block = simplefs_layout.block_size * 8;
+    for(uint32_t b = start / bits_per_block; b <= (uint32_t)(start + count - 1) / bits_per_block; b++)
+        bitmap_dirty[simplefs_layout.inode_bitmap_blocks + b] = 1;
+}
+
+static void simplefs_releaseRun(int start, int count){
+    /*
+	    Give data blocks [start, start + count) back to the free map, which
+	    the caller holds. On a journaled disk they are only marked pending
+	    and stay allocated until the transaction freeing them commits: the
+	    committed metadata may point at them until then, and a block handed
+	    out again could be overwritten in place before the commit
+	*/
+    simplefs_markRunDirty(start, count);
+    if(pending_free){
+        simplefs_bitmapSetRange(pending_free, start, count, 1);
+        pending_free_blocks += count;
+        return;
+    }
+    simplefs_bitmapSetRange(datablock_bitmap, start, count, 0);
+    free_data_blocks += count;
+    if(start < datablock_hint)
+        datablock_hint = start;
+}
+
+struct inode_state_t *simplefs_inodeState(int inodenum){
+    assert(inodenum >= 0 && (uint32_t)inodenum < simplefs_layout.num_inodes);
+    return &inode_states[inodenum];
+}
+
+pthread_rwlock_t *simplefs_inodeLock(int inodenum){
+    return &simplefs_inodeState(inodenum)->lock;
+}
+
+static const char *simplefs_tableBlock(uint32_t b, int *blocknum){
+    /*
+	    The mounted copy of table block `b`, counting the inode bitmap, the
+	    data block bitmap and the checksum table blocks in that order, and
+	    its block number on disk in `blocknum`
+	*/
+    uint32_t bs = simplefs_layout.block_size;
+    uint32_t bitmap_blocks = simplefs_layout.inode_bitmap_blocks + simplefs_layout.datablock_bitmap_blocks;
+    if(b >= bitmap_blocks){
+        *blocknum = simplefs_layout.csum_start + b - bitmap_blocks;
+        return (const char *)block_csums + (size_t)(b - bitmap_blocks) * bs;
+    }
+    *blocknum = simplefs_layout.inode_bitmap_start + b;
+    if(b < simplefs_layout.inode_bitmap_blocks)
+        return (const char *)inode_bitmap + (size_t)b * bs;
+    return (const char *)datablock_bitmap + (size_t)(b - simplefs_layout.inode_bitmap_blocks) * bs;
+}
+
+void simplefs_checksumImages(int count, const int *blocknums, const char *images){
+    /*
+	    Take the checksums of `count` block images a journal commit logs,
+	    before the checksum table is copied into the same commit, so a replay
+	    brings blocks and checksums back together
+	*/
+    for(int i=0; i<count; i++)
+        simplefs_csumStore(blocknums[i], images + (size_t)i * simplefs_layout.block_size);
+}
+
+int simplefs_bitmapSnapshot(int *blocknums, char *images){
+    /*
+	    Copy the changed bitmap and checksum table blocks and their block
+	    numbers out for a journal commit and mark them clean. Returns how
+	    many were copied
+	*/
+    int n = 0;
+    pthread_mutex_lock(&freemap_lock);
+    uint32_t bs = simplefs_layout.block_size;
+    uint32_t nblocks = simplefs_layout.inode_bitmap_blocks + simplefs_layout.datablock_bitmap_blocks + simplefs_layout.csum_blocks;
+    if(superblock_mounted && pending_free)
+        memcpy(commit_free, pending_free, (size_t)simplefs_layout.datablock_bitmap_blocks * bs);
+    // The commit maps the blocks allocated so far, they are no longer fresh
+    if(superblock_mounted && fresh_blocks)
+        memset(fresh_blocks, 0, (size_t)simplefs_layout.datablock_bitmap_blocks * bs);
+    for(uint32_t b=0; superblock_mounted && b<nblocks; b++){
+        if(!__atomic_exchange_n(&bitmap_dirty[b], 0, __ATOMIC_ACQUIRE))
+            continue;
+        memcpy(images + (size_t)n * bs, simplefs_tableBlock(b, &blocknums[n]), bs);
+        // Pending blocks are free in the transaction, and in use until it commits
+        uint32_t d = b - simplefs_layout.inode_bitmap_blocks;
+        if(pending_free && b >= simplefs_layout.inode_bitmap_blocks && d < simplefs_layout.datablock_bitmap_blocks){
+            uint64_t *image = (uint64_t *)(images + (size_t)n * bs);
+            for(size_t w=0; w<bs / sizeof(uint64_t); w++)
+                image[w] &= ~pending_free[d * (bs / sizeof(uint64_t)) + w];
+        }
+        n++;
+        SIMPLEFS_STAT_INC(superblock_writes);
+        SIMPLEFS_STAT_ADD(superblock_ios_saved, -1);
+    }
+    pthread_mutex_unlock(&freemap_lock);
+    return n;
+}
+
+void simplefs_bitmapCommitted(){
+    /*
+	    Release the blocks freed by the transaction a commit just made
+	    durable, those pending when simplefs_bitmapSnapshot() copied the
+	    bitmaps for it. Blocks freed since wait for the next commit
+	*/
+    pthread_mutex_lock(&freemap_lock);
+    for(size_t w=0; superblock_mounted && pending_free && w<BITMAP_WORDS(simplefs_layout.num_data_blocks); w++){
+        uint64_t bits = commit_free[w];
+        if(!bits)
+            continue;
+        datablock_bitmap[w] &= ~bits;
+        pending_free[w] &= ~bits;
+        commit_free[w] = 0;
+        free_data_blocks += __builtin_popcountll(bits);
+        pending_free_blocks -= __builtin_popcountll(bits);
+        int first = w * BITMAP_WORD_BITS + __builtin_ctzll(bits);
+        if(first < datablock_hint)
+            datablock_hint = first;
+    }
+    pthread_mutex_unlock(&freemap_lock);
+}
+
+static void simplefs_writeTables(int sync){
+    /*
+	    Write the changed blocks of the mounted free-space bitmaps and
+	    checksum table back to disk in one batch, then with `sync` set make
+	    the image durable, in the same submission on a ring
+	*/
+    simplefs_csumRefresh();
+    pthread_mutex_lock(&freemap_lock);
+    int n = 0;
+    off_t *offsets = NULL;
+    struct iovec *iov = NULL;
+    int *ones = NULL;
+    if(superblock_mounted){
+        uint32_t bs = simplefs_layout.block_size;
+        uint32_t nblocks = simplefs_layout.inode_bitmap_blocks + simplefs_layout.datablock_bitmap_blocks + simplefs_layout.csum_blocks;
+        offsets = malloc(nblocks * sizeof(off_t));
+        iov = malloc(nblocks * sizeof(struct iovec));
+        ones = malloc(nblocks * sizeof(int));
+        assert(offsets && iov && ones);
+        for(uint32_t b=0; b<nblocks; b++){
+            if(!__atomic_exchange_n(&bitmap_dirty[b], 0, __ATOMIC_ACQUIRE))
+                continue;
+            int blocknum;
+            iov[n].iov_base = (char *)simplefs_tableBlock(b, &blocknum);
+            iov[n].iov_len = bs;
+            offsets[n] = simplefs_blockOffset(blocknum);
+            ones[n++] = 1;
+            SIMPLEFS_STAT_INC(superblock_writes);
+            SIMPLEFS_STAT_ADD(superblock_ios_saved, -1);
+        }
+    }
+    if(n > 0 || sync)
+        simplefs_rawWriteRuns(n, offsets, iov, ones, sync);
+    pthread_mutex_unlock(&freemap_lock);
+    free(offsets);
+    free(iov);
+    free(ones);
+}
+
+void simplefs_syncSuperBlock(){
+    /*
+	    Write the changed blocks of the mounted free-space bitmaps and
+	    checksum table back to disk. On a journaled disk they only get there
+	    through a commit
+	*/
+    if(simplefs_journaling()){
+        simplefs_journalCommit();
+        return;
+    }
+    simplefs_writeTables(0);
+}
+
+static void simplefs_inodeWriteback();
+
+void simplefs_sync(){
+    /*
+	    Write back the superblock and every dirty cached block, then ask the
+	    host to make the image durable. A journal commit does all of that
+	    with its own single fsync
+	*/
+    if(flush_hook)
+        flush_hook();
+    simplefs_inodeWriteback();
+    if(simplefs_journaling()){
+        simplefs_journalCommit();
+        return;
+    }
+    SIMPLEFS_STAT_INC(syncs);
+    if(disk_map){
+        simplefs_syncSuperBlock();
+        msync(disk_map, simplefs_blockOffset(simplefs_layout.num_blocks), MS_SYNC);
+        return;
+    }
+    // Blocks written back update their checksums, so the tables go after them, with the fsync
+    simplefs_cacheFlush();
+    simplefs_writeTables(1);
+}
+
+void simplefs_setFlushHook(void (*hook)(void)){
+    /*
+	    Run `hook` at the start of every simplefs_sync(), and so at unmount
+	*/
+    flush_hook = hook;
+}
+
+static void simplefs_initFileHandles(){
+    pthread_mutex_lock(&handle_lock);
+    for(int c=0; c<handle_slots / HANDLE_CHUNK; c++){
+        for(int i=0; i<HANDLE_CHUNK; i++){
+            free(handle_chunks[c][i].map_entries);
+            pthread_mutex_destroy(&handle_chunks[c][i].lock);
+        }
+        free(handle_chunks[c]);
+        handle_chunks[c] = NULL;
+    }
+    __atomic_store_n(&handle_slots, 0, __ATOMIC_RELEASE);
+    handle_free = -1;
+    pthread_mutex_unlock(&handle_lock);
+}
+
+static inline struct filehandle_t *simplefs_handleSlot(int slot){
+    return &handle_chunks[slot / HANDLE_CHUNK][slot % HANDLE_CHUNK];
+}
+
+static int simplefs_growHandles(){
+    /*
+	    Add a chunk of closed slots to the table and the free list
+	*/
+    if(handle_slots >= MAX_OPEN_FILES)
+        return -1;
+    struct filehandle_t *chunk = calloc(HANDLE_CHUNK, sizeof(struct filehandle_t));
+    if(!chunk)
+        return -1;
+    for(int i=0; i<HANDLE_CHUNK; i++){
+        pthread_mutex_init(&chunk[i].lock, NULL);
+        chunk[i].inode_number = -1;
+        chunk[i].map_block = -1;
+        chunk[i].extent_cursor.index = -1;
+        chunk[i].next_free = i + 1 < HANDLE_CHUNK ? handle_slots + i + 1 : -1;
+    }
+    handle_chunks[handle_slots / HANDLE_CHUNK] = chunk;
+    handle_free = handle_slots;
+    __atomic_store_n(&handle_slots, handle_slots + HANDLE_CHUNK, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int simplefs_handleOpen(int inodenum){
+    /*
+	    Take a slot off the free list for a handle on `inodenum`, growing the
+	    table when it is empty. The handle number is the slot and its
+	    generation, -1 when the table is full
+	*/
+    pthread_mutex_lock(&handle_lock);
+    if(handle_free == -1 && simplefs_growHandles() < 0){
+        pthread_mutex_unlock(&handle_lock);
+        return -1;
+    }
+    int slot = handle_free;
+    struct filehandle_t *handle = simplefs_handleSlot(slot);
+    handle_free = handle->next_free;
+    handle->offset = 0;
+    handle->map_block = -1;
+    handle->extent_cursor.index = -1;
+    handle->ra_next = 0;
+    handle->ra_end = 0;
+    handle->ra_window = 0;
+    handle->next_free = -1;
+    __atomic_store_n(&handle->inode_number, inodenum, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&handle_lock);
+    return (int)(handle->generation << HANDLE_SLOT_BITS) | slot;
+}
+
+struct filehandle_t *simplefs_handleGet(int file_handle){
+    /*
+	    The open handle numbered `file_handle`, NULL if the number is out of
+	    range, closed or left over from an earlier use of its slot
+	*/
+    if(file_handle < 0)
+        return NULL;
+    int slot = file_handle & (MAX_OPEN_FILES - 1);
+    if(slot >= __atomic_load_n(&handle_slots, __ATOMIC_ACQUIRE))
+        return NULL;
+    struct filehandle_t *handle = simplefs_handleSlot(slot);
+    // Closing changes both under the handle's lock, callers without it only look
+    if(__atomic_load_n(&handle->inode_number, __ATOMIC_ACQUIRE) < 0
+       || __atomic_load_n(&handle->generation, __ATOMIC_RELAXED) != (uint32_t)file_handle >> HANDLE_SLOT_BITS)
+        return NULL;
+    return handle;
+}
+
+struct filehandle_t *simplefs_handleLock(int file_handle){
+    /*
+	    simplefs_handleGet() with the handle's lock held, so that threads
+	    sharing a handle take turns with its offset and cached lookups. NULL,
+	    with nothing held, if it is not open or got closed meanwhile
+	*/
+    struct filehandle_t *handle = simplefs_handleGet(file_handle);
+    if(!handle)
+        return NULL;
+    pthread_mutex_lock(&handle->lock);
+    if(simplefs_handleGet(file_handle) != handle){
+        pthread_mutex_unlock(&handle->lock);
+        return NULL;
+    }
+    return handle;
+}
+
+void simplefs_handleUnlock(struct filehandle_t *handle){
+    pthread_mutex_unlock(&handle->lock);
+}
+
+int simplefs_handleClose(int file_handle){
+    /*
+	    Put the slot of an open handle back on the free list, once calls
+	    through it have finished. Its generation moves on, wrapping within
+	    the bits a handle number has for it. Returns the inode the handle
+	    was open on, -1 if it was not open
+	*/
+    pthread_mutex_lock(&handle_lock);
+    struct filehandle_t *handle = simplefs_handleLock(file_handle);
+    if(!handle){
+        pthread_mutex_unlock(&handle_lock);
+        return -1;
+    }
+    int inodenum = handle->inode_number;
+    __atomic_store_n(&handle->inode_number, -1, __ATOMIC_RELEASE);
+    handle->offset = 0;
+    handle->map_block = -1;
+    handle->extent_cursor.index = -1;
+    free(handle->map_entries);
+    handle->map_entries = NULL;
+    __atomic_store_n(&handle->generation, (handle->generation + 1) & ((uint32_t)INT_MAX >> HANDLE_SLOT_BITS), __ATOMIC_RELAXED);
+    handle->next_free = handle_free;
+    handle_free = file_handle & (MAX_OPEN_FILES - 1);
+    pthread_mutex_unlock(&handle->lock);
+    pthread_mutex_unlock(&handle_lock);
+    return inodenum;
+}
+
+static inline uint32_t simplefs_snapshotStart(int slot){
+    return simplefs_layout.snapshot_start + slot * simplefs_layout.snapshot_slot_blocks;
+}
+
+static void simplefs_loadSnapshots(){
+    /*
+	    Count the snapshots referencing each data block, from the data block
+	    bitmap in every slot the superblock names
+	*/
+    if(mounted_superblock.snapshot_map == 0)
+        return;
+    uint32_t bs = simplefs_layout.block_size;
+    snapshot_refs = calloc(simplefs_layout.num_data_blocks, 1);
+    uint64_t *blocks = malloc((size_t)simplefs_layout.datablock_bitmap_blocks * bs);
+    assert(snapshot_refs && blocks);
+    for(uint32_t slot=0; slot<simplefs_layout.snapshot_slots; slot++){
+        if(!(mounted_superblock.snapshot_map >> slot & 1))
+            continue;
+        simplefs_diskReadRun(simplefs_snapshotStart(slot) + simplefs_layout.inode_bitmap_blocks,
+                             simplefs_layout.datablock_bitmap_blocks, (char *)blocks);
+        for(size_t w=0; w<BITMAP_WORDS(simplefs_layout.num_data_blocks); w++){
+            for(uint64_t bits = blocks[w]; bits; bits &= bits - 1)
+                snapshot_refs[w * BITMAP_WORD_BITS + __builtin_ctzll(bits)]++;
+        }
+    }
+    free(blocks);
+}
+
+static int simplefs_mountImage(int snapshot){
+    /*
+	    Open an existing `simplefs` image, derive its layout from the geometry
+	    in the superblock, replay committed journal transactions and load the
+	    free-space bitmaps and checksum table into memory. A snapshot is
+	    mounted read-only through its slot's copies of the bitmaps and the
+	    inode table, without checksums; the journal is left for the next
+	    mount of the live filesystem
+	*/
+    int fd = open("simplefs", O_RDWR);
+    if(fd < 0)
+        return -1;
+    // Check the image before touching the mounted one, which a bad image leaves mounted
+    struct superblock_t superblock;
+    struct simplefs_layout layout;
+    struct stat st;
+    if(simplefs_readSuperBlock(fd, &superblock) < 0
+       || memcmp(superblock.name, "simplefs", 8) != 0
+       || simplefs_computeLayout(&superblock.geometry, &layout) < 0
+       || fstat(fd, &st) < 0 || st.st_size < (off_t)layout.num_blocks * layout.block_size
+       || (snapshot >= 0 && ((uint32_t)snapshot >= layout.snapshot_slots
+                             || !(superblock.snapshot_map >> snapshot & 1)))){
+        close(fd);
+        return -1;
+    }
+    // Unsynced writes reach the disk being unmounted. A journaled one loses its
+    // uncommitted transaction instead, as in a crash, and stays consistent
+    if(DISK_FD >= 0 && !read_only && !simplefs_journaling())
+        simplefs_sync();
+    simplefs_detachImage();
+    DISK_FD = fd;
+    mounted_superblock = superblock;
+    simplefs_layout = layout;
+    if(snapshot >= 0){
+        uint32_t slot = simplefs_snapshotStart(snapshot);
+        simplefs_layout.inode_bitmap_start = slot;
+        simplefs_layout.datablock_bitmap_start = slot + simplefs_layout.inode_bitmap_blocks;
+        simplefs_layout.inode_table_start = simplefs_layout.datablock_bitmap_start + simplefs_layout.datablock_bitmap_blocks;
+        simplefs_layout.features &= ~(SIMPLEFS_FEATURE_JOURNAL | SIMPLEFS_FEATURE_CHECKSUMS);
+    }
+    simplefs_cacheInit(simplefs_layout.block_size);
+    simplefs_startBackend();
+    simplefs_journalInit();
+    simplefs_journalRecover();
+    simplefs_setupMount();
+    uint32_t bs = simplefs_layout.block_size;
+    for(uint32_t b=0; b<simplefs_layout.inode_bitmap_blocks; b++){
+        simplefs_rawRead(simplefs_blockOffset(simplefs_layout.inode_bitmap_start + b), (char *)inode_bitmap + (size_t)b * bs, bs);
+        SIMPLEFS_STAT_INC(superblock_reads);
+    }
+    for(uint32_t b=0; b<simplefs_layout.datablock_bitmap_blocks; b++){
+        simplefs_rawRead(simplefs_blockOffset(simplefs_layout.datablock_bitmap_start + b), (char *)datablock_bitmap + (size_t)b * bs, bs);
+        SIMPLEFS_STAT_INC(superblock_reads);
+    }
+    for(size_t w=0; w<BITMAP_WORDS(simplefs_layout.num_data_blocks); w++)
+        free_data_blocks -= __builtin_popcountll(datablock_bitmap[w]);
+    if(block_csums){
+        simplefs_rawRead(simplefs_blockOffset(simplefs_layout.csum_start), (char *)block_csums, (size_t)simplefs_layout.csum_blocks * bs);
+        SIMPLEFS_STAT_ADD(superblock_reads, simplefs_layout.csum_blocks);
+    }
+    if(snapshot < 0)
+        simplefs_loadSnapshots();
+    read_only = snapshot >= 0;
+    simplefs_indexBuild();
+    simplefs_initFileHandles();
+    return 0;
+}
+
+int simplefs_mount(){
+    return simplefs_mountImage(-1);
+}
+
+int simplefs_mountSnapshot(int snapshot){
+    /*
+	    Mount snapshot `snapshot` of the image read-only, in place of the
+	    live filesystem: every call that would change it fails. -1 if the
+	    slot holds no snapshot
+	*/
+    if(snapshot < 0)
+        return -1;
+    return simplefs_mountImage(snapshot);
+}
+
+int simplefs_readOnly(){
+    return read_only;
 }
 
-void simplefs_writeSuperBlock(struct superblock_t *superblock){
+void simplefs_unmount(){
     /*
-	    Helper function to write superblock from superblock_t structure to disk
+	    Write back the mounted superblock and cached blocks and release the disk
 	*/
-    char tempBuf[BLOCKSIZE];
-    memcpy(tempBuf, superblock, sizeof(struct superblock_t));
-    lseek(DISK_FD, 0, SEEK_SET);
-    int ret = write(DISK_FD ,tempBuf, BLOCKSIZE);
-    assert(ret == BLOCKSIZE);
+    simplefs_sync();
+    simplefs_journalClose();
+    simplefs_detachImage();
 }
 
 void simplefs_formatDisk(){
     /*
-	    Format filesystem and initialise superblock and inodes with default values
+	    Format filesystem with the default geometry
 	*/
+    struct simplefs_geometry geometry = { .block_size = BLOCKSIZE, .num_inodes = NUM_INODES,
+                                          .num_data_blocks = NUM_DATA_BLOCKS };
+    int ret = simplefs_formatDiskWithGeometry(&geometry);
+    assert(ret == 0);
+}
 
-    FILE* fp;
-    fp = fopen("simplefs", "w+");
-    DISK_FD = fileno(fp);
+int simplefs_formatDiskWithGeometry(const struct simplefs_geometry *geometry){
+    /*
+	    Format filesystem and initialise superblock and inodes with default values.
+	    -1 if the geometry is invalid or the image cannot be created, with the
+	    mounted disk left as it was
+	*/
+    struct simplefs_layout layout;
+    if(simplefs_computeLayout(geometry, &layout) < 0)
+        return -1;
 
-    // Setting up superblock
-    struct superblock_t *superblock = (struct superblock_t *)malloc(sizeof(struct superblock_t));
-    memcpy(superblock->name, "simplefs", 8);
-    for(int i=0; i<NUM_INODES; i++)
-        superblock->inode_freelist[i] = INODE_FREE;
-    for(int i=0; i<NUM_DATA_BLOCKS; i++){
-        superblock->datablock_freelist[i] = DATA_BLOCK_FREE;
+    // The new image is built beside the mounted one, which stays usable until it is in place
+    int fd = open("simplefs.new", O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0)
+        return -1;
+    if(ftruncate(fd, (off_t)layout.num_blocks * layout.block_size) < 0 || rename("simplefs.new", "simplefs") < 0){
+        close(fd);
+        unlink("simplefs.new");
+        return -1;
     }
-    simplefs_writeSuperBlock(superblock);
-    free(superblock);
+    // Nothing of the disk formatted over is kept, its unsynced writes included
+    simplefs_cacheDiscardAll();
+    simplefs_detachImage();
+    DISK_FD = fd;
+    simplefs_layout = layout;
+    simplefs_cacheInit(simplefs_layout.block_size);
+    simplefs_startBackend();
+
+    // Setting up superblock; the bitmaps start out all free, as the image is zero-filled
+    memset(&mounted_superblock, 0, sizeof(struct superblock_t));
+    memcpy(mounted_superblock.name, "simplefs", 8);
+    mounted_superblock.geometry = *geometry;
+    simplefs_writeSuperBlock(&mounted_superblock);
+    simplefs_journalInit();
+    simplefs_setupMount();
     
-    // Setting up inode structure
+    // Setting up inode structure, one inode table block at a time
     struct inode_t *inode = (struct inode_t *)malloc(sizeof(struct inode_t));
-    memcpy(inode->name, "", 1);
+    memset(inode, 0, sizeof(struct inode_t));
     inode->status = INODE_FREE;
+    inode->name_block = -1;
     inode->file_size = 0;
-    for(int i=0; i<MAX_FILE_SIZE; i++)
-        inode->direct_blocks[i] = -1;
-    for(int i=0; i<NUM_INODES; i++)
-        simplefs_writeInode(i, inode);
+    simplefs_clearBlockMap(inode);
+    char *table_block = calloc(1, simplefs_layout.block_size);
+    for(uint32_t i=0; i<simplefs_layout.inodes_per_block; i++)
+        memcpy(table_block + i * sizeof(struct inode_t), inode, sizeof(struct inode_t));
+    for(uint32_t b=0; b<simplefs_layout.inode_table_blocks; b++)
+        simplefs_rawWrite(simplefs_blockOffset(simplefs_layout.inode_table_start + b), table_block, simplefs_layout.block_size);
+
+    // The checksum table starts out matching that inode table and the zero-filled data blocks
+    if(block_csums){
+        uint32_t table_csum = simplefs_crc32c(table_block, simplefs_layout.block_size);
+        memset(table_block, 0, simplefs_layout.block_size);
+        uint32_t zero_csum = simplefs_crc32c(table_block, simplefs_layout.block_size);
+        for(uint32_t b=0; b<simplefs_layout.inode_table_blocks; b++)
+            block_csums[b] = table_csum;
+        for(uint32_t b=0; b<simplefs_layout.num_data_blocks; b++)
+            block_csums[simplefs_layout.inode_table_blocks + b] = zero_csum;
+        simplefs_rawWrite(simplefs_blockOffset(simplefs_layout.csum_start), (const char *)block_csums,
+                          (size_t)simplefs_layout.csum_blocks * simplefs_layout.block_size);
+    }
+    free(table_block);
+    simplefs_indexInit();
+
+    // Directory images start with an empty root directory in inode 0
+    if(geometry->features & SIMPLEFS_FEATURE_DIRS){
+        int root = simplefs_allocInode();
+        assert(root == SIMPLEFS_ROOT_INODE);
+        inode->status = INODE_DIRECTORY;
+        strcpy(inode->name, "/");
+        inode->dir_root = -1;
+        inode->dir_height = 0;
+        simplefs_writeInode(root, inode);
+    }
     free(inode);
+    simplefs_journalCommit();
 
     // Formatting file handler array
-    for(int i=0; i<MAX_OPEN_FILES; i++){
-        file_handle_array[i].inode_number = -1;
-        file_handle_array[i].offset = 0;
-    }
+    simplefs_initFileHandles();
+    return 0;
 }
 
 int simplefs_allocInode(){
     /*
-	    Iterate over `inode_freelist` and return index of first empty inode
+	    Search `inode_bitmap` and return index of first empty inode
+	*/
+    int i;
+    return simplefs_allocInodes(1, &i) == 1 ? i : -1;
+}
+
+int simplefs_allocInodes(int count, int *inodenums){
+    /*
+	    Allocate up to `count` inodes into `inodenums` under one hold of the
+	    free map, each the first free one from the hint on. Returns how many
+	    were taken
 	*/
-    struct superblock_t *superblock = (struct superblock_t *)malloc(sizeof(struct superblock_t));
-    simplefs_readSuperBlock(superblock);
-    for(int i=0; i<NUM_INODES; i++){
-        if(superblock->inode_freelist[i] == INODE_FREE){
-            superblock->inode_freelist[i] = INODE_IN_USE;
-            simplefs_writeSuperBlock(superblock);
-            free(superblock);
-            return i;
+    int got = 0;
+    pthread_mutex_lock(&freemap_lock);
+    while(got < count){
+        int i = simplefs_bitmapFindFree(inode_bitmap, simplefs_layout.num_inodes, inode_hint);
+        if(i < 0){
+            inode_hint = simplefs_layout.num_inodes;
+            break;
         }
+        simplefs_bitSet(inode_bitmap, i);
+        simplefs_markBitmapDirty(0, i);
+        inode_hint = i + 1;
+        inodenums[got++] = i;
     }
-    free(superblock);
-    return -1;
+    pthread_mutex_unlock(&freemap_lock);
+    SIMPLEFS_STAT_ADD(superblock_ios_saved, got > 0 ? 2 : 1);
+    return got;
 }
 
-void simplefs_freeInode(int inodenum){
+int simplefs_freeInode(int inodenum){
     /*
 	    free inode with index `inodenum`     
 	*/
-    assert(inodenum < NUM_INODES);
-    struct superblock_t *superblock = (struct superblock_t *)malloc(sizeof(struct superblock_t));
-    struct inode_t *inode = (struct inode_t *)malloc(sizeof(struct inode_t));
-    simplefs_readSuperBlock(superblock);
-    simplefs_readInode(inodenum, inode);
-    assert(superblock->inode_freelist[inodenum] == INODE_IN_USE);
-    superblock->inode_freelist[inodenum] = INODE_FREE;
-    inode->status = INODE_FREE;
-    inode->file_size = 0;
-    for (int i = 0; i < MAX_FILE_SIZE; i++)
-        inode->direct_blocks[i] = -1;
-    simplefs_writeSuperBlock(superblock);
-    simplefs_writeInode(inodenum, inode);
-    free(inode);
-    free(superblock);
+    return simplefs_freeInodes(1, &inodenum);
 }
 
-void simplefs_readInode(int inodenum, struct inode_t *inodeptr){
+int simplefs_freeInodes(int count, const int *inodenums){
     /*
-	    read inode with index `inodenum` from disk into `inodeptr`     
+	    free the `count` inodes of `inodenums`, their images written back
+	    together and then their bits cleared under one hold of the free map.
+	    -1 with errno EIO and none freed when a table block fails its checksum
 	*/
-    assert(inodenum < NUM_INODES);
-    char tempBuf[BLOCKSIZE / NUM_INODES_PER_BLOCK];
-    lseek(DISK_FD, BLOCKSIZE + inodenum * sizeof(struct inode_t), SEEK_SET);
-    int ret = read(DISK_FD, tempBuf, sizeof(struct inode_t));
-    assert(ret == sizeof(struct inode_t));
-    memcpy(inodeptr, tempBuf, sizeof(struct inode_t));
+    if(count == 0)
+        return 0;
+    struct inode_t *inodes = (struct inode_t *)calloc(count, sizeof(struct inode_t));
+    assert(inodes);
+    for(int k=0; k<count; k++){
+        assert(inodenums[k] >= 0 && (uint32_t)inodenums[k] < simplefs_layout.num_inodes);
+        if(simplefs_readInode(inodenums[k], &inodes[k]) < 0){
+            free(inodes);
+            return -1;
+        }
+        inodes[k].status = INODE_FREE;
+        inodes[k].name_block = -1;
+        inodes[k].file_size = 0;
+        simplefs_clearBlockMap(&inodes[k]);
+    }
+    int ret = simplefs_writeInodes(count, inodenums, inodes);
+    free(inodes);
+    if(ret < 0)
+        return -1;
+    pthread_mutex_lock(&freemap_lock);
+    for(int k=0; k<count; k++){
+        assert(simplefs_bitTest(inode_bitmap, inodenums[k]));
+        simplefs_bitClear(inode_bitmap, inodenums[k]);
+        simplefs_markBitmapDirty(0, inodenums[k]);
+        if(inodenums[k] < inode_hint)
+            inode_hint = inodenums[k];
+    }
+    pthread_mutex_unlock(&freemap_lock);
+    SIMPLEFS_STAT_ADD(superblock_ios_saved, 2);
+    return 0;
+}
+
+static inline int simplefs_inodeBlock(int inodenum){
+    return simplefs_layout.inode_table_start + inodenum / simplefs_layout.inodes_per_block;
 }
 
-void simplefs_writeInode(int inodenum, struct inode_t *inodeptr){
+static inline int simplefs_inodeOffset(int inodenum){
+    return (inodenum % simplefs_layout.inodes_per_block) * sizeof(struct inode_t);
+}
+
+static int simplefs_loadInode(int inodenum, struct inode_t *inodeptr){
     /*
-	    write `inodeptr` to inode with index `inodenum` on disk    
+	    Copy inode `inodenum` out of the inode table, -1 with errno EIO when
+	    its table block fails its checksum
 	*/
-    assert(inodenum < NUM_INODES);
-    char tempBuf[BLOCKSIZE / NUM_INODES_PER_BLOCK];
-    memcpy(tempBuf, inodeptr, sizeof(struct inode_t));
-    lseek(DISK_FD, BLOCKSIZE + inodenum * sizeof(struct inode_t), SEEK_SET);
-    int ret = write(DISK_FD, tempBuf, sizeof(struct inode_t));
-    assert(ret == sizeof(struct inode_t));
+    int ret;
+    if(disk_map){
+        ret = simplefs_csumMapped(simplefs_inodeBlock(inodenum));
+        memcpy(inodeptr, disk_map + simplefs_blockOffset(simplefs_inodeBlock(inodenum)) + simplefs_inodeOffset(inodenum), sizeof(struct inode_t));
+    }else{
+        ret = simplefs_cacheReadPartial(simplefs_inodeBlock(inodenum), simplefs_inodeOffset(inodenum),
+                                        (char *)inodeptr, sizeof(struct inode_t));
+    }
+    if(ret < 0)
+        errno = EIO;
+    return ret;
 }
 
-int simplefs_allocDataBlock(){
+static int simplefs_storeInodes(int inodenum, int count, const struct inode_t *inodes){
     /*
-	    Iterate over `datablock_freelist` and return index of first empty inode
+	    Copy `count` inodes numbered from `inodenum` into the inode table,
+	    all in the table block of the first. A whole table block is written
+	    without reading it, its tail past the last inode is zero from format.
+	    Part of one that fails its checksum is not written, -1 with errno EIO
 	*/
-    struct superblock_t *superblock = (struct superblock_t *)malloc(sizeof(struct superblock_t));
-    simplefs_readSuperBlock(superblock);
-    for (int i = 0; i < NUM_DATA_BLOCKS; i++){
-        if (superblock->datablock_freelist[i] == DATA_BLOCK_FREE){
-            superblock->datablock_freelist[i] = DATA_BLOCK_USED;
-            simplefs_writeSuperBlock(superblock);
-            free(superblock);
-            return i;
+    size_t len = count * sizeof(struct inode_t);
+    if(disk_map){
+        if((uint32_t)count < simplefs_layout.inodes_per_block && simplefs_csumMapped(simplefs_inodeBlock(inodenum)) < 0){
+            errno = EIO;
+            return -1;
         }
+        memcpy(disk_map + simplefs_blockOffset(simplefs_inodeBlock(inodenum)) + simplefs_inodeOffset(inodenum), inodes, len);
+        simplefs_csumMappedWrite(simplefs_inodeBlock(inodenum));
+        return 0;
     }
-    free(superblock);   
-    return -1;
+    if((uint32_t)count == simplefs_layout.inodes_per_block){
+        char *block = calloc(1, simplefs_layout.block_size);
+        assert(block);
+        memcpy(block, inodes, len);
+        simplefs_cacheWriteBlock(simplefs_inodeBlock(inodenum), block);
+        free(block);
+        return 0;
+    }
+    if(simplefs_cacheWritePartial(simplefs_inodeBlock(inodenum), simplefs_inodeOffset(inodenum), (const char *)inodes, len) < 0){
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+int simplefs_readInode(int inodenum, struct inode_t *inodeptr){
+    /*
+	    read inode with index `inodenum` from disk into `inodeptr`, from its
+	    in-core copy while open handles pin it. -1 with errno EIO when its
+	    table block fails its checksum
+	*/
+    assert(inodenum >= 0 && (uint32_t)inodenum < simplefs_layout.num_inodes);
+    int ret = 0;
+    pthread_mutex_lock(&inode_table_lock);
+    struct inode_state_t *state = inode_states ? &inode_states[inodenum] : NULL;
+    if(state && state->refs > 0){
+        if(inodeptr != &state->inode)
+            memcpy(inodeptr, &state->inode, sizeof(struct inode_t));
+    }else{
+        ret = simplefs_loadInode(inodenum, inodeptr);
+    }
+    pthread_mutex_unlock(&inode_table_lock);
+    return ret;
+}
+
+int simplefs_writeInode(int inodenum, struct inode_t *inodeptr){
+    /*
+	    write `inodeptr` to inode with index `inodenum` on disk, and to its
+	    in-core copy if it is pinned. -1 with errno EIO when its table block
+	    fails its checksum; a pinned copy then stays dirty
+	*/
+    assert(inodenum >= 0 && (uint32_t)inodenum < simplefs_layout.num_inodes);
+    pthread_mutex_lock(&inode_table_lock);
+    struct inode_state_t *state = inode_states ? &inode_states[inodenum] : NULL;
+    int ret = simplefs_storeInodes(inodenum, 1, inodeptr);
+    if(state && state->refs > 0){
+        if(inodeptr != &state->inode)
+            memcpy(&state->inode, inodeptr, sizeof(struct inode_t));
+        __atomic_store_n(&state->dirty, ret < 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&inode_table_lock);
+    return ret;
+}
+
+int simplefs_writeInodes(int count, const int *inodenums, const struct inode_t *inodes){
+    /*
+	    simplefs_writeInode() for `count` inodes. Neighbours in one table
+	    block are copied into it together. -1 with errno EIO when a table
+	    block fails its checksum, the others are written all the same
+	*/
+    int ret = 0;
+    pthread_mutex_lock(&inode_table_lock);
+    for(int k=0; k<count; ){
+        int run = 1;
+        while(k + run < count && inodenums[k + run] == inodenums[k] + run
+              && simplefs_inodeBlock(inodenums[k + run]) == simplefs_inodeBlock(inodenums[k]))
+            run++;
+        for(int j=k; j<k+run; j++){
+            assert(inodenums[j] >= 0 && (uint32_t)inodenums[j] < simplefs_layout.num_inodes);
+            struct inode_state_t *state = inode_states ? &inode_states[inodenums[j]] : NULL;
+            if(state && state->refs > 0)
+                memcpy(&state->inode, &inodes[j], sizeof(struct inode_t));
+        }
+        int stored = simplefs_storeInodes(inodenums[k], run, &inodes[k]);
+        for(int j=k; j<k+run; j++){
+            struct inode_state_t *state = inode_states ? &inode_states[inodenums[j]] : NULL;
+            if(state && state->refs > 0)
+                __atomic_store_n(&state->dirty, stored < 0, __ATOMIC_RELAXED);
+        }
+        if(stored < 0)
+            ret = -1;
+        k += run;
+    }
+    pthread_mutex_unlock(&inode_table_lock);
+    if(ret < 0)
+        errno = EIO;
+    return ret;
+}
+
+struct inode_t *simplefs_inodePin(int inodenum){
+    /*
+	    Take a reference on the in-core copy of an inode, reading it from the
+	    inode table for the first one. Every open handle on a file holds one,
+	    so reads, writes and seeks work on the shared copy and never go back
+	    to the inode table. NULL with errno EIO, and no reference taken,
+	    when the inode's table block fails its checksum
+	*/
+    struct inode_state_t *state = simplefs_inodeState(inodenum);
+    pthread_mutex_lock(&inode_table_lock);
+    if(state->refs == 0){
+        if(simplefs_loadInode(inodenum, &state->inode) < 0){
+            pthread_mutex_unlock(&inode_table_lock);
+            return NULL;
+        }
+        __atomic_store_n(&state->dirty, 0, __ATOMIC_RELAXED);
+    }
+    state->refs++;
+    pthread_mutex_unlock(&inode_table_lock);
+    return &state->inode;
+}
+
+void simplefs_inodeUnpin(int inodenum){
+    /*
+	    Drop a reference taken by simplefs_inodePin(). The last one writes
+	    back changes still held in memory. Changes a failing table block
+	    would not take are lost with the copy, the next pin fails on it
+	*/
+    struct inode_state_t *state = simplefs_inodeState(inodenum);
+    pthread_mutex_lock(&inode_table_lock);
+    assert(state->refs > 0);
+    if(--state->refs == 0 && state->dirty){
+        simplefs_storeInodes(inodenum, 1, &state->inode);
+        __atomic_store_n(&state->dirty, 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&inode_table_lock);
+}
+
+int simplefs_inodePinned(int inodenum){
+    /*
+	    1 while some handle holds a pin on the inode. An inode nobody has
+	    pinned can only be reached through its name
+	*/
+    pthread_mutex_lock(&inode_table_lock);
+    int pinned = simplefs_inodeState(inodenum)->refs > 0;
+    pthread_mutex_unlock(&inode_table_lock);
+    return pinned;
+}
+
+int simplefs_inodeDirty(int inodenum){
+    /*
+	    Note a change to the in-core copy of a pinned inode, made under its
+	    write lock. Without a journal the inode table is only updated at the
+	    last unpin or the next sync; a journaled disk takes the copy now, into
+	    the transaction that allocated the blocks it maps, and returns -1
+	    with errno EIO when the table block fails its checksum
+	*/
+    struct inode_state_t *state = simplefs_inodeState(inodenum);
+    if(simplefs_journaling())
+        return simplefs_writeInode(inodenum, &state->inode);
+    pthread_mutex_lock(&inode_table_lock);
+    __atomic_store_n(&state->dirty, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&inode_table_lock);
+    return 0;
+}
+
+static void simplefs_inodeWriteback(){
+    /*
+	    Write every dirty in-core inode to the inode table, each under its
+	    read lock so no writer is halfway through changing it. One whose
+	    table block fails its checksum stays dirty
+	*/
+    for(uint32_t i=0; i<num_inode_states; i++){
+        if(!__atomic_load_n(&inode_states[i].dirty, __ATOMIC_RELAXED))
+            continue;
+        pthread_rwlock_rdlock(&inode_states[i].lock);
+        pthread_mutex_lock(&inode_table_lock);
+        if(inode_states[i].refs > 0 && inode_states[i].dirty && simplefs_storeInodes(i, 1, &inode_states[i].inode) == 0)
+            __atomic_store_n(&inode_states[i].dirty, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&inode_table_lock);
+        pthread_rwlock_unlock(&inode_states[i].lock);
+    }
+}
+
+void simplefs_clearBlockMap(struct inode_t *inodeptr){
+    /*
+	    Reset the block map of `inodeptr` to an empty file in the format of
+	    the mounted disk
+	*/
+    if(simplefs_layout.features & SIMPLEFS_FEATURE_EXTENTS){
+        memset(inodeptr->extents, 0, sizeof(inodeptr->extents));
+        inodeptr->extent_block = -1;
+        inodeptr->num_extents = 0;
+        return;
+    }
+    for(int i=0; i<MAX_FILE_SIZE; i++)
+        inodeptr->direct_blocks[i] = -1;
+    inodeptr->indirect_block = -1;
+    inodeptr->double_indirect_block = -1;
+}
+
+static int simplefs_allocBlock(int reserved){
+    /*
+	    Search `datablock_bitmap` and return index of first empty data block.
+	    Blocks promised to delayed allocations are only handed out when the
+	    caller's own reservation covers the block
+	*/
+    SIMPLEFS_STAT_INC(alloc_calls);
+    pthread_mutex_lock(&freemap_lock);
+    int i = -1;
+    if(free_data_blocks - reserved_data_blocks + reserved > 0)
+        i = simplefs_bitmapFindFree(datablock_bitmap, simplefs_layout.num_data_blocks, datablock_hint);
+    if(i < 0){
+        if(free_data_blocks == 0)
+            datablock_hint = simplefs_layout.num_data_blocks;
+        pthread_mutex_unlock(&freemap_lock);
+        SIMPLEFS_STAT_INC(superblock_ios_saved);
+        return -1;
+    }
+    simplefs_bitSet(datablock_bitmap, i);
+    if(fresh_blocks)
+        simplefs_bitSet(fresh_blocks, i);
+    simplefs_markBitmapDirty(1, i);
+    datablock_hint = i + 1;
+    free_data_blocks--;
+    reserved_data_blocks -= reserved;
+    pthread_mutex_unlock(&freemap_lock);
+    SIMPLEFS_STAT_ADD(superblock_ios_saved, 2);
+    return i;
+}
+
+int simplefs_allocDataBlock(){
+    return simplefs_allocBlock(0);
+}
+
+int simplefs_allocReservedBlock(){
+    /*
+	    Allocate a data block out of a reservation taken with
+	    simplefs_reserveDataBlocks(), which it uses up
+	*/
+    return simplefs_allocBlock(1);
+}
+
+int simplefs_reserveDataBlocks(int count){
+    /*
+	    Promise `count` free data blocks to a later allocation, or return -1
+	    if fewer than that are free and unpromised
+	*/
+    int ret = -1;
+    pthread_mutex_lock(&freemap_lock);
+    if(free_data_blocks - reserved_data_blocks >= count){
+        reserved_data_blocks += count;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&freemap_lock);
+    return ret;
+}
+
+int simplefs_freeAfterCommit(int count){
+    /*
+	    Whether fewer than `count` data blocks are free now but committing
+	    the running transaction would release some of the ones it freed
+	*/
+    pthread_mutex_lock(&freemap_lock);
+    int ret = pending_free_blocks > 0 && free_data_blocks - reserved_data_blocks < count;
+    pthread_mutex_unlock(&freemap_lock);
+    return ret;
+}
+
+void simplefs_unreserveDataBlocks(int count){
+    pthread_mutex_lock(&freemap_lock);
+    assert(count <= reserved_data_blocks);
+    reserved_data_blocks -= count;
+    pthread_mutex_unlock(&freemap_lock);
 }
 
 void simplefs_freeDataBlock(int blocknum){
     /*
-	    free data block with index `blocknum`     
+	    free data block with index `blocknum`, unless a snapshot still
+	    references it
 	*/
-    struct superblock_t *superblock = (struct superblock_t *)malloc(sizeof(struct superblock_t));
-    simplefs_readSuperBlock(superblock);
-    assert(superblock->datablock_freelist[blocknum] == DATA_BLOCK_USED);
-    superblock->datablock_freelist[blocknum] = DATA_BLOCK_FREE;
-    simplefs_writeSuperBlock(superblock);
-    free(superblock);
+    assert(blocknum >= 0 && (uint32_t)blocknum < simplefs_layout.num_data_blocks);
+    pthread_mutex_lock(&freemap_lock);
+    assert(simplefs_bitTest(datablock_bitmap, blocknum));
+    if(simplefs_dataShared(blocknum)){
+        pthread_mutex_unlock(&freemap_lock);
+        return;
+    }
+    simplefs_releaseRun(blocknum, 1);
+    pthread_mutex_unlock(&freemap_lock);
+    SIMPLEFS_STAT_ADD(superblock_ios_saved, 2);
 }
 
-void simplefs_readDataBlock(int blocknum, char *buf){
+static int simplefs_allocRun(int goal, int count, int *start, int reserved){
     /*
-	    read data block with index `blocknum` from disk into `buf`     
+	    Allocate up to `count` contiguous data blocks, store the first in
+	    `*start` and return how many were taken, or 0 if the disk is full.
+	    The run starting at `goal` is used if it can hold all `count` blocks,
+	    then the first run that can, and failing both the longest free run.
+	    Up to `reserved` of the blocks come out of the caller's reservation
 	*/
-    assert(blocknum < NUM_DATA_BLOCKS);
-    char tempBuf[BLOCKSIZE];
-    lseek(DISK_FD, BLOCKSIZE*(5 + blocknum), SEEK_SET);
-    int ret = read(DISK_FD, tempBuf, BLOCKSIZE);
-    assert(ret == BLOCKSIZE);
-    memcpy(buf, tempBuf, BLOCKSIZE);
+    assert(count > 0);
+    SIMPLEFS_STAT_INC(alloc_calls);
+    pthread_mutex_lock(&freemap_lock);
+    int nbits = simplefs_layout.num_data_blocks;
+    int avail = free_data_blocks - reserved_data_blocks + reserved;
+    if(count > avail)
+        count = avail;
+    if(count <= 0){
+        pthread_mutex_unlock(&freemap_lock);
+        SIMPLEFS_STAT_INC(superblock_ios_saved);
+        return 0;
+    }
+    int best = -1, best_len = 0;
+    if(goal >= 0 && goal < nbits && !simplefs_bitTest(datablock_bitmap, goal)){
+        best = goal;
+        best_len = simplefs_bitmapRunLength(datablock_bitmap, nbits, goal, count);
+    }
+    int bit = best_len < count ? simplefs_bitmapFindFree(datablock_bitmap, nbits, datablock_hint) : -1;
+    while(bit >= 0){
+        int len = simplefs_bitmapRunLength(datablock_bitmap, nbits, bit, count);
+        if(len > best_len){
+            best = bit;
+            best_len = len;
+            if(len == count)
+                break;
+        }
+        bit = simplefs_bitmapFindFree(datablock_bitmap, nbits, bit + len);
+    }
+    if(best_len == 0){
+        datablock_hint = nbits;
+        pthread_mutex_unlock(&freemap_lock);
+        SIMPLEFS_STAT_INC(superblock_ios_saved);
+        return 0;
+    }
+    simplefs_bitmapSetRange(datablock_bitmap, best, best_len, 1);
+    if(fresh_blocks)
+        simplefs_bitmapSetRange(fresh_blocks, best, best_len, 1);
+    simplefs_markRunDirty(best, best_len);
+    if(best == datablock_hint)
+        datablock_hint = best + best_len;
+    free_data_blocks -= best_len;
+    reserved_data_blocks -= best_len < reserved ? best_len : reserved;
+    pthread_mutex_unlock(&freemap_lock);
+    SIMPLEFS_STAT_ADD(superblock_ios_saved, 2);
+    *start = best;
+    return best_len;
+}
+
+int simplefs_allocDataRun(int goal, int count, int *start){
+    return simplefs_allocRun(goal, count, start, 0);
+}
+
+int simplefs_allocReservedRun(int goal, int count, int *start){
+    /*
+	    simplefs_allocDataRun() out of a reservation covering all `count` blocks
+	*/
+    return simplefs_allocRun(goal, count, start, count);
+}
+
+void simplefs_freeDataRun(int start, int count){
+    /*
+	    free the `count` data blocks starting at `start`
+	*/
+    struct extent_t run = {start, count};
+    simplefs_freeDataExtents(&run, 1);
+}
+
+void simplefs_freeDataExtents(const struct extent_t *runs, int count){
+    /*
+	    free every run of `runs` under one hold of the free map, so a file
+	    losing many blocks at once updates the bitmaps and the free count
+	    in a single pass. Blocks a snapshot references stay allocated to it
+	*/
+    if(count == 0)
+        return;
+    int nbits = simplefs_layout.num_data_blocks;
+    pthread_mutex_lock(&freemap_lock);
+    for(int i=0; i<count; i++){
+        assert(runs[i].start >= 0 && runs[i].length > 0 && (uint32_t)runs[i].start + runs[i].length <= (uint32_t)nbits);
+        assert(simplefs_bitmapRunLength(datablock_bitmap, nbits, runs[i].start, 1) == 0);
+        for(int start = runs[i].start, end = runs[i].start + runs[i].length; start < end; ){
+            int shared;
+            int len = simplefs_sharedRun(start, end - start, &shared);
+            if(!shared)
+                simplefs_releaseRun(start, len);
+            start += len;
+        }
+    }
+    pthread_mutex_unlock(&freemap_lock);
+    SIMPLEFS_STAT_ADD(superblock_ios_saved, 2);
+}
+
+int simplefs_dataShared(int blocknum){
+    /*
+	    1 if a snapshot references data block `blocknum`, which then may not
+	    change: a write gives the file a copy of its own instead
+	*/
+    return snapshot_refs && snapshot_refs[blocknum] > 0;
+}
+
+int simplefs_sharedRun(int start, int count, int *shared){
+    /*
+	    Length of the leading part of data blocks [start, start + count)
+	    that snapshots either all reference or all do not, `*shared` telling
+	    which. Without snapshots that is every block
+	*/
+    *shared = simplefs_dataShared(start);
+    if(!snapshot_refs)
+        return count;
+    int len = 1;
+    while(len < count && (snapshot_refs[start + len] > 0) == *shared)
+        len++;
+    return len;
+}
+
+static void simplefs_syncImage(){
+    SIMPLEFS_STAT_INC(syncs);
+    if(disk_map){
+        msync(disk_map, simplefs_blockOffset(simplefs_layout.num_blocks), MS_SYNC);
+        return;
+    }
+    fsync(DISK_FD);
+}
+
+uint32_t simplefs_snapshotMap(){
+    /*
+	    The slots holding a snapshot, bit s for slot s
+	*/
+    return mounted_superblock.snapshot_map;
+}
+
+void simplefs_snapshotSave(int slot, const uint64_t *blocks, const struct inode_t *inodes){
+    /*
+	    Store a snapshot in free slot `slot`: the inode bitmap, `blocks` as
+	    the data blocks it references and `inodes` as its inode table. The
+	    blocks and the slot are made durable before the superblock names the
+	    slot, so a crash leaves the snapshot out rather than half there, at
+	    worst leaking the blocks copied for it. Each block of `blocks` gains
+	    a reference
+	*/
+    simplefs_sync();
+    uint32_t bs = simplefs_layout.block_size;
+    uint32_t bitmap_blocks = simplefs_layout.inode_bitmap_blocks + simplefs_layout.datablock_bitmap_blocks;
+    char *image = calloc(simplefs_layout.snapshot_slot_blocks, bs);
+    assert(image);
+    pthread_mutex_lock(&freemap_lock);
+    memcpy(image, inode_bitmap, (size_t)simplefs_layout.inode_bitmap_blocks * bs);
+    pthread_mutex_unlock(&freemap_lock);
+    memcpy(image + (size_t)simplefs_layout.inode_bitmap_blocks * bs, blocks, (size_t)simplefs_layout.datablock_bitmap_blocks * bs);
+    for(uint32_t i=0; i<simplefs_layout.num_inodes; i++){
+        size_t offset = (size_t)(bitmap_blocks + i / simplefs_layout.inodes_per_block) * bs
+                        + (i % simplefs_layout.inodes_per_block) * sizeof(struct inode_t);
+        memcpy(image + offset, &inodes[i], sizeof(struct inode_t));
+    }
+    struct iovec iov = {image, (size_t)simplefs_layout.snapshot_slot_blocks * bs};
+    simplefs_diskWriteRun(simplefs_snapshotStart(slot), simplefs_layout.snapshot_slot_blocks, &iov, 1);
+    free(image);
+    simplefs_syncImage();
+
+    pthread_mutex_lock(&freemap_lock);
+    if(!snapshot_refs){
+        snapshot_refs = calloc(simplefs_layout.num_data_blocks, 1);
+        assert(snapshot_refs);
+    }
+    for(size_t w=0; w<BITMAP_WORDS(simplefs_layout.num_data_blocks); w++){
+        for(uint64_t bits = blocks[w]; bits; bits &= bits - 1)
+            snapshot_refs[w * BITMAP_WORD_BITS + __builtin_ctzll(bits)]++;
+    }
+    mounted_superblock.snapshot_map |= 1u << slot;
+    pthread_mutex_unlock(&freemap_lock);
+    simplefs_writeSuperBlock(&mounted_superblock);
+    simplefs_syncImage();
+}
+
+void simplefs_snapshotDrop(int slot, const uint64_t *live){
+    /*
+	    Delete the snapshot in `slot`. The superblock stops naming it first,
+	    then every block it referenced loses that reference, and one left
+	    with none that `live` does not mark either is freed. A crash in
+	    between only leaks blocks
+	*/
+    uint32_t bs = simplefs_layout.block_size;
+    pthread_mutex_lock(&freemap_lock);
+    mounted_superblock.snapshot_map &= ~(1u << slot);
+    pthread_mutex_unlock(&freemap_lock);
+    simplefs_writeSuperBlock(&mounted_superblock);
+    simplefs_syncImage();
+
+    uint64_t *blocks = malloc((size_t)simplefs_layout.datablock_bitmap_blocks * bs);
+    assert(blocks);
+    simplefs_diskReadRun(simplefs_snapshotStart(slot) + simplefs_layout.inode_bitmap_blocks,
+                         simplefs_layout.datablock_bitmap_blocks, (char *)blocks);
+    pthread_mutex_lock(&freemap_lock);
+    for(size_t w=0; w<BITMAP_WORDS(simplefs_layout.num_data_blocks); w++){
+        for(uint64_t bits = blocks[w]; bits; bits &= bits - 1){
+            int b = w * BITMAP_WORD_BITS + __builtin_ctzll(bits);
+            assert(snapshot_refs[b] > 0);
+            if(--snapshot_refs[b] > 0 || simplefs_bitTest(live, b))
+                continue;
+            simplefs_releaseRun(b, 1);
+        }
+    }
+    if(mounted_superblock.snapshot_map == 0){
+        free(snapshot_refs);
+        snapshot_refs = NULL;
+    }
+    pthread_mutex_unlock(&freemap_lock);
+    free(blocks);
+}
+
+int simplefs_dataPacked(int blocknum){
+    /*
+	    1 if `blocknum` names a block of a compressed cluster, see
+	    simplefs_packedBlock(), rather than a data block
+	*/
+    return (uint32_t)blocknum >= simplefs_layout.num_data_blocks;
+}
+
+int simplefs_packedBlock(int pblock, int index){
+    /*
+	    Number under which block `index` of the compressed cluster stored
+	    from data block `pblock` is read. It lies past the data blocks, and
+	    the cache holds the expanded block under it
+	*/
+    return simplefs_layout.num_data_blocks + pblock * simplefs_layout.cluster_blocks + index;
+}
+
+int simplefs_packedBlocks(int pblock){
+    /*
+	    Data blocks taken by the compressed cluster stored from `pblock`, -1
+	    when its first block fails its checksum
+	*/
+    struct packed_header_t header;
+    if(simplefs_readDataBlockPartial(pblock, 0, (char *)&header, sizeof(header)) < 0)
+        return -1;
+    return (sizeof(header) + header.bytes + simplefs_layout.block_size - 1) / simplefs_layout.block_size;
+}
+
+int simplefs_packBlocks(const char *data, int count, char *packed){
+    /*
+	    Compress `count` blocks of `data` into `packed`, which has room for
+	    as many, behind a packed_header_t and padded with zeros to a whole
+	    block. Returns the blocks the cluster takes, -1 unless that saves one
+	*/
+    uint32_t bs = simplefs_layout.block_size;
+    int capacity = (count - 1) * bs - (int)sizeof(struct packed_header_t);
+    int bytes = capacity > 0 ? simplefs_lzCompress(data, count * bs, packed + sizeof(struct packed_header_t), capacity) : -1;
+    if(bytes < 0)
+        return -1;
+    struct packed_header_t header = {bytes, count};
+    memcpy(packed, &header, sizeof(header));
+    int blocks = (sizeof(header) + bytes + bs - 1) / bs;
+    memset(packed + sizeof(header) + bytes, 0, (size_t)blocks * bs - sizeof(header) - bytes);
+    return blocks;
+}
+
+void simplefs_writePacked(int pblock, int blocks, const char *packed){
+    /*
+	    Store a cluster simplefs_packBlocks() compressed at data blocks
+	    [pblock, pblock + blocks). Anything cached for an earlier cluster
+	    stored there is dropped, the new one is expanded when first read
+	*/
+    struct iovec iov = {(char *)packed, (size_t)blocks * simplefs_layout.block_size};
+    simplefs_writeDataRun(pblock, blocks, &iov, 1);
+    simplefs_cacheDiscardRange(simplefs_layout.data_start + simplefs_packedBlock(pblock, 0), simplefs_layout.cluster_blocks);
+    SIMPLEFS_STAT_INC(packs);
+}
+
+int simplefs_rewritePacked(int pblock, const char *data, char *packed){
+    /*
+	    Store the cluster compressed at `pblock` again, now holding `data`,
+	    in the blocks it already takes. `packed` has room for a cluster.
+	    Returns how many of its last blocks it no longer needs, or -1 with
+	    nothing written when it does not fit them any more
+	*/
+    int old = simplefs_packedBlocks(pblock);
+    int blocks = simplefs_packBlocks(data, simplefs_layout.cluster_blocks, packed);
+    if(blocks < 0 || blocks > old)
+        return -1;
+    simplefs_writePacked(pblock, blocks, packed);
+    // The expanded cluster is at hand, reading it next needs no decompressing
+    simplefs_cacheFill(simplefs_layout.data_start + simplefs_packedBlock(pblock, 0), simplefs_layout.cluster_blocks, data);
+    return old - blocks;
+}
+
+static int simplefs_unpackCluster(int blocknum, char *buf){
+    /*
+	    Expand the compressed cluster holding `blocknum` into the cache, so
+	    the rest of it is read without decompressing again, and copy that
+	    block to `buf`. Returns -1, expanding nothing, when the blocks it is
+	    stored in do not match their checksums
+	*/
+    uint32_t bs = simplefs_layout.block_size;
+    int rel = blocknum - simplefs_layout.num_data_blocks;
+    int pblock = rel / simplefs_layout.cluster_blocks;
+    int index = rel % simplefs_layout.cluster_blocks;
+    struct packed_header_t header;
+    if(simplefs_readDataBlockPartial(pblock, 0, (char *)&header, sizeof(header)) < 0)
+        return -1;
+    int blocks = (sizeof(header) + header.bytes + bs - 1) / bs;
+    assert(header.blocks <= simplefs_layout.cluster_blocks && (uint32_t)index < header.blocks
+           && (uint32_t)(pblock + blocks) <= simplefs_layout.num_data_blocks);
+    char *packed = malloc((size_t)blocks * bs);
+    char *data = malloc((size_t)header.blocks * bs);
+    assert(packed && data);
+    struct iovec iov = {packed, (size_t)blocks * bs};
+    int ret = simplefs_readDataRun(pblock, blocks, &iov, 1);
+    if(ret == 0){
+        int len = simplefs_lzDecompress(packed + sizeof(header), header.bytes, data, header.blocks * bs);
+        assert(len == (int)(header.blocks * bs));
+        SIMPLEFS_STAT_INC(unpacks);
+        simplefs_cacheFill(simplefs_layout.data_start + blocknum - index, header.blocks, data);
+        memcpy(buf, data + (size_t)index * bs, bs);
+    }
+    free(data);
+    free(packed);
+    return ret;
+}
+
+void simplefs_discardDataRun(int start, int count){
+    /*
+	    Drop the cached copies of data blocks [start, start + count), which
+	    no longer hold anything, so they are not written back
+	*/
+    if(!disk_map)
+        simplefs_cacheDiscardRange(simplefs_layout.data_start + start, count);
+}
+
+int simplefs_readDataBlock(int blocknum, char *buf){
+    /*
+	    read data block with index `blocknum` from disk into `buf`. Returns
+	    -1 when it does not match its checksum
+	*/
+    if(simplefs_layout.cluster_blocks && simplefs_dataPacked(blocknum)){
+        assert((uint32_t)blocknum < simplefs_layout.num_data_blocks * (simplefs_layout.cluster_blocks + 1));
+        SIMPLEFS_STAT_INC(data_reads);
+        if(!simplefs_cacheReadCached(simplefs_layout.data_start + blocknum, buf))
+            return simplefs_unpackCluster(blocknum, buf);
+        return 0;
+    }
+    assert(blocknum >= 0 && (uint32_t)blocknum < simplefs_layout.num_data_blocks);
+    SIMPLEFS_STAT_INC(data_reads);
+    if(disk_map){
+        memcpy(buf, disk_map + simplefs_blockOffset(simplefs_layout.data_start + blocknum), simplefs_layout.block_size);
+        return simplefs_csumMapped(simplefs_layout.data_start + blocknum);
+    }
+    return simplefs_cacheReadBlock(simplefs_layout.data_start + blocknum, buf);
 }
 
 void simplefs_writeDataBlock(int blocknum, char *buf){
     /*
 	    fill `buf` with data from `blocknum`    
 	*/
-    assert(blocknum < NUM_DATA_BLOCKS);
-    char tempBuf[BLOCKSIZE];
-    lseek(DISK_FD, BLOCKSIZE * (5 + blocknum), SEEK_SET);
-    memcpy(tempBuf, buf, BLOCKSIZE); 
-    int ret = write(DISK_FD, tempBuf, BLOCKSIZE);
-    assert(ret == BLOCKSIZE);
+    assert(blocknum >= 0 && (uint32_t)blocknum < simplefs_layout.num_data_blocks);
+    SIMPLEFS_STAT_INC(data_writes);
+    if(disk_map){
+        memcpy(disk_map + simplefs_blockOffset(simplefs_layout.data_start + blocknum), buf, simplefs_layout.block_size);
+        simplefs_csumMappedWrite(simplefs_layout.data_start + blocknum);
+        return;
+    }
+    simplefs_cacheWriteBlock(simplefs_layout.data_start + blocknum, buf);
+}
+
+int simplefs_readDataBlockPartial(int blocknum, int offset, char *buf, int len){
+    /*
+	    read `len` bytes at `offset` within data block `blocknum` into `buf`.
+	    Returns -1 when the block does not match its checksum
+	*/
+    if(simplefs_layout.cluster_blocks && simplefs_dataPacked(blocknum)){
+        char *block = malloc(simplefs_layout.block_size);
+        assert(block);
+        int ret = simplefs_readDataBlock(blocknum, block);
+        memcpy(buf, block + offset, len);
+        free(block);
+        return ret;
+    }
+    assert(blocknum >= 0 && (uint32_t)blocknum < simplefs_layout.num_data_blocks);
+    SIMPLEFS_STAT_INC(data_reads);
+    if(disk_map){
+        memcpy(buf, disk_map + simplefs_blockOffset(simplefs_layout.data_start + blocknum) + offset, len);
+        return simplefs_csumMapped(simplefs_layout.data_start + blocknum);
+    }
+    return simplefs_cacheReadPartial(simplefs_layout.data_start + blocknum, offset, buf, len);
+}
+
+int simplefs_writeDataBlockPartial(int blocknum, int offset, const char *buf, int len){
+    /*
+	    write `len` bytes from `buf` at `offset` within data block `blocknum`.
+	    Returns -1, with nothing written, when the rest of the block does not
+	    match its checksum
+	*/
+    assert(blocknum >= 0 && (uint32_t)blocknum < simplefs_layout.num_data_blocks);
+    SIMPLEFS_STAT_INC(data_writes);
+    if(disk_map){
+        if(simplefs_csumMapped(simplefs_layout.data_start + blocknum) < 0)
+            return -1;
+        memcpy(disk_map + simplefs_blockOffset(simplefs_layout.data_start + blocknum) + offset, buf, len);
+        simplefs_csumMappedWrite(simplefs_layout.data_start + blocknum);
+        return 0;
+    }
+    return simplefs_cacheWritePartial(simplefs_layout.data_start + blocknum, offset, buf, len);
+}
+
+int simplefs_readDataRun(int blocknum, int count, const struct iovec *iov, int iovcnt){
+    /*
+	    read data blocks [blocknum, blocknum + count) into the buffers of
+	    `iov`, which must add up to `count` blocks, with one vectored read.
+	    Dirty cached copies are written back first so the disk is current,
+	    except on a journaled disk where they are read one block at a time,
+	    as are the blocks of compressed clusters. The blocks are checked
+	    against their checksums, under simplefs_setVerifyOnce() only those
+	    not checked since the mount; returns -1 when one does not match
+	*/
+    int packed = simplefs_layout.cluster_blocks && simplefs_dataPacked(blocknum);
+    assert(blocknum >= 0 && count > 0 && (packed || (uint32_t)blocknum + count <= simplefs_layout.num_data_blocks));
+    int cached = !disk_map && simplefs_cacheRangeCached(simplefs_layout.data_start + blocknum, count);
+    if(packed || cached || (simplefs_journaling() && simplefs_cacheRangeDirty(simplefs_layout.data_start + blocknum, count))){
+        uint32_t bs = simplefs_layout.block_size;
+        char *block = malloc(bs);
+        assert(block);
+        int ret = 0;
+        for(int i=0; i<count && ret == 0; i++){
+            ret = simplefs_readDataBlock(blocknum + i, block);
+            simplefs_iovCopy(iov, (size_t)i * bs, block, bs, 1);
+        }
+        free(block);
+        return ret;
+    }
+    SIMPLEFS_STAT_ADD(data_reads, count);
+    if(!disk_map)
+        simplefs_cacheWritebackRange(simplefs_layout.data_start + blocknum, count);
+    SIMPLEFS_STAT_ADD(disk_reads, count);
+    uint32_t bs = simplefs_layout.block_size;
+    int step = block_csums && CSUM_READ_BYTES / bs > 1 ? (int)(CSUM_READ_BYTES / bs) : count;
+    struct iovec piece[CSUM_READ_IOVS];
+    int ret = 0;
+    for(int done = 0; done < count; ){
+        // With checksums a long run is read a stretch at a time, each checked while the CPU still caches it
+        int n = count - done < step ? count - done : step;
+        int pieces = n == count ? -1 : simplefs_iovSlice(iov, (size_t)done * bs, (size_t)n * bs, piece, CSUM_READ_IOVS);
+        if(pieces < 0){
+            simplefs_rawTransfer(simplefs_blockOffset(simplefs_layout.data_start + blocknum), iov, iovcnt, 0);
+            return simplefs_csumReadRun(simplefs_layout.data_start + blocknum, count, iov);
+        }
+        simplefs_rawTransfer(simplefs_blockOffset(simplefs_layout.data_start + blocknum + done), piece, pieces, 0);
+        if(simplefs_csumReadRun(simplefs_layout.data_start + blocknum + done, n, piece) < 0)
+            ret = -1;
+        done += n;
+    }
+    return ret;
+}
+
+void simplefs_prefetchDataRun(int blocknum, int count){
+    /*
+	    Read data blocks [blocknum, blocknum + count) ahead of use: into the
+	    cache with one read, skipping cached blocks at either end, or on a
+	    mapped disk by telling the kernel the pages will be needed. The
+	    compressed clusters among them are expanded into the cache. Nothing
+	    that does not match its checksum is cached
+	*/
+    int first = simplefs_layout.data_start + blocknum;
+    int last = first + count;
+    if(simplefs_layout.cluster_blocks && simplefs_dataPacked(blocknum)){
+        char *block = malloc(simplefs_layout.block_size);
+        assert(block);
+        for(int i=0; i<count; i++){
+            if(!simplefs_cacheRangeCached(first + i, 1))
+                simplefs_unpackCluster(blocknum + i, block);
+        }
+        free(block);
+        return;
+    }
+    assert(blocknum >= 0 && count > 0 && (uint32_t)blocknum + count <= simplefs_layout.num_data_blocks);
+    if(disk_map){
+        long page = sysconf(_SC_PAGESIZE);
+        off_t start = simplefs_blockOffset(first) / page * page;
+        posix_madvise(disk_map + start, simplefs_blockOffset(last) - start, POSIX_MADV_WILLNEED);
+        return;
+    }
+    while(first < last && simplefs_cacheRangeCached(first, 1))
+        first++;
+    while(last > first && simplefs_cacheRangeCached(last - 1, 1))
+        last--;
+    if(first == last)
+        return;
+    char *buf = malloc((size_t)(last - first) * simplefs_layout.block_size);
+    assert(buf);
+    if(simplefs_diskReadRun(first, last - first, buf) == 0){
+        simplefs_cacheFill(first, last - first, buf);
+        SIMPLEFS_STAT_ADD(readahead_blocks, last - first);
+    }
+    free(buf);
+}
+
+static int simplefs_dataCommitted(int blocknum, int count){
+    /*
+	    1 if a journaled disk with checksums has any of data blocks
+	    [blocknum, blocknum + count) allocated before the running transaction
+	*/
+    if(!fresh_blocks || !simplefs_journaling())
+        return 0;
+    int fresh = 1;
+    pthread_mutex_lock(&freemap_lock);
+    for(int i=0; fresh && i<count; i++)
+        fresh = simplefs_bitTest(fresh_blocks, blocknum + i);
+    pthread_mutex_unlock(&freemap_lock);
+    return !fresh;
+}
+
+void simplefs_writeDataRun(int blocknum, int count, const struct iovec *iov, int iovcnt){
+    /*
+	    write the buffers of `iov` to data blocks [blocknum, blocknum + count)
+	    with one vectored write. Cached copies of the blocks are dropped first
+	    so no stale buffer is written back over the new data. Blocks the
+	    journal still holds older images of are logged instead, or a replay
+	    would bring the old contents back. So are blocks committed metadata
+	    maps when they are checksummed: their new checksums only reach the
+	    disk with the next commit, and a crash before it would leave the new
+	    contents failing the old ones
+	*/
+    assert(blocknum >= 0 && count > 0 && (uint32_t)blocknum + count <= simplefs_layout.num_data_blocks);
+    if(simplefs_journalLogged(simplefs_layout.data_start + blocknum, count) || simplefs_dataCommitted(blocknum, count)){
+        uint32_t bs = simplefs_layout.block_size;
+        char *block = malloc(bs);
+        assert(block);
+        for(int i=0; i<count; i++){
+            simplefs_iovCopy(iov, (size_t)i * bs, block, bs, 0);
+            simplefs_writeDataBlock(blocknum + i, block);
+        }
+        free(block);
+        return;
+    }
+    SIMPLEFS_STAT_ADD(data_writes, count);
+    if(!disk_map)
+        simplefs_cacheDiscardRange(simplefs_layout.data_start + blocknum, count);
+    simplefs_csumRun(simplefs_layout.data_start + blocknum, count, iov, CSUM_STORE);
+    simplefs_rawTransfer(simplefs_blockOffset(simplefs_layout.data_start + blocknum), iov, iovcnt, 1);
+    SIMPLEFS_STAT_ADD(disk_writes, count);
+}
+
+static void simplefs_dumpExtents(uint32_t inodenum, struct inode_t *inode){
+    /*
+	    Print an extent-mapped inode: its runs as start:length, compressed
+	    clusters as start(blocks):length, then the contents of its first
+	    MAX_FILE_SIZE blocks. Blocks failing their checksum are marked as
+	    such, a bad extent block leaving only the inline extents
+	*/
+    uint32_t bs = simplefs_layout.block_size;
+    printf("INODE %u\nSTATUS:\t%c\tNAME\t%s\tSIZE\t%lld\tEXTENTS\t", inodenum, inode->status, inode->name, (long long)inode->file_size);
+    struct extent_t *extents = malloc(sizeof(inode->extents) + bs);
+    char *tempBuf = malloc(bs + 1);
+    assert(extents && tempBuf);
+    tempBuf[bs] = '\0';
+    memcpy(extents, inode->extents, sizeof(inode->extents));
+    int num_extents = inode->num_extents;
+    int bad_map = inode->extent_block != -1 && simplefs_readDataBlock(inode->extent_block, (char *)(extents + INODE_INLINE_EXTENTS)) < 0;
+    if(bad_map && num_extents > INODE_INLINE_EXTENTS)
+        num_extents = INODE_INLINE_EXTENTS;
+    for(int j = 0; j < num_extents; j++){
+        if(extents[j].start < EXTENT_HOLE)
+            printf("%d(%d):%d\t", EXTENT_PACKED(extents[j].start), simplefs_packedBlocks(EXTENT_PACKED(extents[j].start)), extents[j].length);
+        else
+            printf("%d:%d\t", extents[j].start, extents[j].length);
+    }
+    printf("\n");
+    if(inode->extent_block != -1)
+        printf("EXTENT BLOCK\t%d%s\n", inode->extent_block, bad_map ? "\tCHECKSUM MISMATCH" : "");
+    int lblock = 0;
+    for(int j = 0; j < num_extents && lblock < MAX_FILE_SIZE; j++){
+        if(extents[j].start == EXTENT_HOLE){
+            lblock += extents[j].length;
+            continue;
+        }
+        for(int k = 0; k < extents[j].length && lblock < MAX_FILE_SIZE; k++, lblock++){
+            int pblock = extents[j].start < EXTENT_HOLE ? simplefs_packedBlock(EXTENT_PACKED(extents[j].start), k) : extents[j].start + k;
+            if(simplefs_readDataBlock(pblock, tempBuf) < 0)
+                printf("DATA BLOCK %d: CHECKSUM MISMATCH\n", lblock);
+            else
+                printf("DATA BLOCK %d: %s\n", lblock, tempBuf);
+        }
+    }
+    printf("\n");
+    free(tempBuf);
+    free(extents);
 }
 
 void simplefs_dump(){
@@ -186,39 +2399,63 @@ void simplefs_dump(){
 	*/
 
     printf("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<DISK STATE>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n");
-    struct superblock_t *superblock = (struct superblock_t *)malloc(sizeof(struct superblock_t));
-    simplefs_readSuperBlock(superblock);
     char buf[MAX_NAME_STRLEN + 1];
     buf[MAX_NAME_STRLEN] = '\0';
-    memcpy(buf, superblock->name, sizeof(buf) - 1);
+    memcpy(buf, mounted_superblock.name, sizeof(buf) - 1);
     printf("DISK NAME: %s\nINODE FREELIST:\t", buf);
-    for(int i=0; i<NUM_INODES; i++)
-        printf("%c\t", superblock->inode_freelist[i]);
+    for(uint32_t i=0; i<simplefs_layout.num_inodes; i++)
+        printf("%c\t", simplefs_bitTest(inode_bitmap, i) ? INODE_IN_USE : INODE_FREE);
     printf("\nDATA BLOCK FREELIST:\t");
-    for(int i=0; i<NUM_DATA_BLOCKS; i++)
-        printf("%c\t", superblock->datablock_freelist[i]);
+    for(uint32_t i=0; i<simplefs_layout.num_data_blocks; i++)
+        printf("%c\t", simplefs_bitTest(datablock_bitmap, i) && !(pending_free && simplefs_bitTest(pending_free, i)) ? DATA_BLOCK_USED : DATA_BLOCK_FREE);
     printf("\n");
 
     struct inode_t *inode = (struct inode_t *)malloc(sizeof(struct inode_t));
-    for(int i=0; i<NUM_INODES; i++){
-        simplefs_readInode(i, inode);
-        if(inode->status == INODE_IN_USE){
-            printf("INODE %d\nSTATUS:\t%c\tNAME\t%s\tSIZE\t%d\tDATABLOCK\t", i, inode->status, inode->name, inode->file_size);
+    char *tempBuf = malloc(simplefs_layout.block_size + 1);
+    assert(tempBuf);
+    tempBuf[simplefs_layout.block_size] = '\0';
+    for(uint32_t i=0; i<simplefs_layout.num_inodes; i++){
+        if(simplefs_readInode(i, inode) < 0){
+            printf("INODE %u\nCHECKSUM MISMATCH\n\n", i);
+            continue;
+        }
+        if(inode->status == INODE_DIRECTORY){
+            printf("INODE %u\nSTATUS:\t%c\tNAME\t%s\tENTRIES\t%lld\tROOT\t%d\tHEIGHT\t%d\n\n", i, inode->status, inode->name,
+                   (long long)inode->file_size, inode->dir_root, inode->dir_height);
+        }
+        else if(inode->status == INODE_IN_USE && (simplefs_layout.features & SIMPLEFS_FEATURE_EXTENTS)){
+            simplefs_dumpExtents(i, inode);
+        }
+        else if(inode->status == INODE_IN_USE){
+            printf("INODE %u\nSTATUS:\t%c\tNAME\t%s\tSIZE\t%lld\tDATABLOCK\t", i, inode->status, inode->name, (long long)inode->file_size);
             for (int j = 0; j < MAX_FILE_SIZE; j++)
                 printf("%d\t", inode->direct_blocks[j]);
             printf("\n");
+            if (inode->indirect_block != -1 || inode->double_indirect_block != -1)
+                printf("INDIRECT\t%d\tDOUBLE INDIRECT\t%d\n", inode->indirect_block, inode->double_indirect_block);
             for (int j = 0; j < MAX_FILE_SIZE; j++){
                 if (inode->direct_blocks[j] != -1 ){
-                    char tempBuf[BLOCKSIZE+1];
-                    tempBuf[BLOCKSIZE] = '\0';
-                    simplefs_readDataBlock(inode->direct_blocks[j], tempBuf);
-                    printf("DATA BLOCK %d: %s\n", j, tempBuf);
+                    if(simplefs_readDataBlock(inode->direct_blocks[j], tempBuf) < 0)
+                        printf("DATA BLOCK %d: CHECKSUM MISMATCH\n", j);
+                    else
+                        printf("DATA BLOCK %d: %s\n", j, tempBuf);
                 }
             }
             printf("\n");
         }     
     }
+    free(tempBuf);
     free(inode);
-    free(superblock);
     printf("<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n");
 }
+
+void simplefs_getStats(struct simplefs_stats *out){
+    /*
+	    Copy the I/O counters into `out`
+	*/
+    memcpy(out, &simplefs_io_stats, sizeof(struct simplefs_stats));
+}
+
+void simplefs_resetStats(){
+    memset(&simplefs_io_stats, 0, sizeof(struct simplefs_stats));
+}
@@ -10,50 +10,296 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <errno.h>
 
-#define BLOCKSIZE 64
-#define NUM_BLOCKS 35
-#define NUM_DATA_BLOCKS 30
-#define NUM_INODE_BLOCKS 4
-#define NUM_INODES 8
-#define NUM_INODES_PER_BLOCK 2
+#define BLOCKSIZE 64			// default block size, also the smallest supported
+#define MAX_BLOCKSIZE 65536
+#define CSUM_READ_BYTES 131072	// a long run read with checksums is checked this much at a time, while the CPU caches it
+#define CSUM_READ_IOVS 64		// buffers of such a stretch, more and the run is read whole
+#define CSUM_STORE 0			// checksum a run about to be written,
+#define CSUM_VERIFY 1			// check a run read into the cache,
+#define CSUM_VERIFY_ONCE 2		// or one read around it, only its blocks not yet checked under simplefs_setVerifyOnce()
+#define NUM_DATA_BLOCKS 30		// default geometry
+#define NUM_INODES 8			// default geometry
 #define MAX_FILE_SIZE 4 // In Blocks
 #define MAX_FILES 8
-#define MAX_OPEN_FILES 20
+#define HANDLE_SLOT_BITS 20		// low bits of a file handle pick its slot, the bits above hold the slot's generation
+#define MAX_OPEN_FILES (1 << HANDLE_SLOT_BITS)
+#define HANDLE_CHUNK 64			// slots added each time the open-file table grows
 #define MAX_NAME_STRLEN 8
 #define INODE_FREE 'x'
 #define INODE_IN_USE '1'
+#define INODE_DIRECTORY 'd'		// in use as a directory (SIMPLEFS_FEATURE_DIRS)
 #define DATA_BLOCK_FREE 'x'
 #define DATA_BLOCK_USED '1'
+#define SIMPLEFS_IO_FD 0		// lseek + read/write on the image file
+#define SIMPLEFS_IO_MMAP 1		// whole image mapped with MAP_SHARED
+#define SIMPLEFS_IO_URING 2		// requests batched through io_uring, SIMPLEFS_IO_FD when the kernel has none
+#define SIMPLEFS_IO_DIRECT 3	// image opened O_DIRECT, bypassing the host page cache, for block sizes it allows
+#define BITMAP_WORD_BITS 64
+#ifndef IOV_MAX
+#define IOV_MAX 1024			// iovecs per preadv/pwritev, POSIX minimum is 16
+#endif
+#define BITMAP_WORDS(nbits) (((nbits) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+#define SIMPLEFS_FEATURE_EXTENTS 0x1	// files are mapped by extents instead of block pointers
+#define SIMPLEFS_FEATURE_DIRS 0x2		// hierarchical namespace, inode 0 is the root directory
+#define SIMPLEFS_FEATURE_JOURNAL 0x4	// metadata updates go through a write-ahead journal
+#define SIMPLEFS_FEATURE_SNAPSHOTS 0x8	// copy-on-write snapshots of the whole filesystem, kept in slots
+#define SIMPLEFS_FEATURE_COMPRESSION 0x10	// file data is stored in compressed clusters, with SIMPLEFS_FEATURE_EXTENTS only
+#define SIMPLEFS_FEATURE_CHECKSUMS 0x20	// a CRC32C per inode table block and data block, a read of one that does not match fails
+#define SIMPLEFS_FEATURES_KNOWN (SIMPLEFS_FEATURE_EXTENTS | SIMPLEFS_FEATURE_DIRS | SIMPLEFS_FEATURE_JOURNAL | SIMPLEFS_FEATURE_SNAPSHOTS \
+                                 | SIMPLEFS_FEATURE_COMPRESSION | SIMPLEFS_FEATURE_CHECKSUMS)
+#define SIMPLEFS_MAX_SNAPSHOTS 32		// snapshot slots an image can have, one bit each in the superblock
+#define SIMPLEFS_ROOT_INODE 0
+#define SIMPLEFS_MAX_NAMELEN 255		// longest path component, further limited to block_size - 1
+#define INODE_INLINE_EXTENTS 2
+#define EXTENT_HOLE -1					// extent_t.start of a run of logical blocks with no data blocks
+#define EXTENT_PACKED(pblock) (-2 - (pblock))	// extent_t.start of a compressed cluster stored from data block `pblock`, and back
+#define COMPRESS_CLUSTER_BYTES 4096		// file bytes compressed together
+#define COMPRESS_MIN_CLUSTER 4			// blocks in a cluster when the block size leaves fewer
+
+struct simplefs_geometry
+{
+	uint32_t block_size;		// bytes per block, power of two in [BLOCKSIZE, MAX_BLOCKSIZE]
+	uint32_t num_inodes;		// entries in the inode table
+	uint32_t num_data_blocks;	// blocks available for file data
+	uint32_t features;			// SIMPLEFS_FEATURE_* flags, fixed at format time
+	uint32_t journal_blocks;	// size of the journal region, SIMPLEFS_FEATURE_JOURNAL only
+	uint32_t snapshots;			// snapshot slots, SIMPLEFS_FEATURE_SNAPSHOTS only
+};
 
 struct superblock_t
 {
 	char name[MAX_NAME_STRLEN]; 				// "simplefs" after formatting
-	char inode_freelist[NUM_INODES];			// INODE_FREE if free, INODE_IN_USE if used
-	char datablock_freelist[NUM_DATA_BLOCKS];   // DATA_BLOCK_FREE if free, DATA_BLOCK_USED if used
+	struct simplefs_geometry geometry;			// everything else is derived from this at mount
+	uint32_t snapshot_map;						// bit s set while snapshot slot s holds a snapshot
+};
+
+struct simplefs_layout
+{
+	uint32_t block_size;
+	uint32_t num_inodes;
+	uint32_t num_data_blocks;
+	uint32_t inodes_per_block;
+	uint32_t inode_bitmap_start;		// one bit per inode, set if used
+	uint32_t inode_bitmap_blocks;
+	uint32_t datablock_bitmap_start;	// one bit per data block, set if used
+	uint32_t datablock_bitmap_blocks;
+	uint32_t inode_table_start;
+	uint32_t inode_table_blocks;
+	uint32_t journal_start;				// two halves, each holding one committed transaction
+	uint32_t journal_blocks;			// 0 without SIMPLEFS_FEATURE_JOURNAL
+	uint32_t snapshot_start;			// slots, each a copy of both bitmaps and the inode table
+	uint32_t snapshot_slots;			// 0 without SIMPLEFS_FEATURE_SNAPSHOTS
+	uint32_t snapshot_slot_blocks;
+	uint32_t cluster_blocks;			// blocks compressed together, 0 without SIMPLEFS_FEATURE_COMPRESSION
+	uint32_t csum_start;				// CRC32C of each inode table block, then of each data block
+	uint32_t csum_blocks;				// 0 without SIMPLEFS_FEATURE_CHECKSUMS
+	uint32_t data_start;				// absolute block number of data block 0
+	uint32_t num_blocks;				// size of the image in blocks
+	uint32_t features;
+};
+
+struct extent_t
+{
+	int start;		// first data block of the run, EXTENT_HOLE for a hole, EXTENT_PACKED() for a compressed cluster
+	int length;		// number of blocks in the run, logical blocks for a compressed cluster
+};
+
+struct packed_header_t
+{
+	uint32_t bytes;		// length of the compressed stream following the header
+	uint32_t blocks;	// blocks it expands to
 };
 
 struct inode_t
 {
 	int status;								// INODE_FREE if free, INODE_IN_USE if used
-	char name[MAX_NAME_STRLEN];					// name of the file
-	int file_size;								// size of the file in bytes
-	int direct_blocks[MAX_FILE_SIZE];			// -1 if free, block number if used
+	char name[MAX_NAME_STRLEN];					// name of the file, truncated if it has a name block
+	int name_block;								// -1, or a block holding a name too long for `name`
+	int64_t file_size;							// size of the file in bytes, entries for a directory
+	union {
+		struct {								// block-mapped files
+			int direct_blocks[MAX_FILE_SIZE];	// -1 if free, block number if used
+			int indirect_block;					// -1 if free, else a block of pointers
+			int double_indirect_block;			// -1 if free, else a block of indirect block pointers
+		};
+		struct {								// extent-mapped files (SIMPLEFS_FEATURE_EXTENTS)
+			struct extent_t extents[INODE_INLINE_EXTENTS];	// first runs, in logical order
+			int extent_block;					// -1 if free, else a block of further extents
+			int num_extents;
+		};
+		struct {								// directories
+			int dir_root;						// -1 if empty, else root node of the entry B-tree
+			int dir_height;						// levels below the root, 0 when the root is a leaf
+		};
+	};
+};
+
+struct delayed_tail_t
+{
+	int64_t first;		// logical block the tail starts at, the end of the file's mapped blocks
+	int64_t size;		// size of the file including the tail
+	int64_t capacity;	// bytes allocated for `data`
+	char *data;			// contents from block `first` on, NULL when nothing is delayed
+	int reserved;		// blocks reserved for the tail and the pointer blocks mapping it
+};
+
+struct inode_state_t
+{
+	pthread_rwlock_t lock;		// shared for reads, exclusive for writes and deletes
+	uint32_t map_generation;	// bumped whenever the file's block map changes
+	struct delayed_tail_t tail;	// written data waiting for blocks, delayed allocation only
+	int64_t *repack;			// first blocks of clusters writes left expanded, compressed again at close or sync
+	int repack_count;
+	int repack_capacity;
+	int refs;					// open handles sharing `inode`
+	int dirty;					// `inode` has changes not yet in the inode table, set under inode_table_lock and read without it
+	struct inode_t inode;		// in-core copy of the inode, valid while refs > 0
+};
+
+struct extent_cursor_t
+{
+	int index;				// extent last visited, -1 if none
+	int64_t first;			// first logical block of that extent
+	struct extent_t extent;
+	uint32_t generation;	// map_generation of the inode when the cursor was set
 };
 
 struct filehandle_t
 {
-	int offset;		  // current offset in opened file
+	pthread_mutex_t lock;		// held by a call through the handle, guards everything below
+	int64_t offset;	  // current offset in opened file
 	int inode_number; // Inode number for the file
+	int map_block;				// pointer block cached in map_entries, -1 if none
+	int64_t map_first;			// first logical block mapped by map_entries
+	uint32_t map_generation;	// map_generation of the inode when map_entries was loaded
+	int *map_entries;			// copy of one indirect pointer block
+	struct extent_cursor_t extent_cursor;	// position in the extent list of an extent-mapped file
+	int64_t ra_next;			// logical block after the last one read, 0 before the first read
+	int64_t ra_end;				// logical block after the readahead window
+	int ra_window;				// readahead window in blocks, 0 while the reader is not sequential
+	uint32_t generation;		// bumped when the handle is closed, so its old number no longer matches
+	int next_free;				// next slot on the free list while closed, -1 at its end
+};
+
+struct simplefs_stats
+{
+	long superblock_reads;		// superblock blocks read from disk
+	long superblock_writes;		// superblock blocks written to disk
+	long superblock_ios_saved;	// superblock I/Os avoided by the mounted copy, net of write-backs
+	long cache_hits;			// block requests served by the buffer cache
+	long cache_misses;			// block requests that had to claim a buffer
+	long cache_writebacks;		// dirty buffers written to disk
+	long disk_reads;			// blocks read from the disk image
+	long disk_writes;			// blocks written to the disk image
+	long disk_calls;			// read and write system calls on the disk image
+	long bmap_walks;			// indirect lookups that walked the pointer chain
+	long bmap_cache_hits;		// indirect lookups served by a handle's cached pointer block
+	long data_reads;			// data blocks read through simplefs_readDataBlock*
+	long data_writes;			// data blocks written through simplefs_writeDataBlock*
+	long name_hits;				// name lookups that found an inode in the index
+	long name_misses;			// name lookups answered "no such file" by the index
+	long syncs;					// fsync and msync calls on the disk image
+	long journal_commits;		// transactions written to the journal
+	long journal_blocks;		// descriptor, image and commit blocks written to the journal
+	long journal_replays;		// committed transactions replayed at mount
+	long alloc_calls;			// calls into the data block allocator
+	long readahead_blocks;		// data blocks read into the cache ahead of use
+	long packs;					// clusters written compressed
+	long unpacks;				// compressed clusters expanded into the cache
+	long csum_checks;			// blocks read from disk whose checksum was verified, every read unless simplefs_setVerifyOnce() is set
+	long csum_errors;			// blocks read from disk that did not match their checksum
 };
 
+extern struct simplefs_stats simplefs_io_stats;
+extern struct simplefs_layout simplefs_layout;	// layout of the mounted disk
+#define SIMPLEFS_STAT_ADD(field, n) __atomic_fetch_add(&simplefs_io_stats.field, (n), __ATOMIC_RELAXED)
+#define SIMPLEFS_STAT_INC(field) SIMPLEFS_STAT_ADD(field, 1)
+
+#include "simplefs-cache.h"
+#include "simplefs-index.h"
+#include "simplefs-dir.h"
+#include "simplefs-journal.h"
+#include "simplefs-uring.h"
+#include "simplefs-lz.h"
+#include "simplefs-crc.h"
+
+void simplefs_setIOMode(int mode);
+void simplefs_setVerifyOnce(int once);
 void simplefs_formatDisk();
+int simplefs_formatDiskWithGeometry(const struct simplefs_geometry *geometry);
+int simplefs_mount();
+int simplefs_mountSnapshot(int snapshot);
+int simplefs_readOnly();
+void simplefs_unmount();
+void simplefs_syncSuperBlock();
+void simplefs_sync();
+int simplefs_diskReadBlock(int blocknum, char *buf);
+void simplefs_diskWriteBlock(int blocknum, const char *buf);
+int simplefs_diskReadRun(int blocknum, int count, char *buf);
+void simplefs_diskWriteRun(int blocknum, int count, const struct iovec *iov, int iovcnt);
+void simplefs_diskWriteBlocks(int count, const int *blocknums, const char *const *bufs);
+void simplefs_diskWriteRuns(int nruns, const int *blocknums, const int *counts, const struct iovec *iov, const int *iovcnt, int sync);
+void simplefs_diskSync();
+int simplefs_bitmapSnapshot(int *blocknums, char *images);
+void simplefs_bitmapCommitted();
+void simplefs_checksumImages(int count, const int *blocknums, const char *images);
+void simplefs_bitmapSetRange(uint64_t *map, int start, int len, int value);
 int simplefs_allocInode();
-void simplefs_freeInode(int inodenum);
-void simplefs_readInode(int inodenum, struct inode_t *inodeptr);
-void simplefs_writeInode(int inodenum, struct inode_t *inodeptr); 
+int simplefs_allocInodes(int count, int *inodenums);
+int simplefs_freeInode(int inodenum);
+int simplefs_freeInodes(int count, const int *inodenums);
+int simplefs_readInode(int inodenum, struct inode_t *inodeptr);
+int simplefs_writeInode(int inodenum, struct inode_t *inodeptr); 
+int simplefs_writeInodes(int count, const int *inodenums, const struct inode_t *inodes);
+void simplefs_clearBlockMap(struct inode_t *inodeptr);
 int simplefs_allocDataBlock();
 void simplefs_freeDataBlock(int blocknum);
-void simplefs_readDataBlock(int blocknum, char *buf);
+int simplefs_allocDataRun(int goal, int count, int *start);
+int simplefs_reserveDataBlocks(int count);
+void simplefs_unreserveDataBlocks(int count);
+int simplefs_freeAfterCommit(int count);
+int simplefs_allocReservedBlock();
+int simplefs_allocReservedRun(int goal, int count, int *start);
+void simplefs_setFlushHook(void (*hook)(void));
+void simplefs_freeDataRun(int start, int count);
+void simplefs_freeDataExtents(const struct extent_t *runs, int count);
+int simplefs_dataShared(int blocknum);
+int simplefs_sharedRun(int start, int count, int *shared);
+uint32_t simplefs_snapshotMap();
+void simplefs_snapshotSave(int slot, const uint64_t *blocks, const struct inode_t *inodes);
+void simplefs_snapshotDrop(int slot, const uint64_t *live);
+int simplefs_packBlocks(const char *data, int count, char *packed);
+void simplefs_writePacked(int pblock, int blocks, const char *packed);
+int simplefs_packedBlocks(int pblock);
+int simplefs_rewritePacked(int pblock, const char *data, char *packed);
+int simplefs_packedBlock(int pblock, int index);
+int simplefs_dataPacked(int blocknum);
+void simplefs_discardDataRun(int start, int count);
+int simplefs_readDataBlock(int blocknum, char *buf);
 void simplefs_writeDataBlock(int blocknum, char *buf);
+int simplefs_readDataBlockPartial(int blocknum, int offset, char *buf, int len);
+int simplefs_writeDataBlockPartial(int blocknum, int offset, const char *buf, int len);
+int simplefs_readDataRun(int blocknum, int count, const struct iovec *iov, int iovcnt);
+void simplefs_writeDataRun(int blocknum, int count, const struct iovec *iov, int iovcnt);
+void simplefs_prefetchDataRun(int blocknum, int count);
+pthread_rwlock_t *simplefs_inodeLock(int inodenum);
+struct inode_state_t *simplefs_inodeState(int inodenum);
+struct inode_t *simplefs_inodePin(int inodenum);
+int simplefs_handleOpen(int inodenum);
+struct filehandle_t *simplefs_handleGet(int file_handle);
+struct filehandle_t *simplefs_handleLock(int file_handle);
+void simplefs_handleUnlock(struct filehandle_t *handle);
+int simplefs_handleClose(int file_handle);
+void simplefs_inodeUnpin(int inodenum);
+int simplefs_inodePinned(int inodenum);
+int simplefs_inodeDirty(int inodenum);
 void simplefs_dump();
+void simplefs_getStats(struct simplefs_stats *stats);
+void simplefs_resetStats();
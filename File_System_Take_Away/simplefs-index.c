@@ -0,0 +1,98 @@
+#include "simplefs-disk.h"
+
+/*
+    Every in-use inode is in the index while a disk is mounted, so a name
+    that is not found does not exist and misses never touch the inode table.
+    Chains are threaded through per-inode arrays, so the index allocates
+    nothing after it is built. Callers serialise updates against lookups
+    (simplefs-ops.c holds its namespace lock)
+*/
+static int *buckets = NULL;                    // first inode in each chain, -1 if empty
+static int *chain_next = NULL;                 // next inode in the same chain, per inode
+static char (*names)[MAX_NAME_STRLEN] = NULL;  // indexed name, per inode
+static uint32_t bucket_mask = 0;
+
+uint32_t simplefs_nameHash(const char *name){
+    /*
+	    FNV-1a over the bytes of `name` up to its terminator
+	*/
+    uint32_t h = 2166136261u;
+    for(; *name; name++){
+        h ^= (unsigned char)*name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void simplefs_indexRelease(){
+    free(buckets);
+    free(chain_next);
+    free(names);
+    buckets = chain_next = NULL;
+    names = NULL;
+}
+
+void simplefs_indexInit(){
+    /*
+	    Size an empty index for the mounted disk
+	*/
+    simplefs_indexRelease();
+    uint32_t nbuckets = 1;
+    while(nbuckets < simplefs_layout.num_inodes)
+        nbuckets <<= 1;
+    bucket_mask = nbuckets - 1;
+    buckets = malloc(nbuckets * sizeof(int));
+    chain_next = malloc(simplefs_layout.num_inodes * sizeof(int));
+    names = malloc(simplefs_layout.num_inodes * sizeof(*names));
+    assert(buckets && chain_next && names);
+    memset(buckets, 0xff, nbuckets * sizeof(int));
+}
+
+void simplefs_indexBuild(){
+    /*
+	    Load every in-use inode of the mounted disk into a fresh index,
+	    passing over those failing their checksum. Directory images keep
+	    their names in the directories instead
+	*/
+    simplefs_indexInit();
+    if(simplefs_layout.features & SIMPLEFS_FEATURE_DIRS)
+        return;
+    struct inode_t inode;
+    for(uint32_t i=0; i<simplefs_layout.num_inodes; i++){
+        if(simplefs_readInode(i, &inode) == 0 && inode.status == INODE_IN_USE)
+            simplefs_indexInsert(i, inode.name);
+    }
+}
+
+int simplefs_indexLookup(const char *name){
+    /*
+	    Return the inode named `name`, or -1 if there is none
+	*/
+    int i = buckets[simplefs_nameHash(name) & bucket_mask];
+    while(i != -1 && strcmp(names[i], name) != 0)
+        i = chain_next[i];
+    if(i == -1){
+        SIMPLEFS_STAT_INC(name_misses);
+        return -1;
+    }
+    SIMPLEFS_STAT_INC(name_hits);
+    return i;
+}
+
+void simplefs_indexInsert(int inodenum, const char *name){
+    assert(inodenum >= 0 && (uint32_t)inodenum < simplefs_layout.num_inodes);
+    strncpy(names[inodenum], name, MAX_NAME_STRLEN);
+    names[inodenum][MAX_NAME_STRLEN - 1] = '\0';
+    uint32_t h = simplefs_nameHash(names[inodenum]) & bucket_mask;
+    chain_next[inodenum] = buckets[h];
+    buckets[h] = inodenum;
+}
+
+void simplefs_indexRemove(int inodenum){
+    assert(inodenum >= 0 && (uint32_t)inodenum < simplefs_layout.num_inodes);
+    int *pp = &buckets[simplefs_nameHash(names[inodenum]) & bucket_mask];
+    while(*pp != -1 && *pp != inodenum)
+        pp = &chain_next[*pp];
+    if(*pp == inodenum)
+        *pp = chain_next[inodenum];
+}
@@ -0,0 +1,15 @@
+/*
+	NAME INDEX
+*/
+#ifndef SIMPLEFS_INDEX_H
+#define SIMPLEFS_INDEX_H
+
+uint32_t simplefs_nameHash(const char *name);
+void simplefs_indexInit();
+void simplefs_indexBuild();
+void simplefs_indexRelease();
+int simplefs_indexLookup(const char *name);
+void simplefs_indexInsert(int inodenum, const char *name);
+void simplefs_indexRemove(int inodenum);
+
+#endif
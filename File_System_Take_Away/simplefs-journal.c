@@ -0,0 +1,461 @@
+#include "simplefs-disk.h"
+
+/*
+    Operations that change metadata run inside a handle (simplefs_journalStart
+    / simplefs_journalStop) reserving the cached blocks they may dirty. Dirty
+    buffers are pinned in the cache until a commit logs them together with the
+    changed bitmap blocks, makes the log durable and writes them home. A commit
+    only runs while no handle is open, so every transaction holds whole
+    operations, and it runs when the reserved blocks would not fit, on
+    simplefs_sync() and at unmount. Callers start a handle only after taking
+    every lock the operation needs, so a handle waiting for a commit never
+    blocks one that is still open
+*/
+
+static int journaling = 0;
+static int credit_limit = 0;                   // cached blocks one transaction may log
+static int open_handles = 0;
+static int reserved_credits = 0;               // sum of the credits of the open handles
+static int committing = 0;
+static uint32_t next_sequence = 1;
+static int next_half = 0;                      // half the next transaction is written to
+static int *logged[2] = {NULL, NULL};          // sorted home blocks of the transaction in each half
+static int logged_count[2] = {0, 0};
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER; // guards the handle and commit state
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;   // a handle closed or a commit ended
+
+static inline uint32_t simplefs_tagsPerDescriptor(uint32_t block_size){
+    return (block_size - sizeof(struct journal_header_t)) / sizeof(int);
+}
+
+static inline uint32_t simplefs_halfStart(int half){
+    return simplefs_layout.journal_start + half * (simplefs_layout.journal_blocks / 2);
+}
+
+static uint32_t simplefs_journalChecksum(uint32_t h, const char *p, size_t len){
+    /*
+	    FNV-1a over `len` bytes, continuing from `h`
+	*/
+    for(size_t i=0; i<len; i++){
+        h ^= (unsigned char)p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int simplefs_compareInt(const void *a, const void *b){
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+int simplefs_journalCapacity(const struct simplefs_layout *layout){
+    /*
+	    Cached blocks one transaction can log next to every bitmap and
+	    checksum table block,
+	    given the journal size of `layout`: n images need n / tags-per-
+	    descriptor descriptors, rounded up, and a commit block in one half
+	*/
+    int64_t half = layout->journal_blocks / 2;
+    int64_t tpd = simplefs_tagsPerDescriptor(layout->block_size);
+    int64_t images = (half - 1) * tpd / (tpd + 1);
+    int64_t n = images - layout->inode_bitmap_blocks - layout->datablock_bitmap_blocks - layout->csum_blocks;
+    if(half < 2 || n < 0)
+        return -1;
+    return n > INT_MAX ? INT_MAX : n;
+}
+
+static void simplefs_journalForget(){
+    for(int h=0; h<2; h++){
+        free(logged[h]);
+        logged[h] = NULL;
+        logged_count[h] = 0;
+    }
+}
+
+void simplefs_journalInit(){
+    /*
+	    Reset the journal for the disk being formatted or mounted. Dirty
+	    buffers are pinned in the cache on journaled disks only
+	*/
+    journaling = (simplefs_layout.features & SIMPLEFS_FEATURE_JOURNAL) != 0;
+    open_handles = 0;
+    reserved_credits = 0;
+    committing = 0;
+    next_sequence = 1;
+    next_half = 0;
+    simplefs_journalForget();
+    simplefs_cachePinDirty(journaling);
+    if(!journaling)
+        return;
+    credit_limit = simplefs_journalCapacity(&simplefs_layout);
+    int cache_limit = simplefs_cacheBuffers() * 3 / 4;
+    if(credit_limit > cache_limit)
+        credit_limit = cache_limit;
+    assert(credit_limit >= JOURNAL_MIN_CREDITS);
+}
+
+int simplefs_journaling(){
+    return journaling;
+}
+
+static void simplefs_journalWriteTransaction(){
+    /*
+	    Log every dirty cached block and bitmap and checksum table block,
+	    make the log durable with one fsync, then write the blocks home and
+	    unpin them
+	*/
+    uint32_t bs = simplefs_layout.block_size;
+    int tables = simplefs_layout.inode_bitmap_blocks + simplefs_layout.datablock_bitmap_blocks + simplefs_layout.csum_blocks;
+    int max = tables + simplefs_cacheDirtyCount();
+    int *tags = malloc(max * sizeof(int));
+    char *images = malloc((size_t)max * bs);
+    assert(tags && images);
+    int n = simplefs_cacheSnapshot(tags, images, max - tables);
+    simplefs_checksumImages(n, tags, images);
+    n += simplefs_bitmapSnapshot(tags + n, images + (size_t)n * bs);
+    if(n == 0){
+        free(tags);
+        free(images);
+        return;
+    }
+
+    uint32_t tpd = simplefs_tagsPerDescriptor(bs);
+    int ndesc = (n + tpd - 1) / tpd;
+    assert(ndesc + n + 1 <= (int)simplefs_layout.journal_blocks / 2);
+    uint32_t base = simplefs_halfStart(next_half);
+    char *blocks = calloc(ndesc + 1, bs);   // the descriptors, then the commit block
+    assert(blocks);
+    for(int d=0; d<ndesc; d++){
+        int ntags = (n - d * (int)tpd) < (int)tpd ? n - d * (int)tpd : (int)tpd;
+        struct journal_header_t *header = (struct journal_header_t *)(blocks + (size_t)d * bs);
+        header->magic = JOURNAL_DESCRIPTOR_MAGIC;
+        header->sequence = next_sequence;
+        header->count = n;
+        memcpy((char *)header + sizeof(struct journal_header_t), tags + d * tpd, ntags * sizeof(int));
+    }
+    struct journal_header_t *header = (struct journal_header_t *)(blocks + (size_t)ndesc * bs);
+    header->magic = JOURNAL_COMMIT_MAGIC;
+    header->sequence = next_sequence;
+    header->count = n;
+    header->checksum = simplefs_journalChecksum(simplefs_journalChecksum(2166136261u, (const char *)tags, n * sizeof(int)),
+                                                images, (size_t)n * bs);
+    // Descriptors, images and commit block as three runs, the fsync after them in the same batch
+    int starts[3] = {base, base + ndesc, base + ndesc + n};
+    int counts[3] = {ndesc, n, 1};
+    int iovcnt[3] = {1, 1, 1};
+    struct iovec iov[3] = {{blocks, (size_t)ndesc * bs}, {images, (size_t)n * bs}, {blocks + (size_t)ndesc * bs, bs}};
+    simplefs_diskWriteRuns(3, starts, counts, iov, iovcnt, 1);
+    free(blocks);
+    // The transaction is durable, the blocks it freed may be handed out again
+    simplefs_bitmapCommitted();
+    SIMPLEFS_STAT_INC(syncs);
+    SIMPLEFS_STAT_INC(journal_commits);
+    SIMPLEFS_STAT_ADD(journal_blocks, ndesc + n + 1);
+
+    // Checkpoint: home locations in block order, neighbours as one run, every run in one batch
+    int *order = malloc(n * 2 * sizeof(int));
+    int *runs = malloc(n * 2 * sizeof(int));        // start and length of each run
+    struct iovec *run = malloc(n * sizeof(struct iovec));
+    assert(order && runs && run);
+    for(int i=0; i<n; i++){
+        order[2 * i] = tags[i];
+        order[2 * i + 1] = i;
+    }
+    qsort(order, n, 2 * sizeof(int), simplefs_compareInt);
+    int nruns = 0;
+    for(int i=0; i<n; ){
+        int len = 0;
+        while(i + len < n && len < IOV_MAX && (len == 0 || order[2 * (i + len)] == order[2 * i] + len)){
+            run[i + len].iov_base = images + (size_t)order[2 * (i + len) + 1] * bs;
+            run[i + len].iov_len = bs;
+            len++;
+        }
+        runs[nruns] = order[2 * i];
+        runs[n + nruns++] = len;
+        i += len;
+    }
+    // A run takes one buffer per block, so its lengths double as buffer counts
+    simplefs_diskWriteRuns(nruns, runs, runs + n, run, runs + n, 0);
+    free(runs);
+    for(int i=0; i<n; i++){
+        simplefs_cacheClean(order[2 * i]);
+        tags[i] = order[2 * i];
+    }
+    free(run);
+    free(order);
+    free(images);
+
+    free(logged[next_half]);
+    logged[next_half] = tags;
+    logged_count[next_half] = n;
+    next_half ^= 1;
+    next_sequence++;
+}
+
+static void simplefs_journalCommitLocked(){
+    /*
+	    Called with journal_lock held and no handle open
+	*/
+    committing = 1;
+    pthread_mutex_unlock(&journal_lock);
+    simplefs_journalWriteTransaction();
+    pthread_mutex_lock(&journal_lock);
+    committing = 0;
+    pthread_cond_broadcast(&journal_cond);
+}
+
+void simplefs_journalStart(int credits){
+    /*
+	    Open a handle that may dirty up to `credits` cached blocks, committing
+	    the running transaction first when they would not fit in it, or when
+	    the handle may allocate more data blocks than are free and the
+	    transaction holds freed ones back until it commits
+	*/
+    if(!journaling)
+        return;
+    assert(credits <= credit_limit);
+    pthread_mutex_lock(&journal_lock);
+    int release = open_handles == 0 && simplefs_freeAfterCommit(credits);
+    while(committing || release || simplefs_cacheDirtyCount() + reserved_credits + credits > credit_limit){
+        if(!committing && open_handles == 0){
+            release = 0;
+            simplefs_journalCommitLocked();
+            continue;
+        }
+        pthread_cond_wait(&journal_cond, &journal_lock);
+    }
+    open_handles++;
+    reserved_credits += credits;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+void simplefs_journalStop(int credits){
+    if(!journaling)
+        return;
+    pthread_mutex_lock(&journal_lock);
+    open_handles--;
+    reserved_credits -= credits;
+    if(open_handles == 0)
+        pthread_cond_broadcast(&journal_cond);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+int64_t simplefs_journalWriteChunk(int *credits){
+    /*
+	    Blocks a write may cover under one handle, and the credits that handle
+	    needs: a cached block per data block, the pointer blocks mapping them
+	    and a few blocks of slack for the inode and partial pointer blocks
+	*/
+    if(!journaling){
+        *credits = 0;
+        return INT64_MAX;
+    }
+    int64_t ptrs = simplefs_layout.block_size / sizeof(int);
+    *credits = credit_limit / 2;
+    return (*credits - 8) * ptrs / (ptrs + 1);
+}
+
+void simplefs_journalBatchStart(struct journal_batch_t *batch){
+    /*
+	    Open one handle for a run of operations. Each reserves its credits
+	    with simplefs_journalBatchNext(), like a write chunk up to half a
+	    transaction. By then what the earlier ones dirtied is counted as
+	    dirty, so the handle is only closed, and the transaction committed,
+	    once the next operation no longer fits
+	*/
+    batch->credits = 0;
+    batch->max_credits = journaling ? credit_limit / 2 : INT_MAX;
+    simplefs_journalStart(0);
+    batch->mark = journaling ? simplefs_cacheDirtyCount() : 0;
+}
+
+void simplefs_journalBatchNext(struct journal_batch_t *batch, int op_credits){
+    /*
+	    Reserve `op_credits` for the batch's next operation, called between
+	    operations
+	*/
+    if(!journaling)
+        return;
+    assert(op_credits <= credit_limit);
+    pthread_mutex_lock(&journal_lock);
+    int dirty = simplefs_cacheDirtyCount();
+    if(dirty - batch->mark + op_credits <= batch->credits){
+        pthread_mutex_unlock(&journal_lock);
+        return;
+    }
+    if(dirty + reserved_credits - batch->credits + op_credits <= credit_limit){
+        reserved_credits += op_credits - batch->credits;
+        batch->credits = op_credits;
+        batch->mark = dirty;
+        pthread_mutex_unlock(&journal_lock);
+        return;
+    }
+    pthread_mutex_unlock(&journal_lock);
+    simplefs_journalStop(batch->credits);
+    simplefs_journalStart(op_credits);
+    batch->credits = op_credits;
+    batch->mark = simplefs_cacheDirtyCount();
+}
+
+void simplefs_journalBatchStop(struct journal_batch_t *batch){
+    simplefs_journalStop(batch->credits);
+}
+
+void simplefs_journalCommit(){
+    /*
+	    Commit the running transaction once every open handle has closed
+	*/
+    if(!journaling)
+        return;
+    pthread_mutex_lock(&journal_lock);
+    while(committing || open_handles > 0)
+        pthread_cond_wait(&journal_cond, &journal_lock);
+    simplefs_journalCommitLocked();
+    pthread_mutex_unlock(&journal_lock);
+}
+
+static void simplefs_journalInvalidate(){
+    char *block = calloc(1, simplefs_layout.block_size);
+    assert(block);
+    for(int h=0; h<2; h++)
+        simplefs_diskWriteBlock(simplefs_halfStart(h), block);
+    free(block);
+}
+
+void simplefs_journalClose(){
+    /*
+	    Called after the last commit of a mount: once the checkpoint is durable
+	    the journal is cleared, so the next mount has nothing to replay
+	*/
+    if(!journaling)
+        return;
+    if(logged_count[0] || logged_count[1]){
+        simplefs_diskSync();
+        SIMPLEFS_STAT_INC(syncs);
+        simplefs_journalInvalidate();
+    }
+    simplefs_journalForget();
+    journaling = 0;
+    simplefs_cachePinDirty(0);
+}
+
+int simplefs_journalLogged(int blocknum, int count){
+    /*
+	    1 if a transaction still in the journal holds an image of any block
+	    of [blocknum, blocknum + count)
+	*/
+    for(int h=0; journaling && h<2; h++){
+        int lo = 0, hi = logged_count[h];
+        while(lo < hi){
+            int mid = (lo + hi) / 2;
+            if(logged[h][mid] < blocknum)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if(lo < logged_count[h] && logged[h][lo] < blocknum + count)
+            return 1;
+    }
+    return 0;
+}
+
+struct journal_txn_t
+{
+    uint32_t sequence;
+    int half;
+    int count;
+    int *tags;
+    char *images;
+};
+
+static int simplefs_journalScan(int half, struct journal_txn_t *txn, uint32_t *newest){
+    /*
+	    Read the transaction in `half`, 0 if it is missing, torn or refers
+	    to blocks outside the image
+	*/
+    uint32_t bs = simplefs_layout.block_size;
+    uint32_t tpd = simplefs_tagsPerDescriptor(bs);
+    int half_blocks = simplefs_layout.journal_blocks / 2;
+    uint32_t base = simplefs_halfStart(half);
+    char *block = malloc(bs);
+    assert(block);
+    struct journal_header_t *header = (struct journal_header_t *)block;
+    simplefs_diskReadBlock(base, block);
+    if(header->magic != JOURNAL_DESCRIPTOR_MAGIC || header->count == 0 || header->count >= (uint32_t)half_blocks){
+        free(block);
+        return 0;
+    }
+    txn->half = half;
+    txn->sequence = header->sequence;
+    txn->count = header->count;
+    if((int32_t)(txn->sequence - *newest) > 0)
+        *newest = txn->sequence;
+    int ndesc = (txn->count + tpd - 1) / tpd;
+    if(ndesc + txn->count + 1 > half_blocks){
+        free(block);
+        return 0;
+    }
+    txn->tags = malloc(txn->count * sizeof(int));
+    txn->images = malloc((size_t)txn->count * bs);
+    assert(txn->tags && txn->images);
+    int valid = 1;
+    for(int d=0; d<ndesc && valid; d++){
+        int ntags = (txn->count - d * (int)tpd) < (int)tpd ? txn->count - d * (int)tpd : (int)tpd;
+        if(d > 0)
+            simplefs_diskReadBlock(base + d, block);
+        valid = header->magic == JOURNAL_DESCRIPTOR_MAGIC && header->sequence == txn->sequence
+                && header->count == (uint32_t)txn->count;
+        memcpy(txn->tags + d * tpd, block + sizeof(struct journal_header_t), ntags * sizeof(int));
+    }
+    for(int i=0; i<txn->count && valid; i++)
+        valid = txn->tags[i] > 0 && (uint32_t)txn->tags[i] < simplefs_layout.num_blocks;
+    if(valid){
+        simplefs_diskReadRun(base + ndesc, txn->count, txn->images);
+        simplefs_diskReadBlock(base + ndesc + txn->count, block);
+        uint32_t checksum = simplefs_journalChecksum(simplefs_journalChecksum(2166136261u, (const char *)txn->tags, txn->count * sizeof(int)),
+                                                     txn->images, (size_t)txn->count * bs);
+        valid = header->magic == JOURNAL_COMMIT_MAGIC && header->sequence == txn->sequence
+                && header->count == (uint32_t)txn->count && header->checksum == checksum;
+    }
+    free(block);
+    if(!valid){
+        free(txn->tags);
+        free(txn->images);
+    }
+    return valid;
+}
+
+int simplefs_journalRecover(){
+    /*
+	    Replay the committed transactions left in the journal, oldest first,
+	    then clear it. Returns how many were replayed
+	*/
+    if(!journaling)
+        return 0;
+    struct journal_txn_t txns[2];
+    int ntxns = 0;
+    uint32_t newest = 0;
+    for(int h=0; h<2; h++)
+        ntxns += simplefs_journalScan(h, &txns[ntxns], &newest);
+    if(ntxns == 2 && (int32_t)(txns[0].sequence - txns[1].sequence) > 0){
+        struct journal_txn_t t = txns[0];
+        txns[0] = txns[1];
+        txns[1] = t;
+    }
+    uint32_t bs = simplefs_layout.block_size;
+    for(int t=0; t<ntxns; t++){
+        for(int i=0; i<txns[t].count; i++)
+            simplefs_diskWriteBlock(txns[t].tags[i], txns[t].images + (size_t)i * bs);
+        free(txns[t].tags);
+        free(txns[t].images);
+        SIMPLEFS_STAT_INC(journal_replays);
+    }
+    if(ntxns > 0){
+        simplefs_diskSync();
+        simplefs_journalInvalidate();
+        simplefs_diskSync();
+        SIMPLEFS_STAT_ADD(syncs, 2);
+    }
+    next_sequence = newest + 1;
+    return ntxns;
+}
@@ -0,0 +1,50 @@
+/*
+	METADATA JOURNAL
+*/
+#ifndef SIMPLEFS_JOURNAL_H
+#define SIMPLEFS_JOURNAL_H
+
+/*
+	The journal region is split into two halves used in turn. A commit
+	writes one transaction into the next half:
+	    descriptor blocks | block images | commit block
+	The descriptors list the home block number of every image, the commit
+	block carries a checksum of them all, so a torn commit is never replayed.
+	Each half is overwritten only after the other half's commit has been
+	made durable, by which time its blocks are home: one fsync per commit
+*/
+#define JOURNAL_DESCRIPTOR_MAGIC 0x4a444553	// "JDES"
+#define JOURNAL_COMMIT_MAGIC 0x4a434d54		// "JCMT"
+#define JOURNAL_MIN_CREDITS 64				// smallest number of cached blocks a transaction must hold
+#define JOURNAL_NAMESPACE_CREDITS 40		// create, mkdir, delete, rmdir, truncate: inode, name block, B-tree path
+
+struct journal_header_t
+{
+	uint32_t magic;		// JOURNAL_DESCRIPTOR_MAGIC or JOURNAL_COMMIT_MAGIC
+	uint32_t sequence;	// transaction number
+	uint32_t count;		// blocks logged by the transaction
+	uint32_t checksum;	// commit block: checksum of the tags and images
+};
+
+struct journal_batch_t
+{
+	int credits;		// reserved for the operation under way
+	int mark;			// dirty cached blocks when it was reserved
+	int max_credits;	// most one operation should reserve
+};
+
+int simplefs_journalCapacity(const struct simplefs_layout *layout);
+void simplefs_journalInit();
+int simplefs_journalRecover();
+int simplefs_journaling();
+void simplefs_journalStart(int credits);
+void simplefs_journalStop(int credits);
+int64_t simplefs_journalWriteChunk(int *credits);
+void simplefs_journalBatchStart(struct journal_batch_t *batch);
+void simplefs_journalBatchNext(struct journal_batch_t *batch, int op_credits);
+void simplefs_journalBatchStop(struct journal_batch_t *batch);
+void simplefs_journalCommit();
+void simplefs_journalClose();
+int simplefs_journalLogged(int blocknum, int count);
+
+#endif
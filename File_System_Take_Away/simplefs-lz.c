@@ -0,0 +1,168 @@
+#include "simplefs-disk.h"
+
+static inline uint32_t simplefs_lzRead32(const uint8_t *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t simplefs_lzHash(uint32_t v){
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *simplefs_lzLength(uint8_t *op, const uint8_t *oend, int len){
+    /*
+	    Append the bytes extending a nibble that overflowed by `len`, NULL if
+	    they do not fit before `oend`
+	*/
+    for(; len >= 255; len -= 255){
+        if(op == oend)
+            return NULL;
+        *op++ = 255;
+    }
+    if(op == oend)
+        return NULL;
+    *op++ = len;
+    return op;
+}
+
+static uint8_t *simplefs_lzSequence(uint8_t *op, const uint8_t *oend, const uint8_t *literals, int nliterals, int offset, int match){
+    /*
+	    Append a sequence of `nliterals` literals and a match of `match`
+	    bytes `offset` back, or the literals alone when `match` is 0. NULL
+	    when it does not fit before `oend`
+	*/
+    if(op == oend)
+        return NULL;
+    uint8_t *token = op++;
+    *token = (nliterals < 15 ? nliterals : 15) << 4;
+    if(nliterals >= 15 && !(op = simplefs_lzLength(op, oend, nliterals - 15)))
+        return NULL;
+    if(oend - op < nliterals)
+        return NULL;
+    memcpy(op, literals, nliterals);
+    op += nliterals;
+    if(match == 0)
+        return op;
+    if(oend - op < 2)
+        return NULL;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    match -= LZ_MIN_MATCH;
+    *token |= match < 15 ? match : 15;
+    if(match >= 15 && !(op = simplefs_lzLength(op, oend, match - 15)))
+        return NULL;
+    return op;
+}
+
+int simplefs_lzCompress(const char *src, int len, char *dst, int capacity){
+    /*
+	    Compress the `len` bytes at `src` into `dst`. Matches are found
+	    through a table of the last position each hash of 4 bytes was seen
+	    at, checked before use, and extended as far as they go. Returns the
+	    length of the stream, -1 if it takes more than `capacity` bytes
+	*/
+    const uint8_t *in = (const uint8_t *)src;
+    const uint8_t *end = in + len;
+    uint8_t *op = (uint8_t *)dst;
+    const uint8_t *oend = op + capacity;
+    int32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+
+    const uint8_t *anchor = in;
+    const uint8_t *ip = in;
+    int misses = 0;
+    while(end - ip >= LZ_MIN_MATCH){
+        uint32_t seq = simplefs_lzRead32(ip);
+        uint32_t h = simplefs_lzHash(seq);
+        int32_t candidate = table[h];
+        table[h] = ip - in;
+        if(candidate < 0 || ip - (in + candidate) > LZ_MAX_OFFSET || simplefs_lzRead32(in + candidate) != seq){
+            ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+            continue;
+        }
+        misses = 0;
+        const uint8_t *ref = in + candidate;
+        // A match may also start before the position that found it
+        while(ip > anchor && ref > in && ip[-1] == ref[-1]){
+            ip--;
+            ref--;
+        }
+        int match = LZ_MIN_MATCH;
+        while(ip + match < end && ip[match] == ref[match])
+            match++;
+        op = simplefs_lzSequence(op, oend, anchor, ip - anchor, ip - ref, match);
+        if(!op)
+            return -1;
+        ip += match;
+        anchor = ip;
+        if(end - ip >= LZ_MIN_MATCH + 2)
+            table[simplefs_lzHash(simplefs_lzRead32(ip - 2))] = ip - 2 - in;
+    }
+    op = simplefs_lzSequence(op, oend, anchor, end - anchor, 0, 0);
+    return op ? (int)(op - (uint8_t *)dst) : -1;
+}
+
+int simplefs_lzDecompress(const char *src, int len, char *dst, int capacity){
+    /*
+	    Expand the stream of `len` bytes at `src` into `dst`. Every length
+	    and offset is checked against both buffers, so a damaged stream
+	    fails instead of reading or writing past them. Returns the bytes
+	    written, -1 for a malformed stream or one that expands past `capacity`
+	*/
+    const uint8_t *ip = (const uint8_t *)src;
+    const uint8_t *iend = ip + len;
+    uint8_t *out = (uint8_t *)dst;
+    uint8_t *op = out;
+    const uint8_t *oend = out + capacity;
+    while(ip < iend){
+        int token = *ip++;
+        size_t nliterals = token >> 4;
+        if(nliterals == 15){
+            int b;
+            do{
+                if(ip == iend)
+                    return -1;
+                b = *ip++;
+                nliterals += b;
+            }while(b == 255);
+        }
+        if(nliterals > (size_t)(iend - ip) || nliterals > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, nliterals);
+        ip += nliterals;
+        op += nliterals;
+        if(ip == iend)
+            break;
+        if(iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if(offset == 0 || offset > (size_t)(op - out))
+            return -1;
+        size_t match = token & 15;
+        if(match == 15){
+            int b;
+            do{
+                if(ip == iend)
+                    return -1;
+                b = *ip++;
+                match += b;
+            }while(b == 255);
+        }
+        match += LZ_MIN_MATCH;
+        if(match > (size_t)(oend - op))
+            return -1;
+        // An offset shorter than the match repeats the bytes it is still writing
+        const uint8_t *ref = op - offset;
+        if(offset >= match){
+            memcpy(op, ref, match);
+            op += match;
+        }
+        else{
+            for(size_t i=0; i<match; i++)
+                *op++ = ref[i];
+        }
+    }
+    return op - out;
+}
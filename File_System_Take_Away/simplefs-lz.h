@@ -0,0 +1,25 @@
+/*
+	LZ BLOCK CODEC
+*/
+#ifndef SIMPLEFS_LZ_H
+#define SIMPLEFS_LZ_H
+
+/*
+	A byte-oriented LZ77 format in the LZ4 family, small enough to live in
+	the tree. The stream is a list of sequences:
+	    token | literal length bytes | literals | offset | match length bytes
+	The token's high nibble counts the literals and its low nibble the match
+	length minus LZ_MIN_MATCH, 15 in either meaning more length bytes follow,
+	each added in until one is not 255. The offset is two bytes, little
+	endian, back from the end of the output so far. The last sequence has
+	literals only and ends the stream
+*/
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12			// positions remembered by the compressor, one per hash of 4 bytes
+#define LZ_SKIP_TRIGGER 6		// misses in a row before the compressor steps faster through data that does not match
+
+int simplefs_lzCompress(const char *src, int len, char *dst, int capacity);
+int simplefs_lzDecompress(const char *src, int len, char *dst, int capacity);
+
+#endif
@@ -1,201 +1,2808 @@
+#define _GNU_SOURCE						// PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
 #include "simplefs-ops.h"
 
-extern struct filehandle_t file_handle_array[MAX_OPEN_FILES]; // Array for storing opened files
-struct inode_t inode;
+// Lock order: namespace_lock, then freeze_lock, then an inode lock (simplefs_inodeLock), then the
+// open-file table's lock. Journal handles are opened after the locks an operation takes and closed
+// before they are released
+static pthread_rwlock_t namespace_lock = PTHREAD_RWLOCK_INITIALIZER;	// name lookups vs create/delete
+// Shared by every change to a file's data or size, exclusive while a snapshot is taken or deleted.
+// Waiting snapshots go ahead of new writers, so a steady stream of writes does not starve them
+static pthread_rwlock_t freeze_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static int delayed_allocation = 0;		// writes past the mapped blocks wait in memory for their blocks
 
-int simplefs_create(char *filename) {
-	for (int i = 0; i < 8; i++) {
-		simplefs_readInode(i, &inode);
-		if (strcmp(inode.name, filename) == 0)
+#define PTRS_PER_BLOCK ((int64_t)(simplefs_layout.block_size / sizeof(int)))
+#define EXTENTS_PER_BLOCK ((int)(simplefs_layout.block_size / sizeof(struct extent_t)))
+#define DELAYED_MAX_BYTES (1 << 20)		// a longer delayed tail is flushed before it grows further
+#define READAHEAD_MIN_BLOCKS 4				// first readahead window of a sequential reader
+#define READAHEAD_MAX_BYTES (128 * 1024)	// largest readahead window
+#define NAMESPACE_RUN 512					// most names simplefs_createMany/deleteMany handle at a time
+#define REPACK_MAX 256						// most clusters a file keeps waiting to be compressed again
+#define MAP_CORRUPT -2						// block map lookup through a pointer or extent block failing its checksum
+
+// Kinds of blocks a write may allocate, recorded so a failed write can undo them
+#define ALLOC_DATA 0
+#define ALLOC_INDIRECT 1
+#define ALLOC_DOUBLE_INDIRECT 2
+#define ALLOC_DOUBLE_INDIRECT_CHILD 3
+#define ALLOC_RUN 4				// blocks appended to the last extent, `index` holds the count
+#define ALLOC_EXTENT_BLOCK 5
+#define ALLOC_HOLE 6			// hole appended to the last extent, `index` holds the count
+#define ALLOC_FILL 7			// run mapped into a hole, `index` holds the count
+#define ALLOC_EXTENT_LIST 8		// extent list about to be rebuilt, its old copy is in `saved`
+#define ALLOC_COPY 9			// copy of a block a snapshot shares, `replaced` holds the shared block
+#define ALLOC_UNPACK 10			// compressed cluster replaced by plain blocks, `index` holds its blocks, freed once the write cannot fail
+
+struct alloc_log_t
+{
+	int count;
+	int capacity;
+	struct {
+		int kind;
+		int pblock;		// allocated block
+		int64_t index;	// logical block for ALLOC_DATA, slot in the double indirect block for a child,
+						// length for ALLOC_RUN
+		int replaced;	// ALLOC_COPY
+	} *entries;
+	int reserved;		// blocks left in the reservation of a delayed allocation, used before free space
+	struct extent_t *saved;	// extent list before holes were filled, NULL if none were
+	int saved_count;
+	struct extent_t pool;	// run taken from the free map ahead of use, handed out first
+};
+
+static int simplefs_usesExtents() {
+	return (simplefs_layout.features & SIMPLEFS_FEATURE_EXTENTS) != 0;
+}
+
+static int simplefs_compressing() {
+	return simplefs_layout.cluster_blocks > 0;
+}
+
+static int simplefs_usesDirectories() {
+	return (simplefs_layout.features & SIMPLEFS_FEATURE_DIRS) != 0;
+}
+
+static int64_t simplefs_maxFileBlocks() {
+	// Holes take no blocks, so an extent-mapped file is only bounded by its lengths
+	if (simplefs_usesExtents())
+		return INT_MAX;
+	return MAX_FILE_SIZE + PTRS_PER_BLOCK + PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+}
+
+static int simplefs_readPointer(int pblock, int64_t index) {
+	int entry;
+	if (simplefs_readDataBlockPartial(pblock, index * sizeof(int), (char *)&entry, sizeof(int)) < 0)
+		return MAP_CORRUPT;
+	return entry;
+}
+
+static void simplefs_writePointer(int pblock, int64_t index, int entry) {
+	simplefs_writeDataBlockPartial(pblock, index * sizeof(int), (const char *)&entry, sizeof(int));
+}
+
+static void simplefs_logAllocation(struct alloc_log_t *log, int kind, int pblock, int64_t index) {
+	if (log->count == log->capacity) {
+		log->capacity = log->capacity ? 2 * log->capacity : 8;
+		log->entries = realloc(log->entries, log->capacity * sizeof(*log->entries));
+		assert(log->entries);
+	}
+	log->entries[log->count].kind = kind;
+	log->entries[log->count].pblock = pblock;
+	log->entries[log->count].index = index;
+	log->count++;
+}
+
+static int simplefs_allocBlock(struct alloc_log_t *log) {
+	if (log->pool.length > 0) {
+		log->pool.length--;
+		return log->pool.start++;
+	}
+	if (log->reserved == 0)
+		return simplefs_allocDataBlock();
+	int pblock = simplefs_allocReservedBlock();
+	if (pblock != -1)
+		log->reserved--;
+	return pblock;
+}
+
+static int simplefs_allocRun(struct alloc_log_t *log, int goal, int64_t count, int *start) {
+	if (log->reserved == 0)
+		return simplefs_allocDataRun(goal, count < INT_MAX ? count : INT_MAX, start);
+	int got = simplefs_allocReservedRun(goal, count < log->reserved ? count : log->reserved, start);
+	log->reserved -= got;
+	return got;
+}
+
+static int simplefs_allocPointerBlock(struct alloc_log_t *log, int kind, int64_t index) {
+	/*
+		Allocate a block of pointers with every entry set to -1
+	*/
+	int pblock = simplefs_allocBlock(log);
+	if (pblock == -1)
+		return -1;
+	char *empty = malloc(simplefs_layout.block_size);
+	assert(empty);
+	memset(empty, 0xff, simplefs_layout.block_size);
+	simplefs_writeDataBlock(pblock, empty);
+	free(empty);
+	simplefs_logAllocation(log, kind, pblock, index);
+	return pblock;
+}
+
+static int simplefs_leafPointerBlock(struct inode_t *inode, int64_t lblock, int64_t *leaf_first, struct alloc_log_t *log) {
+	/*
+		Return the indirect block whose entries map `lblock` (which must be past
+		the direct blocks) and the first logical block it maps. Missing pointer
+		blocks are allocated when `log` is given, otherwise -1 is returned.
+		MAP_CORRUPT when the double indirect block fails its checksum
+	*/
+	int64_t rel = lblock - MAX_FILE_SIZE;
+	if (rel < PTRS_PER_BLOCK) {
+		*leaf_first = MAX_FILE_SIZE;
+		if (inode->indirect_block == -1 && log)
+			inode->indirect_block = simplefs_allocPointerBlock(log, ALLOC_INDIRECT, 0);
+		return inode->indirect_block;
+	}
+	rel -= PTRS_PER_BLOCK;
+	int64_t slot = rel / PTRS_PER_BLOCK;
+	*leaf_first = MAX_FILE_SIZE + PTRS_PER_BLOCK + slot * PTRS_PER_BLOCK;
+	if (inode->double_indirect_block == -1) {
+		if (!log)
+			return -1;
+		inode->double_indirect_block = simplefs_allocPointerBlock(log, ALLOC_DOUBLE_INDIRECT, 0);
+		if (inode->double_indirect_block == -1)
+			return -1;
+	}
+	int leaf = simplefs_readPointer(inode->double_indirect_block, slot);
+	if (leaf == -1 && log) {
+		leaf = simplefs_allocPointerBlock(log, ALLOC_DOUBLE_INDIRECT_CHILD, slot);
+		if (leaf != -1)
+			simplefs_writePointer(inode->double_indirect_block, slot, leaf);
+	}
+	return leaf;
+}
+
+static int simplefs_getExtent(struct inode_t *inode, int i, struct extent_t *extent) {
+	// -1 when the extent block fails its checksum
+	if (i < INODE_INLINE_EXTENTS) {
+		*extent = inode->extents[i];
+		return 0;
+	}
+	return simplefs_readDataBlockPartial(inode->extent_block, (i - INODE_INLINE_EXTENTS) * sizeof(struct extent_t),
+	                                     (char *)extent, sizeof(struct extent_t));
+}
+
+static void simplefs_setExtent(struct inode_t *inode, int i, const struct extent_t *extent) {
+	if (i < INODE_INLINE_EXTENTS)
+		inode->extents[i] = *extent;
+	else
+		simplefs_writeDataBlockPartial(inode->extent_block, (i - INODE_INLINE_EXTENTS) * sizeof(struct extent_t),
+		                               (const char *)extent, sizeof(struct extent_t));
+}
+
+static int64_t simplefs_extentBlocks(struct inode_t *inode) {
+	// -1 when the extent block fails its checksum
+	int64_t blocks = 0;
+	for (int i = 0; i < inode->num_extents; i++) {
+		struct extent_t extent;
+		if (simplefs_getExtent(inode, i, &extent) < 0)
+			return -1;
+		blocks += extent.length;
+	}
+	return blocks;
+}
+
+static inline int simplefs_extentBlock(const struct extent_t *extent, int64_t index) {
+	if (extent->start < EXTENT_HOLE)
+		return simplefs_packedBlock(EXTENT_PACKED(extent->start), index);
+	return extent->start == EXTENT_HOLE ? -1 : extent->start + index;
+}
+
+static int simplefs_extentLookup(struct extent_cursor_t *cursor, struct inode_t *inode, uint32_t generation, int64_t lblock) {
+	/*
+		Map logical block `lblock` through the extent list, -1 if unmapped,
+		MAP_CORRUPT if the extent block fails its checksum. The walk resumes from the cursor's extent when it is still valid and
+		not past `lblock`, so sequential access visits each extent once
+	*/
+	int i = 0;
+	int64_t first = 0;
+	if (cursor->index >= 0 && cursor->generation == generation && lblock >= cursor->first) {
+		if (lblock < cursor->first + cursor->extent.length) {
+			SIMPLEFS_STAT_INC(bmap_cache_hits);
+			return simplefs_extentBlock(&cursor->extent, lblock - cursor->first);
+		}
+		i = cursor->index + 1;
+		first = cursor->first + cursor->extent.length;
+	}
+	SIMPLEFS_STAT_INC(bmap_walks);
+	for (; i < inode->num_extents; i++) {
+		struct extent_t extent;
+		if (simplefs_getExtent(inode, i, &extent) < 0)
+			return MAP_CORRUPT;
+		if (lblock < first + extent.length) {
+			cursor->index = i;
+			cursor->first = first;
+			cursor->extent = extent;
+			cursor->generation = generation;
+			return simplefs_extentBlock(&extent, lblock - first);
+		}
+		first += extent.length;
+	}
+	return -1;
+}
+
+static int simplefs_reserveExtents(struct inode_t *inode, int count, struct alloc_log_t *log) {
+	/*
+		Make room for `count` extents, allocating the extent block once the
+		inline ones are used up. -1 when the inode cannot hold that many
+	*/
+	if (count > INODE_INLINE_EXTENTS + EXTENTS_PER_BLOCK)
+		return -1;
+	if (count > INODE_INLINE_EXTENTS && inode->extent_block == -1) {
+		int pblock = simplefs_allocBlock(log);
+		if (pblock == -1)
+			return -1;
+		inode->extent_block = pblock;
+		simplefs_logAllocation(log, ALLOC_EXTENT_BLOCK, pblock, 0);
+	}
+	return 0;
+}
+
+static int simplefs_appendHole(struct inode_t *inode, int inode_number, int64_t count, struct alloc_log_t *log) {
+	/*
+		Leave `count` unmapped blocks at the end of an extent-mapped file, for
+		a write that starts past it
+	*/
+	struct extent_t last = {EXTENT_HOLE, 0};
+	if (inode->num_extents > 0 && simplefs_getExtent(inode, inode->num_extents - 1, &last) < 0) {
+		errno = EIO;
+		return -1;
+	}
+	if (inode->num_extents > 0 && last.start == EXTENT_HOLE) {
+		last.length += count;
+		simplefs_setExtent(inode, inode->num_extents - 1, &last);
+	} else {
+		if (simplefs_reserveExtents(inode, inode->num_extents + 1, log) < 0)
 			return -1;
+		struct extent_t hole = {EXTENT_HOLE, count};
+		simplefs_setExtent(inode, inode->num_extents++, &hole);
+	}
+	simplefs_logAllocation(log, ALLOC_HOLE, EXTENT_HOLE, count);
+	simplefs_inodeState(inode_number)->map_generation++;
+	return 0;
+}
+
+static int simplefs_pushExtent(struct extent_t *list, int *count, struct extent_t extent) {
+	/*
+		Add `extent` to the end of `list`, merged with the last entry when
+		both are holes or the runs are neighbours on disk. A compressed
+		cluster always stays an entry of its own. -1 once the list is longer
+		than an inode can hold
+	*/
+	if (extent.length == 0)
+		return 0;
+	if (*count > 0) {
+		struct extent_t *last = &list[*count - 1];
+		if ((last->start == EXTENT_HOLE && extent.start == EXTENT_HOLE)
+		    || (last->start >= 0 && extent.start == last->start + last->length)) {
+			last->length += extent.length;
+			return 0;
+		}
+	}
+	if (*count == INODE_INLINE_EXTENTS + EXTENTS_PER_BLOCK)
+		return -1;
+	list[(*count)++] = extent;
+	return 0;
+}
+
+static int simplefs_fillHoles(struct inode_t *inode, int inode_number, int64_t first, int64_t last, const int64_t *unshare, struct alloc_log_t *log, int64_t filled[2]) {
+	/*
+		Map the blocks of the holes between logical blocks `first` and `last`
+		of an extent-mapped file, and unless `unshare` is NULL give the ones
+		there a snapshot shares new blocks too, see simplefs_copyBlock(), and
+		expand the compressed clusters there into blocks of their own, whole.
+		The extent list is rebuilt with each hole or shared run split around
+		its new runs, and the old list is kept in `log` for a failed write to
+		put back. `first` and `last` are noted in `filled` when they were in
+		a hole
+	*/
+	int n = inode->num_extents;
+	struct extent_t *old = malloc((n > 0 ? n : 1) * sizeof(struct extent_t));
+	assert(old);
+	int64_t pos = 0;
+	int remap = 0;
+	for (int i = 0; i < n; i++) {
+		if (simplefs_getExtent(inode, i, &old[i]) < 0) {
+			free(old);
+			errno = EIO;
+			return -1;
+		}
+		int64_t lo = first > pos ? first : pos;
+		int64_t hi = last + 1 < pos + old[i].length ? last + 1 : pos + old[i].length;
+		for (int64_t b = lo; b < hi && !remap; ) {
+			int shared = 1;
+			if (old[i].start >= 0)
+				b += simplefs_sharedRun(old[i].start + b - pos, hi - b, &shared);
+			else
+				b = hi;
+			remap = shared && (unshare || old[i].start == EXTENT_HOLE);
+		}
+		pos += old[i].length;
+	}
+	if (!remap) {
+		free(old);
+		return 0;
+	}
+	// The log keeps the old list for a failed write to put back
+	log->saved = old;
+	log->saved_count = n;
+	simplefs_logAllocation(log, ALLOC_EXTENT_LIST, -1, 0);
+
+	// Both grow with the block size, so they are kept off the stack
+	struct extent_t *list = malloc((INODE_INLINE_EXTENTS + EXTENTS_PER_BLOCK) * sizeof(struct extent_t));
+	char *block = malloc(simplefs_layout.block_size);
+	assert(list && block);
+	int ret = -1;
+	int count = 0;
+	pos = 0;
+	for (int i = 0; i < n; i++) {
+		int64_t lo = first > pos ? first : pos;
+		int64_t hi = last + 1 < pos + old[i].length ? last + 1 : pos + old[i].length;
+		int hole = old[i].start == EXTENT_HOLE;
+		int packed = old[i].start < EXTENT_HOLE;
+		if (packed && lo < hi && unshare) {
+			lo = pos;
+			hi = pos + old[i].length;
+			int blocks = simplefs_packedBlocks(EXTENT_PACKED(old[i].start));
+			if (blocks < 0) {
+				errno = EIO;
+				goto fail;
+			}
+			simplefs_logAllocation(log, ALLOC_UNPACK, EXTENT_PACKED(old[i].start), blocks);
+		}
+		if (lo >= hi || (packed && !unshare)) {
+			if (simplefs_pushExtent(list, &count, old[i]) < 0)
+				goto fail;
+			pos += old[i].length;
+			continue;
+		}
+		struct extent_t head = {old[i].start, lo - pos};
+		if (simplefs_pushExtent(list, &count, head) < 0)
+			goto fail;
+		for (int64_t b = lo; b < hi; ) {
+			int shared = 1;
+			int64_t len = hole || packed ? hi - b : simplefs_sharedRun(old[i].start + b - pos, hi - b, &shared);
+			if (!hole && (!shared || !unshare)) {
+				struct extent_t kept = {old[i].start + b - pos, len};
+				if (simplefs_pushExtent(list, &count, kept) < 0)
+					goto fail;
+				b += len;
+				continue;
+			}
+			if (hole && b == first)
+				filled[0] = first;
+			if (hole && b + len == last + 1)
+				filled[1] = last;
+			for (int64_t left = len; left > 0; ) {
+				struct extent_t *prev = count > 0 ? &list[count - 1] : NULL;
+				int goal = prev && prev->start >= 0 ? prev->start + prev->length : -1;
+				int start;
+				int got = simplefs_allocRun(log, goal, left, &start);
+				if (got == 0)
+					goto fail;
+				simplefs_logAllocation(log, ALLOC_FILL, start, got);
+				for (int e = 0; e < 2 && !hole && !packed; e++) {
+					// A partly written block takes the contents of the one it replaces
+					int64_t lblock = unshare[e];
+					if (lblock >= b && lblock < b + got && (e == 0 || lblock != unshare[0])) {
+						if (simplefs_readDataBlock(old[i].start + lblock - pos, block) < 0) {
+							errno = EIO;
+							goto fail;
+						}
+						simplefs_writeDataBlock(start + lblock - b, block);
+					}
+				}
+				for (int64_t lblock = b; packed && lblock < b + got; lblock++) {
+					// Of a compressed cluster only the blocks the write replaces whole are left out
+					if (lblock >= first && lblock <= last && lblock != unshare[0] && lblock != unshare[1])
+						continue;
+					if (simplefs_readDataBlock(simplefs_extentBlock(&old[i], lblock - pos), block) < 0) {
+						errno = EIO;
+						goto fail;
+					}
+					simplefs_writeDataBlock(start + lblock - b, block);
+				}
+				struct extent_t run = {start, got};
+				if (simplefs_pushExtent(list, &count, run) < 0)
+					goto fail;
+				left -= got;
+				b += got;
+			}
+		}
+		struct extent_t tail = {hole || packed ? old[i].start : old[i].start + hi - pos, pos + old[i].length - hi};
+		if (simplefs_pushExtent(list, &count, tail) < 0)
+			goto fail;
+		pos += old[i].length;
+	}
+	if (simplefs_reserveExtents(inode, count, log) < 0)
+		goto fail;
+	for (int i = 0; i < count; i++)
+		simplefs_setExtent(inode, i, &list[i]);
+	inode->num_extents = count;
+	simplefs_inodeState(inode_number)->map_generation++;
+	ret = 0;
+fail:
+	free(list);
+	free(block);
+	return ret;
+}
+
+static int simplefs_appendExtents(struct inode_t *inode, int inode_number, int64_t count, struct alloc_log_t *log) {
+	/*
+		Map `count` more blocks at the end of an extent-mapped file. Every run
+		is asked for the whole remainder and placed right after the last
+		extent when possible, so a sequential write grows a single extent
+	*/
+	simplefs_inodeState(inode_number)->map_generation++;
+	while (count > 0) {
+		struct extent_t last = {EXTENT_HOLE, 0};
+		if (inode->num_extents > 0 && simplefs_getExtent(inode, inode->num_extents - 1, &last) < 0) {
+			errno = EIO;
+			return -1;
+		}
+		int goal = last.start >= 0 ? last.start + last.length : -1;
+		int start;
+		int got = simplefs_allocRun(log, goal, count, &start);
+		if (got == 0)
+			return -1;
+		if (inode->num_extents > 0 && start == goal) {
+			last.length += got;
+			simplefs_setExtent(inode, inode->num_extents - 1, &last);
+		} else {
+			if (simplefs_reserveExtents(inode, inode->num_extents + 1, log) < 0) {
+				simplefs_freeDataRun(start, got);
+				return -1;
+			}
+			struct extent_t extent = {start, got};
+			simplefs_setExtent(inode, inode->num_extents++, &extent);
+		}
+		simplefs_logAllocation(log, ALLOC_RUN, start, got);
+		count -= got;
+	}
+	return 0;
+}
+
+static int simplefs_lookupBlock(struct filehandle_t *handle, struct inode_t *inode, int64_t lblock) {
+	/*
+		Map logical block `lblock` to a data block for reading, -1 if unmapped,
+		MAP_CORRUPT if a pointer or extent block on the way fails its
+		checksum. The last indirect block used is kept on the handle, so a
+		sequential reader only walks the pointer chain once per indirect block
+	*/
+	uint32_t generation = simplefs_inodeState(handle->inode_number)->map_generation;
+	if (simplefs_usesExtents())
+		return simplefs_extentLookup(&handle->extent_cursor, inode, generation, lblock);
+	if (lblock < MAX_FILE_SIZE)
+		return inode->direct_blocks[lblock];
+	if (lblock >= simplefs_maxFileBlocks())
+		return -1;
+
+	if (handle->map_block != -1 && handle->map_generation == generation
+	    && lblock >= handle->map_first && lblock < handle->map_first + PTRS_PER_BLOCK) {
+		SIMPLEFS_STAT_INC(bmap_cache_hits);
+		return handle->map_entries[lblock - handle->map_first];
+	}
+
+	SIMPLEFS_STAT_INC(bmap_walks);
+	int64_t leaf_first;
+	int leaf = simplefs_leafPointerBlock(inode, lblock, &leaf_first, NULL);
+	if (leaf < 0)
+		return leaf;
+	if (!handle->map_entries) {
+		handle->map_entries = malloc(simplefs_layout.block_size);
+		assert(handle->map_entries);
+	}
+	if (simplefs_readDataBlock(leaf, (char *)handle->map_entries) < 0) {
+		handle->map_block = -1;
+		return MAP_CORRUPT;
+	}
+	handle->map_block = leaf;
+	handle->map_first = leaf_first;
+	handle->map_generation = generation;
+	return handle->map_entries[lblock - leaf_first];
+}
+
+static int simplefs_mappedBlock(struct inode_t *inode, int64_t lblock) {
+	/*
+		Map logical block `lblock` without a handle, -1 if unmapped,
+		MAP_CORRUPT if the block map fails its checksum
+	*/
+	if (simplefs_usesExtents()) {
+		struct extent_cursor_t cursor = {-1, 0, {0, 0}, 0};
+		return simplefs_extentLookup(&cursor, inode, 0, lblock);
+	}
+	if (lblock < MAX_FILE_SIZE)
+		return inode->direct_blocks[lblock];
+	int64_t leaf_first;
+	int leaf = simplefs_leafPointerBlock(inode, lblock, &leaf_first, NULL);
+	return leaf < 0 ? leaf : simplefs_readPointer(leaf, lblock - leaf_first);
+}
+
+static int simplefs_peekBlock(struct filehandle_t *handle, struct inode_t *inode, int64_t lblock) {
+	/*
+		Map logical block `lblock` from what the handle already holds: the
+		direct pointers, its cached pointer block or its current extent.
+		-1 when that would take a lookup
+	*/
+	uint32_t generation = simplefs_inodeState(handle->inode_number)->map_generation;
+	if (simplefs_usesExtents()) {
+		struct extent_cursor_t *cursor = &handle->extent_cursor;
+		if (cursor->index >= 0 && cursor->generation == generation
+		    && lblock >= cursor->first && lblock < cursor->first + cursor->extent.length)
+			return simplefs_extentBlock(&cursor->extent, lblock - cursor->first);
+		return -1;
+	}
+	if (lblock < MAX_FILE_SIZE)
+		return inode->direct_blocks[lblock];
+	if (handle->map_block != -1 && handle->map_generation == generation
+	    && lblock >= handle->map_first && lblock < handle->map_first + PTRS_PER_BLOCK)
+		return handle->map_entries[lblock - handle->map_first];
+	return -1;
+}
+
+static void simplefs_readahead(struct filehandle_t *handle, struct inode_t *inode, int64_t first, int64_t last) {
+	/*
+		Keep the blocks ahead of a sequential reader in the cache. A read is
+		sequential when it starts in the block the previous one ended in or in
+		the next. The window starts at READAHEAD_MIN_BLOCKS and doubles every
+		time the reader comes within half a window of its end, any other read
+		drops it. The window ends where the handle's mapping does, the reader
+		does the next lookup itself
+	*/
+	int sequential = first == handle->ra_next || (handle->ra_next > 0 && first == handle->ra_next - 1);
+	handle->ra_next = last + 1;
+	if (!sequential) {
+		handle->ra_window = 0;
+		handle->ra_end = 0;
+		return;
+	}
+	if (handle->ra_window > 0 && last + handle->ra_window / 2 < handle->ra_end)
+		return;
+
+	uint32_t bs = simplefs_layout.block_size;
+	int max = READAHEAD_MAX_BYTES / bs;
+	if (max > simplefs_cacheBuffers() / 4)
+		max = simplefs_cacheBuffers() / 4;
+	int window = handle->ra_window ? 2 * handle->ra_window : READAHEAD_MIN_BLOCKS;
+	handle->ra_window = window < max ? window : max;
+
+	// Blocks of a delayed tail have no disk copy yet
+	int64_t lblock = handle->ra_end > last + 1 ? handle->ra_end : last + 1;
+	int64_t to = last + 1 + handle->ra_window;
+	int64_t end = (inode->file_size + bs - 1) / bs;
+	struct delayed_tail_t *tail = &simplefs_inodeState(handle->inode_number)->tail;
+	if (tail->data && tail->first < end)
+		end = tail->first;
+	if (to > end)
+		to = end;
+
+	// Each run of neighbouring blocks in the window is read with one call
+	int start = -1;
+	int count = 0;
+	for (; lblock < to; lblock++) {
+		int pblock = simplefs_peekBlock(handle, inode, lblock);
+		if (pblock == -1)
+			break;
+		if (start != -1 && pblock == start + count) {
+			count++;
+			continue;
+		}
+		if (start != -1)
+			simplefs_prefetchDataRun(start, count);
+		start = pblock;
+		count = 1;
+	}
+	if (start != -1)
+		simplefs_prefetchDataRun(start, count);
+	if (lblock > handle->ra_end)
+		handle->ra_end = lblock;
+}
+
+static int simplefs_copyBlock(struct alloc_log_t *log, int64_t lblock, int pblock, const int64_t *unshare) {
+	/*
+		Allocate the block replacing data block `pblock`, which a snapshot
+		shares, as logical block `lblock`. The old contents are copied when
+		`unshare` names `lblock` as only partly overwritten, -1 with errno
+		EIO when they fail their checksum
+	*/
+	int copy = simplefs_allocBlock(log);
+	if (copy == -1)
+		return -1;
+	simplefs_logAllocation(log, ALLOC_COPY, copy, lblock);
+	log->entries[log->count - 1].replaced = pblock;
+	if (lblock == unshare[0] || lblock == unshare[1]) {
+		char *block = malloc(simplefs_layout.block_size);
+		assert(block);
+		int ret = simplefs_readDataBlock(pblock, block);
+		if (ret == 0)
+			simplefs_writeDataBlock(copy, block);
+		free(block);
+		if (ret < 0) {
+			errno = EIO;
+			return -1;
+		}
+	}
+	return copy;
+}
+
+static int simplefs_mapBlockForWrite(struct inode_t *inode, int inode_number, int64_t lblock, struct alloc_log_t *log, const int64_t *unshare, int *is_new) {
+	/*
+		Map logical block `lblock` to a data block, allocating the block and
+		any pointer blocks on the way. Unless `unshare` is NULL a block a
+		snapshot shares is replaced by a copy, see simplefs_copyBlock().
+		Returns -1 when the disk is full, or with errno EIO when a pointer
+		block fails its checksum
+	*/
+	*is_new = 0;
+	if (lblock < MAX_FILE_SIZE) {
+		if (inode->direct_blocks[lblock] == -1) {
+			int pblock = simplefs_allocBlock(log);
+			if (pblock == -1)
+				return -1;
+			inode->direct_blocks[lblock] = pblock;
+			simplefs_logAllocation(log, ALLOC_DATA, pblock, lblock);
+			*is_new = 1;
+		} else if (unshare && simplefs_dataShared(inode->direct_blocks[lblock])) {
+			int pblock = simplefs_copyBlock(log, lblock, inode->direct_blocks[lblock], unshare);
+			if (pblock == -1)
+				return -1;
+			inode->direct_blocks[lblock] = pblock;
+		}
+		return inode->direct_blocks[lblock];
+	}
+
+	int64_t leaf_first;
+	int leaf = simplefs_leafPointerBlock(inode, lblock, &leaf_first, log);
+	int pblock = leaf < 0 ? leaf : simplefs_readPointer(leaf, lblock - leaf_first);
+	if (pblock == MAP_CORRUPT) {
+		errno = EIO;
+		return -1;
+	}
+	if (leaf == -1)
+		return -1;
+	if (pblock == -1) {
+		pblock = simplefs_allocBlock(log);
+		if (pblock == -1)
+			return -1;
+		simplefs_writePointer(leaf, lblock - leaf_first, pblock);
+		simplefs_logAllocation(log, ALLOC_DATA, pblock, lblock);
+		simplefs_inodeState(inode_number)->map_generation++;
+		*is_new = 1;
+	} else if (unshare && simplefs_dataShared(pblock)) {
+		pblock = simplefs_copyBlock(log, lblock, pblock, unshare);
+		if (pblock == -1)
+			return -1;
+		simplefs_writePointer(leaf, lblock - leaf_first, pblock);
+		simplefs_inodeState(inode_number)->map_generation++;
+	}
+	return pblock;
+}
+
+static void simplefs_undoAllocations(struct inode_t *inode, int inode_number, struct alloc_log_t *log, int64_t max) {
+	/*
+		Release up to `max` of the blocks a failed write allocated, newest
+		first, so a child pointer block is unhooked before its parent is freed.
+		The undone entries are dropped from `log`
+	*/
+	int stop = log->count > max ? log->count - max : 0;
+	for (int i = log->count - 1; i >= stop; i--) {
+		int pblock = log->entries[i].pblock;
+		int64_t index = log->entries[i].index;
+		if (log->entries[i].kind == ALLOC_RUN || log->entries[i].kind == ALLOC_HOLE) {
+			// The write read the extent block before, only a block gone bad since is skipped
+			struct extent_t last;
+			if (simplefs_getExtent(inode, inode->num_extents - 1, &last) < 0)
+				continue;
+			last.length -= index;
+			if (last.length == 0)
+				inode->num_extents--;
+			else
+				simplefs_setExtent(inode, inode->num_extents - 1, &last);
+			if (log->entries[i].kind == ALLOC_RUN)
+				simplefs_freeDataRun(pblock, index);
+			continue;
+		}
+		if (log->entries[i].kind == ALLOC_FILL) {
+			simplefs_freeDataRun(pblock, index);
+			continue;
+		}
+		if (log->entries[i].kind == ALLOC_UNPACK)
+			continue;
+		if (log->entries[i].kind == ALLOC_EXTENT_LIST) {
+			// Every later entry is undone, the list is back to where it was copied
+			for (int j = 0; j < log->saved_count; j++)
+				simplefs_setExtent(inode, j, &log->saved[j]);
+			inode->num_extents = log->saved_count;
+			continue;
+		}
+		int entry = log->entries[i].kind == ALLOC_COPY ? log->entries[i].replaced : -1;
+		switch (log->entries[i].kind) {
+		case ALLOC_DATA:
+		case ALLOC_COPY:
+			if (index < MAX_FILE_SIZE) {
+				inode->direct_blocks[index] = entry;
+			} else {
+				int64_t leaf_first;
+				int leaf = simplefs_leafPointerBlock(inode, index, &leaf_first, NULL);
+				if (leaf >= 0)
+					simplefs_writePointer(leaf, index - leaf_first, entry);
+			}
+			break;
+		case ALLOC_INDIRECT:
+			inode->indirect_block = -1;
+			break;
+		case ALLOC_DOUBLE_INDIRECT:
+			inode->double_indirect_block = -1;
+			break;
+		case ALLOC_DOUBLE_INDIRECT_CHILD:
+			if (inode->double_indirect_block != -1)
+				simplefs_writePointer(inode->double_indirect_block, index, -1);
+			break;
+		case ALLOC_EXTENT_BLOCK:
+			inode->extent_block = -1;
+			break;
+		}
+		simplefs_freeDataBlock(pblock);
+	}
+	log->count = stop;
+	simplefs_inodeState(inode_number)->map_generation++;
+}
+
+struct write_map_t
+{
+	struct inode_t *inode;
+	int inode_number;
+	struct alloc_log_t log;			// blocks allocated so far, undone if the write fails
+	struct extent_cursor_t cursor;	// extent-mapped files
+	uint32_t generation;			// map_generation the cursor is valid for
+	int64_t first_new;				// first block appended by this write, extent-mapped files
+	int64_t filled[2];				// first and last block of the write if they were in a hole, else -1
+	int unshare;					// blocks a snapshot shares get copies, for a write that changes them
+	int64_t partial[2];				// first and last block of the write if only partly written, else -1
+};
+
+static int simplefs_writeMapBegin(struct write_map_t *map, int64_t offset, int64_t nbytes) {
+	/*
+		Extent-mapped files get every missing block of the write up front, in
+		as few runs as the free space allows: holes it covers are filled,
+		blocks a snapshot shares are replaced when the map unshares, and a
+		write past the end leaves a hole before its own blocks
+	*/
+	uint32_t bs = simplefs_layout.block_size;
+	int64_t first = offset / bs;
+	int64_t last = (offset + nbytes - 1) / bs;
+	map->filled[0] = map->filled[1] = -1;
+	map->partial[0] = nbytes > 0 && offset % bs ? first : -1;
+	map->partial[1] = nbytes > 0 && (offset + nbytes) % bs ? last : -1;
+	if (simplefs_usesExtents() && nbytes > 0) {
+		map->first_new = simplefs_extentBlocks(map->inode);
+		if (map->first_new < 0) {
+			errno = EIO;
+			return -1;
+		}
+		int64_t last_old = last < map->first_new ? last : map->first_new - 1;
+		if (first <= last_old && simplefs_fillHoles(map->inode, map->inode_number, first, last_old,
+		                                            map->unshare ? map->partial : NULL, &map->log, map->filled) < 0)
+			return -1;
+		if (first > map->first_new
+		    && simplefs_appendHole(map->inode, map->inode_number, first - map->first_new, &map->log) < 0)
+			return -1;
+		int64_t append_from = first > map->first_new ? first : map->first_new;
+		if (last >= append_from
+		    && simplefs_appendExtents(map->inode, map->inode_number, last + 1 - append_from, &map->log) < 0)
+			return -1;
+		// Every block of the write is mapped and nothing further can fail,
+		// the compressed clusters it expanded are no longer needed
+		for (int i = 0; i < map->log.count; i++) {
+			if (map->log.entries[i].kind == ALLOC_UNPACK)
+				simplefs_freeDataRun(map->log.entries[i].pblock, map->log.entries[i].index);
+		}
+	}
+	map->generation = simplefs_inodeState(map->inode_number)->map_generation;
+	return 0;
+}
+
+static int simplefs_writeMapBlock(struct write_map_t *map, int64_t lblock, int *is_new) {
+	/*
+		Data block backing `lblock` for the write, -1 when the disk is full
+		or, with errno EIO, the block map fails its checksum
+	*/
+	if (simplefs_usesExtents()) {
+		// Only the first and last block of a write can be partly written,
+		// one filled into a hole starts out as zeros like an appended one
+		*is_new = lblock >= map->first_new || lblock == map->filled[0] || lblock == map->filled[1];
+		int pblock = simplefs_extentLookup(&map->cursor, map->inode, map->generation, lblock);
+		if (pblock == MAP_CORRUPT) {
+			errno = EIO;
+			return -1;
+		}
+		return pblock;
+	}
+	return simplefs_mapBlockForWrite(map->inode, map->inode_number, lblock, &map->log, map->unshare ? map->partial : NULL, is_new);
+}
+
+struct free_list_t
+{
+	int count;
+	int capacity;
+	struct extent_t *runs;	// blocks to free, neighbours on disk merged into one run
+};
+
+static void simplefs_collectRun(struct free_list_t *list, int start, int length) {
+	if (list->count > 0 && list->runs[list->count - 1].start + list->runs[list->count - 1].length == start) {
+		list->runs[list->count - 1].length += length;
+		return;
+	}
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? 2 * list->capacity : 8;
+		list->runs = realloc(list->runs, list->capacity * sizeof(struct extent_t));
+		assert(list->runs);
+	}
+	list->runs[list->count].start = start;
+	list->runs[list->count].length = length;
+	list->count++;
+}
+
+static void simplefs_freePointerBlock(int pblock, int depth, int64_t keep, struct free_list_t *list) {
+	/*
+		Collect every block reachable from pointer block `pblock` that maps a
+		logical block from `keep` on, counted from the first block `pblock`
+		maps, and `pblock` itself when nothing is kept. `depth` is 1 for an
+		indirect block, 2 for a double indirect one
+	*/
+	int64_t span = depth > 1 ? PTRS_PER_BLOCK : 1;
+	int *entries = malloc(simplefs_layout.block_size);
+	assert(entries);
+	if (simplefs_readDataBlock(pblock, (char *)entries) < 0) {
+		// Checked before, see simplefs_checkBlockMap(). Gone bad since, what
+		// it maps stays allocated rather than free whatever it now holds
+		free(entries);
+		return;
+	}
+	int changed = 0;
+	for (int64_t i = keep / span; i < PTRS_PER_BLOCK; i++) {
+		if (entries[i] == -1)
+			continue;
+		int64_t from = keep > i * span ? keep - i * span : 0;
+		if (depth > 1)
+			simplefs_freePointerBlock(entries[i], depth - 1, from, list);
+		else
+			simplefs_collectRun(list, entries[i], 1);
+		if (from == 0) {
+			entries[i] = -1;
+			changed = 1;
+		}
+	}
+	if (keep == 0)
+		simplefs_collectRun(list, pblock, 1);
+	else if (changed)
+		simplefs_writeDataBlock(pblock, (char *)entries);
+	free(entries);
+}
+
+static int simplefs_checkBlockMap(struct inode_t *inode, int64_t keep) {
+	/*
+		Read every extent, pointer block and compressed cluster header that
+		releasing the block map of `inode` past its first `keep` blocks goes
+		through, so one failing its checksum is found before anything is
+		unmapped. -1 with errno EIO then. The release finds them in the cache
+	*/
+	int ok = 1;
+	if (simplefs_usesExtents()) {
+		int64_t first = 0;
+		for (int j = 0; ok && j < inode->num_extents; j++) {
+			struct extent_t extent;
+			ok = simplefs_getExtent(inode, j, &extent) == 0;
+			if (ok && extent.start < EXTENT_HOLE && keep <= first)
+				ok = simplefs_packedBlocks(EXTENT_PACKED(extent.start)) >= 0;
+			first += extent.length;
+		}
+	} else {
+		uint32_t bs = simplefs_layout.block_size;
+		int *entries = malloc(2 * bs);
+		assert(entries);
+		int64_t rel = keep > MAX_FILE_SIZE ? keep - MAX_FILE_SIZE : 0;
+		if (inode->indirect_block != -1 && rel < PTRS_PER_BLOCK)
+			ok = simplefs_readDataBlock(inode->indirect_block, (char *)entries) == 0;
+		rel = keep > MAX_FILE_SIZE + PTRS_PER_BLOCK ? keep - MAX_FILE_SIZE - PTRS_PER_BLOCK : 0;
+		if (ok && inode->double_indirect_block != -1 && rel < PTRS_PER_BLOCK * PTRS_PER_BLOCK) {
+			ok = simplefs_readDataBlock(inode->double_indirect_block, (char *)entries) == 0;
+			for (int64_t i = rel / PTRS_PER_BLOCK; ok && i < PTRS_PER_BLOCK; i++) {
+				if (entries[i] != -1)
+					ok = simplefs_readDataBlock(entries[i], (char *)entries + bs) == 0;
+			}
+		}
+		free(entries);
+	}
+	if (!ok)
+		errno = EIO;
+	return ok ? 0 : -1;
+}
+
+static void simplefs_releaseBlockMap(struct inode_t *inode, int64_t keep, struct free_list_t *list) {
+	/*
+		Unmap every data and mapping block of `inode` past its first `keep`
+		blocks and collect them into `list`. The caller has checked the block
+		map with simplefs_checkBlockMap()
+	*/
+	if (simplefs_usesExtents()) {
+		int64_t first = 0;
+		int count = 0;
+		for (int j = 0; j < inode->num_extents; j++) {
+			struct extent_t extent;
+			if (simplefs_getExtent(inode, j, &extent) < 0) {
+				// Gone bad since the check, the rest stays allocated
+				count = inode->num_extents;
+				break;
+			}
+			int64_t cut = keep > first ? keep - first : 0;
+			first += extent.length;
+			if (cut >= extent.length) {
+				count = j + 1;
+				continue;
+			}
+			// A compressed cluster that is cut keeps its blocks and maps fewer of those it expands to
+			int packed = extent.start < EXTENT_HOLE && cut == 0 ? simplefs_packedBlocks(EXTENT_PACKED(extent.start)) : -1;
+			if (extent.start >= 0)
+				simplefs_collectRun(list, extent.start + cut, extent.length - cut);
+			else if (packed > 0)
+				simplefs_collectRun(list, EXTENT_PACKED(extent.start), packed);
+			if (cut > 0) {
+				extent.length = cut;
+				simplefs_setExtent(inode, j, &extent);
+				count = j + 1;
+			}
+		}
+		// A hole at the end of the list maps nothing, reads past the list see zeros anyway
+		while (count > 0) {
+			struct extent_t extent;
+			if (simplefs_getExtent(inode, count - 1, &extent) < 0 || extent.start != EXTENT_HOLE)
+				break;
+			count--;
+		}
+		if (count <= INODE_INLINE_EXTENTS && inode->extent_block != -1) {
+			simplefs_collectRun(list, inode->extent_block, 1);
+			inode->extent_block = -1;
+		}
+		inode->num_extents = count;
+	} else {
+		for (int64_t j = keep; j < MAX_FILE_SIZE; j++) {
+			if (inode->direct_blocks[j] != -1)
+				simplefs_collectRun(list, inode->direct_blocks[j], 1);
+			inode->direct_blocks[j] = -1;
+		}
+		int64_t rel = keep > MAX_FILE_SIZE ? keep - MAX_FILE_SIZE : 0;
+		if (inode->indirect_block != -1 && rel < PTRS_PER_BLOCK) {
+			simplefs_freePointerBlock(inode->indirect_block, 1, rel, list);
+			if (rel == 0)
+				inode->indirect_block = -1;
+		}
+		rel = keep > MAX_FILE_SIZE + PTRS_PER_BLOCK ? keep - MAX_FILE_SIZE - PTRS_PER_BLOCK : 0;
+		if (inode->double_indirect_block != -1 && rel < PTRS_PER_BLOCK * PTRS_PER_BLOCK) {
+			simplefs_freePointerBlock(inode->double_indirect_block, 2, rel, list);
+			if (rel == 0)
+				inode->double_indirect_block = -1;
+		}
+	}
+	if (keep == 0)
+		simplefs_clearBlockMap(inode);
+}
+
+static void simplefs_freeBlockMap(struct inode_t *inode, int64_t keep) {
+	/*
+		Free every data and mapping block of `inode` past its first `keep`
+		blocks. They are gathered into runs and given back to the free map
+		together. The caller has checked the block map with
+		simplefs_checkBlockMap()
+	*/
+	struct free_list_t list = {0, 0, NULL};
+	simplefs_releaseBlockMap(inode, keep, &list);
+	simplefs_freeDataExtents(list.runs, list.count);
+	free(list.runs);
+}
+
+static int simplefs_resolve(const char *path, int *parent, const char **leaf) {
+	/*
+		Split `path` into the directory holding it and its last component.
+		Flat images have a single namespace, reported as parent -1
+	*/
+	if (!simplefs_usesDirectories()) {
+		*parent = -1;
+		*leaf = path;
+		return 0;
+	}
+	return simplefs_dirResolve(path, parent, leaf);
+}
+
+static int simplefs_findEntry(int parent, const char *name) {
+	if (parent == -1)
+		return simplefs_indexLookup(name);
+	return simplefs_dirLookup(parent, name);
+}
+
+static int simplefs_createNode(char *path, int status) {
+	int parent;
+	const char *leaf;
+	pthread_rwlock_wrlock(&namespace_lock);
+	if (simplefs_readOnly() || simplefs_resolve(path, &parent, &leaf) < 0 || simplefs_findEntry(parent, leaf) != -1) {
+		pthread_rwlock_unlock(&namespace_lock);
+		return -1;
+	}
+
+	simplefs_journalStart(JOURNAL_NAMESPACE_CREDITS);
+	int inode_number = simplefs_allocInode();
+	if (inode_number == -1) {
+		simplefs_journalStop(JOURNAL_NAMESPACE_CREDITS);
+		pthread_rwlock_unlock(&namespace_lock);
+		return -1;
+	}
+
+	struct inode_t new_inode;
+	if (parent == -1) {
+		strncpy(new_inode.name, path, MAX_NAME_STRLEN);
+		new_inode.name[MAX_NAME_STRLEN - 1] = '\0';
+		new_inode.name_block = -1;
+	} else if (simplefs_dirSetName(&new_inode, leaf) < 0) {
+		simplefs_freeInode(inode_number);
+		simplefs_journalStop(JOURNAL_NAMESPACE_CREDITS);
+		pthread_rwlock_unlock(&namespace_lock);
+		return -1;
+	}
+	new_inode.status = status;
+	new_inode.file_size = 0;
+	if (status == INODE_DIRECTORY) {
+		new_inode.dir_root = -1;
+		new_inode.dir_height = 0;
+	} else {
+		simplefs_clearBlockMap(&new_inode);
+	}
+
+	if (simplefs_writeInode(inode_number, &new_inode) < 0) {
+		// The inode's table block fails its checksum, the inode stays unused
+		simplefs_dirReleaseName(&new_inode);
+		inode_number = -1;
+	} else if (parent == -1) {
+		simplefs_indexInsert(inode_number, new_inode.name);
+	} else if (simplefs_dirInsert(parent, leaf, inode_number) < 0) {
+		simplefs_dirReleaseName(&new_inode);
+		simplefs_freeInode(inode_number);
+		inode_number = -1;
+	}
+	simplefs_journalStop(JOURNAL_NAMESPACE_CREDITS);
+	pthread_rwlock_unlock(&namespace_lock);
+	return inode_number;
+}
+
+static int simplefs_unlinkEntry(int parent, const char *leaf, int inode_number, struct inode_t *inode) {
+	/*
+		Drop the name of `inode_number` and free the inode itself. -1 with
+		errno EIO when the inode's table block fails its checksum, the inode
+		then left allocated with everything it holds
+	*/
+	if (parent == -1)
+		simplefs_indexRemove(inode_number);
+	else
+		simplefs_dirRemove(parent, leaf);
+	if (simplefs_freeInode(inode_number) < 0)
+		return -1;
+	simplefs_dirReleaseName(inode);
+	return 0;
+}
+
+static void simplefs_dropTail(int inode_number) {
+	struct delayed_tail_t *tail = &simplefs_inodeState(inode_number)->tail;
+	if (!tail->data)
+		return;
+	simplefs_unreserveDataBlocks(tail->reserved);
+	free(tail->data);
+	memset(tail, 0, sizeof(*tail));
+}
+
+static void simplefs_dropRepack(int inode_number) {
+	struct inode_state_t *state = simplefs_inodeState(inode_number);
+	free(state->repack);
+	state->repack = NULL;
+	state->repack_count = state->repack_capacity = 0;
+}
+
+static int64_t simplefs_fileSize(int inode_number) {
+	/*
+		Size of an open file from its pinned inode, taking in any delayed tail
+	*/
+	struct inode_state_t *state = simplefs_inodeState(inode_number);
+	if (state->tail.data && state->tail.size > state->inode.file_size)
+		return state->tail.size;
+	return state->inode.file_size;
+}
+
+static int simplefs_flushTail(int inode_number, struct inode_t *inode);
+static void simplefs_repackPending(int inode_number, struct inode_t *inode);
+
+int simplefs_create(char *filename) {
+	return simplefs_createNode(filename, INODE_IN_USE);
+}
+
+int simplefs_mkdir(char *path) {
+	if (!simplefs_usesDirectories())
+		return -1;
+	return simplefs_createNode(path, INODE_DIRECTORY);
+}
+
+void simplefs_delete(char *filename) {
+	struct inode_t inode;
+	int parent;
+	const char *leaf;
+	pthread_rwlock_wrlock(&namespace_lock);
+	int i = -1;
+	if (!simplefs_readOnly() && simplefs_resolve(filename, &parent, &leaf) == 0)
+		i = simplefs_findEntry(parent, leaf);
+	if (i != -1) {
+		pthread_rwlock_wrlock(simplefs_inodeLock(i));
+		simplefs_journalStart(JOURNAL_NAMESPACE_CREDITS);
+		// A file whose inode or block map fails its checksum is left in place
+		if (simplefs_readInode(i, &inode) == 0 && inode.status == INODE_IN_USE && simplefs_checkBlockMap(&inode, 0) == 0
+		    && simplefs_unlinkEntry(parent, leaf, i, &inode) == 0) {
+			simplefs_dropTail(i);
+			simplefs_dropRepack(i);
+			simplefs_freeBlockMap(&inode, 0);
+			simplefs_inodeState(i)->map_generation++;
+		}
+		simplefs_journalStop(JOURNAL_NAMESPACE_CREDITS);
+		pthread_rwlock_unlock(simplefs_inodeLock(i));
+	}
+	pthread_rwlock_unlock(&namespace_lock);
+}
+
+int simplefs_rmdir(char *path) {
+	struct inode_t inode;
+	int parent;
+	const char *leaf;
+	if (!simplefs_usesDirectories() || simplefs_readOnly())
+		return -1;
+	pthread_rwlock_wrlock(&namespace_lock);
+	int i = -1;
+	if (simplefs_resolve(path, &parent, &leaf) == 0)
+		i = simplefs_findEntry(parent, leaf);
+	if (i == -1 || simplefs_readInode(i, &inode) < 0 || inode.status != INODE_DIRECTORY || inode.file_size != 0) {
+		pthread_rwlock_unlock(&namespace_lock);
+		return -1;
+	}
+	simplefs_journalStart(JOURNAL_NAMESPACE_CREDITS);
+	int ret = simplefs_dirFree(i) < 0 || simplefs_unlinkEntry(parent, leaf, i, &inode) < 0 ? -1 : 0;
+	simplefs_journalStop(JOURNAL_NAMESPACE_CREDITS);
+	pthread_rwlock_unlock(&namespace_lock);
+	return ret;
+}
+
+struct batch_name_t
+{
+	int parent;			// directory holding the name, -1 on flat images
+	uint32_t hash;
+	const char *leaf;
+	int index;			// position in the caller's list
+	int inode_number;	// simplefs_deleteMany(): the file the name leads to
+};
+
+static int simplefs_compareBatchNames(const void *a, const void *b) {
+	const struct batch_name_t *x = a, *y = b;
+	if (x->parent != y->parent)
+		return (x->parent > y->parent) - (x->parent < y->parent);
+	if (x->hash != y->hash)
+		return (x->hash > y->hash) - (x->hash < y->hash);
+	int c = strcmp(x->leaf, y->leaf);
+	if (c != 0)
+		return c;
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+static int simplefs_compareBatchIndex(const void *a, const void *b) {
+	const struct batch_name_t *x = a, *y = b;
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+static int simplefs_resolveBatch(char **names, int n, struct batch_name_t *entries) {
+	/*
+		Resolve `names[0..n)` into `entries`, dropping those that cannot be.
+		Names in directories are sorted by directory and key, so looking them
+		up and changing their entries walks each B-tree once from left to
+		right; flat names stay in the caller's order. Returns how many are left
+	*/
+	int count = 0;
+	for (int i = 0; i < n && !simplefs_readOnly(); i++) {
+		struct batch_name_t *e = &entries[count];
+		if (simplefs_resolve(names[i], &e->parent, &e->leaf) < 0)
+			continue;
+		e->hash = e->parent == -1 ? 0 : simplefs_nameHash(e->leaf);
+		e->index = i;
+		count++;
+	}
+	if (simplefs_usesDirectories())
+		qsort(entries, count, sizeof(struct batch_name_t), simplefs_compareBatchNames);
+	return count;
+}
+
+static int simplefs_batchRun(const struct batch_name_t *entries, int count, int from, int per_name,
+                             const struct journal_batch_t *batch) {
+	/*
+		Number of names from `from` on, all in the same directory, whose
+		operations of `per_name` credits each fit what one operation of the
+		batch should reserve, with two blocks to spare for the directory's
+		inode and a new B-tree root
+	*/
+	int max = (batch->max_credits - 2) / per_name;
+	if (max > NAMESPACE_RUN)
+		max = NAMESPACE_RUN;
+	int m = 1;
+	while (from + m < count && m < max && entries[from + m].parent == entries[from].parent)
+		m++;
+	return m;
+}
+
+static int simplefs_createRun(char **names, struct batch_name_t *run, int m, int *out_inodes, struct inode_t *images,
+                              int *inodes, const char **leaves, char *inserted, int *created) {
+	/*
+		Create the files of a run of simplefs_createMany(), all in the same
+		directory. Its inodes are taken in one free-map update, given to the
+		names in the caller's order and written in one pass, one at a time
+		when a table block fails its checksum. Adds the files created to
+		`*created` and returns -1 when the inodes ran out
+	*/
+	int parent = run[0].parent;
+	int *unused = inodes + m;
+	if (parent != -1)
+		qsort(run, m, sizeof(struct batch_name_t), simplefs_compareBatchIndex);
+	int got = simplefs_allocInodes(m, inodes);
+	int used = 0, named = 0;
+	for (int j = 0; j < m && used < got; j++) {
+		struct inode_t *image = &images[used];
+		// A flat name goes into the index at once, so a repeat of it later in the batch finds it
+		if (parent == -1) {
+			if (simplefs_indexLookup(names[run[j].index]) != -1)
+				continue;
+			strncpy(image->name, names[run[j].index], MAX_NAME_STRLEN);
+			image->name[MAX_NAME_STRLEN - 1] = '\0';
+			image->name_block = -1;
+			simplefs_indexInsert(inodes[used], image->name);
+		} else if (simplefs_dirSetName(image, run[j].leaf) < 0) {
+			continue;
+		} else {
+			leaves[named] = run[j].leaf;
+			unused[named++] = inodes[used];
+		}
+		image->status = INODE_IN_USE;
+		image->file_size = 0;
+		simplefs_clearBlockMap(image);
+		run[used++].index = run[j].index;
+	}
+
+	// An inode whose table block fails its checksum gets no name and stays allocated
+	char stored[NAMESPACE_RUN];
+	memset(stored, 1, used);
+	if (simplefs_writeInodes(used, inodes, images) < 0) {
+		for (int j = 0; j < used; j++)
+			stored[j] = simplefs_writeInode(inodes[j], &images[j]) == 0;
+	}
+	named = 0;
+	for (int j = 0; j < used; j++) {
+		if (!stored[j] && parent == -1) {
+			simplefs_indexRemove(inodes[j]);
+		} else if (!stored[j]) {
+			simplefs_dirReleaseName(&images[j]);
+		} else if (parent != -1) {
+			leaves[named] = leaves[j];
+			unused[named++] = unused[j];
+		}
 	}
 
-	int inode_number = simplefs_allocInode();
-	if (inode_number == -1)
-		return -1;
+	memset(inserted, 1, used);
+	if (parent != -1)
+		simplefs_dirInsertMany(parent, named, leaves, unused, inserted);
+	int nunused = 0;
+	for (int j = 0, k = 0; j < used; j++) {
+		if (!stored[j])
+			continue;
+		if (!inserted[parent == -1 ? j : k++]) {
+			simplefs_dirReleaseName(&images[j]);
+			unused[nunused++] = inodes[j];
+			continue;
+		}
+		out_inodes[run[j].index] = inodes[j];
+		(*created)++;
+	}
+	for (int j = used; j < got; j++)
+		unused[nunused++] = inodes[j];
+	simplefs_freeInodes(nunused, unused);
+	return got < m ? -1 : 0;
+}
 
-	struct inode_t new_inode;
-	strcpy(new_inode.name, filename);
-	new_inode.name[MAX_NAME_STRLEN - 1] = '\0';
-	new_inode.status = INODE_IN_USE;
-	new_inode.file_size = 0;
-	for (int i = 0; i < MAX_FILE_SIZE; i++)
-		new_inode.direct_blocks[i] = -1;
+int simplefs_createMany(char **names, int n, int *out_inodes) {
+	/*
+		Create the files `names[0..n)`, storing the inode of each in
+		`out_inodes`, or -1 when the name is taken, repeats an earlier one
+		or no inode is left. Returns how many were created. The names are
+		checked under one hold of the namespace lock and share one journal
+		handle, renewed only once the blocks they dirty fill it
+	*/
+	struct batch_name_t *entries = malloc(n * sizeof(struct batch_name_t));
+	struct inode_t *images = malloc(NAMESPACE_RUN * sizeof(struct inode_t));
+	int *inodes = malloc(2 * NAMESPACE_RUN * sizeof(int));
+	const char **leaves = malloc(NAMESPACE_RUN * sizeof(char *));
+	char *inserted = malloc(NAMESPACE_RUN);
+	assert((entries || n == 0) && images && inodes && leaves && inserted);
+	int created = 0;
+	for (int i = 0; i < n; i++)
+		out_inodes[i] = -1;
 
-	simplefs_writeInode(inode_number, &new_inode);
-	return inode_number;
+	pthread_rwlock_wrlock(&namespace_lock);
+	int count = simplefs_resolveBatch(names, n, entries);
+	// A name in a directory that is taken or repeats an earlier one is dropped here, flat ones as they go in
+	if (simplefs_usesDirectories()) {
+		int kept = 0;
+		for (int j = 0; j < count; j++) {
+			struct batch_name_t *e = &entries[j];
+			if (kept > 0 && entries[kept - 1].parent == e->parent && entries[kept - 1].hash == e->hash
+			    && strcmp(entries[kept - 1].leaf, e->leaf) == 0)
+				continue;
+			if (simplefs_dirLookup(e->parent, e->leaf) == -1)
+				entries[kept++] = *e;
+		}
+		count = kept;
+	}
+
+	struct journal_batch_t batch;
+	simplefs_journalBatchStart(&batch);
+	for (int from = 0; from < count; ) {
+		int parent = entries[from].parent;
+		// A flat name dirties its inode's table block, one in a directory its name block and a B-tree path on top
+		int per_name = parent == -1 ? 1 : simplefs_dirCredits(parent) + 2;
+		int m = simplefs_batchRun(entries, count, from, per_name, &batch);
+		simplefs_journalBatchNext(&batch, m * per_name + 2);
+		if (simplefs_createRun(names, &entries[from], m, out_inodes, images, inodes, leaves, inserted, &created) < 0)
+			break;
+		from += m;
+	}
+	simplefs_journalBatchStop(&batch);
+	pthread_rwlock_unlock(&namespace_lock);
+	free(entries);
+	free(images);
+	free(inodes);
+	free(leaves);
+	free(inserted);
+	return created;
 }
 
-void simplefs_delete(char *filename) {
-	for (int i = 0; i < 8; i++) {
-		simplefs_readInode(i, &inode);
-		if (inode.status == INODE_IN_USE && strcmp(inode.name, filename) == 0) {
-			for (int j = 0; j < MAX_FILE_SIZE; j++) {
-				if (inode.direct_blocks[j] != -1) {
-					simplefs_freeDataBlock(inode.direct_blocks[j]);
-					inode.direct_blocks[j] = -1;
-				}
+int simplefs_deleteMany(char **names, int n) {
+	/*
+		Delete the files `names[0..n)`, passing over names that do not exist,
+		are directories or have an inode or block map failing its checksum.
+		Returns how many were deleted. The names are
+		looked up under one hold of the namespace lock and share one journal
+		handle, renewed only once the blocks they dirty fill it. Only files
+		that are open can be reached by anyone but through their names, so
+		only their inode locks are taken, before the handle. Each run of
+		names gives its blocks back to the free map together, frees its
+		inodes in one update and drops its entries a leaf at a time
+	*/
+	struct batch_name_t *entries = malloc(n * sizeof(struct batch_name_t));
+	int *inodes = malloc(NAMESPACE_RUN * sizeof(int));
+	struct inode_t *images = malloc(NAMESPACE_RUN * sizeof(struct inode_t));
+	const char **leaves = malloc(NAMESPACE_RUN * sizeof(char *));
+	char *locked = malloc(n);
+	char *seen = calloc(simplefs_layout.num_inodes, 1);
+	assert(((entries && locked) || n == 0) && inodes && images && leaves && seen);
+	int deleted = 0;
+
+	pthread_rwlock_wrlock(&namespace_lock);
+	int count = simplefs_resolveBatch(names, n, entries);
+	// A file named twice is deleted once
+	int kept = 0;
+	for (int j = 0; j < count; j++) {
+		struct batch_name_t *e = &entries[j];
+		e->inode_number = simplefs_findEntry(e->parent, e->leaf);
+		if (e->inode_number == -1 || seen[e->inode_number])
+			continue;
+		seen[e->inode_number] = 1;
+		entries[kept++] = *e;
+	}
+	count = kept;
+	for (int j = 0; j < count; j++) {
+		locked[j] = simplefs_inodePinned(entries[j].inode_number);
+		if (locked[j])
+			pthread_rwlock_wrlock(simplefs_inodeLock(entries[j].inode_number));
+	}
+
+	struct journal_batch_t batch;
+	struct free_list_t list = {0, 0, NULL};
+	simplefs_journalBatchStart(&batch);
+	for (int from = 0; from < count; ) {
+		int parent = entries[from].parent;
+		// A name dirties its inode's table block, in a directory its leaf too
+		int per_name = parent == -1 ? 1 : 2;
+		int m = simplefs_batchRun(entries, count, from, per_name, &batch);
+		simplefs_journalBatchNext(&batch, m * per_name + 2);
+		int gone = 0;
+		for (int j = from; j < from + m; j++) {
+			int i = entries[j].inode_number;
+			if (simplefs_readInode(i, &images[gone]) < 0 || images[gone].status != INODE_IN_USE
+			    || simplefs_checkBlockMap(&images[gone], 0) < 0)
+				continue;
+			if (parent == -1)
+				simplefs_indexRemove(i);
+			leaves[gone] = entries[j].leaf;
+			inodes[gone++] = i;
+		}
+		if (parent != -1)
+			simplefs_dirRemoveMany(parent, gone, leaves, inodes);
+		// An inode whose table block fails its checksum is left allocated with everything it holds
+		if (simplefs_freeInodes(gone, inodes) < 0) {
+			int kept = 0;
+			for (int g = 0; g < gone; g++) {
+				if (simplefs_freeInode(inodes[g]) < 0)
+					continue;
+				images[kept] = images[g];
+				inodes[kept++] = inodes[g];
 			}
-			simplefs_freeInode(i);
-			return;
+			gone = kept;
 		}
+		for (int g = 0; g < gone; g++) {
+			int i = inodes[g];
+			simplefs_dropTail(i);
+			simplefs_dropRepack(i);
+			simplefs_releaseBlockMap(&images[g], 0, &list);
+			simplefs_inodeState(i)->map_generation++;
+			simplefs_dirReleaseName(&images[g]);
+		}
+		simplefs_freeDataExtents(list.runs, list.count);
+		list.count = 0;
+		deleted += gone;
+		from += m;
+	}
+	simplefs_journalBatchStop(&batch);
+	for (int j = 0; j < count; j++) {
+		if (locked[j])
+			pthread_rwlock_unlock(simplefs_inodeLock(entries[j].inode_number));
 	}
+	pthread_rwlock_unlock(&namespace_lock);
+	free(list.runs);
+	free(entries);
+	free(inodes);
+	free(images);
+	free(leaves);
+	free(locked);
+	free(seen);
+	return deleted;
 }
 
 int simplefs_open(char *filename) {
+	int parent;
+	const char *leaf;
+	pthread_rwlock_rdlock(&namespace_lock);
 	int found_inode = -1;
-	for (int i = 0; i < 8; i++) {
-		simplefs_readInode(i, &inode);
-		if (inode.status == INODE_IN_USE && strcmp(inode.name, filename) == 0) {
-			found_inode = i;
-			break;
+	if (simplefs_resolve(filename, &parent, &leaf) == 0)
+		found_inode = simplefs_findEntry(parent, leaf);
+	if (found_inode != -1) {
+		// Pinned before the name can go away, the handles share the in-core inode
+		struct inode_t *inode = simplefs_inodePin(found_inode);
+		if (!inode) {
+			pthread_rwlock_unlock(&namespace_lock);
+			return -1;
+		}
+		if (inode->status == INODE_DIRECTORY) {
+			simplefs_inodeUnpin(found_inode);
+			pthread_rwlock_unlock(&namespace_lock);
+			return -1;
 		}
 	}
+	pthread_rwlock_unlock(&namespace_lock);
 	if (found_inode == -1) {
 		printf("Not found\n");
 		return -1;
 	}
 
-	for (int i = 0; i < MAX_OPEN_FILES; i++) {
-		if (file_handle_array[i].inode_number < 0) {
-			file_handle_array[i].inode_number = found_inode;
-			file_handle_array[i].offset = 0;
-			return i;
-		}
-	}
+	int file_handle = simplefs_handleOpen(found_inode);
+	if (file_handle == -1)
+		simplefs_inodeUnpin(found_inode);
+	return file_handle;
+}
 
-	return -1;
+static int simplefs_flushPending(int inode_number) {
+	/*
+		Whether the file has a delayed tail or clusters left expanded, read
+		under its inode lock. The caller holds the freeze lock
+	*/
+	struct inode_state_t *state = simplefs_inodeState(inode_number);
+	pthread_rwlock_rdlock(simplefs_inodeLock(inode_number));
+	int pending = state->tail.data || state->repack_count;
+	pthread_rwlock_unlock(simplefs_inodeLock(inode_number));
+	return pending;
 }
 
 void simplefs_close(int file_handle) {
-	if (file_handle < 0 || file_handle >= MAX_OPEN_FILES)
+	struct filehandle_t *handle = simplefs_handleLock(file_handle);
+	if (!handle)
 		return;
 
-	file_handle_array[file_handle].inode_number = -1;
-	file_handle_array[file_handle].offset = 0;
-}
-
-int simplefs_read(int file_handle, char *buf, int nbytes) {
-	if (file_handle < 0 || file_handle >= MAX_OPEN_FILES || nbytes < 0)
-		return -1;
+	// Data kept back by delayed allocation gets its blocks when the file is
+	// closed, and the clusters writes left expanded are compressed again
+	int inode_number = handle->inode_number;
+	simplefs_handleUnlock(handle);
+	struct inode_state_t *state = simplefs_inodeState(inode_number);
+	pthread_rwlock_rdlock(&freeze_lock);
+	if (simplefs_flushPending(inode_number)) {
+		pthread_rwlock_wrlock(simplefs_inodeLock(inode_number));
+		simplefs_flushTail(inode_number, &state->inode);
+		simplefs_repackPending(inode_number, &state->inode);
+		pthread_rwlock_unlock(simplefs_inodeLock(inode_number));
+	}
+	pthread_rwlock_unlock(&freeze_lock);
 
-	int inode_number = file_handle_array[file_handle].inode_number;
-	int offset = file_handle_array[file_handle].offset;
+	if (simplefs_handleClose(file_handle) != -1)
+		simplefs_inodeUnpin(inode_number);
+}
 
-	if (inode_number == -1)
+int simplefs_read(int file_handle, char *buf, int64_t nbytes) {
+	if (nbytes < 0)
 		return -1;
-
-	simplefs_readInode(inode_number, &inode);
-	if (offset + nbytes > inode.file_size)
+	struct filehandle_t *handle = simplefs_handleLock(file_handle);
+	if (!handle)
 		return -1;
 
-	int bytes_read = 0;
-	int current_offset = offset;
+	int inode_number = handle->inode_number;
+	int64_t offset = handle->offset;
 
-	while (bytes_read < nbytes) {
-		int block_index = current_offset / BLOCKSIZE;
-		int block_offset = current_offset % BLOCKSIZE;
-		int block_num = inode.direct_blocks[block_index];
+	struct inode_t *inode = &simplefs_inodeState(inode_number)->inode;
+	pthread_rwlock_rdlock(simplefs_inodeLock(inode_number));
+	if (offset + nbytes > simplefs_fileSize(inode_number)) {
+		pthread_rwlock_unlock(simplefs_inodeLock(inode_number));
+		simplefs_handleUnlock(handle);
+		return -1;
+	}
 
-		if (block_num == -1)
-			return -1;
+	uint32_t bs = simplefs_layout.block_size;
+	int64_t bytes_read = 0;
+	int64_t current_offset = offset;
+	struct delayed_tail_t *tail = &simplefs_inodeState(inode_number)->tail;
+	int status = 0;
 
-		char temp_block[BLOCKSIZE];
-		simplefs_readDataBlock(block_num, temp_block);
+	while (bytes_read < nbytes && status == 0) {
+		int64_t block_index = current_offset / bs;
+		int block_offset = current_offset % bs;
+		if (tail->data && block_index >= tail->first) {
+			// The rest of the file has no blocks yet
+			memcpy(buf + bytes_read, tail->data + (current_offset - tail->first * bs), nbytes - bytes_read);
+			break;
+		}
+		int block_num = simplefs_lookupBlock(handle, inode, block_index);
+		if (block_num == MAP_CORRUPT) {
+			status = -1;
+			break;
+		}
 
-		int bytes_to_copy = BLOCKSIZE - block_offset;
+		int64_t bytes_to_copy = bs - block_offset;
 		if (bytes_to_copy > (nbytes - bytes_read))
 			bytes_to_copy = nbytes - bytes_read;
 
-		memcpy(buf + bytes_read, temp_block + block_offset, bytes_to_copy);
+		if (block_num == -1) {
+			// A hole reads as zeros without touching the disk
+			memset(buf + bytes_read, 0, bytes_to_copy);
+		} else if (bytes_to_copy == bs) {
+			// Whole blocks that are also neighbours on disk are read with one call
+			int64_t run = 1;
+			while ((run + 1) * bs <= nbytes - bytes_read && run < INT_MAX
+			       && simplefs_lookupBlock(handle, inode, block_index + run) == block_num + run)
+				run++;
+			if (run == 1) {
+				status = simplefs_readDataBlock(block_num, buf + bytes_read);
+			} else {
+				struct iovec iov = {buf + bytes_read, run * bs};
+				status = simplefs_readDataRun(block_num, run, &iov, 1);
+			}
+			bytes_to_copy = run * bs;
+		} else {
+			char *temp_block = malloc(bs);
+			assert(temp_block);
+			status = simplefs_readDataBlock(block_num, temp_block);
+			memcpy(buf + bytes_read, temp_block + block_offset, bytes_to_copy);
+			free(temp_block);
+		}
 		bytes_read += bytes_to_copy;
 		current_offset += bytes_to_copy;
 	}
+	if (nbytes > 0 && status == 0)
+		simplefs_readahead(handle, inode, offset / bs, (offset + nbytes - 1) / bs);
 
-	//file_handle_array[file_handle].offset = current_offset;
+	pthread_rwlock_unlock(simplefs_inodeLock(inode_number));
+	simplefs_handleUnlock(handle);
+	//handle->offset = current_offset;
+	if (status < 0) {
+		// A block, or the block map, did not match its checksum, what `buf`
+		// holds is not the file
+		errno = EIO;
+		return -1;
+	}
 	return 0;
 }
 
-int simplefs_write(int file_handle, char *buf, int nbytes) {
-	if (file_handle < 0 || file_handle >= MAX_OPEN_FILES || nbytes < 0)
+static void simplefs_undoWrite(int inode_number, struct inode_t *inode, struct alloc_log_t *log, int64_t chunk, int credits, int64_t old_size) {
+	/*
+		Give back what a failed write allocated, inside its open handle.
+		Handles of a split write may already have committed a longer file, so
+		the undo is split the same way and the inode rewritten after each part
+	*/
+	simplefs_undoAllocations(inode, inode_number, log, chunk);
+	if (simplefs_journaling()) {
+		inode->file_size = old_size;
+		simplefs_writeInode(inode_number, inode);
+		while (log->count > 0) {
+			simplefs_journalStop(credits);
+			simplefs_journalStart(credits);
+			simplefs_undoAllocations(inode, inode_number, log, chunk);
+			simplefs_writeInode(inode_number, inode);
+		}
+	}
+}
+
+static int simplefs_packCluster(int inode_number, struct inode_t *inode, int64_t lfirst) {
+	/*
+		Store the cluster of logical blocks from `lfirst` compressed, when
+		every one of them is mapped to a block no snapshot shares and
+		compressing saves a block. Its runs give way to a single extent for
+		the compressed cluster and their blocks are freed. Anything that does
+		not work out leaves the file as it was. -1 with errno EIO when a block
+		of the cluster fails its checksum
+	*/
+	uint32_t bs = simplefs_layout.block_size;
+	int64_t cluster = simplefs_layout.cluster_blocks;
+	int n = inode->num_extents;
+	// The extent lists grow with the block size, so they are kept off the stack
+	struct extent_t *old = malloc((n > 0 ? n : 1) * sizeof(struct extent_t));
+	struct extent_t *list = malloc((INODE_INLINE_EXTENTS + EXTENTS_PER_BLOCK) * sizeof(struct extent_t));
+	struct free_list_t plain = {0, 0, NULL};
+	char *data = calloc(2, cluster * bs);
+	assert(old && list && data);
+	char *packed = data + cluster * bs;
+	int64_t pos = 0;
+	int64_t covered = 0;
+	int ret = 0;
+	for (int i = 0; i < n && ret == 0; i++) {
+		if (simplefs_getExtent(inode, i, &old[i]) < 0) {
+			errno = EIO;
+			ret = -1;
+			break;
+		}
+		int64_t lo = lfirst > pos ? lfirst : pos;
+		int64_t hi = lfirst + cluster < pos + old[i].length ? lfirst + cluster : pos + old[i].length;
+		int shared = 1;
+		if (lo < hi && old[i].start >= 0 && simplefs_sharedRun(old[i].start + lo - pos, hi - lo, &shared) == hi - lo && !shared) {
+			struct iovec iov = {data + (lo - lfirst) * bs, (hi - lo) * bs};
+			if (simplefs_readDataRun(old[i].start + lo - pos, hi - lo, &iov, 1) < 0) {
+				errno = EIO;
+				ret = -1;
+			}
+			simplefs_collectRun(&plain, old[i].start + lo - pos, hi - lo);
+			covered += hi - lo;
+		}
+		pos += old[i].length;
+	}
+	int blocks = ret == 0 && covered == cluster ? simplefs_packBlocks(data, cluster, packed) : -1;
+	int start = -1;
+	if (blocks != -1) {
+		int got = simplefs_allocDataRun(-1, blocks, &start);
+		if (got < blocks) {
+			if (got > 0)
+				simplefs_freeDataRun(start, got);
+			start = -1;
+		}
+	}
+
+	int count = 0;
+	pos = 0;
+	for (int i = 0; i < n && start != -1; i++) {
+		int64_t lo = lfirst > pos ? lfirst : pos;
+		int64_t hi = lfirst + cluster < pos + old[i].length ? lfirst + cluster : pos + old[i].length;
+		struct extent_t head = {old[i].start, lo < hi ? lo - pos : old[i].length};
+		struct extent_t packed_run = {EXTENT_PACKED(start), lo == lfirst && lo < hi ? cluster : 0};
+		struct extent_t tail = {old[i].start + hi - pos, lo < hi ? pos + old[i].length - hi : 0};
+		if (simplefs_pushExtent(list, &count, head) < 0 || simplefs_pushExtent(list, &count, packed_run) < 0
+		    || simplefs_pushExtent(list, &count, tail) < 0) {
+			simplefs_freeDataRun(start, blocks);
+			start = -1;
+		}
+		pos += old[i].length;
+	}
+	struct alloc_log_t log = {0, 0, NULL, 0, NULL, 0, {0, 0}};
+	if (start != -1 && simplefs_reserveExtents(inode, count, &log) < 0) {
+		simplefs_freeDataRun(start, blocks);
+		start = -1;
+	}
+	if (start != -1) {
+		simplefs_writePacked(start, blocks, packed);
+		for (int i = 0; i < count; i++)
+			simplefs_setExtent(inode, i, &list[i]);
+		inode->num_extents = count;
+		simplefs_inodeState(inode_number)->map_generation++;
+		for (int i = 0; i < plain.count; i++)
+			simplefs_discardDataRun(plain.runs[i].start, plain.runs[i].length);
+		simplefs_freeDataExtents(plain.runs, plain.count);
+	}
+	free(log.entries);
+	free(plain.runs);
+	free(data);
+	free(list);
+	free(old);
+	return ret;
+}
+
+static int64_t simplefs_patchPacked(struct inode_t *inode, const char *buf, int64_t offset, int64_t nbytes) {
+	/*
+		Write the leading part of `nbytes` at `offset` that falls in one
+		compressed cluster into that cluster, compressed again in the blocks
+		it already takes. Returns the bytes written, 0 when `offset` is not in
+		a whole cluster only this file references or the cluster no longer
+		fits, and the write has to expand it
+	*/
+	uint32_t bs = simplefs_layout.block_size;
+	int64_t cluster = simplefs_layout.cluster_blocks;
+	struct extent_cursor_t cursor = {-1, 0, {0, 0}, 0};
+	if (simplefs_extentLookup(&cursor, inode, 0, offset / bs) < 0 || cursor.extent.start >= EXTENT_HOLE
+	    || cursor.extent.length != cluster)
+		return 0;
+	int64_t begin = cursor.first * bs;
+	int64_t end = begin + cluster * bs;
+	int64_t n = offset + nbytes < end ? nbytes : end - offset;
+	if (offset + n > inode->file_size)
+		return 0;
+	int pblock = EXTENT_PACKED(cursor.extent.start);
+	int blocks = simplefs_packedBlocks(pblock);
+	int shared;
+	if (blocks < 0 || simplefs_sharedRun(pblock, blocks, &shared) < blocks || shared)
+		return 0;
+	char *data = malloc(2 * cluster * bs);
+	assert(data);
+	// A cluster the write replaces whole need not be expanded first
+	struct iovec iov = {data, cluster * bs};
+	if ((offset > begin || n < end - begin) && simplefs_readDataRun(simplefs_packedBlock(pblock, 0), cluster, &iov, 1) < 0) {
+		free(data);
+		return 0;
+	}
+	memcpy(data + (offset - begin), buf, n);
+	int spare = simplefs_rewritePacked(pblock, data, data + cluster * bs);
+	if (spare > 0)
+		simplefs_freeDataRun(pblock + blocks - spare, spare);
+	free(data);
+	return spare < 0 ? 0 : n;
+}
+
+static void simplefs_flushDelayed();
+
+static int simplefs_queueRepack(int inode_number, int64_t lfirst, int queue) {
+	/*
+		Leave the cluster from `lfirst` to be compressed again when the file
+		is closed or synced, or with `queue` 0 take it off the list as it is
+		compressed now. -1 when the file already has REPACK_MAX waiting
+	*/
+	struct inode_state_t *state = simplefs_inodeState(inode_number);
+	for (int i = 0; i < state->repack_count; i++) {
+		if (state->repack[i] == lfirst) {
+			if (!queue)
+				state->repack[i] = state->repack[--state->repack_count];
+			return 0;
+		}
+	}
+	if (!queue)
+		return 0;
+	if (state->repack_count == REPACK_MAX)
 		return -1;
+	if (state->repack_count == state->repack_capacity) {
+		state->repack_capacity = state->repack_capacity ? 2 * state->repack_capacity : 8;
+		state->repack = realloc(state->repack, state->repack_capacity * sizeof(int64_t));
+		assert(state->repack);
+	}
+	state->repack[state->repack_count++] = lfirst;
+	simplefs_setFlushHook(simplefs_flushDelayed);
+	return 0;
+}
+
+static void simplefs_repackPending(int inode_number, struct inode_t *inode) {
+	/*
+		Compress the clusters writes left expanded, those still whole in the
+		file, each under a handle of its own. The caller holds the inode's
+		write lock
+	*/
+	struct inode_state_t *state = simplefs_inodeState(inode_number);
+	int64_t cluster = simplefs_layout.cluster_blocks;
+	int credits;
+	simplefs_journalWriteChunk(&credits);
+	for (int i = 0; i < state->repack_count && (!simplefs_journaling() || credits >= cluster + 8); i++) {
+		if ((state->repack[i] + cluster) * simplefs_layout.block_size > inode->file_size)
+			continue;
+		simplefs_journalStart(credits);
+		simplefs_packCluster(inode_number, inode, state->repack[i]);
+		int stored = simplefs_writeInode(inode_number, inode);
+		simplefs_journalStop(credits);
+		// The inode stays dirty in core, the rest are not compressed over it
+		if (stored < 0)
+			break;
+	}
+	simplefs_dropRepack(inode_number);
+}
+
+static int simplefs_zeroTail(int inode_number, struct inode_t *inode, int64_t end);
 
-	int inode_number = file_handle_array[file_handle].inode_number;
-	int offset = file_handle_array[file_handle].offset;
+static int simplefs_writeBlocks(int inode_number, struct inode_t *inode, const char *buf, int64_t offset, int64_t nbytes, int *reserved) {
+	/*
+		Write `nbytes` at `offset` through the block map, allocating what is
+		missing, then the inode. The first `*reserved` blocks come out of a
+		delayed allocation's reservation and what is left of it is returned in
+		`*reserved`. A write that runs out of space, or whose inode's table
+		block fails its checksum, is undone
+	*/
+	uint32_t bs = simplefs_layout.block_size;
 
-	if (inode_number == -1 || (offset + nbytes) > (BLOCKSIZE * MAX_FILE_SIZE))
+	// A write past the file's last block grows it over that block's tail,
+	// which is zeroed first. One into the block zeroes it below
+	if (offset >= (inode->file_size / bs + 1) * bs && simplefs_zeroTail(inode_number, inode, offset) < 0)
 		return -1;
 
-	simplefs_readInode(inode_number, &inode);
+	// On a journaled disk a long write is split into handles. Each ends with
+	// the inode written, so every transaction maps exactly the blocks it allocated
+	int credits;
+	int64_t chunk = simplefs_journalWriteChunk(&credits);
+	int64_t chunk_blocks = 0;
+	int64_t old_size = inode->file_size;
+	simplefs_journalStart(credits);
+
+	// Leading bytes in compressed clusters go straight back into them while
+	// they fit, when the write runs to the end of the cluster or the file
+	// cannot leave another one expanded
+	int64_t cluster = simplefs_layout.cluster_blocks;
+	while (simplefs_compressing() && nbytes > 0) {
+		int64_t end = (offset / bs / cluster + 1) * cluster * bs;
+		if (offset + nbytes < end && simplefs_inodeState(inode_number)->repack_count < REPACK_MAX)
+			break;
+		int64_t done = simplefs_patchPacked(inode, buf, offset, nbytes);
+		if (done == 0)
+			break;
+		buf += done;
+		offset += done;
+		nbytes -= done;
+		simplefs_journalStop(credits);
+		simplefs_journalStart(credits);
+	}
+
+	int64_t bytes_written = 0;
+	int64_t current_offset = offset;
+	struct write_map_t map = {inode, inode_number, {0, 0, NULL, *reserved, NULL, 0, {0, 0}}, {-1, 0, {0, 0}, 0}, 0, 0, {-1, -1}, 1, {-1, -1}};
 
-	int bytes_written = 0;
-	int current_offset = offset;
-	int newly_allocated[MAX_FILE_SIZE] = {0};
+	if (simplefs_writeMapBegin(&map, offset, nbytes) < 0)
+		goto fail;
 
 	while (bytes_written < nbytes) {
-		int block_index = current_offset / BLOCKSIZE;
-		int block_offset = current_offset % BLOCKSIZE;
+		if (chunk_blocks >= chunk) {
+			if (current_offset > inode->file_size)
+				inode->file_size = current_offset;
+			if (simplefs_writeInode(inode_number, inode) < 0)
+				goto fail;
+			simplefs_journalStop(credits);
+			simplefs_journalStart(credits);
+			chunk_blocks = 0;
+		}
+		int64_t block_index = current_offset / bs;
+		int block_offset = current_offset % bs;
 
 		// Allocate block if not already allocated
-		if (inode.direct_blocks[block_index] == -1) {
-			int new_block = simplefs_allocDataBlock();
-			if (new_block == -1) {
-				for (int i = 0; i < MAX_FILE_SIZE; i++) {
-					if (newly_allocated[i]) {
-						simplefs_freeDataBlock(inode.direct_blocks[i]);
-						inode.direct_blocks[i] = -1;
-					}
-				}
-				return -1;
+		int is_new;
+		int block_num = simplefs_writeMapBlock(&map, block_index, &is_new);
+		if (block_num == -1)
+			goto fail;
+
+		int64_t space = bs - block_offset;
+		int64_t to_copy = (nbytes - bytes_written < space) ? (nbytes - bytes_written) : space;
+
+		if (to_copy == bs) {
+			// The whole block is replaced, nothing of the old contents survives.
+			// Following whole blocks that are neighbours on disk go out with it
+			int64_t run = 1;
+			while ((run + 1) * bs <= nbytes - bytes_written && run < INT_MAX && chunk_blocks + run < chunk) {
+				int next = simplefs_writeMapBlock(&map, block_index + run, &is_new);
+				if (next == -1)
+					goto fail;
+				if (next != block_num + run)
+					break;
+				run++;
+			}
+			if (run == 1) {
+				simplefs_writeDataBlock(block_num, (char *)buf + bytes_written);
+			} else {
+				struct iovec iov = {(char *)buf + bytes_written, run * bs};
+				simplefs_writeDataRun(block_num, run, &iov, 1);
+			}
+			to_copy = run * bs;
+			chunk_blocks += run;
+		} else {
+			// A new block starts out as zeros, an existing one is patched
+			char *temp_block = malloc(bs);
+			assert(temp_block);
+			if (is_new) {
+				memset(temp_block, 0, bs);
+			} else if (simplefs_readDataBlock(block_num, temp_block) < 0) {
+				// A block failing its checksum is not patched and stored under a new one
+				free(temp_block);
+				errno = EIO;
+				goto fail;
 			}
+			// What lies past the old end may be left from a write a crash undid
+			if (block_index == old_size / bs && !is_new)
+				memset(temp_block + old_size % bs, 0, bs - old_size % bs);
+			memcpy(temp_block + block_offset, buf + bytes_written, to_copy);
+			simplefs_writeDataBlock(block_num, temp_block);
+			free(temp_block);
+			chunk_blocks++;
+		}
+
+		bytes_written += to_copy;
+		current_offset += to_copy;
+	}
 
-			inode.direct_blocks[block_index] = new_block;
-			newly_allocated[block_index] = 1;
+	if (offset + nbytes > inode->file_size)
+		inode->file_size = offset + nbytes;
 
-			// Initialize the new block to zeros
-			char zero_block[BLOCKSIZE];
-			memset(zero_block, 0, BLOCKSIZE);
-			simplefs_writeDataBlock(new_block, zero_block);
+	// A cluster the write ran to the end of is compressed now, under a handle
+	// of its own. One it ended inside is left for close or sync, so a run of
+	// small writes through it is compressed once. The write stands when a
+	// block of the cluster fails its checksum, but it reports EIO. Once a
+	// cluster is compressed the write is not undone either
+	int ret = 0, packed = 0;
+	for (int64_t lblock = offset / bs / (cluster ? cluster : 1) * cluster;
+	     simplefs_compressing() && nbytes > 0 && lblock <= (offset + nbytes - 1) / bs
+	     && (lblock + cluster) * bs <= inode->file_size && (!simplefs_journaling() || credits >= cluster + 8);
+	     lblock += cluster) {
+		if (offset + nbytes < (lblock + cluster) * bs && simplefs_queueRepack(inode_number, lblock, 1) == 0)
+			continue;
+		simplefs_queueRepack(inode_number, lblock, 0);
+		if (simplefs_writeInode(inode_number, inode) < 0) {
+			if (!packed)
+				goto fail;
+			ret = -1;
+			break;
 		}
+		simplefs_journalStop(credits);
+		simplefs_journalStart(credits);
+		if (simplefs_packCluster(inode_number, inode, lblock) < 0)
+			ret = -1;
+		packed = 1;
+	}
+	if (simplefs_inodeDirty(inode_number) < 0) {
+		if (!packed)
+			goto fail;
+		ret = -1;
+	}
 
-		int block_num = inode.direct_blocks[block_index];
-		char temp_block[BLOCKSIZE];
-		simplefs_readDataBlock(block_num, temp_block);
+	free(map.log.entries);
+	free(map.log.saved);
+	*reserved = map.log.reserved;
+	simplefs_journalStop(credits);
+	return ret;
 
-		int space = BLOCKSIZE - block_offset;
-		int to_copy = (nbytes - bytes_written < space) ? (nbytes - bytes_written) : space;
+fail:
+	simplefs_undoWrite(inode_number, inode, &map.log, chunk, credits, old_size);
+	free(map.log.entries);
+	free(map.log.saved);
+	*reserved = map.log.reserved;
+	simplefs_journalStop(credits);
+	return -1;
+}
 
-		memcpy(temp_block + block_offset, buf + bytes_written, to_copy);
-		simplefs_writeDataBlock(block_num, temp_block);
+static int simplefs_zeroTail(int inode_number, struct inode_t *inode, int64_t end) {
+	/*
+		Zero the file's last block from its end up to `end` or the end of the
+		block, before the file grows. Bytes there are past the end, but a write
+		a crash undid may have left them behind, and growing would expose them.
+		A tail that already reads as zeros is left alone
+	*/
+	uint32_t bs = simplefs_layout.block_size;
+	int64_t size = inode->file_size;
+	int64_t block_end = (size / bs + 1) * bs;
+	if (size % bs == 0 || end <= size)
+		return 0;
+	int pblock = simplefs_mappedBlock(inode, size / bs);
+	if (pblock == -1)
+		return 0;
+	int64_t len = (end < block_end ? end : block_end) - size;
+	char *block = malloc(bs);
+	assert(block);
+	if (pblock == MAP_CORRUPT || simplefs_readDataBlock(pblock, block) < 0) {
+		free(block);
+		errno = EIO;
+		return -1;
+	}
+	int64_t i = size % bs;
+	while (i < size % bs + len && block[i] == 0)
+		i++;
+	int ret = 0;
+	if (i < size % bs + len) {
+		int none = 0;
+		memset(block, 0, len);
+		ret = simplefs_writeBlocks(inode_number, inode, block, size, len, &none);
+	}
+	free(block);
+	return ret;
+}
 
-		bytes_written += to_copy;
-		current_offset += to_copy;
+static int simplefs_tailReservation(int64_t blocks) {
+	/*
+		Blocks to reserve for a delayed tail of `blocks` blocks: the data
+		blocks and every pointer or extent block that may be needed to map them
+	*/
+	if (simplefs_usesExtents())
+		return blocks + 1;
+	return blocks + blocks / PTRS_PER_BLOCK + 3;
+}
+
+static int simplefs_flushTail(int inode_number, struct inode_t *inode) {
+	/*
+		Give the delayed tail of a file its blocks. The tail goes out as one
+		write, so its blocks are chosen together once its size is known
+	*/
+	struct delayed_tail_t *tail = &simplefs_inodeState(inode_number)->tail;
+	if (!tail->data)
+		return 0;
+	int64_t start = tail->first * simplefs_layout.block_size;
+	int reserved = tail->reserved;
+	int ret = tail->size > start ? simplefs_writeBlocks(inode_number, inode, tail->data, start, tail->size - start, &reserved) : 0;
+	if (ret < 0 && inode->file_size < tail->size) {
+		// The undone write gave back the blocks it took, promise them again
+		if (simplefs_reserveDataBlocks(tail->reserved - reserved) == 0)
+			reserved = tail->reserved;
+		tail->reserved = reserved;
+		return -1;
+	}
+	// A write that stood but could not compress a cluster still reports it
+	simplefs_unreserveDataBlocks(reserved);
+	free(tail->data);
+	memset(tail, 0, sizeof(*tail));
+	return ret;
+}
+
+static int simplefs_delayWrite(int inode_number, struct inode_t *inode, const char *buf, int64_t offset, int64_t nbytes) {
+	/*
+		Keep the part of a write past the file's mapped blocks in memory and
+		only reserve blocks for it. Returns 1 when the write has to go through
+		the block map instead, with any tail flushed first so the block map
+		covers the whole file
+	*/
+	uint32_t bs = simplefs_layout.block_size;
+	struct delayed_tail_t *tail = &simplefs_inodeState(inode_number)->tail;
+
+	// Only the block map can hold the hole a write past the end leaves
+	if (offset > (tail->data ? tail->size : inode->file_size))
+		return tail->data && simplefs_flushTail(inode_number, inode) < 0 ? -1 : 1;
+	if (!tail->data) {
+		tail->first = (inode->file_size + bs - 1) / bs;
+		tail->size = inode->file_size;
+	}
+	int64_t start = tail->first * bs;
+	int64_t end = offset + nbytes;
+	if (end <= start)
+		return 1;
+	int64_t size = end > tail->size ? end : tail->size;
+	if (size - start > DELAYED_MAX_BYTES)
+		return simplefs_flushTail(inode_number, inode) < 0 ? -1 : 1;
+	int need = simplefs_tailReservation((size - start + bs - 1) / bs) - tail->reserved;
+	if (need > 0) {
+		if (simplefs_reserveDataBlocks(need) < 0)
+			return simplefs_flushTail(inode_number, inode) < 0 ? -1 : 1;
+		tail->reserved += need;
+	}
+	if (size - start > tail->capacity) {
+		int64_t capacity = tail->capacity ? tail->capacity : bs;
+		while (capacity < size - start)
+			capacity *= 2;
+		tail->data = realloc(tail->data, capacity);
+		assert(tail->data);
+		tail->capacity = capacity;
+	}
+
+	// Bytes before the tail land in the file's last mapped block
+	if (offset < start) {
+		int none = 0;
+		if (simplefs_writeBlocks(inode_number, inode, buf, offset, start - offset, &none) < 0)
+			return -1;
+		buf += start - offset;
+		nbytes -= start - offset;
+		offset = start;
+	}
+	memcpy(tail->data + (offset - start), buf, nbytes);
+	tail->size = size;
+	return 0;
+}
+
+static void simplefs_flushDelayed() {
+	/*
+		Flush every delayed tail and compress the clusters writes left
+		expanded, run before each sync
+	*/
+	for (uint32_t i = 0; i < simplefs_layout.num_inodes; i++) {
+		pthread_rwlock_rdlock(&freeze_lock);
+		if (!simplefs_flushPending(i)) {
+			pthread_rwlock_unlock(&freeze_lock);
+			continue;
+		}
+		struct inode_t *inode = simplefs_inodePin(i);
+		if (!inode) {
+			pthread_rwlock_unlock(&freeze_lock);
+			continue;
+		}
+		pthread_rwlock_wrlock(simplefs_inodeLock(i));
+		simplefs_flushTail(i, inode);
+		simplefs_repackPending(i, inode);
+		pthread_rwlock_unlock(simplefs_inodeLock(i));
+		pthread_rwlock_unlock(&freeze_lock);
+		simplefs_inodeUnpin(i);
+	}
+}
+
+void simplefs_setDelayedAllocation(int enable) {
+	/*
+		With delayed allocation on, data written past a file's mapped blocks
+		stays in memory until the file is closed or synced, and only then gets
+		its blocks, all at once and so in as few runs as possible
+	*/
+	if (!enable && delayed_allocation)
+		simplefs_flushDelayed();
+	delayed_allocation = enable;
+	simplefs_setFlushHook(enable || simplefs_compressing() ? simplefs_flushDelayed : NULL);
+}
+
+int simplefs_write(int file_handle, char *buf, int64_t nbytes) {
+	if (nbytes < 0 || simplefs_readOnly())
+		return -1;
+	// A write only needs the handle's offset, the file has a lock of its own
+	struct filehandle_t *handle = simplefs_handleLock(file_handle);
+	if (!handle)
+		return -1;
+	int inode_number = handle->inode_number;
+	int64_t offset = handle->offset;
+	simplefs_handleUnlock(handle);
+
+	uint32_t bs = simplefs_layout.block_size;
+	if ((offset + nbytes) > (int64_t)bs * simplefs_maxFileBlocks())
+		return -1;
+
+	struct inode_t *inode = &simplefs_inodeState(inode_number)->inode;
+	pthread_rwlock_rdlock(&freeze_lock);
+	pthread_rwlock_wrlock(simplefs_inodeLock(inode_number));
+	int ret = delayed_allocation && nbytes > 0 ? simplefs_delayWrite(inode_number, inode, buf, offset, nbytes) : 1;
+	if (ret == 1) {
+		int reserved = 0;
+		ret = simplefs_writeBlocks(inode_number, inode, buf, offset, nbytes, &reserved);
 	}
+	pthread_rwlock_unlock(simplefs_inodeLock(inode_number));
+	pthread_rwlock_unlock(&freeze_lock);
+	return ret;
+}
+
+int simplefs_seek(int file_handle, int64_t nseek) {
+	struct filehandle_t *handle = simplefs_handleLock(file_handle);
+	if (!handle)
+		return -1;
+
+	// Seeking past the end is allowed, a write there leaves a hole
+	int64_t current_offset = handle->offset;
+	int64_t new_offset = current_offset + nseek;
 
-	if (offset + nbytes > inode.file_size)
-		inode.file_size = offset + nbytes;
+	if (new_offset < 0 || new_offset > (int64_t)simplefs_layout.block_size * simplefs_maxFileBlocks()) {
+		simplefs_handleUnlock(handle);
+		return -1;
+	}
 
-	//file_handle_array[file_handle].offset = current_offset;
-	simplefs_writeInode(inode_number, &inode);
+	handle->offset = new_offset;
+	simplefs_handleUnlock(handle);
 	return 0;
 }
 
-int simplefs_seek(int file_handle, int nseek) {
-	if (file_handle < 0 || file_handle >= MAX_OPEN_FILES)
+static int64_t simplefs_nextMapped(struct filehandle_t *handle, struct inode_t *inode, int64_t lblock, int64_t end, int data) {
+	/*
+		First logical block in [`lblock`, `end`) that is mapped when `data`
+		is set, or a hole when it is not, `end` if there is none. Extents and
+		missing pointer blocks are stepped over whole. -1 with errno EIO when
+		the block map fails its checksum
+	*/
+	if (simplefs_usesExtents()) {
+		int64_t first = 0;
+		for (int i = 0; i < inode->num_extents && lblock < end; i++) {
+			struct extent_t extent;
+			if (simplefs_getExtent(inode, i, &extent) < 0) {
+				errno = EIO;
+				return -1;
+			}
+			if (lblock < first + extent.length && (extent.start != EXTENT_HOLE) == data)
+				return lblock;
+			first += extent.length;
+			if (lblock < first)
+				lblock = first;
+		}
+		return data || lblock > end ? end : lblock;
+	}
+	for (; lblock < end; lblock++) {
+		if (lblock >= MAX_FILE_SIZE) {
+			int64_t leaf_first;
+			int leaf = simplefs_leafPointerBlock(inode, lblock, &leaf_first, NULL);
+			if (leaf == MAP_CORRUPT)
+				break;
+			if (leaf == -1) {
+				if (!data)
+					return lblock;
+				lblock = leaf_first + PTRS_PER_BLOCK - 1;
+				continue;
+			}
+		}
+		int pblock = simplefs_lookupBlock(handle, inode, lblock);
+		if (pblock == MAP_CORRUPT)
+			break;
+		if ((pblock != -1) == data)
+			return lblock;
+	}
+	if (lblock < end) {
+		errno = EIO;
+		return -1;
+	}
+	return end;
+}
+
+int64_t simplefs_seekData(int file_handle, int64_t offset, int whence) {
+	/*
+		Move to the first offset from `offset` on that holds data
+		(SIMPLEFS_SEEK_DATA) or lies in a hole (SIMPLEFS_SEEK_HOLE), and return
+		it. The end of the file counts as a hole. -1 if `offset` is not inside
+		the file, or when looking for data past the last of it, or with errno
+		EIO when the block map fails its checksum
+	*/
+	if (whence != SIMPLEFS_SEEK_DATA && whence != SIMPLEFS_SEEK_HOLE)
+		return -1;
+	struct filehandle_t *handle = simplefs_handleLock(file_handle);
+	if (!handle)
+		return -1;
+
+	int inode_number = handle->inode_number;
+	struct inode_t *inode = &simplefs_inodeState(inode_number)->inode;
+	uint32_t bs = simplefs_layout.block_size;
+	pthread_rwlock_rdlock(simplefs_inodeLock(inode_number));
+	int64_t size = simplefs_fileSize(inode_number);
+	if (offset < 0 || offset >= size) {
+		pthread_rwlock_unlock(simplefs_inodeLock(inode_number));
+		simplefs_handleUnlock(handle);
+		return -1;
+	}
+
+	// A delayed tail is data that has no blocks yet
+	struct delayed_tail_t *tail = &simplefs_inodeState(inode_number)->tail;
+	int64_t end = (size + bs - 1) / bs;
+	int64_t mapped_end = tail->data && tail->first < end ? tail->first : end;
+	int64_t lblock = simplefs_nextMapped(handle, inode, offset / bs, mapped_end, whence == SIMPLEFS_SEEK_DATA);
+	pthread_rwlock_unlock(simplefs_inodeLock(inode_number));
+	if (lblock < 0) {
+		simplefs_handleUnlock(handle);
+		return -1;
+	}
+
+	int64_t found;
+	if (lblock < mapped_end)
+		found = lblock * bs;
+	else if (whence == SIMPLEFS_SEEK_DATA)
+		found = mapped_end < end ? mapped_end * bs : -1;
+	else
+		found = size;
+	if (found != -1) {
+		if (found < offset)
+			found = offset;
+		handle->offset = found;
+	}
+	simplefs_handleUnlock(handle);
+	return found;
+}
+
+int simplefs_truncate(int file_handle, int64_t size) {
+	/*
+		Set the size of an open file to `size`. Blocks past the new end go
+		back to the free map together, and the bytes past it in its last block
+		are zeroed so the file can grow again over zeros. Growing zeroes the
+		old last block's tail and leaves a hole past it. -1 if `size` is out of range, or if the last block is shared
+		with a snapshot or compressed and no block is left for its copy
+	*/
+	uint32_t bs = simplefs_layout.block_size;
+	if (size < 0 || size > (int64_t)bs * simplefs_maxFileBlocks() || simplefs_readOnly())
+		return -1;
+	struct filehandle_t *handle = simplefs_handleLock(file_handle);
+	if (!handle)
+		return -1;
+
+	int inode_number = handle->inode_number;
+	struct inode_state_t *state = simplefs_inodeState(inode_number);
+	struct inode_t *inode = &state->inode;
+	pthread_rwlock_rdlock(&freeze_lock);
+	pthread_rwlock_wrlock(simplefs_inodeLock(inode_number));
+
+	// A delayed tail is cut in memory, or given its blocks when the file grows past it
+	struct delayed_tail_t *tail = &state->tail;
+	if (tail->data) {
+		if (size <= tail->first * bs) {
+			simplefs_dropTail(inode_number);
+		} else if (size <= tail->size) {
+			tail->size = size;
+			pthread_rwlock_unlock(simplefs_inodeLock(inode_number));
+			pthread_rwlock_unlock(&freeze_lock);
+			simplefs_handleUnlock(handle);
+			return 0;
+		} else if (simplefs_flushTail(inode_number, inode) < 0) {
+			pthread_rwlock_unlock(simplefs_inodeLock(inode_number));
+			pthread_rwlock_unlock(&freeze_lock);
+			simplefs_handleUnlock(handle);
+			return -1;
+		}
+	}
+
+	// A block map failing its checksum is left as it is, and so is the file
+	int pblock = size < inode->file_size && size % bs ? simplefs_lookupBlock(handle, inode, size / bs) : -1;
+	if (pblock == MAP_CORRUPT || (size < inode->file_size && simplefs_checkBlockMap(inode, (size + bs - 1) / bs) < 0)) {
+		pthread_rwlock_unlock(simplefs_inodeLock(inode_number));
+		pthread_rwlock_unlock(&freeze_lock);
+		simplefs_handleUnlock(handle);
+		errno = EIO;
+		return -1;
+	}
+	if (pblock != -1 && (simplefs_dataPacked(pblock) || simplefs_dataShared(pblock))) {
+		// A snapshot keeps the last block as it is, its tail is zeroed in a
+		// copy. A compressed one is zeroed in place, or expanded by the write
+		// doing that when it no longer fits
+		char *zero = calloc(1, bs);
+		assert(zero);
+		int64_t len = inode->file_size - size < bs - size % bs ? inode->file_size - size : bs - size % bs;
+		int none = 0;
+		simplefs_journalStart(JOURNAL_NAMESPACE_CREDITS);
+		int64_t done = simplefs_dataPacked(pblock) ? simplefs_patchPacked(inode, zero, size, len) : 0;
+		simplefs_journalStop(JOURNAL_NAMESPACE_CREDITS);
+		int ret = done == len ? 0 : simplefs_writeBlocks(inode_number, inode, zero, size, len, &none);
+		free(zero);
+		if (ret < 0) {
+			pthread_rwlock_unlock(simplefs_inodeLock(inode_number));
+			pthread_rwlock_unlock(&freeze_lock);
+			simplefs_handleUnlock(handle);
+			return -1;
+		}
+		pblock = -1;
+	}
+	if (size > inode->file_size && simplefs_zeroTail(inode_number, inode, size) < 0) {
+		pthread_rwlock_unlock(simplefs_inodeLock(inode_number));
+		pthread_rwlock_unlock(&freeze_lock);
+		simplefs_handleUnlock(handle);
+		return -1;
+	}
+
+	simplefs_journalStart(JOURNAL_NAMESPACE_CREDITS);
+	// Freed blocks cannot be taken back, so the inode is stored unchanged
+	// first and a table block failing its checksum leaves the file as it is
+	if (size < inode->file_size && simplefs_journaling() && simplefs_writeInode(inode_number, inode) < 0) {
+		simplefs_journalStop(JOURNAL_NAMESPACE_CREDITS);
+		pthread_rwlock_unlock(simplefs_inodeLock(inode_number));
+		pthread_rwlock_unlock(&freeze_lock);
+		simplefs_handleUnlock(handle);
 		return -1;
+	}
+	if (size < inode->file_size) {
+		if (pblock != -1) {
+			char *block = malloc(bs);
+			assert(block);
+			int ret = simplefs_readDataBlock(pblock, block);
+			if (ret == 0) {
+				memset(block + size % bs, 0, bs - size % bs);
+				simplefs_writeDataBlock(pblock, block);
+			}
+			free(block);
+			if (ret < 0) {
+				// Nothing is freed, the file keeps its size
+				simplefs_journalStop(JOURNAL_NAMESPACE_CREDITS);
+				pthread_rwlock_unlock(simplefs_inodeLock(inode_number));
+				pthread_rwlock_unlock(&freeze_lock);
+				simplefs_handleUnlock(handle);
+				errno = EIO;
+				return -1;
+			}
+		}
+		simplefs_freeBlockMap(inode, (size + bs - 1) / bs);
+		state->map_generation++;
+	}
+	inode->file_size = size;
+	int ret = simplefs_inodeDirty(inode_number);
+	simplefs_journalStop(JOURNAL_NAMESPACE_CREDITS);
+	pthread_rwlock_unlock(simplefs_inodeLock(inode_number));
+	pthread_rwlock_unlock(&freeze_lock);
+	simplefs_handleUnlock(handle);
+	return ret;
+}
+
+static void simplefs_zeroRun(int start, int count) {
+	/*
+		Write zeros over data blocks [`start`, `start` + `count`), up to
+		IOV_MAX blocks per call out of a single zeroed buffer
+	*/
+	uint32_t bs = simplefs_layout.block_size;
+	int n = count < IOV_MAX ? count : IOV_MAX;
+	char *zero = calloc(1, bs);
+	struct iovec *iov = malloc(n * sizeof(struct iovec));
+	assert(zero && iov);
+	for (int i = 0; i < n; i++) {
+		iov[i].iov_base = zero;
+		iov[i].iov_len = bs;
+	}
+	for (int done = 0; done < count; done += n) {
+		if (n > count - done)
+			n = count - done;
+		simplefs_writeDataRun(start + done, n, iov, n);
+	}
+	free(iov);
+	free(zero);
+}
+
+static int simplefs_allocateRange(struct filehandle_t *handle, struct inode_t *inode, int64_t offset, int64_t len) {
+	/*
+		Map every unmapped block of [`offset`, `offset` + `len`) and zero it.
+		Extent-mapped files get the blocks up front like a write. For a
+		pointer-mapped file the missing blocks are counted first and taken
+		from the free map a run at a time into the log's pool, which the
+		block map then draws on. On a journaled disk the work is split into
+		handles like a long write, and a failure undoes all of it
+	*/
+	int inode_number = handle->inode_number;
+	uint32_t bs = simplefs_layout.block_size;
+	int64_t first = offset / bs;
+	int64_t last = (offset + len - 1) / bs;
+	int credits;
+	int64_t chunk = simplefs_journalWriteChunk(&credits);
+	int64_t chunk_blocks = 0;
+	int64_t old_size = inode->file_size;
+	int64_t missing = 0;
+	for (int64_t lblock = first; !simplefs_usesExtents() && lblock <= last; lblock++) {
+		int pblock = simplefs_lookupBlock(handle, inode, lblock);
+		if (pblock == MAP_CORRUPT) {
+			errno = EIO;
+			return -1;
+		}
+		missing += pblock == -1;
+	}
+	simplefs_journalStart(credits);
+
+	struct write_map_t map = {inode, inode_number, {0, 0, NULL, 0, NULL, 0, {0, 0}}, {-1, 0, {0, 0}, 0}, 0, 0, {-1, -1}, 0, {-1, -1}};
+	if (simplefs_writeMapBegin(&map, offset, len) < 0)
+		goto fail;
+	int goal = -1;
+	for (int64_t lblock = first; missing > 0 && lblock <= last; lblock++) {
+		if (chunk_blocks >= chunk) {
+			if (simplefs_writeInode(inode_number, inode) < 0)
+				goto fail;
+			simplefs_journalStop(credits);
+			simplefs_journalStart(credits);
+			chunk_blocks = 0;
+		}
+		if (map.log.pool.length == 0) {
+			int got = simplefs_allocRun(&map.log, goal, missing, &map.log.pool.start);
+			if (got == 0)
+				goto fail;
+			map.log.pool.length = got;
+		}
+		int is_new;
+		int pblock = simplefs_writeMapBlock(&map, lblock, &is_new);
+		if (pblock == -1)
+			goto fail;
+		if (is_new) {
+			missing--;
+			goal = pblock + 1;
+		}
+		chunk_blocks++;
+	}
+
+	// Every data block the log took is new, neighbours on disk are zeroed together
+	struct extent_t run = {0, 0};
+	for (int i = 0; i <= map.log.count; i++) {
+		struct extent_t next = {0, 0};
+		if (i < map.log.count) {
+			int kind = map.log.entries[i].kind;
+			if (kind != ALLOC_DATA && kind != ALLOC_RUN && kind != ALLOC_FILL)
+				continue;
+			next.start = map.log.entries[i].pblock;
+			next.length = kind == ALLOC_DATA ? 1 : map.log.entries[i].index;
+			if (run.length > 0 && next.start == run.start + run.length && run.length < INT_MAX - next.length) {
+				run.length += next.length;
+				continue;
+			}
+		}
+		while (run.length > 0) {
+			if (chunk_blocks >= chunk) {
+				if (simplefs_writeInode(inode_number, inode) < 0)
+					goto fail;
+				simplefs_journalStop(credits);
+				simplefs_journalStart(credits);
+				chunk_blocks = 0;
+			}
+			int n = chunk - chunk_blocks < run.length ? chunk - chunk_blocks : run.length;
+			simplefs_zeroRun(run.start, n);
+			run.start += n;
+			run.length -= n;
+			chunk_blocks += n;
+		}
+		run = next;
+	}
+
+	if (offset + len > inode->file_size)
+		inode->file_size = offset + len;
+	if (simplefs_inodeDirty(inode_number) < 0)
+		goto fail;
+	if (map.log.pool.length > 0)
+		simplefs_freeDataRun(map.log.pool.start, map.log.pool.length);
+	free(map.log.entries);
+	free(map.log.saved);
+	simplefs_journalStop(credits);
+	return 0;
+
+fail:
+	if (map.log.pool.length > 0)
+		simplefs_freeDataRun(map.log.pool.start, map.log.pool.length);
+	simplefs_undoWrite(inode_number, inode, &map.log, chunk, credits, old_size);
+	free(map.log.entries);
+	free(map.log.saved);
+	simplefs_journalStop(credits);
+	return -1;
+}
 
-	int inode_number = file_handle_array[file_handle].inode_number;
-	if (inode_number == -1)
+int simplefs_fallocate(int file_handle, int64_t offset, int64_t len) {
+	/*
+		Give every block of [`offset`, `offset` + `len`) that has none a
+		zeroed data block, and grow the file to cover the range. The blocks
+		come from the free map in runs as long as it can give, so a writer
+		that preallocates its final size then streams into them without
+		calling the allocator. -1 when they do not all fit, with nothing
+		allocated
+	*/
+	uint32_t bs = simplefs_layout.block_size;
+	if (offset < 0 || len <= 0 || offset + len > (int64_t)bs * simplefs_maxFileBlocks() || simplefs_readOnly())
+		return -1;
+	struct filehandle_t *handle = simplefs_handleLock(file_handle);
+	if (!handle)
 		return -1;
 
-	simplefs_readInode(inode_number, &inode);
-	int current_offset = file_handle_array[file_handle].offset;
-	int new_offset = current_offset + nseek;
+	int inode_number = handle->inode_number;
+	struct inode_t *inode = &simplefs_inodeState(inode_number)->inode;
+	pthread_rwlock_rdlock(&freeze_lock);
+	pthread_rwlock_wrlock(simplefs_inodeLock(inode_number));
+	// The block map has to cover the whole file before blocks are added to it
+	int ret = simplefs_flushTail(inode_number, inode);
+	if (ret == 0)
+		ret = simplefs_zeroTail(inode_number, inode, offset + len);
+	if (ret == 0)
+		ret = simplefs_allocateRange(handle, inode, offset, len);
+	pthread_rwlock_unlock(simplefs_inodeLock(inode_number));
+	pthread_rwlock_unlock(&freeze_lock);
+	simplefs_handleUnlock(handle);
+	return ret;
+}
+
+static void simplefs_resume() {
+	pthread_rwlock_unlock(&freeze_lock);
+	pthread_rwlock_unlock(&namespace_lock);
+}
+
+static int simplefs_quiesce() {
+	/*
+		Hold off every change to the filesystem: namespace changes through
+		the namespace lock, the rest through the freeze lock, both taken
+		exclusive. Delayed tails then get their blocks, clusters left
+		expanded are compressed again and the in-core inodes go to the inode
+		table, each file's inode lock taken only when it has some of that to
+		do, to wait out its readers. -1 with nothing held when a tail finds
+		no space or an inode's table block fails its checksum
+	*/
+	pthread_rwlock_wrlock(&namespace_lock);
+	pthread_rwlock_wrlock(&freeze_lock);
+	for (uint32_t i = 0; i < simplefs_layout.num_inodes; i++) {
+		struct inode_state_t *state = simplefs_inodeState(i);
+		// Only a pinned inode is dirty, a handle closing meanwhile writes it back itself
+		if (!state->tail.data && !state->repack_count && !__atomic_load_n(&state->dirty, __ATOMIC_RELAXED))
+			continue;
+		pthread_rwlock_wrlock(simplefs_inodeLock(i));
+		int ret = simplefs_flushTail(i, &state->inode);
+		if (ret == 0)
+			simplefs_repackPending(i, &state->inode);
+		if (ret == 0 && __atomic_load_n(&state->dirty, __ATOMIC_RELAXED))
+			ret = simplefs_writeInode(i, &state->inode);
+		pthread_rwlock_unlock(simplefs_inodeLock(i));
+		if (ret < 0) {
+			simplefs_resume();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+struct snapshot_walk_t
+{
+	uint64_t *blocks;			// data blocks reached, one bit each
+	int copy;					// the block maps and entry trees are copied, the inodes pointed at the copies
+	struct free_list_t copies;	// blocks taken for copies, given back if the walk fails
+	struct journal_batch_t batch;	// journal handle the copies are written under
+};
+
+static int simplefs_walkMapBlock(void *arg, int pblock, char *contents) {
+	/*
+		Visit a block of a block map or an entry tree holding `contents`,
+		which may already point at copies. A copying walk writes them to a
+		new block and returns that instead of `pblock`
+	*/
+	struct snapshot_walk_t *walk = arg;
+	if (walk->copy) {
+		simplefs_journalBatchNext(&walk->batch, 1);
+		pblock = simplefs_allocDataBlock();
+		if (pblock == -1)
+			return -1;
+		simplefs_writeDataBlock(pblock, contents);
+		simplefs_collectRun(&walk->copies, pblock, 1);
+	}
+	simplefs_bitmapSetRange(walk->blocks, pblock, 1, 1);
+	return pblock;
+}
 
-	if (new_offset < 0 || new_offset > inode.file_size)
+static int simplefs_walkPointers(struct snapshot_walk_t *walk, int pblock, int depth) {
+	int *entries = malloc(simplefs_layout.block_size);
+	assert(entries);
+	if (simplefs_readDataBlock(pblock, (char *)entries) < 0) {
+		free(entries);
+		errno = EIO;
 		return -1;
+	}
+	for (int64_t i = 0; i < PTRS_PER_BLOCK; i++) {
+		if (entries[i] == -1)
+			continue;
+		if (depth == 1)
+			simplefs_bitmapSetRange(walk->blocks, entries[i], 1, 1);
+		else if ((entries[i] = simplefs_walkPointers(walk, entries[i], depth - 1)) == -1) {
+			free(entries);
+			return -1;
+		}
+	}
+	int ret = simplefs_walkMapBlock(walk, pblock, (char *)entries);
+	free(entries);
+	return ret;
+}
 
-	file_handle_array[file_handle].offset = new_offset;
+static int simplefs_walkInode(struct snapshot_walk_t *walk, struct inode_t *inode) {
+	/*
+		Mark every block `inode` references. A copying walk leaves `inode`
+		pointing at copies of its block map or entry tree, its data blocks
+		and name block are shared. -1 when no block is left for a copy, or
+		with errno EIO when a block of the map or tree fails its checksum
+	*/
+	if (inode->status != INODE_IN_USE && inode->status != INODE_DIRECTORY)
+		return 0;
+	if (inode->name_block != -1)
+		simplefs_bitmapSetRange(walk->blocks, inode->name_block, 1, 1);
+	if (inode->status == INODE_DIRECTORY) {
+		if (inode->dir_root == -1)
+			return 0;
+		inode->dir_root = simplefs_dirWalk(inode->dir_root, inode->dir_height, simplefs_walkMapBlock, walk);
+		return inode->dir_root == -1 ? -1 : 0;
+	}
+	if (simplefs_usesExtents()) {
+		for (int i = 0; i < inode->num_extents; i++) {
+			struct extent_t extent;
+			int packed = 0;
+			if (simplefs_getExtent(inode, i, &extent) < 0
+			    || (extent.start < EXTENT_HOLE && (packed = simplefs_packedBlocks(EXTENT_PACKED(extent.start))) < 0)) {
+				errno = EIO;
+				return -1;
+			}
+			if (extent.start >= 0)
+				simplefs_bitmapSetRange(walk->blocks, extent.start, extent.length, 1);
+			else if (extent.start != EXTENT_HOLE)
+				simplefs_bitmapSetRange(walk->blocks, EXTENT_PACKED(extent.start), packed, 1);
+		}
+		if (inode->extent_block == -1)
+			return 0;
+		char *block = malloc(simplefs_layout.block_size);
+		assert(block);
+		if (simplefs_readDataBlock(inode->extent_block, block) < 0) {
+			free(block);
+			errno = EIO;
+			return -1;
+		}
+		inode->extent_block = simplefs_walkMapBlock(walk, inode->extent_block, block);
+		free(block);
+		return inode->extent_block == -1 ? -1 : 0;
+	}
+	for (int i = 0; i < MAX_FILE_SIZE; i++) {
+		if (inode->direct_blocks[i] != -1)
+			simplefs_bitmapSetRange(walk->blocks, inode->direct_blocks[i], 1, 1);
+	}
+	if (inode->indirect_block != -1 && (inode->indirect_block = simplefs_walkPointers(walk, inode->indirect_block, 1)) == -1)
+		return -1;
+	if (inode->double_indirect_block != -1
+	    && (inode->double_indirect_block = simplefs_walkPointers(walk, inode->double_indirect_block, 2)) == -1)
+		return -1;
 	return 0;
 }
 
+int simplefs_snapshotCreate() {
+	/*
+		Take a snapshot of the whole filesystem and return its number, for
+		simplefs_mountSnapshot() and simplefs_snapshotDelete(). The inode
+		table and the bitmaps are copied to a free slot, and each file's
+		block map or directory's entry tree to new blocks. Data and name
+		blocks are shared, so the cost follows the metadata, not the data.
+		A shared block never changes again: a write gives the file a copy of
+		its own. -1 without a free slot or blocks for the copies, or with
+		errno EIO when an inode fails its checksum
+	*/
+	if (!(simplefs_layout.features & SIMPLEFS_FEATURE_SNAPSHOTS) || simplefs_readOnly())
+		return -1;
+	uint32_t slot = 0;
+	while (slot < simplefs_layout.snapshot_slots && simplefs_snapshotMap() >> slot & 1)
+		slot++;
+	if (slot == simplefs_layout.snapshot_slots || simplefs_quiesce() < 0)
+		return -1;
+
+	uint32_t bs = simplefs_layout.block_size;
+	struct inode_t *inodes = malloc(simplefs_layout.num_inodes * sizeof(struct inode_t));
+	struct snapshot_walk_t walk = {calloc(simplefs_layout.datablock_bitmap_blocks, bs), 1, {0, 0, NULL}, {0, 0, 0}};
+	assert(inodes && walk.blocks);
+	simplefs_journalBatchStart(&walk.batch);
+	int ret = slot;
+	for (uint32_t i = 0; i < simplefs_layout.num_inodes && ret != -1; i++) {
+		if (simplefs_readInode(i, &inodes[i]) < 0 || simplefs_walkInode(&walk, &inodes[i]) < 0)
+			ret = -1;
+	}
+	if (ret == -1)
+		simplefs_freeDataExtents(walk.copies.runs, walk.copies.count);
+	simplefs_journalBatchStop(&walk.batch);
+	if (ret != -1)
+		simplefs_snapshotSave(slot, walk.blocks, inodes);
+	simplefs_resume();
+	free(walk.copies.runs);
+	free(walk.blocks);
+	free(inodes);
+	return ret;
+}
+
+int simplefs_snapshotDelete(int snapshot) {
+	/*
+		Delete snapshot `snapshot`. Its copies go back to the free map, and
+		so do the blocks it shared that neither another snapshot nor a live
+		file still references, the live ones found by walking every inode.
+		-1 if there is no such snapshot, or with errno EIO, the snapshot
+		kept, when a live file's inode or block map fails its checksum
+	*/
+	if (simplefs_readOnly() || snapshot < 0 || (uint32_t)snapshot >= simplefs_layout.snapshot_slots
+	    || !(simplefs_snapshotMap() >> snapshot & 1) || simplefs_quiesce() < 0)
+		return -1;
+	struct snapshot_walk_t walk = {calloc(simplefs_layout.datablock_bitmap_blocks, simplefs_layout.block_size), 0, {0, 0, NULL}, {0, 0, 0}};
+	assert(walk.blocks);
+	int ret = 0;
+	for (uint32_t i = 0; i < simplefs_layout.num_inodes && ret == 0; i++) {
+		struct inode_t inode;
+		ret = simplefs_readInode(i, &inode);
+		if (ret == 0)
+			ret = simplefs_walkInode(&walk, &inode);
+	}
+	// A block map the walk could not read may still reference any block
+	if (ret == 0)
+		simplefs_snapshotDrop(snapshot, walk.blocks);
+	simplefs_resume();
+	free(walk.blocks);
+	return ret;
+}
@@ -3,11 +3,24 @@
 #include <stdio.h>
 #include "simplefs-disk.h"
 
+#define SIMPLEFS_SEEK_DATA 3	// simplefs_seekData(): next offset holding data, as lseek(SEEK_DATA)
+#define SIMPLEFS_SEEK_HOLE 4	// next offset in a hole, the end of the file counting as one
+
 // Functions to implement in simplefs-ops.c
 int simplefs_create(char *filename);
 int simplefs_open(char *filename);
 void simplefs_delete (char *filename); 
 void simplefs_close(int file_handle);
-int simplefs_read(int file_handle, char *buf, int nbytes);
-int simplefs_write(int file_handle, char *buf, int nbytes);
-int simplefs_seek(int file_handle, int nseek);
+int simplefs_read(int file_handle, char *buf, int64_t nbytes);
+int simplefs_write(int file_handle, char *buf, int64_t nbytes);
+int simplefs_seek(int file_handle, int64_t nseek);
+int64_t simplefs_seekData(int file_handle, int64_t offset, int whence);
+int simplefs_truncate(int file_handle, int64_t size);
+int simplefs_fallocate(int file_handle, int64_t offset, int64_t len);
+int simplefs_mkdir(char *path);
+int simplefs_rmdir(char *path);
+int simplefs_createMany(char **names, int n, int *out_inodes);
+int simplefs_deleteMany(char **names, int n);
+int simplefs_snapshotCreate();
+int simplefs_snapshotDelete(int snapshot);
+void simplefs_setDelayedAllocation(int enable);
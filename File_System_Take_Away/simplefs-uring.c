@@ -0,0 +1,321 @@
+#include "simplefs-disk.h"
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+    The ring is driven with the raw system calls, no liburing needed. A
+    caller prepares its batch under the ring mutex and queues it. Whichever
+    caller finds no one reaping then submits everything queued and waits for
+    its own batch in the same io_uring_enter, without the mutex, hands each
+    completion to the batch it belongs to and wakes the others. A caller
+    arriving meanwhile only submits. The submission queue holds two batches,
+    so one can be queued while another is being submitted
+*/
+struct simplefs_ring
+{
+    int fd;                             // ring descriptor, -1 when not set up
+    int file;                           // image descriptor, used when it could not be registered
+    int fixed_file;                     // 1 if the image is registered file 0
+    unsigned entries;                   // largest batch
+    unsigned sq_entries, cq_entries;
+    unsigned in_flight;                 // entries submitted and not yet reaped
+    int reaping;                        // 1 while a caller blocks in io_uring_enter for completions
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;            // mappings, the same one when the kernel offers a single mmap
+    size_t sq_ring_len, cq_ring_len, sqes_len;
+    char *buf;                          // registered buffer 0, NULL if none
+    size_t buf_len;
+};
+
+struct simplefs_uringBatch;
+
+struct simplefs_uringSlot
+{
+    struct simplefs_uringBatch *batch;  // the batch an entry completes, its user_data points here
+    size_t expect;                      // bytes it must move
+};
+
+struct simplefs_uringBatch
+{
+    unsigned n;                         // entries prepared
+    unsigned pending;                   // entries submitted and not yet completed
+    int ok;                             // 0 once an entry failed or came short
+    struct simplefs_uringSlot slots[URING_ENTRIES];
+};
+
+static struct simplefs_ring ring = { .fd = -1 };
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER; // a batch completed or entries were reaped
+
+static void simplefs_uringUnmap(){
+    if(ring.sqes && ring.sqes != MAP_FAILED)
+        munmap(ring.sqes, ring.sqes_len);
+    if(ring.cq_ring && ring.cq_ring != MAP_FAILED && ring.cq_ring != ring.sq_ring)
+        munmap(ring.cq_ring, ring.cq_ring_len);
+    if(ring.sq_ring && ring.sq_ring != MAP_FAILED)
+        munmap(ring.sq_ring, ring.sq_ring_len);
+    ring.sqes = NULL;
+    ring.sq_ring = ring.cq_ring = NULL;
+}
+
+int simplefs_uringInit(int fd, void *buffers, size_t len){
+    /*
+	    Set up a ring for the image `fd`, registering the image and the `len`
+	    bytes at `buffers` where the kernel allows. Returns -1 when io_uring
+	    is not available
+	*/
+    simplefs_uringExit();
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int rfd = syscall(__NR_io_uring_setup, 2 * URING_ENTRIES, &p);
+    if(rfd < 0)
+        return -1;
+    ring.fd = rfd;
+    ring.sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        if(ring.cq_ring_len > ring.sq_ring_len)
+            ring.sq_ring_len = ring.cq_ring_len;
+        ring.cq_ring_len = ring.sq_ring_len;
+    }
+    ring.sq_ring = mmap(NULL, ring.sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQ_RING);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        ring.cq_ring = ring.sq_ring;
+    else
+        ring.cq_ring = mmap(NULL, ring.cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_CQ_RING);
+    ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQES);
+    if(ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED || ring.sqes == MAP_FAILED){
+        simplefs_uringExit();
+        return -1;
+    }
+    char *sq = ring.sq_ring, *cq = ring.cq_ring;
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.entries = p.sq_entries / 2 < URING_ENTRIES ? p.sq_entries / 2 : URING_ENTRIES;
+    ring.sq_entries = p.sq_entries;
+    ring.cq_entries = p.cq_entries;
+    ring.in_flight = 0;
+    ring.reaping = 0;
+
+    ring.file = fd;
+    ring.fixed_file = syscall(__NR_io_uring_register, rfd, IORING_REGISTER_FILES, &fd, 1) == 0;
+    struct iovec iov = {buffers, len};
+    if(buffers && syscall(__NR_io_uring_register, rfd, IORING_REGISTER_BUFFERS, &iov, 1) == 0){
+        ring.buf = buffers;
+        ring.buf_len = len;
+    }
+    return 0;
+}
+
+void simplefs_uringExit(){
+    /*
+	    Tear the ring down, closing it also drops the registrations. Nothing
+	    may be in flight
+	*/
+    simplefs_uringUnmap();
+    if(ring.fd >= 0)
+        close(ring.fd);
+    ring.fd = -1;
+    ring.fixed_file = 0;
+    ring.buf = NULL;
+    ring.buf_len = 0;
+}
+
+int simplefs_uringActive(){
+    return ring.fd >= 0;
+}
+
+static void simplefs_uringPrep(struct simplefs_uringBatch *batch, int opcode, off_t offset, const void *addr, unsigned len,
+                              size_t expect){
+    /*
+	    Fill the next entry of `batch`, which moves `expect` bytes. A single
+	    buffer inside the registered one is passed by index
+	*/
+    unsigned index = (*ring.sq_tail + batch->n) & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    if(ring.buf && (opcode == IORING_OP_READ || opcode == IORING_OP_WRITE)
+       && (const char *)addr >= ring.buf && (const char *)addr + len <= ring.buf + ring.buf_len){
+        opcode = opcode == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = 0;
+    }
+    sqe->opcode = opcode;
+    sqe->fd = ring.fixed_file ? 0 : ring.file;
+    if(ring.fixed_file)
+        sqe->flags = IOSQE_FIXED_FILE;
+    // A sync starts once every write before it in the ring is done
+    if(opcode == IORING_OP_FSYNC)
+        sqe->flags |= IOSQE_IO_DRAIN;
+    sqe->off = offset;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    batch->slots[batch->n].batch = batch;
+    batch->slots[batch->n].expect = expect;
+    sqe->user_data = (uint64_t)(uintptr_t)&batch->slots[batch->n];
+    ring.sq_array[index] = index;
+    batch->n++;
+}
+
+static void simplefs_uringReap(){
+    /*
+	    Hand every completion in the ring to its batch. Called with ring_lock held
+	*/
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++){
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        struct simplefs_uringSlot *slot = (struct simplefs_uringSlot *)(uintptr_t)cqe->user_data;
+        if(cqe->res < 0 || (size_t)cqe->res != slot->expect)
+            slot->batch->ok = 0;
+        slot->batch->pending--;
+        ring.in_flight--;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&ring_cond);
+}
+
+static int simplefs_uringBegin(struct simplefs_uringBatch *batch){
+    /*
+	    Take ring_lock and wait until both queues have room for a full batch
+	    besides those queued and in flight. -1, with the lock released, when
+	    the ring is not in use
+	*/
+    pthread_mutex_lock(&ring_lock);
+    while(ring.fd >= 0 && (ring.in_flight + ring.entries > ring.cq_entries
+          || *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) + ring.entries > ring.sq_entries))
+        pthread_cond_wait(&ring_cond, &ring_lock);
+    if(ring.fd < 0){
+        pthread_mutex_unlock(&ring_lock);
+        return -1;
+    }
+    batch->n = 0;
+    batch->pending = 0;
+    batch->ok = 1;
+    return 0;
+}
+
+static int simplefs_uringSubmit(struct simplefs_uringBatch *batch){
+    /*
+	    Queue the prepared entries of `batch` and wait for all of them to
+	    complete. Each io_uring_enter submits whatever is queued, whoever
+	    queued it, and the caller that finds no one reaping also waits in it
+	    for its batch. Called and returns with ring_lock held. -1 if any entry
+	    failed or moved fewer bytes than expected
+	*/
+    __atomic_store_n(ring.sq_tail, *ring.sq_tail + batch->n, __ATOMIC_RELEASE);
+    batch->pending += batch->n;
+    ring.in_flight += batch->n;
+    batch->n = 0;
+    while(batch->pending > 0){
+        unsigned queued = *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        int reap = !ring.reaping;
+        if(!reap && queued == 0){
+            pthread_cond_wait(&ring_cond, &ring_lock);
+            continue;
+        }
+        unsigned wait = reap ? batch->pending : 0;
+        ring.reaping |= reap;
+        pthread_mutex_unlock(&ring_lock);
+        int ret = syscall(__NR_io_uring_enter, ring.fd, queued, wait, reap ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        SIMPLEFS_STAT_INC(disk_calls);
+        // Queued entries are always consumed in the end, anything but a retry is a bug
+        assert(ret >= 0 || errno == EINTR || errno == EAGAIN || errno == EBUSY);
+        pthread_mutex_lock(&ring_lock);
+        if(reap)
+            ring.reaping = 0;
+        simplefs_uringReap();
+    }
+    return batch->ok ? 0 : -1;
+}
+
+int simplefs_uringTransfer(off_t offset, const struct iovec *iov, int iovcnt, int write){
+    /*
+	    Move the bytes described by `iov` to or from the image at `offset`.
+	    Each entry covers up to IOV_MAX buffers. -1 when the transfer has to
+	    be repeated another way
+	*/
+    struct simplefs_uringBatch batch;
+    if(simplefs_uringBegin(&batch) < 0)
+        return -1;
+    int ret = 0;
+    while(iovcnt > 0 && ret == 0){
+        while(batch.n < ring.entries && iovcnt > 0){
+            int k = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+            size_t bytes = 0;
+            for(int i=0; i<k; i++)
+                bytes += iov[i].iov_len;
+            if(k == 1)
+                simplefs_uringPrep(&batch, write ? IORING_OP_WRITE : IORING_OP_READ, offset, iov->iov_base, iov->iov_len, bytes);
+            else
+                simplefs_uringPrep(&batch, write ? IORING_OP_WRITEV : IORING_OP_READV, offset, iov, k, bytes);
+            offset += bytes;
+            iov += k;
+            iovcnt -= k;
+        }
+        ret = simplefs_uringSubmit(&batch);
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return ret;
+}
+
+int simplefs_uringWriteBlocks(int count, const off_t *offsets, const char *const *bufs, size_t len){
+    /*
+	    Write `count` buffers of `len` bytes to scattered `offsets`, a batch
+	    per system call
+	*/
+    struct simplefs_uringBatch batch;
+    if(simplefs_uringBegin(&batch) < 0)
+        return -1;
+    int ret = 0;
+    for(int i=0; i<count && ret == 0; ){
+        for(; batch.n < ring.entries && i < count; i++)
+            simplefs_uringPrep(&batch, IORING_OP_WRITE, offsets[i], bufs[i], len, len);
+        ret = simplefs_uringSubmit(&batch);
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return ret;
+}
+
+int simplefs_uringWriteRuns(int count, const off_t *offsets, const struct iovec *iov, const int *iovcnt, int sync){
+    /*
+	    Write `count` runs to scattered `offsets`, run i from the next
+	    iovcnt[i] buffers of `iov`, at most IOV_MAX each. With `sync` set the
+	    image is made durable after them, by an fsync in the same submission
+	    when it has room
+	*/
+    struct simplefs_uringBatch batch;
+    if(simplefs_uringBegin(&batch) < 0)
+        return -1;
+    int ret = 0;
+    for(int i=0; (i < count || sync) && ret == 0; ){
+        for(; batch.n < ring.entries && i < count; i++){
+            assert(iovcnt[i] > 0 && iovcnt[i] <= IOV_MAX);
+            size_t bytes = 0;
+            for(int k=0; k<iovcnt[i]; k++)
+                bytes += iov[k].iov_len;
+            if(iovcnt[i] == 1)
+                simplefs_uringPrep(&batch, IORING_OP_WRITE, offsets[i], iov->iov_base, iov->iov_len, bytes);
+            else
+                simplefs_uringPrep(&batch, IORING_OP_WRITEV, offsets[i], iov, iovcnt[i], bytes);
+            iov += iovcnt[i];
+        }
+        if(sync && i == count && batch.n < ring.entries){
+            simplefs_uringPrep(&batch, IORING_OP_FSYNC, 0, NULL, 0, 0);
+            sync = 0;
+        }
+        ret = simplefs_uringSubmit(&batch);
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return ret;
+}
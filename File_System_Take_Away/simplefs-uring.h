@@ -0,0 +1,27 @@
+/*
+	IO_URING DISK BACKEND
+*/
+#ifndef SIMPLEFS_URING_H
+#define SIMPLEFS_URING_H
+
+/*
+	When the image is mounted in SIMPLEFS_IO_URING mode, every transfer of
+	simplefs-disk.c goes through one ring: single blocks, vectored runs and
+	cache flushes alike. Scattered writes that end in an fsync, such as a
+	journal commit or a sync's bitmap blocks, share one submission with it.
+	The image is a registered file and the buffer cache's slab a registered
+	buffer, so the kernel does no file lookup or page pinning per request.
+	Threads submit their batches independently and have them in flight
+	together. Any failure leaves the caller to repeat the transfer with
+	pread/pwrite, which also serve when the kernel has no io_uring at all
+*/
+#define URING_ENTRIES 64	// largest batch per system call, the submission queue holds two
+
+int simplefs_uringInit(int fd, void *buffers, size_t len);
+void simplefs_uringExit();
+int simplefs_uringActive();
+int simplefs_uringTransfer(off_t offset, const struct iovec *iov, int iovcnt, int write);
+int simplefs_uringWriteBlocks(int count, const off_t *offsets, const char *const *bufs, size_t len);
+int simplefs_uringWriteRuns(int count, const off_t *offsets, const struct iovec *iov, const int *iovcnt, int sync);
+
+#endif
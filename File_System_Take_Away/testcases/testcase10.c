@@ -0,0 +1,28 @@
+#include "simplefs-ops.h"
+
+int main()
+{
+    struct simplefs_stats stats;
+    char str[] = "!-----------------------128 Bytes of Data----------------------!!-----------------------128 Bytes of Data----------------------!";
+    char buf[BLOCKSIZE * 2 + 1];
+    buf[BLOCKSIZE * 2] = '\0';
+    simplefs_setIOMode(SIMPLEFS_IO_MMAP);
+    simplefs_formatDisk();
+    simplefs_create("fileabc");
+    int fd = simplefs_open("fileabc");
+    printf("Write Data: %d\n", simplefs_write(fd, str, BLOCKSIZE * 2));
+    printf("Read Data %d\n", simplefs_read(fd, buf, BLOCKSIZE * 2));
+    printf("Data: %s\n", buf);
+    simplefs_close(fd);
+    simplefs_getStats(&stats);
+    printf("Cache Hits: %ld Misses: %ld\n", stats.cache_hits, stats.cache_misses);
+    simplefs_unmount();
+
+    simplefs_setIOMode(SIMPLEFS_IO_FD);
+    printf("Mount: %d\n", simplefs_mount());
+    fd = simplefs_open("fileabc");
+    printf("Read Data %d\n", simplefs_read(fd, buf, BLOCKSIZE * 2));
+    printf("Data: %s\n", buf);
+    simplefs_close(fd);
+    simplefs_dump();
+}
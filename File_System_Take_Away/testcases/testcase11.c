@@ -0,0 +1,33 @@
+#include "simplefs-ops.h"
+
+int main()
+{
+    struct simplefs_geometry bad = { .block_size = 100, .num_inodes = 16, .num_data_blocks = 100 };
+    printf("Format 100 byte blocks: %d\n", simplefs_formatDiskWithGeometry(&bad));
+
+    struct simplefs_geometry geometry = { .block_size = 4096, .num_inodes = 16, .num_data_blocks = 100 };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&geometry));
+    printf("Block size: %u Inodes per block: %u Inode table: %u+%u Data: %u+%u Blocks: %u\n",
+           simplefs_layout.block_size, simplefs_layout.inodes_per_block,
+           simplefs_layout.inode_table_start, simplefs_layout.inode_table_blocks,
+           simplefs_layout.data_start, simplefs_layout.num_data_blocks, simplefs_layout.num_blocks);
+
+    static char data[4096 * MAX_FILE_SIZE];
+    static char buf[4096 * MAX_FILE_SIZE];
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = 'a' + i % 26;
+    simplefs_create("big");
+    int fd = simplefs_open("big");
+    printf("Write Data: %d\n", simplefs_write(fd, data, 10000));
+    printf("Seek: %d\n", simplefs_seek(fd, 10000));
+    printf("Write Data: %d\n", simplefs_write(fd, data + 10000, sizeof(data) - 10000));
+    simplefs_close(fd);
+    simplefs_unmount();
+
+    printf("Mount: %d\n", simplefs_mount());
+    printf("Block size: %u Inodes: %u Data blocks: %u\n", simplefs_layout.block_size, simplefs_layout.num_inodes, simplefs_layout.num_data_blocks);
+    fd = simplefs_open("big");
+    printf("Read Data %d\n", simplefs_read(fd, buf, sizeof(buf)));
+    printf("Match: %d\n", memcmp(data, buf, sizeof(buf)) == 0);
+    simplefs_close(fd);
+}
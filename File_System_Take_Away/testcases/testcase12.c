@@ -0,0 +1,41 @@
+#include "simplefs-ops.h"
+
+int main()
+{
+    struct simplefs_stats stats;
+    char data[BLOCKSIZE * 22 + 1];
+    char buf[BLOCKSIZE * 22 + 1];
+    for (int i = 0; i < BLOCKSIZE * 22; i++)
+        data[i] = 'A' + (i / BLOCKSIZE) % 26;
+    data[BLOCKSIZE * 22] = '\0';
+    buf[BLOCKSIZE * 22] = '\0';
+    simplefs_formatDisk();
+
+    simplefs_create("big");
+    int fd = simplefs_open("big");
+    printf("Write Data: %d\n", simplefs_write(fd, data, BLOCKSIZE * 22));
+
+    simplefs_resetStats();
+    printf("Seek: %d\n", simplefs_seek(fd, BLOCKSIZE * MAX_FILE_SIZE));
+    for (int i = MAX_FILE_SIZE; i < 20; i++)
+    {
+        if (simplefs_read(fd, buf, BLOCKSIZE) != 0)
+            printf("Read Data -1\n");
+        simplefs_seek(fd, BLOCKSIZE);
+    }
+    simplefs_getStats(&stats);
+    printf("Pointer Walks: %ld Cached Lookups: %ld\n", stats.bmap_walks, stats.bmap_cache_hits);
+    printf("Seek: %d\n", simplefs_seek(fd, -BLOCKSIZE * 20));
+    printf("Read Data %d\n", simplefs_read(fd, buf, BLOCKSIZE * 22));
+    printf("Match: %d\n", strcmp(data, buf) == 0);
+    simplefs_close(fd);
+
+    simplefs_create("small");
+    fd = simplefs_open("small");
+    printf("Write Data: %d\n", simplefs_write(fd, data, BLOCKSIZE * 6));
+    simplefs_close(fd);
+    simplefs_dump();
+
+    simplefs_delete("big");
+    simplefs_dump();
+}
@@ -0,0 +1,66 @@
+#include "simplefs-ops.h"
+
+int main()
+{
+    char data[BLOCKSIZE * 10];
+    char buf[BLOCKSIZE * 10];
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = 'A' + (i / BLOCKSIZE) % 26;
+
+    struct simplefs_geometry bad = { .block_size = BLOCKSIZE, .num_inodes = NUM_INODES,
+                                     .num_data_blocks = NUM_DATA_BLOCKS, .features = 0x80 };
+    printf("Format unknown feature: %d\n", simplefs_formatDiskWithGeometry(&bad));
+    struct simplefs_geometry geometry = { .block_size = BLOCKSIZE, .num_inodes = NUM_INODES,
+                                          .num_data_blocks = NUM_DATA_BLOCKS, .features = SIMPLEFS_FEATURE_EXTENTS };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&geometry));
+
+    simplefs_create("a");
+    simplefs_create("b");
+    int fa = simplefs_open("a");
+    int fb = simplefs_open("b");
+    printf("Write Data: %d\n", simplefs_write(fa, data, BLOCKSIZE * 3));
+    printf("Write Data: %d\n", simplefs_write(fb, data, BLOCKSIZE * 2));
+    simplefs_seek(fa, BLOCKSIZE * 3);
+    printf("Write Data: %d\n", simplefs_write(fa, data + BLOCKSIZE * 3, BLOCKSIZE * 3));
+    simplefs_close(fb);
+    simplefs_delete("b");
+
+    // Too small for three blocks, the hole left by b is skipped
+    simplefs_create("c");
+    int fc = simplefs_open("c");
+    printf("Write Data: %d\n", simplefs_write(fc, data, BLOCKSIZE * 3));
+    simplefs_close(fc);
+
+    // A third extent moves a's runs into an extent block
+    simplefs_seek(fa, BLOCKSIZE * 3);
+    printf("Write Data: %d\n", simplefs_write(fa, data + BLOCKSIZE * 6, BLOCKSIZE * 4));
+    simplefs_seek(fa, -BLOCKSIZE * 6);
+    printf("Read Data %d\n", simplefs_read(fa, buf, BLOCKSIZE * 10));
+    printf("Match: %d\n", memcmp(data, buf, BLOCKSIZE * 10) == 0);
+
+    simplefs_create("d");
+    int fd = simplefs_open("d");
+    printf("Write Data: %d\n", simplefs_write(fd, data, BLOCKSIZE * 10));
+    simplefs_close(fd);
+    simplefs_dump();
+
+    // Six blocks left in two runs: the write is split, then the disk is full
+    simplefs_create("e");
+    int fe = simplefs_open("e");
+    printf("Write Data: %d\n", simplefs_write(fe, data, BLOCKSIZE * 6));
+    simplefs_close(fe);
+    simplefs_create("f");
+    int ff = simplefs_open("f");
+    printf("Write Data: %d\n", simplefs_write(ff, data, BLOCKSIZE));
+    simplefs_close(ff);
+    simplefs_close(fa);
+    simplefs_unmount();
+
+    printf("Mount: %d\n", simplefs_mount());
+    fa = simplefs_open("a");
+    printf("Read Data %d\n", simplefs_read(fa, buf, BLOCKSIZE * 10));
+    printf("Match: %d\n", memcmp(data, buf, BLOCKSIZE * 10) == 0);
+    simplefs_close(fa);
+    simplefs_delete("a");
+    simplefs_dump();
+}
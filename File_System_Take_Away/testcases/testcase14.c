@@ -0,0 +1,44 @@
+#include "simplefs-ops.h"
+
+int main()
+{
+    struct simplefs_stats stats;
+    char name[MAX_NAME_STRLEN];
+    struct simplefs_geometry geometry = { .block_size = BLOCKSIZE, .num_inodes = 1000, .num_data_blocks = 100 };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&geometry));
+
+    int created = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        snprintf(name, sizeof(name), "f%d", i);
+        created += simplefs_create(name) == i;
+    }
+    printf("Created: %d\n", created);
+    printf("Create full: %d\n", simplefs_create("extra"));
+    printf("Create duplicate: %d\n", simplefs_create("f500"));
+
+    // Lookups are answered by the name index, open only reads the inode it pins
+    simplefs_resetStats();
+    int fd = simplefs_open("f999");
+    printf("Open f999: %d\n", fd);
+    printf("Open missing: %d\n", simplefs_open("nofile"));
+    simplefs_getStats(&stats);
+    printf("Hits: %ld Misses: %ld Blocks touched: %ld\n", stats.name_hits, stats.name_misses, stats.cache_hits + stats.cache_misses);
+    simplefs_close(fd);
+
+    simplefs_delete("f3");
+    printf("Open deleted: %d\n", simplefs_open("f3"));
+    printf("Create: %d\n", simplefs_create("new"));
+    simplefs_unmount();
+
+    printf("Mount: %d\n", simplefs_mount());
+    fd = simplefs_open("new");
+    printf("Open new: %d\n", fd);
+    simplefs_close(fd);
+    fd = simplefs_open("f998");
+    printf("Open f998: %d\n", fd);
+    simplefs_close(fd);
+    printf("Open f3: %d\n", simplefs_open("f3"));
+    simplefs_delete("new");
+    printf("Create f3: %d\n", simplefs_create("f3"));
+}
@@ -0,0 +1,74 @@
+#include "simplefs-ops.h"
+
+int main()
+{
+    struct simplefs_stats stats;
+    char path[64];
+    char buf[BLOCKSIZE];
+    struct simplefs_geometry geometry = { .block_size = BLOCKSIZE, .num_inodes = 400, .num_data_blocks = 300,
+                                          .features = SIMPLEFS_FEATURE_DIRS };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&geometry));
+
+    printf("Mkdir jobs: %d\n", simplefs_mkdir("/jobs"));
+    printf("Mkdir jobs/old: %d\n", simplefs_mkdir("/jobs/old"));
+    printf("Mkdir missing parent: %d\n", simplefs_mkdir("/nodir/x"));
+    printf("Mkdir duplicate: %d\n", simplefs_mkdir("jobs"));
+
+    int created = 0;
+    for (int i = 0; i < 300; i++)
+    {
+        snprintf(path, sizeof(path), "/jobs/run%d", i);
+        created += simplefs_create(path) >= 0;
+    }
+    printf("Created: %d\n", created);
+    printf("Create duplicate: %d\n", simplefs_create("/jobs/run42"));
+
+    // A lookup reads one node per tree level plus the candidate inode
+    simplefs_resetStats();
+    int fd = simplefs_open("/jobs/run299");
+    simplefs_getStats(&stats);
+    printf("Open: %d Blocks touched: %ld\n", fd, stats.cache_hits + stats.cache_misses);
+    simplefs_close(fd);
+
+    char *long_name = "/jobs/old/nightly-artifact-with-a-long-name.tar";
+    printf("Create long name: %d\n", simplefs_create(long_name));
+    fd = simplefs_open(long_name);
+    printf("Write Data: %d\n", simplefs_write(fd, "long names are kept in a name block", 36));
+    printf("Read Data %d\n", simplefs_read(fd, buf, 36));
+    printf("Data: %s\n", buf);
+    simplefs_close(fd);
+    printf("Open truncated name: %d\n", simplefs_open("/jobs/old/nightly"));
+    printf("Open directory: %d\n", simplefs_open("/jobs"));
+    printf("Create under a file: %d\n", simplefs_create("/jobs/run1/x"));
+
+    for (int i = 0; i < 300; i += 2)
+    {
+        snprintf(path, sizeof(path), "/jobs/run%d", i);
+        simplefs_delete(path);
+    }
+    simplefs_unmount();
+
+    printf("Mount: %d\n", simplefs_mount());
+    int found = 0;
+    for (int i = 0; i < 300; i++)
+    {
+        snprintf(path, sizeof(path), "jobs/run%d", i);
+        fd = simplefs_open(path);
+        if (fd >= 0)
+        {
+            found += i % 2;
+            simplefs_close(fd);
+        }
+    }
+    printf("Found odd runs: %d\n", found);
+    printf("Rmdir non-empty: %d\n", simplefs_rmdir("/jobs/old"));
+    simplefs_delete(long_name);
+    printf("Rmdir: %d\n", simplefs_rmdir("/jobs/old"));
+    for (int i = 1; i < 300; i += 2)
+    {
+        snprintf(path, sizeof(path), "/jobs/run%d", i);
+        simplefs_delete(path);
+    }
+    simplefs_create("/jobs/last");
+    simplefs_dump();
+}
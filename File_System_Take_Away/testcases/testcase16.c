@@ -0,0 +1,38 @@
+#include "simplefs-ops.h"
+
+static void report(const char *what, int ret)
+{
+    struct simplefs_stats stats;
+    simplefs_getStats(&stats);
+    printf("%s: %d Block reads: %ld Block writes: %ld\n", what, ret, stats.data_reads, stats.data_writes);
+    simplefs_resetStats();
+}
+
+int main()
+{
+    char data[BLOCKSIZE * 3];
+    char buf[BLOCKSIZE * 3 + 1];
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = 'a' + i % 26;
+    simplefs_formatDisk();
+    simplefs_create("f");
+    int fd = simplefs_open("f");
+
+    simplefs_resetStats();
+    report("New whole block", simplefs_write(fd, data, BLOCKSIZE));
+    report("Overwrite whole block", simplefs_write(fd, data, BLOCKSIZE));
+    report("Patch existing block", simplefs_write(fd, "XYZ", 3));
+    simplefs_seek(fd, BLOCKSIZE);
+    report("New partial block", simplefs_write(fd, data, 10));
+    simplefs_seek(fd, -BLOCKSIZE / 2);
+    report("Straddle two blocks", simplefs_write(fd, data, BLOCKSIZE));
+    simplefs_seek(fd, -BLOCKSIZE / 2);
+    report("Three whole blocks", simplefs_write(fd, data, BLOCKSIZE * 3));
+
+    simplefs_seek(fd, -BLOCKSIZE);
+    printf("Read Data %d\n", simplefs_read(fd, buf, BLOCKSIZE * 3));
+    buf[BLOCKSIZE * 3] = '\0';
+    printf("%s\n", buf);
+    simplefs_close(fd);
+    simplefs_dump();
+}
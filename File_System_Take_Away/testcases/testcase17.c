@@ -0,0 +1,55 @@
+#include "simplefs-ops.h"
+
+static void report(const char *what, int ret)
+{
+    struct simplefs_stats stats;
+    simplefs_getStats(&stats);
+    printf("%s: %d Disk calls: %ld Blocks read: %ld Blocks written: %ld\n", what, ret, stats.disk_calls, stats.disk_reads, stats.disk_writes);
+    simplefs_resetStats();
+}
+
+int main()
+{
+    static char data[BLOCKSIZE * 100];
+    static char buf[BLOCKSIZE * 100];
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = 'a' + (i / 7) % 26;
+
+    struct simplefs_geometry geometry = { .block_size = BLOCKSIZE, .num_inodes = NUM_INODES, .num_data_blocks = 200,
+                                          .features = SIMPLEFS_FEATURE_EXTENTS };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&geometry));
+    simplefs_create("seq");
+    int fd = simplefs_open("seq");
+    simplefs_resetStats();
+    report("Write 100 blocks", simplefs_write(fd, data, sizeof(data)));
+    simplefs_close(fd);
+    simplefs_unmount();
+
+    simplefs_mount();
+    fd = simplefs_open("seq");
+    simplefs_resetStats();
+    report("Read 100 blocks", simplefs_read(fd, buf, sizeof(buf)));
+    printf("Match: %d\n", memcmp(data, buf, sizeof(data)) == 0);
+    simplefs_seek(fd, 10);
+    report("Read unaligned", simplefs_read(fd, buf, BLOCKSIZE * 50));
+    printf("Match: %d\n", memcmp(data + 10, buf, BLOCKSIZE * 50) == 0);
+
+    // A partial write leaves a dirty cached block, which a run read must see
+    simplefs_seek(fd, BLOCKSIZE * 2 - 10);
+    report("Patch", simplefs_write(fd, "0123456789", 10));
+    memcpy(data + BLOCKSIZE * 2, "0123456789", 10);
+    simplefs_seek(fd, -BLOCKSIZE * 2);
+    report("Read 100 blocks", simplefs_read(fd, buf, sizeof(buf)));
+    printf("Match: %d\n", memcmp(data, buf, sizeof(data)) == 0);
+    simplefs_close(fd);
+
+    // Block-mapped files break runs where a pointer block sits between data blocks
+    simplefs_formatDisk();
+    simplefs_create("map");
+    fd = simplefs_open("map");
+    simplefs_resetStats();
+    report("Write 20 blocks", simplefs_write(fd, data, BLOCKSIZE * 20));
+    report("Read 20 blocks", simplefs_read(fd, buf, BLOCKSIZE * 20));
+    printf("Match: %d\n", memcmp(data, buf, BLOCKSIZE * 20) == 0);
+    simplefs_close(fd);
+}
@@ -0,0 +1,87 @@
+#include "simplefs-ops.h"
+
+static void report(const char *what)
+{
+    struct simplefs_stats stats;
+    simplefs_getStats(&stats);
+    printf("%s: Syncs: %ld Commits: %ld Journal blocks: %ld Replays: %ld\n", what, stats.syncs, stats.journal_commits,
+           stats.journal_blocks, stats.journal_replays);
+    simplefs_resetStats();
+}
+
+static void clobber(uint32_t start, uint32_t count)
+{
+    // Lose blocks written home after the last commit, as a crash could
+    int fd = open("simplefs", O_RDWR);
+    char zero[BLOCKSIZE] = {0};
+    for (uint32_t b = start; b < start + count; b++)
+        pwrite(fd, zero, BLOCKSIZE, (off_t)b * BLOCKSIZE);
+    close(fd);
+}
+
+int main()
+{
+    static char data[BLOCKSIZE * 300];
+    static char buf[BLOCKSIZE * 300];
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = 'a' + (i / 5) % 26;
+
+    struct simplefs_geometry small = { .block_size = BLOCKSIZE, .num_inodes = 32, .num_data_blocks = 200,
+                                       .features = SIMPLEFS_FEATURE_JOURNAL, .journal_blocks = 100 };
+    printf("Format small journal: %d\n", simplefs_formatDiskWithGeometry(&small));
+    struct simplefs_geometry geometry = { .block_size = BLOCKSIZE, .num_inodes = 32, .num_data_blocks = 200,
+                                          .features = SIMPLEFS_FEATURE_JOURNAL, .journal_blocks = 400 };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&geometry));
+    simplefs_resetStats();
+
+    // Many operations, one commit
+    char name[8];
+    for (int i = 0; i < 10; i++) {
+        sprintf(name, "f%d", i);
+        simplefs_create(name);
+        int fd = simplefs_open(name);
+        simplefs_write(fd, data + i, BLOCKSIZE + 10);
+        simplefs_close(fd);
+    }
+    report("Before sync");
+    simplefs_sync();
+    report("After sync");
+
+    // Crash: uncommitted work is lost and the checkpoint never made it home
+    simplefs_create("late");
+    clobber(simplefs_layout.inode_bitmap_start, simplefs_layout.inode_table_start + simplefs_layout.inode_table_blocks - 1);
+    printf("Mount: %d\n", simplefs_mount());
+    report("Recovered");
+    for (int i = 0; i < 10; i++) {
+        sprintf(name, "f%d", i);
+        int fd = simplefs_open(name);
+        int ret = simplefs_read(fd, buf, BLOCKSIZE + 10);
+        printf("%s: %d Match: %d\n", name, ret, memcmp(data + i, buf, BLOCKSIZE + 10) == 0);
+        simplefs_close(fd);
+    }
+    int fd = simplefs_open("late");
+    printf("late: %d\n", fd);
+
+    // A write too long for one transaction is split, a failed one undone
+    simplefs_create("big");
+    fd = simplefs_open("big");
+    printf("Write 150 blocks: %d\n", simplefs_write(fd, data, BLOCKSIZE * 150));
+    printf("Write 270 blocks: %d\n", simplefs_write(fd, data, BLOCKSIZE * 270));
+    simplefs_close(fd);
+    simplefs_unmount();
+    report("Unmount");
+
+    printf("Mount: %d\n", simplefs_mount());
+    report("Clean mount");
+    fd = simplefs_open("big");
+    printf("Read 150 blocks: %d\n", simplefs_read(fd, buf, BLOCKSIZE * 150));
+    printf("Match: %d\n", memcmp(data, buf, BLOCKSIZE * 150) == 0);
+    printf("Read 151 blocks: %d\n", simplefs_read(fd, buf, BLOCKSIZE * 151));
+    simplefs_close(fd);
+    simplefs_delete("big");
+    simplefs_create("big");
+    fd = simplefs_open("big");
+    printf("Write 160 blocks: %d\n", simplefs_write(fd, data, BLOCKSIZE * 160));
+    simplefs_close(fd);
+    simplefs_unmount();
+}
@@ -0,0 +1,90 @@
+#include "simplefs-ops.h"
+
+static void appendBoth(int fa, int fb, const char *data)
+{
+    // Two files growing side by side in short appends
+    for (int i = 0; i < 4; i++) {
+        simplefs_write(fa, (char *)data + i * 70, 70);
+        simplefs_seek(fa, 70);
+        simplefs_write(fb, (char *)data + i * 70, 70);
+        simplefs_seek(fb, 70);
+    }
+}
+
+static void report(const char *what)
+{
+    struct simplefs_stats stats;
+    simplefs_getStats(&stats);
+    printf("%s: Allocator calls: %ld\n", what, stats.alloc_calls);
+    simplefs_resetStats();
+}
+
+int main()
+{
+    char data[BLOCKSIZE * 8];
+    char buf[BLOCKSIZE * 8];
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = 'a' + (i / 7) % 26;
+
+    struct simplefs_geometry geometry = { .block_size = BLOCKSIZE, .num_inodes = NUM_INODES,
+                                          .num_data_blocks = NUM_DATA_BLOCKS, .features = SIMPLEFS_FEATURE_EXTENTS };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&geometry));
+
+    // Blocks handed out as the appends arrive interleave the two files
+    simplefs_create("a");
+    simplefs_create("b");
+    int fa = simplefs_open("a");
+    int fb = simplefs_open("b");
+    simplefs_resetStats();
+    appendBoth(fa, fb, data);
+    simplefs_close(fa);
+    simplefs_close(fb);
+    report("Immediate");
+
+    // Delayed, each file gets its blocks in one run when it is closed
+    simplefs_setDelayedAllocation(1);
+    simplefs_create("c");
+    simplefs_create("d");
+    int fc = simplefs_open("c");
+    int fd = simplefs_open("d");
+    appendBoth(fc, fd, data);
+    simplefs_seek(fc, -280);
+    int ret = simplefs_read(fc, buf, 280);
+    printf("Read before close: %d Match: %d\n", ret, memcmp(data, buf, 280) == 0);
+    simplefs_seek(fc, 65);
+    printf("Overwrite across the tail: %d\n", simplefs_write(fc, "XXXXXXXXXX", 10));
+    simplefs_close(fc);
+    simplefs_close(fd);
+    report("Delayed");
+    simplefs_dump();
+
+    // The blocks reserved for e are not handed to f, its spare one is freed by the sync
+    simplefs_create("e");
+    int fe = simplefs_open("e");
+    printf("Write Data: %d\n", simplefs_write(fe, data, BLOCKSIZE * 6));
+    simplefs_create("f");
+    int ff = simplefs_open("f");
+    printf("Write Data: %d\n", simplefs_write(ff, data, BLOCKSIZE * 3));
+    simplefs_sync();
+    printf("Write Data: %d\n", simplefs_write(ff, data, BLOCKSIZE * 2));
+    simplefs_close(fe);
+    simplefs_close(ff);
+    simplefs_setDelayedAllocation(0);
+    simplefs_unmount();
+
+    printf("Mount: %d\n", simplefs_mount());
+    fd = simplefs_open("d");
+    ret = simplefs_read(fd, buf, 280);
+    printf("Read Data: %d Match: %d\n", ret, memcmp(data, buf, 280) == 0);
+    simplefs_close(fd);
+    fc = simplefs_open("c");
+    ret = simplefs_read(fc, buf, 280);
+    printf("Read Data: %d Match: %d\n", ret, memcmp(data, buf, 65) == 0 && memcmp(buf + 65, "XXXXXXXXXX", 10) == 0
+           && memcmp(data + 75, buf + 75, 205) == 0);
+    simplefs_close(fc);
+    fe = simplefs_open("e");
+    ret = simplefs_read(fe, buf, BLOCKSIZE * 6);
+    printf("Read Data: %d Match: %d\n", ret, memcmp(data, buf, BLOCKSIZE * 6) == 0);
+    simplefs_close(fe);
+    simplefs_unmount();
+}
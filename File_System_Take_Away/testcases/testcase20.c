@@ -0,0 +1,57 @@
+#include "simplefs-ops.h"
+
+#define RECORD 70
+#define RECORDS 100
+
+static char data[RECORD * RECORDS];
+
+static void report(const char *what)
+{
+    struct simplefs_stats stats;
+    simplefs_getStats(&stats);
+    printf("%s: Disk calls: %ld Cache hits: %ld Cache misses: %ld Read ahead: %ld\n", what, stats.disk_calls,
+           stats.cache_hits, stats.cache_misses, stats.readahead_blocks);
+}
+
+static int scan(int stride)
+{
+    // Read every record once, `stride` records apart, and check it
+    char buf[RECORD];
+    simplefs_mount();
+    simplefs_resetStats();
+    int fd = simplefs_open("records");
+    int matches = 0;
+    int64_t offset = 0;
+    for (int k = 0; k < RECORDS; k++) {
+        int record = (k * stride) % RECORDS;
+        simplefs_seek(fd, (int64_t)record * RECORD - offset);
+        offset = (int64_t)record * RECORD;
+        int ret = simplefs_read(fd, buf, RECORD);
+        matches += ret == 0 && memcmp(buf, data + offset, RECORD) == 0;
+    }
+    simplefs_close(fd);
+    return matches;
+}
+
+int main()
+{
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = 'a' + (i / 3) % 26;
+
+    struct simplefs_geometry geometry = { .block_size = BLOCKSIZE, .num_inodes = NUM_INODES, .num_data_blocks = 200,
+                                          .features = SIMPLEFS_FEATURE_EXTENTS };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&geometry));
+    simplefs_create("records");
+    int fd = simplefs_open("records");
+    printf("Write Data: %d\n", simplefs_write(fd, data, sizeof(data)));
+    simplefs_close(fd);
+    simplefs_unmount();
+
+    // Each mount starts with an empty cache
+    printf("Sequential matches: %d\n", scan(1));
+    report("Sequential");
+    simplefs_unmount();
+    printf("Random matches: %d\n", scan(37));
+    report("Random");
+    simplefs_unmount();
+}
@@ -0,0 +1,74 @@
+#include "simplefs-ops.h"
+
+static char data[BLOCKSIZE * 40];
+
+static int workload(int mode, const struct simplefs_geometry *geometry, char *image, size_t len)
+{
+    // Write, overwrite and delete files, remount and check them, keep the image
+    char name[8];
+    char buf[BLOCKSIZE * 40];
+    simplefs_setIOMode(mode);
+    simplefs_formatDiskWithGeometry(geometry);
+    for (int i = 0; i < 6; i++) {
+        sprintf(name, "f%d", i);
+        simplefs_create(name);
+        int fd = simplefs_open(name);
+        simplefs_write(fd, data + i, BLOCKSIZE * (i * 6 + 1) + i);
+        simplefs_close(fd);
+    }
+    simplefs_delete("f2");
+    simplefs_sync();
+    int fd = simplefs_open("f5");
+    simplefs_seek(fd, 100);
+    simplefs_write(fd, "patched", 7);
+    simplefs_close(fd);
+    simplefs_unmount();
+
+    int matches = simplefs_mount() == 0;
+    for (int i = 0; i < 6; i++) {
+        if (i == 2)
+            continue;
+        sprintf(name, "f%d", i);
+        fd = simplefs_open(name);
+        int64_t size = BLOCKSIZE * (i * 6 + 1) + i;
+        int ret = simplefs_read(fd, buf, size);
+        if (i == 5)
+            matches += ret == 0 && memcmp(buf, data + i, 100) == 0 && memcmp(buf + 100, "patched", 7) == 0
+                       && memcmp(buf + 107, data + i + 107, size - 107) == 0;
+        else
+            matches += ret == 0 && memcmp(buf, data + i, size) == 0;
+        simplefs_close(fd);
+    }
+    simplefs_unmount();
+    FILE *fp = fopen("simplefs", "r");
+    size_t got = fread(image, 1, len, fp);
+    fclose(fp);
+    simplefs_setIOMode(SIMPLEFS_IO_FD);
+    return got == len ? matches : -1;
+}
+
+int main()
+{
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = 'a' + (i / 5) % 26;
+    struct simplefs_geometry plain = { .block_size = BLOCKSIZE, .num_inodes = NUM_INODES, .num_data_blocks = 200,
+                                       .features = SIMPLEFS_FEATURE_EXTENTS };
+    struct simplefs_geometry journal = { .block_size = BLOCKSIZE, .num_inodes = 32, .num_data_blocks = 200,
+                                         .features = SIMPLEFS_FEATURE_EXTENTS | SIMPLEFS_FEATURE_JOURNAL,
+                                         .journal_blocks = 400 };
+    const struct simplefs_geometry *geometries[] = { &plain, &journal };
+
+    // The ring, or the fd backend it falls back to, leaves the image byte for byte the same
+    for (int g = 0; g < 2; g++) {
+        simplefs_formatDiskWithGeometry(geometries[g]);
+        struct stat st;
+        stat("simplefs", &st);
+        char *fd_image = malloc(st.st_size), *ring_image = malloc(st.st_size);
+        int fd_matches = workload(SIMPLEFS_IO_FD, geometries[g], fd_image, st.st_size);
+        int ring_matches = workload(SIMPLEFS_IO_URING, geometries[g], ring_image, st.st_size);
+        printf("%s: fd matches: %d ring matches: %d images equal: %d\n", g ? "Journal" : "Plain", fd_matches, ring_matches,
+               memcmp(fd_image, ring_image, st.st_size) == 0);
+        free(fd_image);
+        free(ring_image);
+    }
+}
@@ -0,0 +1,70 @@
+#include "simplefs-ops.h"
+
+static int64_t onDiskSize(int inode_number)
+{
+    // Size field of an inode as stored in the image file
+    struct inode_t inode;
+    FILE *fp = fopen("simplefs", "r");
+    fseek(fp, (long)simplefs_layout.inode_table_start * simplefs_layout.block_size + inode_number * sizeof(struct inode_t), SEEK_SET);
+    size_t got = fread(&inode, sizeof(inode), 1, fp);
+    fclose(fp);
+    return got == 1 ? inode.file_size : -1;
+}
+
+int main()
+{
+    struct simplefs_stats stats;
+    char data[100], buf[100];
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = 'A' + i % 26;
+
+    simplefs_formatDisk();
+    simplefs_create("shared");
+    int fd1 = simplefs_open("shared");
+    int fd2 = simplefs_open("shared");
+
+    // Both handles see the inode the other one changed
+    printf("Write Data: %d\n", simplefs_write(fd1, data, sizeof(data)));
+    printf("Seek: %d\n", simplefs_seek(fd2, 60));
+    int ret = simplefs_read(fd2, buf, 40);
+    printf("Read Data: %d Match: %d\n", ret, memcmp(buf, data + 60, 40) == 0);
+
+    // Seeks and reads no longer go back to the inode table
+    simplefs_resetStats();
+    for (int i = 0; i < 1000; i++)
+        simplefs_seek(fd2, i % 2 ? 40 : -40);
+    simplefs_getStats(&stats);
+    printf("Seeks blocks touched: %ld\n", stats.cache_hits + stats.cache_misses);
+    simplefs_resetStats();
+    for (int i = 0; i < 10; i++)
+        simplefs_read(fd2, buf, 10);
+    simplefs_getStats(&stats);
+    printf("Reads blocks touched: %ld Data blocks read: %ld\n", stats.cache_hits + stats.cache_misses, stats.data_reads);
+
+    // The size reaches the image at sync, the handles stay open
+    simplefs_sync();
+    printf("Size after sync: %ld\n", (long)onDiskSize(0));
+
+    // Written back when the last handle closes
+    simplefs_seek(fd1, 40);
+    printf("Write Data: %d\n", simplefs_write(fd1, data, 60));
+    simplefs_close(fd1);
+    simplefs_close(fd2);
+    simplefs_unmount();
+    printf("Size after close: %ld\n", (long)onDiskSize(0));
+
+    simplefs_mount();
+    int fd = simplefs_open("shared");
+    printf("Seek: %d\n", simplefs_seek(fd, 100));
+    simplefs_seek(fd, -100);
+    ret = simplefs_read(fd, buf, 40);
+    printf("Read Data: %d Match: %d\n", ret, memcmp(buf, data, 40) == 0);
+    ret = simplefs_read(fd, buf, 100);
+    printf("Read Data: %d Match: %d\n", ret, memcmp(buf + 40, data, 60) == 0);
+
+    // A file deleted under an open handle reads as empty
+    simplefs_delete("shared");
+    printf("Read deleted: %d\n", simplefs_read(fd, buf, 10));
+    simplefs_close(fd);
+    simplefs_unmount();
+}
@@ -0,0 +1,47 @@
+#include "simplefs-ops.h"
+
+#define HANDLES 5000
+
+static int fds[HANDLES];
+
+int main()
+{
+    char buf[10];
+    simplefs_formatDisk();
+    simplefs_create("many");
+    int fd = simplefs_open("many");
+    printf("Write Data: %d\n", simplefs_write(fd, "0123456789", 10));
+    simplefs_close(fd);
+
+    // Far more handles than the old fixed table held, each one usable
+    int opened = 0, distinct = 1, readable = 0;
+    for (int i = 0; i < HANDLES; i++) {
+        fds[i] = simplefs_open("many");
+        opened += fds[i] >= 0;
+        distinct &= i == 0 || fds[i] != fds[i - 1];
+    }
+    for (int i = 0; i < HANDLES; i++) {
+        simplefs_seek(fds[i], i % 10);
+        int ret = simplefs_read(fds[i], buf, 1);
+        readable += ret == 0 && buf[0] == '0' + i % 10;
+    }
+    printf("Opened: %d Distinct: %d Readable: %d\n", opened, distinct, readable);
+
+    // A closed handle is rejected, also once its slot is in use again
+    int stale = fds[100];
+    simplefs_close(stale);
+    printf("Read closed: %d Seek closed: %d\n", simplefs_read(stale, buf, 1), simplefs_seek(stale, 1));
+    int reused = simplefs_open("many");
+    printf("Reopened: %d Same number: %d\n", reused >= 0, reused == stale);
+    printf("Read stale: %d Write stale: %d\n", simplefs_read(stale, buf, 1), simplefs_write(stale, "x", 1));
+    simplefs_close(stale);
+    printf("Read reopened: %d\n", simplefs_read(reused, buf, 10));
+    printf("Read bogus: %d Read negative: %d\n", simplefs_read(1 << 24, buf, 1), simplefs_read(-1, buf, 1));
+    fds[100] = reused;
+
+    for (int i = 0; i < HANDLES; i++)
+        simplefs_close(fds[i]);
+    simplefs_delete("many");
+    printf("Open deleted: %d\n", simplefs_open("many"));
+    simplefs_unmount();
+}
@@ -0,0 +1,152 @@
+#include "simplefs-ops.h"
+
+static int64_t position;	// offset of the handle in use, simplefs_read/write leave it alone
+
+static void moveTo(int fd, int64_t offset)
+{
+    simplefs_seek(fd, offset - position);
+    position = offset;
+}
+
+static int isZero(const char *buf, int len)
+{
+    for (int i = 0; i < len; i++)
+        if (buf[i])
+            return 0;
+    return 1;
+}
+
+static void query(int fd, int64_t offset)
+{
+    // Both queries move the handle, the second one last
+    int64_t data = simplefs_seekData(fd, offset, SIMPLEFS_SEEK_DATA);
+    int64_t hole = simplefs_seekData(fd, offset, SIMPLEFS_SEEK_HOLE);
+    if (hole != -1)
+        position = hole;
+    printf("From %lld: data %lld hole %lld\n", (long long)offset, (long long)data, (long long)hole);
+}
+
+static int numExtents()
+{
+    struct inode_t inode;
+    simplefs_readInode(0, &inode);
+    return inode.num_extents;
+}
+
+int main()
+{
+    struct simplefs_stats stats;
+    static char buf[4096 * 4];
+    int ret;
+
+    // Block-mapped: the data past the hole lands in the double indirect range
+    simplefs_formatDisk();
+    simplefs_create("sparse");
+    int fd = simplefs_open("sparse");
+    position = 0;
+    printf("Write Data: %d\n", simplefs_write(fd, "Start", 5));
+    moveTo(fd, BLOCKSIZE * 100);
+    printf("Write Data: %d\n", simplefs_write(fd, "End", 3));
+    moveTo(fd, BLOCKSIZE);
+    simplefs_resetStats();
+    ret = simplefs_read(fd, buf, BLOCKSIZE * 4);
+    simplefs_getStats(&stats);
+    printf("Read hole: %d Zeros: %d Blocks touched: %ld\n", ret, isZero(buf, BLOCKSIZE * 4), stats.cache_hits + stats.cache_misses);
+    query(fd, 2);
+    query(fd, BLOCKSIZE);
+    query(fd, BLOCKSIZE * 100 + 1);
+    query(fd, BLOCKSIZE * 100 + 3);
+
+    // A write into the hole maps just its own block
+    moveTo(fd, BLOCKSIZE * 2 + 10);
+    printf("Write Data: %d\n", simplefs_write(fd, "Mid", 3));
+    moveTo(fd, 0);
+    ret = simplefs_read(fd, buf, BLOCKSIZE * 4);
+    printf("Read Data: %d Start: %d Zeros: %d Mid: %d Zeros: %d\n", ret, memcmp(buf, "Start", 5) == 0,
+           isZero(buf + 5, BLOCKSIZE * 2 + 5), memcmp(buf + BLOCKSIZE * 2 + 10, "Mid", 3) == 0,
+           isZero(buf + BLOCKSIZE * 2 + 13, BLOCKSIZE * 2 - 13));
+    query(fd, BLOCKSIZE);
+    query(fd, BLOCKSIZE * 3);
+    simplefs_close(fd);
+    simplefs_dump();
+
+    // Extent-mapped: holes are extents without blocks
+    int bs = 512;
+    struct simplefs_geometry geometry = { .block_size = bs, .num_inodes = NUM_INODES, .num_data_blocks = 60,
+                                          .features = SIMPLEFS_FEATURE_EXTENTS };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&geometry));
+    simplefs_create("sparse");
+    fd = simplefs_open("sparse");
+    position = 0;
+    printf("Write Data: %d\n", simplefs_write(fd, "Start", 5));
+    moveTo(fd, (int64_t)bs * 1000);
+    ret = simplefs_write(fd, "End", 3);
+    printf("Write Data: %d Extents: %d\n", ret, numExtents());
+    query(fd, 0);
+    query(fd, (int64_t)bs * 500);
+
+    // Filling a hole a block at a time grows a single extent
+    char block[512];
+    memset(block, 'f', bs);
+    ret = 0;
+    for (int i = 10; i < 30; i++) {
+        moveTo(fd, (int64_t)bs * i);
+        ret |= simplefs_write(fd, block, bs);
+    }
+    printf("Fill: %d Extents: %d\n", ret, numExtents());
+    query(fd, bs * 5);
+    query(fd, bs * 12);
+
+    // A partial write into a hole keeps the rest of its block zero
+    moveTo(fd, (int64_t)bs * 500 + 7);
+    ret = simplefs_write(fd, "Mid", 3);
+    printf("Write Data: %d Extents: %d\n", ret, numExtents());
+    moveTo(fd, (int64_t)bs * 500);
+    ret = simplefs_read(fd, buf, bs);
+    printf("Read Data: %d Mid: %d Zeros: %d %d\n", ret, memcmp(buf + 7, "Mid", 3) == 0, isZero(buf, 7), isZero(buf + 10, bs - 10));
+
+    // Filling more hole than there are free blocks fails and changes nothing
+    static char big[512 * 100];
+    moveTo(fd, (int64_t)bs * 100);
+    int before = numExtents();
+    ret = simplefs_write(fd, big, sizeof(big));
+    printf("Write too much: %d Extents: %d -> %d\n", ret, before, numExtents());
+    moveTo(fd, (int64_t)bs * 950);
+    ret = simplefs_write(fd, big, sizeof(big));
+    printf("Write past the end: %d Extents: %d\n", ret, numExtents());
+    moveTo(fd, (int64_t)bs * 1001);
+    ret = simplefs_write(fd, big, bs * 30);
+    printf("Write 30 blocks: %d Extents: %d\n", ret, numExtents());
+    moveTo(fd, 0);
+    ret = simplefs_read(fd, buf, 5);
+    printf("Read Data: %d Start: %d\n", ret, memcmp(buf, "Start", 5) == 0);
+    query(fd, bs * 600);
+    simplefs_close(fd);
+    simplefs_unmount();
+
+    // Holes survive a remount, also one left under delayed allocation
+    printf("Mount: %d\n", simplefs_mount());
+    simplefs_setDelayedAllocation(1);
+    fd = simplefs_open("sparse");
+    position = 0;
+    moveTo(fd, (int64_t)bs * 1000 + 3);
+    printf("Write Data: %d\n", simplefs_write(fd, "er", 2));
+    moveTo(fd, (int64_t)bs * 2000);
+    printf("Write Data: %d\n", simplefs_write(fd, "Far", 3));
+    simplefs_close(fd);
+    simplefs_setDelayedAllocation(0);
+    simplefs_unmount();
+    printf("Mount: %d\n", simplefs_mount());
+    fd = simplefs_open("sparse");
+    position = 0;
+    moveTo(fd, (int64_t)bs * 1000);
+    ret = simplefs_read(fd, buf, 5);
+    printf("Read Data: %d Ender: %d\n", ret, memcmp(buf, "Ender", 5) == 0);
+    moveTo(fd, (int64_t)bs * 2000);
+    ret = simplefs_read(fd, buf, 3);
+    printf("Read Data: %d Far: %d\n", ret, memcmp(buf, "Far", 3) == 0);
+    query(fd, bs * 1500);
+    query(fd, bs * 1020);
+    printf("Extents: %d\n", numExtents());
+    simplefs_close(fd);
+}
@@ -0,0 +1,151 @@
+#include "simplefs-ops.h"
+
+static int64_t position;	// offset of the handle in use, simplefs_read/write leave it alone
+
+static void moveTo(int fd, int64_t offset)
+{
+    simplefs_seek(fd, offset - position);
+    position = offset;
+}
+
+static int isFilled(const char *buf, int len, char c)
+{
+    for (int i = 0; i < len; i++)
+        if (buf[i] != c)
+            return 0;
+    return 1;
+}
+
+static int numExtents(int inode_number)
+{
+    struct inode_t inode;
+    simplefs_readInode(inode_number, &inode);
+    return inode.num_extents;
+}
+
+int main()
+{
+    struct simplefs_stats stats;
+    static char buf[512 * 64];
+    int ret;
+
+    // Block-mapped: the file reaches into the double indirect range
+    simplefs_formatDisk();
+    simplefs_create("f");
+    int fd = simplefs_open("f");
+    position = 0;
+    memset(buf, 'a', BLOCKSIZE * 24);
+    printf("Write Data: %d\n", simplefs_write(fd, buf, BLOCKSIZE * 24));
+
+    // Shrinking frees the blocks past the end and the pointer blocks left empty
+    printf("Truncate: %d\n", simplefs_truncate(fd, BLOCKSIZE * 5 + 10));
+    simplefs_dump();
+
+    // Growing again reads zeros, also over the rest of the block that was cut
+    printf("Truncate: %d\n", simplefs_truncate(fd, BLOCKSIZE * 8));
+    ret = simplefs_read(fd, buf, BLOCKSIZE * 8);
+    printf("Read Data: %d Kept: %d Zeros: %d\n", ret, isFilled(buf, BLOCKSIZE * 5 + 10, 'a'),
+           isFilled(buf + BLOCKSIZE * 5 + 10, BLOCKSIZE * 3 - 10, 0));
+    ret = simplefs_truncate(fd, -1);
+    printf("Truncate: %d %d\n", ret, simplefs_truncate(fd, 0));
+
+    // Preallocation takes the blocks in runs, the writes that follow allocate nothing
+    simplefs_resetStats();
+    ret = simplefs_fallocate(fd, 0, BLOCKSIZE * 24);
+    simplefs_getStats(&stats);
+    printf("Fallocate: %d Allocator calls: %ld\n", ret, stats.alloc_calls);
+    ret = simplefs_read(fd, buf, BLOCKSIZE * 24);
+    printf("Read Data: %d Zeros: %d\n", ret, isFilled(buf, BLOCKSIZE * 24, 0));
+    simplefs_resetStats();
+    memset(buf, 'b', BLOCKSIZE);
+    ret = 0;
+    for (int i = 0; i < 24; i++) {
+        moveTo(fd, BLOCKSIZE * i);
+        ret |= simplefs_write(fd, buf, BLOCKSIZE);
+    }
+    simplefs_getStats(&stats);
+    printf("Write Data: %d Allocator calls: %ld\n", ret, stats.alloc_calls);
+
+    // More than the free blocks fails and leaves the file empty
+    simplefs_create("g");
+    int fd2 = simplefs_open("g");
+    ret = simplefs_fallocate(fd2, 0, BLOCKSIZE * 10);
+    printf("Fallocate too much: %d Read: %d\n", ret, simplefs_read(fd2, buf, 1));
+    ret = simplefs_truncate(fd, BLOCKSIZE * 4);
+    printf("Truncate: %d Fallocate: %d\n", ret, simplefs_fallocate(fd2, BLOCKSIZE * 2, BLOCKSIZE * 10));
+    simplefs_close(fd2);
+    simplefs_close(fd);
+    simplefs_dump();
+
+    // Extent-mapped: preallocating past the end leaves a hole before the new run
+    int bs = 512;
+    struct simplefs_geometry geometry = { .block_size = bs, .num_inodes = NUM_INODES, .num_data_blocks = 60,
+                                          .features = SIMPLEFS_FEATURE_EXTENTS };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&geometry));
+    simplefs_create("e");
+    fd = simplefs_open("e");
+    position = 0;
+    memset(buf, 'c', bs * 20);
+    printf("Write Data: %d\n", simplefs_write(fd, buf, bs * 20));
+    ret = simplefs_fallocate(fd, (int64_t)bs * 30, bs * 10);
+    printf("Fallocate: %d Extents: %d\n", ret, numExtents(0));
+    ret = simplefs_read(fd, buf, bs * 40);
+    printf("Read Data: %d Kept: %d Zeros: %d\n", ret, isFilled(buf, bs * 20, 'c'), isFilled(buf + bs * 20, bs * 20, 0));
+
+    // Cutting into the hole drops the run after it, cutting into a run shortens it
+    ret = simplefs_truncate(fd, (int64_t)bs * 25);
+    printf("Truncate: %d Extents: %d\n", ret, numExtents(0));
+    ret = simplefs_truncate(fd, (int64_t)bs * 10 + 100);
+    printf("Truncate: %d Extents: %d\n", ret, numExtents(0));
+    simplefs_dump();
+
+    // Failing preallocation changes nothing, one that fits grows the same extent
+    ret = simplefs_fallocate(fd, 0, bs * 70);
+    printf("Fallocate too much: %d Extents: %d\n", ret, numExtents(0));
+    simplefs_resetStats();
+    ret = simplefs_fallocate(fd, 0, bs * 40);
+    simplefs_getStats(&stats);
+    printf("Fallocate: %d Extents: %d Allocator calls: %ld\n", ret, numExtents(0), stats.alloc_calls);
+    ret = simplefs_read(fd, buf, bs * 40);
+    printf("Read Data: %d Kept: %d Zeros: %d\n", ret, isFilled(buf, bs * 10 + 100, 'c'), isFilled(buf + bs * 10 + 100, bs * 30 - 100, 0));
+    simplefs_resetStats();
+    memset(buf, 'd', bs * 40);
+    ret = simplefs_write(fd, buf, bs * 40);
+    simplefs_getStats(&stats);
+    printf("Write Data: %d Allocator calls: %ld\n", ret, stats.alloc_calls);
+    simplefs_close(fd);
+
+    // Journaled: preallocation and truncation survive a remount
+    struct simplefs_geometry journal = { .block_size = BLOCKSIZE, .num_inodes = 32, .num_data_blocks = 200,
+                                         .features = SIMPLEFS_FEATURE_JOURNAL, .journal_blocks = 400 };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&journal));
+    simplefs_create("j");
+    fd = simplefs_open("j");
+    position = 0;
+    ret = simplefs_fallocate(fd, 0, BLOCKSIZE * 100);
+    moveTo(fd, BLOCKSIZE * 50);
+    memset(buf, 'e', BLOCKSIZE);
+    printf("Fallocate: %d Write Data: %d\n", ret, simplefs_write(fd, buf, BLOCKSIZE));
+    ret = simplefs_truncate(fd, BLOCKSIZE * 60 + 5);
+    printf("Truncate: %d\n", ret);
+
+    // A delayed tail is cut in memory
+    simplefs_setDelayedAllocation(1);
+    moveTo(fd, BLOCKSIZE * 60 + 5);
+    memset(buf, 'f', BLOCKSIZE * 3);
+    ret = simplefs_write(fd, buf, BLOCKSIZE * 3);
+    printf("Write Data: %d Truncate: %d\n", ret, simplefs_truncate(fd, BLOCKSIZE * 62));
+    simplefs_close(fd);
+    simplefs_setDelayedAllocation(0);
+    simplefs_unmount();
+
+    printf("Mount: %d\n", simplefs_mount());
+    fd = simplefs_open("j");
+    position = 0;
+    ret = simplefs_read(fd, buf, BLOCKSIZE * 62);
+    printf("Read Data: %d Zeros: %d Data: %d Zeros: %d Tail: %d\n", ret, isFilled(buf, BLOCKSIZE * 50, 0),
+           isFilled(buf + BLOCKSIZE * 50, BLOCKSIZE, 'e'), isFilled(buf + BLOCKSIZE * 51, BLOCKSIZE * 9 + 5, 0),
+           isFilled(buf + BLOCKSIZE * 60 + 5, BLOCKSIZE * 2 - 5, 'f'));
+    printf("Read past the end: %d\n", simplefs_read(fd, buf, BLOCKSIZE * 62 + 1));
+    simplefs_close(fd);
+}
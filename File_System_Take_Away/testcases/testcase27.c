@@ -0,0 +1,81 @@
+#include "simplefs-ops.h"
+
+static void printInodes(const char *what, int ret, const int *inodes, int n)
+{
+    printf("%s: %d Inodes:", what, ret);
+    for (int i = 0; i < n; i++)
+        printf(" %d", inodes[i]);
+    printf("\n");
+}
+
+int main()
+{
+    int inodes[64];
+    int ret;
+
+    // Flat: a name already taken, one repeated in the batch and more names than inodes
+    simplefs_formatDisk();
+    simplefs_create("taken");
+    char *flat[] = {"a", "taken", "b", "a", "c", "d", "e", "f", "g", "h"};
+    ret = simplefs_createMany(flat, 10, inodes);
+    printInodes("Create many", ret, inodes, 10);
+    int fd = simplefs_open("c");
+    printf("Write Data: %d\n", simplefs_write(fd, "Batch", 5));
+    simplefs_close(fd);
+    simplefs_dump();
+
+    // Missing and repeated names are passed over, the freed inodes are reused lowest first
+    char *gone[] = {"b", "missing", "c", "b", "taken"};
+    printf("Delete many: %d\n", simplefs_deleteMany(gone, 5));
+    char *again[] = {"x", "y", "z"};
+    ret = simplefs_createMany(again, 3, inodes);
+    printInodes("Create many", ret, inodes, 3);
+    ret = simplefs_open("c");
+    printf("Open c: %d Open x: %d\n", ret, simplefs_open("x"));
+    simplefs_dump();
+
+    // Directories: names are leaves of their own directory, long ones get a name block
+    struct simplefs_geometry geometry = { .block_size = BLOCKSIZE, .num_inodes = 32, .num_data_blocks = 60,
+                                          .features = SIMPLEFS_FEATURE_DIRS };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&geometry));
+    printf("Mkdir: %d\n", simplefs_mkdir("/d"));
+    char *paths[] = {"/d/one", "/d/two", "/nodir/three", "/d/a-name-longer-than-an-inode-holds", "/d/one", "/four"};
+    ret = simplefs_createMany(paths, 6, inodes);
+    printInodes("Create many", ret, inodes, 6);
+    ret = simplefs_open("/d/a-name-longer-than-an-inode-holds");
+    printf("Open: %d %d\n", ret >= 0, simplefs_open("/nodir/three"));
+    char *dirgone[] = {"/d", "/d/one", "/d/a-name-longer-than-an-inode-holds", "/four"};
+    printf("Delete many: %d\n", simplefs_deleteMany(dirgone, 4));
+    printf("Rmdir: %d\n", simplefs_rmdir("/d"));
+    simplefs_dump();
+
+    // Journaled: batches larger than one journal handle survive a remount
+    struct simplefs_geometry journal = { .block_size = BLOCKSIZE, .num_inodes = 600, .num_data_blocks = 200,
+                                         .features = SIMPLEFS_FEATURE_JOURNAL, .journal_blocks = 400 };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&journal));
+    static char names[500][16];
+    static char *list[500];
+    static int many[500];
+    for (int i = 0; i < 500; i++) {
+        sprintf(names[i], "s%d", i);
+        list[i] = names[i];
+    }
+    ret = simplefs_createMany(list, 500, many);
+    printf("Create many: %d First: %d Last: %d\n", ret, many[0], many[499]);
+    fd = simplefs_open("s250");
+    printf("Write Data: %d\n", simplefs_write(fd, "Kept", 4));
+    simplefs_close(fd);
+    printf("Delete many: %d\n", simplefs_deleteMany(list, 250));
+    simplefs_unmount();
+    printf("Mount: %d\n", simplefs_mount());
+    char buf[4];
+    fd = simplefs_open("s250");
+    ret = simplefs_read(fd, buf, 4);
+    printf("Read Data: %d Kept: %d\n", ret, memcmp(buf, "Kept", 4) == 0);
+    simplefs_close(fd);
+    ret = simplefs_open("s0");
+    printf("Open s0: %d Open s499: %d\n", ret, simplefs_open("s499") >= 0);
+    printf("Delete many: %d\n", simplefs_deleteMany(list, 500));
+    ret = simplefs_createMany(list, 500, many);
+    printf("Create many: %d First: %d Last: %d\n", ret, many[0], many[499]);
+}
@@ -0,0 +1,114 @@
+#include "simplefs-ops.h"
+
+static int isFilled(const char *buf, int len, char c)
+{
+    for (int i = 0; i < len; i++)
+        if (buf[i] != c)
+            return 0;
+    return 1;
+}
+
+int main()
+{
+    static char buf[BLOCKSIZE * 30];
+    int ret;
+
+    // Block-mapped: the snapshot shares the data, the live file gets copies of what it overwrites
+    struct simplefs_geometry geometry = { .block_size = BLOCKSIZE, .num_inodes = 16, .num_data_blocks = 60,
+                                          .features = SIMPLEFS_FEATURE_SNAPSHOTS, .snapshots = 4 };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&geometry));
+    simplefs_create("a");
+    simplefs_create("b");
+    int fd = simplefs_open("a");
+    memset(buf, 'a', BLOCKSIZE * 6);
+    printf("Write Data: %d\n", simplefs_write(fd, buf, BLOCKSIZE * 6));
+    int fd2 = simplefs_open("b");
+    printf("Write Data: %d\n", simplefs_write(fd2, "Short", 5));
+    int snap = simplefs_snapshotCreate();
+    printf("Snapshot: %d\n", snap);
+    simplefs_dump();
+
+    memset(buf, 'x', 10);
+    printf("Write Data: %d\n", simplefs_write(fd, buf, 10));
+    simplefs_seek(fd, BLOCKSIZE * 5);
+    memset(buf, 'y', BLOCKSIZE * 3);
+    printf("Write Data: %d\n", simplefs_write(fd, buf, BLOCKSIZE * 3));
+    simplefs_close(fd);
+    simplefs_close(fd2);
+    simplefs_delete("b");
+    ret = simplefs_snapshotCreate();
+    printf("Snapshot: %d %d\n", ret, simplefs_snapshotCreate());
+    printf("Snapshot: %d\n", simplefs_snapshotCreate());
+    printf("Snapshot: %d\n", simplefs_snapshotCreate());
+    simplefs_dump();
+    simplefs_unmount();
+
+    // The first snapshot still holds the old contents and refuses changes
+    printf("Mount snapshot: %d\n", simplefs_mountSnapshot(snap));
+    fd = simplefs_open("a");
+    ret = simplefs_read(fd, buf, BLOCKSIZE * 6);
+    printf("Read Data: %d Kept: %d\n", ret, isFilled(buf, BLOCKSIZE * 6, 'a'));
+    printf("Read past the end: %d\n", simplefs_read(fd, buf, BLOCKSIZE * 6 + 1));
+    printf("Write Data: %d Truncate: %d\n", simplefs_write(fd, buf, 1), simplefs_truncate(fd, 0));
+    simplefs_close(fd);
+    fd = simplefs_open("b");
+    ret = simplefs_read(fd, buf, 5);
+    printf("Read Data: %d Kept: %d\n", ret, memcmp(buf, "Short", 5) == 0);
+    simplefs_close(fd);
+    printf("Create: %d Snapshot: %d\n", simplefs_create("c"), simplefs_snapshotCreate());
+    simplefs_unmount();
+    printf("Mount snapshot: %d\n", simplefs_mountSnapshot(7));
+
+    // Back on the live filesystem the newer data is there, deleting the snapshots frees what they held alone
+    printf("Mount: %d\n", simplefs_mount());
+    fd = simplefs_open("a");
+    ret = simplefs_read(fd, buf, BLOCKSIZE * 8);
+    printf("Read Data: %d New: %d Old: %d New: %d\n", ret, isFilled(buf, 10, 'x'), isFilled(buf + 10, BLOCKSIZE * 5 - 10, 'a'),
+           isFilled(buf + BLOCKSIZE * 5, BLOCKSIZE * 3, 'y'));
+    simplefs_close(fd);
+    printf("Open b: %d\n", simplefs_open("b"));
+    printf("Delete snapshot: %d\n", simplefs_snapshotDelete(snap));
+    printf("Delete snapshot: %d\n", simplefs_snapshotDelete(snap));
+    for (int s = 0; s < 4; s++)
+        if (s != snap)
+            simplefs_snapshotDelete(s);
+    simplefs_dump();
+
+    // Extent-mapped with directories and a journal: a partial overwrite splits the shared extent
+    struct simplefs_geometry extents = { .block_size = BLOCKSIZE, .num_inodes = 16, .num_data_blocks = 200,
+                                         .features = SIMPLEFS_FEATURE_EXTENTS | SIMPLEFS_FEATURE_DIRS | SIMPLEFS_FEATURE_JOURNAL
+                                                   | SIMPLEFS_FEATURE_SNAPSHOTS,
+                                         .journal_blocks = 400, .snapshots = 2 };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&extents));
+    simplefs_mkdir("/d");
+    simplefs_create("/d/e");
+    fd = simplefs_open("/d/e");
+    memset(buf, 'e', BLOCKSIZE * 20);
+    printf("Write Data: %d\n", simplefs_write(fd, buf, BLOCKSIZE * 20));
+    snap = simplefs_snapshotCreate();
+    printf("Snapshot: %d\n", snap);
+    simplefs_seek(fd, BLOCKSIZE * 8 + 3);
+    memset(buf, 'f', BLOCKSIZE * 2);
+    printf("Write Data: %d\n", simplefs_write(fd, buf, BLOCKSIZE * 2));
+    printf("Truncate: %d\n", simplefs_truncate(fd, BLOCKSIZE * 12 + 7));
+    simplefs_close(fd);
+    simplefs_create("/d/g");
+    simplefs_unmount();
+
+    printf("Mount snapshot: %d\n", simplefs_mountSnapshot(snap));
+    fd = simplefs_open("/d/e");
+    ret = simplefs_read(fd, buf, BLOCKSIZE * 20);
+    printf("Read Data: %d Kept: %d Open g: %d\n", ret, isFilled(buf, BLOCKSIZE * 20, 'e'), simplefs_open("/d/g"));
+    printf("Mkdir: %d\n", simplefs_mkdir("/x"));
+    simplefs_close(fd);
+    simplefs_unmount();
+
+    printf("Mount: %d\n", simplefs_mount());
+    fd = simplefs_open("/d/e");
+    ret = simplefs_read(fd, buf, BLOCKSIZE * 12 + 7);
+    printf("Read Data: %d Old: %d New: %d Old: %d\n", ret, isFilled(buf, BLOCKSIZE * 8 + 3, 'e'),
+           isFilled(buf + BLOCKSIZE * 8 + 3, BLOCKSIZE * 2, 'f'), isFilled(buf + BLOCKSIZE * 10 + 3, BLOCKSIZE * 2 + 4, 'e'));
+    simplefs_close(fd);
+    printf("Delete snapshot: %d\n", simplefs_snapshotDelete(snap));
+    simplefs_dump();
+}
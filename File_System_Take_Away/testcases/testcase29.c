@@ -0,0 +1,138 @@
+#include "simplefs-ops.h"
+
+static int64_t position;	// offset of the handle in use, simplefs_read/write leave it alone
+
+static void moveTo(int fd, int64_t offset)
+{
+    simplefs_seek(fd, offset - position);
+    position = offset;
+}
+
+static void fillLog(char *buf, int len, int seed)
+{
+    // Text much like a log file, repetitive enough to compress well
+    int n = 0;
+    for (int line = seed; n < len; line++) {
+        char text[64];
+        int k = sprintf(text, "%06d INFO request served in %d ms\n", line, line % 97);
+        for (int i = 0; i < k && n < len; i++)
+            buf[n++] = text[i];
+    }
+}
+
+int main()
+{
+    struct simplefs_stats stats;
+    static char buf[512 * 64], log[512 * 64];
+    int ret;
+
+    // Extent-mapped with compression: each whole 4 KB cluster is stored compressed
+    int bs = 512;
+    struct simplefs_geometry geometry = { .block_size = bs, .num_inodes = 16, .num_data_blocks = 60,
+                                          .features = SIMPLEFS_FEATURE_EXTENTS | SIMPLEFS_FEATURE_COMPRESSION };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&geometry));
+    simplefs_create("log");
+    int fd = simplefs_open("log");
+    position = 0;
+    fillLog(log, bs * 40, 0);
+    simplefs_resetStats();
+    ret = simplefs_write(fd, log, bs * 40 + 100);
+    simplefs_getStats(&stats);
+    printf("Write Data: %d Clusters packed: %ld\n", ret, stats.packs);
+    simplefs_dump();
+
+    // A cluster is expanded once, reading it again comes from the cache
+    simplefs_resetStats();
+    ret = simplefs_read(fd, buf, bs * 40 + 100);
+    simplefs_getStats(&stats);
+    printf("Read Data: %d Same: %d Clusters expanded: %ld\n", ret, memcmp(buf, log, bs * 40 + 100) == 0, stats.unpacks);
+    simplefs_resetStats();
+    ret = simplefs_read(fd, buf, bs * 40 + 100);
+    simplefs_getStats(&stats);
+    printf("Read Data: %d Same: %d Clusters expanded: %ld\n", ret, memcmp(buf, log, bs * 40 + 100) == 0, stats.unpacks);
+
+    // Writing inside a cluster expands it, it is packed again at the next sync
+    moveTo(fd, bs * 9 + 7);
+    memset(log + bs * 9 + 7, 'z', bs * 2);
+    simplefs_resetStats();
+    ret = simplefs_write(fd, log + bs * 9 + 7, bs * 2);
+    simplefs_getStats(&stats);
+    printf("Write Data: %d Clusters packed: %ld\n", ret, stats.packs);
+    moveTo(fd, 0);
+    ret = simplefs_read(fd, buf, bs * 40 + 100);
+    printf("Read Data: %d Same: %d\n", ret, memcmp(buf, log, bs * 40 + 100) == 0);
+    simplefs_resetStats();
+    simplefs_sync();
+    simplefs_getStats(&stats);
+    printf("Sync: Clusters packed: %ld\n", stats.packs);
+
+    // A write running to the end of a cluster packs it again where it is
+    moveTo(fd, bs * 30);
+    memset(log + bs * 30, 'y', bs * 2);
+    simplefs_resetStats();
+    ret = simplefs_write(fd, log + bs * 30, bs * 2);
+    simplefs_getStats(&stats);
+    printf("Write Data: %d Clusters packed: %ld Expanded: %ld\n", ret, stats.packs, stats.unpacks);
+    moveTo(fd, 0);
+    ret = simplefs_read(fd, buf, bs * 40 + 100);
+    printf("Read Data: %d Same: %d\n", ret, memcmp(buf, log, bs * 40 + 100) == 0);
+    simplefs_dump();
+
+    // Data that does not compress stays in plain blocks
+    simplefs_create("noise");
+    int fd2 = simplefs_open("noise");
+    unsigned seed = 1;
+    for (int i = 0; i < bs * 8; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+    simplefs_resetStats();
+    ret = simplefs_write(fd2, buf, bs * 8);
+    simplefs_getStats(&stats);
+    printf("Write Data: %d Clusters packed: %ld\n", ret, stats.packs);
+    simplefs_close(fd2);
+    simplefs_delete("noise");
+
+    // Cutting into a cluster keeps it compressed, the blocks past the end read as zeros
+    ret = simplefs_truncate(fd, bs * 20 + 3);
+    printf("Truncate: %d\n", ret);
+    ret = simplefs_truncate(fd, bs * 24);
+    printf("Truncate: %d\n", ret);
+    moveTo(fd, 0);
+    ret = simplefs_read(fd, buf, bs * 24);
+    int zeros = 1;
+    for (int i = bs * 20 + 3; i < bs * 24; i++)
+        zeros &= buf[i] == 0;
+    printf("Read Data: %d Kept: %d Zeros: %d\n", ret, memcmp(buf, log, bs * 20 + 3) == 0, zeros);
+    simplefs_close(fd);
+    simplefs_dump();
+    simplefs_delete("log");
+    simplefs_dump();
+
+    // Journaled with directories: compressed clusters survive a remount
+    struct simplefs_geometry journal = { .block_size = bs, .num_inodes = 16, .num_data_blocks = 120,
+                                         .features = SIMPLEFS_FEATURE_EXTENTS | SIMPLEFS_FEATURE_COMPRESSION
+                                                   | SIMPLEFS_FEATURE_JOURNAL | SIMPLEFS_FEATURE_DIRS,
+                                         .journal_blocks = 200 };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&journal));
+    printf("Mkdir: %d\n", simplefs_mkdir("/var"));
+    simplefs_create("/var/log");
+    fd = simplefs_open("/var/log");
+    fillLog(log, bs * 64, 1000);
+    simplefs_resetStats();
+    ret = simplefs_write(fd, log, bs * 64);
+    simplefs_getStats(&stats);
+    printf("Write Data: %d Clusters packed: %ld\n", ret, stats.packs);
+    simplefs_close(fd);
+    simplefs_unmount();
+    printf("Mount: %d\n", simplefs_mount());
+    fd = simplefs_open("/var/log");
+    ret = simplefs_read(fd, buf, bs * 64);
+    printf("Read Data: %d Same: %d\n", ret, memcmp(buf, log, bs * 64) == 0);
+    simplefs_close(fd);
+
+    // Compression needs extent-mapped files
+    struct simplefs_geometry blockmap = { .block_size = bs, .num_inodes = 16, .num_data_blocks = 60,
+                                          .features = SIMPLEFS_FEATURE_COMPRESSION };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&blockmap));
+}
@@ -0,0 +1,184 @@
+#include "simplefs-ops.h"
+
+static void report(const char *what)
+{
+    struct simplefs_stats stats;
+    simplefs_getStats(&stats);
+    printf("%s: Checked: %ld Mismatches: %ld\n", what, stats.csum_checks, stats.csum_errors);
+    simplefs_resetStats();
+}
+
+static void corrupt(uint32_t block, int offset)
+{
+    // Flip one bit of the image behind the filesystem's back, as bit rot would
+    int fd = open("simplefs", O_RDWR);
+    char c;
+    off_t at = (off_t)block * simplefs_layout.block_size + offset;
+    pread(fd, &c, 1, at);
+    c ^= 0x10;
+    pwrite(fd, &c, 1, at);
+    close(fd);
+}
+
+int main()
+{
+    static char data[512 * 40], buf[512 * 40];
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = 'a' + (i / 7) % 26;
+    int ret;
+
+    // Both ways of computing CRC32C agree, on the standard check value too
+    printf("CRC32C: %08x Software: %08x\n", simplefs_crc32c("123456789", 9), simplefs_crc32cSoftware("123456789", 9));
+    int agree = 1;
+    for (int len = 0; len < 300; len += 13)
+        agree &= simplefs_crc32c(data + len % 8, len) == simplefs_crc32cSoftware(data + len % 8, len);
+    printf("Agree: %d\n", agree);
+
+    // Every block read back from the image is checked, each time it is read
+    int bs = 512;
+    struct simplefs_geometry geometry = { .block_size = bs, .num_inodes = 16, .num_data_blocks = 60,
+                                          .features = SIMPLEFS_FEATURE_EXTENTS | SIMPLEFS_FEATURE_CHECKSUMS };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&geometry));
+    simplefs_create("a");
+    simplefs_create("b");
+    int fd = simplefs_open("a");
+    printf("Write Data: %d\n", simplefs_write(fd, data, bs * 20));
+    simplefs_close(fd);
+    fd = simplefs_open("b");
+    printf("Write Data: %d\n", simplefs_write(fd, data + 3, bs * 2 + 10));
+    simplefs_close(fd);
+    simplefs_unmount();
+    simplefs_resetStats();
+    printf("Mount: %d\n", simplefs_mount());
+    fd = simplefs_open("a");
+    ret = simplefs_read(fd, buf, bs * 20);
+    printf("Read Data: %d Same: %d\n", ret, memcmp(buf, data, bs * 20) == 0);
+    ret = simplefs_read(fd, buf, bs * 20);
+    printf("Read Data: %d Same: %d\n", ret, memcmp(buf, data, bs * 20) == 0);
+    simplefs_close(fd);
+    report("Clean");
+
+    // Opted in, a block read around the cache is only checked until it first matches
+    simplefs_setVerifyOnce(1);
+    simplefs_unmount();
+    simplefs_mount();
+    simplefs_resetStats();
+    fd = simplefs_open("a");
+    simplefs_read(fd, buf, bs * 20);
+    ret = simplefs_read(fd, buf, bs * 20);
+    printf("Read Data: %d Same: %d\n", ret, memcmp(buf, data, bs * 20) == 0);
+    simplefs_close(fd);
+    simplefs_setVerifyOnce(0);
+    report("Checked once");
+
+    // A flipped bit in a data block is reported when the block is read
+    struct inode_t inode;
+    simplefs_readInode(1, &inode);
+    int block = inode.extents[0].start;
+    simplefs_unmount();
+    corrupt(simplefs_layout.data_start + block + 1, 100);
+    simplefs_mount();
+    simplefs_resetStats();
+    fd = simplefs_open("b");
+    ret = simplefs_read(fd, buf, bs * 2 + 10);
+    printf("Read Data: %d EIO: %d\n", ret, errno == EIO);
+    // Read again through the cache it fails again: the bad block was not kept
+    simplefs_seek(fd, bs + 5);
+    ret = simplefs_read(fd, buf, 10);
+    printf("Read Data: %d EIO: %d\n", ret, errno == EIO);
+    simplefs_close(fd);
+    report("Data block flipped");
+
+    // So is one in the inode table, already while mounting
+    simplefs_unmount();
+    corrupt(simplefs_layout.inode_table_start, sizeof(struct inode_t) * 5 + 3);
+    simplefs_resetStats();
+    printf("Mount: %d\n", simplefs_mount());
+    report("Inode table flipped");
+
+    // Its inodes then fail to read, so the mount passes over their files. The
+    // block is only written in part, so a new file given an inode there is not
+    // created over it and the block keeps failing
+    ret = simplefs_readInode(1, &inode);
+    printf("Read Inode: %d EIO: %d\n", ret, errno == EIO);
+    printf("Open: %d\n", simplefs_open("b"));
+    ret = simplefs_create("c");
+    printf("Create: %d EIO: %d\n", ret, errno == EIO);
+    report("Table block failing");
+
+    // Journaled with compressed clusters: a commit carries the checksums of what it logs
+    struct simplefs_geometry journal = { .block_size = bs, .num_inodes = 16, .num_data_blocks = 120,
+                                         .features = SIMPLEFS_FEATURE_EXTENTS | SIMPLEFS_FEATURE_COMPRESSION | SIMPLEFS_FEATURE_JOURNAL
+                                                   | SIMPLEFS_FEATURE_DIRS | SIMPLEFS_FEATURE_CHECKSUMS,
+                                         .journal_blocks = 200 };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&journal));
+    printf("Mkdir: %d\n", simplefs_mkdir("/d"));
+    simplefs_create("/d/f");
+    fd = simplefs_open("/d/f");
+    printf("Write Data: %d\n", simplefs_write(fd, data, bs * 40));
+    simplefs_close(fd);
+    simplefs_sync();
+    simplefs_create("/d/late");
+    printf("Mount: %d\n", simplefs_mount());
+    simplefs_resetStats();
+    fd = simplefs_open("/d/f");
+    ret = simplefs_read(fd, buf, bs * 40);
+    printf("Read Data: %d Same: %d\n", ret, memcmp(buf, data, bs * 40) == 0);
+    simplefs_close(fd);
+    ret = simplefs_open("/d/late");
+    printf("Open late: %d\n", ret);
+    report("Recovered");
+    simplefs_unmount();
+
+    // Without the feature nothing is checked
+    struct simplefs_geometry plain = { .block_size = bs, .num_inodes = 16, .num_data_blocks = 60,
+                                       .features = SIMPLEFS_FEATURE_EXTENTS };
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&plain));
+    simplefs_create("a");
+    fd = simplefs_open("a");
+    simplefs_write(fd, data, bs * 20);
+    simplefs_close(fd);
+    simplefs_unmount();
+    simplefs_mount();
+    simplefs_resetStats();
+    fd = simplefs_open("a");
+    ret = simplefs_read(fd, buf, bs * 20);
+    printf("Read Data: %d Same: %d\n", ret, memcmp(buf, data, bs * 20) == 0);
+    simplefs_close(fd);
+    report("Plain");
+
+    // A mapped image checks each block every time it is read and takes the
+    // checksums of the blocks written at the next sync
+    simplefs_setIOMode(SIMPLEFS_IO_MMAP);
+    printf("Format: %d\n", simplefs_formatDiskWithGeometry(&geometry));
+    simplefs_create("m");
+    fd = simplefs_open("m");
+    simplefs_write(fd, data, bs * 20);
+    simplefs_seek(fd, bs * 3 + 7);
+    simplefs_write(fd, data + 100, 50);
+    memcpy(data + bs * 3 + 7, data + 100, 50);
+    simplefs_close(fd);
+    simplefs_unmount();
+    simplefs_mount();
+    simplefs_resetStats();
+    fd = simplefs_open("m");
+    ret = simplefs_read(fd, buf, bs * 20);
+    printf("Read Data: %d Same: %d\n", ret, memcmp(buf, data, bs * 20) == 0);
+    ret = simplefs_read(fd, buf, bs * 20);
+    printf("Read Data: %d Same: %d\n", ret, memcmp(buf, data, bs * 20) == 0);
+    simplefs_close(fd);
+    report("Mapped");
+    simplefs_readInode(0, &inode);
+    block = inode.extents[0].start;
+    simplefs_unmount();
+    corrupt(simplefs_layout.data_start + block + 7, 1);
+    simplefs_mount();
+    simplefs_resetStats();
+    fd = simplefs_open("m");
+    ret = simplefs_read(fd, buf, bs * 20);
+    printf("Read Data: %d EIO: %d\n", ret, errno == EIO);
+    simplefs_close(fd);
+    report("Mapped block flipped");
+    simplefs_unmount();
+    simplefs_setIOMode(SIMPLEFS_IO_FD);
+}
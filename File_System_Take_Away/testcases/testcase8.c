@@ -0,0 +1,21 @@
+#include "simplefs-ops.h"
+
+int main()
+{
+    struct simplefs_stats stats;
+    simplefs_formatDisk();
+    simplefs_resetStats();
+    simplefs_create("fileabc");
+    int fd = simplefs_open("fileabc");
+    char str[] = "!-----------------------64 Bytes of Data-----------------------!!-----------------------64 Bytes of Data-----------------------!!-----------------------64 Bytes of Data-----------------------!!-----------------------64 Bytes of Data-----------------------!";
+    printf("Write Data: %d\n", simplefs_write(fd, str, BLOCKSIZE * MAX_FILE_SIZE));
+    simplefs_getStats(&stats);
+    printf("Superblock Reads: %ld Writes: %ld Saved: %ld\n", stats.superblock_reads, stats.superblock_writes, stats.superblock_ios_saved);
+    simplefs_syncSuperBlock();
+    simplefs_getStats(&stats);
+    printf("Superblock Reads: %ld Writes: %ld Saved: %ld\n", stats.superblock_reads, stats.superblock_writes, stats.superblock_ios_saved);
+    simplefs_close(fd);
+    simplefs_unmount();
+    printf("Mount: %d\n", simplefs_mount());
+    simplefs_dump();
+}
@@ -0,0 +1,26 @@
+#include "simplefs-ops.h"
+
+int main()
+{
+    struct simplefs_stats stats;
+    char str[] = "!-----------------------64 Bytes of Data-----------------------!";
+    char buf[11];
+    buf[10] = '\0';
+    simplefs_formatDisk();
+    simplefs_create("fileabc");
+    int fd = simplefs_open("fileabc");
+    printf("Write Data: %d\n", simplefs_write(fd, str, BLOCKSIZE));
+    simplefs_resetStats();
+    for (int i = 0; i < 5; i++)
+    {
+        printf("Read Data %d\n", simplefs_read(fd, buf, 10));
+        printf("Data: %s\n", buf);
+    }
+    simplefs_getStats(&stats);
+    printf("Cache Hits: %ld Misses: %ld Disk Reads: %ld Disk Writes: %ld\n", stats.cache_hits, stats.cache_misses, stats.disk_reads, stats.disk_writes);
+    simplefs_sync();
+    simplefs_getStats(&stats);
+    printf("Cache Writebacks: %ld Disk Writes: %ld\n", stats.cache_writebacks, stats.disk_writes);
+    simplefs_close(fd);
+    simplefs_dump();
+}